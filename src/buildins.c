@@ -220,8 +220,8 @@ void* buildins_decompressed(buildin_file_info_st *info) {
         return info->raw;
     }
     
-    // 分配内存
-    void *raw_data = malloc(info->orig_sz);
+    // 分配内存（多一个字节，结尾补 0：C 脚本等文本资源可以直接作为字符串使用）
+    void *raw_data = malloc(info->orig_sz + 1);
     if (!raw_data) {
         fprintf(stderr, "Buildins: Failed to allocate %u bytes for %s\n",
                 info->orig_sz, info->uri);
@@ -236,6 +236,8 @@ void* buildins_decompressed(buildin_file_info_st *info) {
         return NULL;
     }
     
+    ((char*)raw_data)[info->orig_sz] = 0;
+
     // 缓存解压后的数据
     info->raw = raw_data;
     
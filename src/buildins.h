@@ -106,7 +106,7 @@ int buildins_is_dir(const buildin_file_info_st *info);
  * 获取解压后的资源数据
  * 
  * 如果资源尚未解压（raw == NULL），则分配内存并解压。
- * 解压后的数据缓存在 raw 字段中，后续调用直接返回。
+ * 解压后的数据缓存在 raw 字段中，后续调用直接返回。数据之后补有结尾的 0，文本资源可以直接作为字符串使用。
  * 
  * 特殊情况：
  * - 空文件（orig_sz=0）：返回 (void*)1 作为标记，表示已处理但无数据
@@ -0,0 +1,747 @@
+/*
+ * Bench - Implementation
+ */
+
+#include "http_bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libtcc.h>
+#include "tcc_evn.h"
+
+#define BENCH_BUF_SIZE          65536   /* 每个连接的接收缓冲，回复头部不能超过该长度 */
+#define BENCH_STATIC_FILE       "bench.html"
+#define BENCH_STATIC_SIZE       4096    /* 静态文件场景的文件大小 */
+#define BENCH_SCRIPT_FILE       "bench.c"
+#define BENCH_START_TIMEOUT     10000   /* 等待服务器开始监听的最长时间（毫秒） */
+#define BENCH_COMPILE_N         50      /* 编译场景每种方式的编译次数 */
+
+typedef struct bench_scenario {
+    const char*         zName;
+    const char*         zRequest;
+} bench_scenario;
+
+#define BENCH_HDR       "Host: localhost\r\nUser-Agent: wpp-bench\r\n"
+
+static const bench_scenario s_aScenario[] = {
+    { "buildins-gzip",      "GET /hello.html HTTP/1.1\r\n" BENCH_HDR "Accept-Encoding: gzip\r\n\r\n" },
+    { "buildins-identity",  "GET /hello.html HTTP/1.1\r\n" BENCH_HDR "\r\n" },
+    { "static",             "GET /" BENCH_STATIC_FILE " HTTP/1.1\r\n" BENCH_HDR "\r\n" },
+    { "c-script",           "GET /hello.c HTTP/1.1\r\n" BENCH_HDR "\r\n" },
+    { "c-handler",          "GET /" BENCH_SCRIPT_FILE " HTTP/1.1\r\n" BENCH_HDR "\r\n" },
+    { "sqtp-select",        "SQTP-SELECT / HTTP/1.1\r\n" BENCH_HDR "TABLE: users\r\n\r\n" },
+};
+#define BENCH_SCENARIO_N    (int)(sizeof(s_aScenario) / sizeof(s_aScenario[0]))
+
+// 回复的解析状态
+enum {
+    RS_HEAD = 0,                        /* 回复头部 */
+    RS_BODY,                            /* 有 Content-Length 的回复体 */
+    RS_CHUNK_SIZE,                      /* chunked：块长度行 */
+    RS_CHUNK_DATA,                      /* chunked：块数据（包括结尾的 CRLF） */
+    RS_TRAILER,                         /* chunked：结尾的头部 */
+    RS_EOF                              /* 没有长度，直到连接关闭 */
+};
+
+typedef struct bench_conn {
+    int                 fd;             /* -1 表示需要重新连接 */
+    int                 iState;
+    int                 iStatus;
+    bool                bClose;         /* 回复带有 Connection: close */
+    bool                bReused;        /* 连接上已经完成过请求（服务器关闭空闲连接时重发，不算错误） */
+    bool                bTimed;         /* 请求在测量阶段发出，计入延迟 */
+    long long           nLeft;          /* 回复体（或当前块）剩余的字节数 */
+    int64_t             tSend;
+    size_t              iPos;
+    size_t              nHave;
+    char                aBuf[BENCH_BUF_SIZE];
+} bench_conn;
+
+typedef struct bench_thread {
+    pthread_t           tid;
+    const char*         zRequest;
+    size_t              nRequest;
+    int                 nConns;
+    bench_conn*         aConn;
+    uint64_t            nDone;          /* 测量阶段完成的请求 */
+    uint64_t            nErrors;        /* 测量阶段的错误：非 2xx 的回复、连接错误 */
+    uint64_t            nBytes;         /* 测量阶段收到的字节数 */
+    uint32_t*           aLat;           /* 测量阶段发出的各请求的延迟（微秒） */
+    size_t              nLat;
+    size_t              nLatAlloc;
+} bench_thread;
+
+typedef struct bench_result {
+    uint64_t            nReq;
+    uint64_t            nErrors;
+    uint64_t            nBytes;
+    double              rRps;
+    int64_t             p50, p99, p999; /* 微秒 */
+    double              rCpuUs;         /* 服务器每个请求的 CPU 时间（微秒），<0 表示无法统计 */
+} bench_result;
+
+static struct sockaddr_in6  s_addr;
+static int                  s_iPhase;   /* 0 预热，1 测量，2 结束 */
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int phase(void) {
+    return __atomic_load_n(&s_iPhase, __ATOMIC_ACQUIRE);
+}
+
+static void sleep_ms(int64_t nMs) {
+    struct timespec ts = { (time_t)(nMs / 1000), (long)(nMs % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+/*
+** 客户端
+*/
+
+static void BenchClose(bench_conn *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+static int BenchConnect(bench_conn *c) {
+    int opt = 1;
+    c->fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (c->fd < 0) return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(c->fd, (struct sockaddr*)&s_addr, sizeof(s_addr)) < 0) {
+        BenchClose(c);
+        return -1;
+    }
+    c->iState = RS_HEAD;
+    c->iPos = c->nHave = 0;
+    c->bReused = false;
+    return 0;
+}
+
+// 在连接上发出请求（必要时先建立连接）
+static int BenchSend(bench_thread *t, bench_conn *c) {
+    if (c->fd < 0 && BenchConnect(c) < 0) return -1;
+    c->tSend = now_us();
+    c->bTimed = phase() == 1;
+    c->bClose = false;
+    const char *z = t->zRequest;
+    size_t n = t->nRequest;
+    while (n > 0) {
+        ssize_t k = send(c->fd, z, n, 0);
+        if (k < 0) {
+            if (errno == EINTR) continue;
+            BenchClose(c);
+            return -1;
+        }
+        z += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+// 在 [z, zEnd) 中查找一行的结尾（CRLF 或 LF），返回下一行的开始，没有完整的行时返回 NULL
+static char *BenchLine(char *z, char *zEnd) {
+    char *p = memchr(z, '\n', (size_t)(zEnd - z));
+    return p ? p + 1 : NULL;
+}
+
+// [z, zEnd) 中是否含有 zWord（不区分大小写）
+static bool BenchHas(const char *z, const char *zEnd, const char *zWord) {
+    size_t n = strlen(zWord);
+    for (; z + n <= zEnd; z++) {
+        if (strncasecmp(z, zWord, n) == 0) return true;
+    }
+    return false;
+}
+
+// 解析回复头部：状态码、Content-Length、Transfer-Encoding、Connection
+static void BenchHead(bench_conn *c, char *z, char *zEnd) {
+    char *zNext = BenchLine(z, zEnd);
+    c->iStatus = (zEnd - z > 12 && strncmp(z, "HTTP/1.", 7) == 0) ? atoi(z + 9) : 0;
+    c->nLeft = -1;
+    c->iState = RS_EOF;
+    for (z = zNext; z && z < zEnd; z = zNext) {
+        zNext = BenchLine(z, zEnd);
+        if (strncasecmp(z, "Content-Length:", 15) == 0) {
+            c->nLeft = strtoll(z + 15, 0, 10);
+            c->iState = RS_BODY;
+        }
+        else if (strncasecmp(z, "Transfer-Encoding:", 18) == 0) {
+            if (BenchHas(z + 18, zNext, "chunked")) c->iState = RS_CHUNK_SIZE;
+        }
+        else if (strncasecmp(z, "Connection:", 11) == 0) {
+            if (BenchHas(z + 11, zNext, "close")) c->bClose = true;
+        }
+    }
+    if (c->iState == RS_CHUNK_SIZE) c->nLeft = 0;
+}
+
+// 从接收缓冲中解析回复：1 收完一个回复，0 还需要更多数据，-1 回复格式错误
+static int BenchParse(bench_conn *c) {
+    for (;;) {
+        char *z = c->aBuf + c->iPos;
+        char *zEnd = c->aBuf + c->nHave;
+        char *zNext;
+        long long n;
+
+        switch (c->iState) {
+        case RS_HEAD:
+            // 头部以空行结束
+            for (char *zLine = z; (zNext = BenchLine(zLine, zEnd)) != NULL; zLine = zNext) {
+                if (zLine > z && (zNext - zLine == 1 || (zNext - zLine == 2 && zLine[0] == '\r'))) break;
+            }
+            if (!zNext) return c->nHave == BENCH_BUF_SIZE && c->iPos == 0 ? -1 : 0;
+            BenchHead(c, z, zNext);
+            c->iPos = (size_t)(zNext - c->aBuf);
+            if (c->iStatus >= 100 && c->iStatus < 200) c->iState = RS_HEAD;    // 100 Continue 之后还有回复
+            else if (c->iState == RS_BODY && c->nLeft <= 0) goto done;
+            break;
+
+        case RS_BODY:
+        case RS_CHUNK_DATA:
+        case RS_EOF:
+            n = zEnd - z;
+            if (c->iState != RS_EOF && n > c->nLeft) n = c->nLeft;
+            c->iPos += (size_t)n;
+            if (c->iState == RS_EOF) return 0;
+            c->nLeft -= n;
+            if (c->nLeft > 0) return 0;
+            if (c->iState == RS_BODY) goto done;
+            c->iState = RS_CHUNK_SIZE;
+            break;
+
+        case RS_CHUNK_SIZE:
+            if ((zNext = BenchLine(z, zEnd)) == NULL) return 0;
+            n = strtoll(z, 0, 16);
+            c->iPos = (size_t)(zNext - c->aBuf);
+            if (n < 0) return -1;
+            c->iState = n > 0 ? RS_CHUNK_DATA : RS_TRAILER;
+            c->nLeft = n + 2;
+            break;
+
+        case RS_TRAILER:
+            if ((zNext = BenchLine(z, zEnd)) == NULL) return 0;
+            c->iPos = (size_t)(zNext - c->aBuf);
+            if (zNext - z <= 2) goto done;
+            break;
+        }
+    }
+done:
+    c->iState = RS_HEAD;
+    return 1;
+}
+
+// 读取并解析回复：1 收完一个回复，0 还需要更多数据，-1 连接出错或者被关闭
+static int BenchRecv(bench_thread *t, bench_conn *c) {
+    if (c->iPos == c->nHave) c->iPos = c->nHave = 0;
+    else if (c->nHave == BENCH_BUF_SIZE && c->iPos > 0) {
+        memmove(c->aBuf, c->aBuf + c->iPos, c->nHave - c->iPos);
+        c->nHave -= c->iPos;
+        c->iPos = 0;
+    }
+    ssize_t k = recv(c->fd, c->aBuf + c->nHave, BENCH_BUF_SIZE - c->nHave, 0);
+    if (k < 0 && errno == EINTR) return 0;
+    if (k <= 0) {
+        if (k == 0 && c->iState == RS_EOF) {
+            c->iState = RS_HEAD;
+            c->bClose = true;
+            return 1;
+        }
+        return -1;
+    }
+    if (phase() == 1) t->nBytes += (uint64_t)k;
+    c->nHave += (size_t)k;
+    return BenchParse(c);
+}
+
+static void BenchLatency(bench_thread *t, int64_t nUs) {
+    if (t->nLat == t->nLatAlloc) {
+        size_t nAlloc = t->nLatAlloc ? t->nLatAlloc * 2 : 65536;
+        uint32_t *a = realloc(t->aLat, nAlloc * sizeof(uint32_t));
+        if (!a) return;
+        t->aLat = a;
+        t->nLatAlloc = nAlloc;
+    }
+    t->aLat[t->nLat++] = nUs > UINT32_MAX ? UINT32_MAX : (uint32_t)nUs;
+}
+
+/* 客户端线程：每个连接上始终有一个未完成的请求，收完回复后立即发出下一个（闭环）
+ | + 回复带有 Connection: close，或者服务器关闭了连接时重新连接
+ | + 测量阶段发出的请求计入延迟，测量阶段完成的请求计入请求数
+*/
+static void *BenchThread(void *pArg) {
+    bench_thread *t = (bench_thread*)pArg;
+    struct pollfd *aPoll = calloc((size_t)t->nConns, sizeof(struct pollfd));
+    int *aIdx = calloc((size_t)t->nConns, sizeof(int));
+    if (!aPoll || !aIdx) {
+        free(aPoll);
+        free(aIdx);
+        return NULL;
+    }
+
+    for (int i = 0; i < t->nConns; i++) {
+        t->aConn[i].fd = -1;
+        BenchSend(t, &t->aConn[i]);
+    }
+
+    while (phase() != 2) {
+        int nPoll = 0, nDown = 0;
+        for (int i = 0; i < t->nConns; i++) {
+            bench_conn *c = &t->aConn[i];
+            if (c->fd < 0 && BenchSend(t, c) < 0) {
+                if (phase() == 1) t->nErrors++;
+                nDown++;
+                continue;
+            }
+            aPoll[nPoll].fd = c->fd;
+            aPoll[nPoll].events = POLLIN;
+            aIdx[nPoll++] = i;
+        }
+        if (nDown) sleep_ms(1);                 // 服务器无法连接时不要空转
+        if (nPoll == 0 || poll(aPoll, (nfds_t)nPoll, 100) <= 0) continue;
+
+        for (int j = 0; j < nPoll; j++) {
+            if (!aPoll[j].revents) continue;
+            bench_conn *c = &t->aConn[aIdx[j]];
+            int rc = BenchRecv(t, c);
+            if (rc == 0) continue;
+
+            bool bMeasure = phase() == 1;
+            if (rc > 0) {
+                if (bMeasure) {
+                    t->nDone++;
+                    if (c->iStatus < 200 || c->iStatus >= 300) t->nErrors++;
+                }
+                if (c->bTimed) BenchLatency(t, now_us() - c->tSend);
+                c->bReused = true;
+                if (c->bClose) BenchClose(c);
+            }
+            else {
+                // 服务器关闭了空闲的 Keep-Alive 连接：重新连接后重发，不算错误
+                if (bMeasure && !(c->bReused && c->iState == RS_HEAD && c->nHave == 0)) t->nErrors++;
+                BenchClose(c);
+            }
+            if (phase() != 2) BenchSend(t, c);
+        }
+    }
+
+    for (int i = 0; i < t->nConns; i++) BenchClose(&t->aConn[i]);
+    free(aPoll);
+    free(aIdx);
+    return NULL;
+}
+
+/*
+** 服务器
+*/
+
+// 服务器进程组（主进程和它的所有子进程）已消耗的 CPU 时间（微秒），-1 表示无法统计
+// + 仍在运行的进程计入它自己的时间，已被回收的子进程计入父进程的 cutime/cstime，两者不会重复
+static int64_t BenchCpu(pid_t pgrp) {
+#ifdef __linux__
+    DIR *pDir = opendir("/proc");
+    if (!pDir) return -1;
+    long nHz = sysconf(_SC_CLK_TCK);
+    uint64_t nTicks = 0;
+    struct dirent *pEnt;
+    while ((pEnt = readdir(pDir)) != NULL) {
+        if (pEnt->d_name[0] < '1' || pEnt->d_name[0] > '9') continue;
+        char zPath[300], zLine[1024];
+        snprintf(zPath, sizeof(zPath), "/proc/%s/stat", pEnt->d_name);
+        int fd = open(zPath, O_RDONLY);
+        if (fd < 0) continue;
+        ssize_t n = read(fd, zLine, sizeof(zLine) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        zLine[n] = 0;
+
+        // pid (comm) state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime cutime cstime ...
+        char *z = strrchr(zLine, ')');
+        int iPgrp;
+        unsigned long long uTime, sTime, cuTime, csTime;
+        if (!z || sscanf(z + 2, "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                         &iPgrp, &uTime, &sTime, &cuTime, &csTime) != 5) continue;
+        if (iPgrp == pgrp) nTicks += uTime + sTime + cuTime + csTime;
+    }
+    closedir(pDir);
+    return nHz > 0 ? (int64_t)(nTicks * 1000000 / (uint64_t)nHz) : -1;
+#else
+    (void)pgrp;
+    return -1;
+#endif
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 运行一个场景：预热 nSeconds/5 秒，然后测量 nSeconds 秒
+static void BenchRun(const http_bench_st *pBench, const bench_scenario *pScenario, pid_t pidServer, bench_result *r) {
+    int nThreads = pBench->nThreads;
+    bench_thread *aThread = calloc((size_t)nThreads, sizeof(bench_thread));
+    bench_conn *aConn = calloc((size_t)pBench->nConns, sizeof(bench_conn));
+    memset(r, 0, sizeof(*r));
+    r->rCpuUs = -1;
+    if (!aThread || !aConn) {
+        free(aThread);
+        free(aConn);
+        return;
+    }
+
+    __atomic_store_n(&s_iPhase, 0, __ATOMIC_RELEASE);
+    for (int i = 0, iConn = 0; i < nThreads; i++) {
+        bench_thread *t = &aThread[i];
+        t->zRequest = pScenario->zRequest;
+        t->nRequest = strlen(pScenario->zRequest);
+        t->nConns = pBench->nConns / nThreads + (i < pBench->nConns % nThreads);
+        t->aConn = &aConn[iConn];
+        iConn += t->nConns;
+        if (pthread_create(&t->tid, NULL, BenchThread, t) != 0) t->nConns = -1;
+    }
+
+    int64_t nWarmMs = (int64_t)pBench->nSeconds * 200;
+    sleep_ms(nWarmMs < 200 ? 200 : nWarmMs);
+    int64_t nCpu0 = BenchCpu(pidServer);
+    int64_t t0 = now_us();
+    __atomic_store_n(&s_iPhase, 1, __ATOMIC_RELEASE);
+
+    sleep_ms((int64_t)pBench->nSeconds * 1000);
+    int64_t nCpu1 = BenchCpu(pidServer);
+    int64_t t1 = now_us();
+    __atomic_store_n(&s_iPhase, 2, __ATOMIC_RELEASE);
+
+    size_t nLat = 0;
+    for (int i = 0; i < nThreads; i++) {
+        bench_thread *t = &aThread[i];
+        if (t->nConns < 0) continue;
+        pthread_join(t->tid, NULL);
+        r->nReq += t->nDone;
+        r->nErrors += t->nErrors;
+        r->nBytes += t->nBytes;
+        nLat += t->nLat;
+    }
+
+    // 合并各线程的延迟，排序后取百分位
+    uint32_t *aLat = nLat ? malloc(nLat * sizeof(uint32_t)) : NULL;
+    if (aLat) {
+        size_t n = 0;
+        for (int i = 0; i < nThreads; i++) {
+            if (aThread[i].nLat) memcpy(aLat + n, aThread[i].aLat, aThread[i].nLat * sizeof(uint32_t));
+            n += aThread[i].nLat;
+        }
+        qsort(aLat, nLat, sizeof(uint32_t), cmp_u32);
+        r->p50 = aLat[(size_t)(nLat * 0.5)];
+        r->p99 = aLat[(size_t)(nLat * 0.99)];
+        r->p999 = aLat[(size_t)(nLat * 0.999)];
+        free(aLat);
+    }
+    for (int i = 0; i < nThreads; i++) free(aThread[i].aLat);
+
+    r->rRps = t1 > t0 ? (double)r->nReq * 1e6 / (double)(t1 - t0) : 0;
+    if (nCpu0 >= 0 && nCpu1 >= 0 && r->nReq > 0) r->rCpuUs = (double)(nCpu1 - nCpu0) / (double)r->nReq;
+
+    free(aThread);
+    free(aConn);
+}
+
+// c-handler 场景的脚本：同时定义 main() 和 handle_request()，输出相同的内容，-R 时常驻运行，否则作为 CGI 运行
+static const char s_zBenchScript[] =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "int main(void) {\n"
+    "    printf(\"Content-Type: text/plain\\r\\n\\r\\nhello from %s\\n\", getenv(\"REQUEST_METHOD\"));\n"
+    "    return 0;\n"
+    "}\n"
+    "int handle_request(wpp_req *req, wpp_res *res) {\n"
+    "    wpp_header(res, \"Content-Type\", \"text/plain\");\n"
+    "    wpp_printf(res, \"hello from %s\\n\", wpp_param(req, \"REQUEST_METHOD\"));\n"
+    "    return 0;\n"
+    "}\n";
+
+// 编译场景的脚本：包含 <sqlite3.h> 等常用的头文件，编译时间主要花在读取和切分头文件上
+static const char s_zCompileScript[] =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <sqlite3.h>\n"
+    "int main(void) {\n"
+    "    sqlite3 *db;\n"
+    "    if (sqlite3_open(\":memory:\", &db) != SQLITE_OK) return 1;\n"
+    "    printf(\"Content-Type: text/plain\\r\\n\\r\\nsqlite %s\\n\", sqlite3_libversion());\n"
+    "    sqlite3_close(db);\n"
+    "    return 0;\n"
+    "}\n";
+
+typedef struct bench_compile {
+    double              rPlainMs;       /* 直接编译，每次的平均时间（毫秒），<0 表示编译失败 */
+    double              rSnapshotMs;    /* 使用系统头文件快照，<0 表示没有可用的快照（--header-snapshot none）或编译失败 */
+} bench_compile;
+
+static void BenchCompileError(void *pOpaque, const char *zMsg) {
+    (void)pOpaque;
+    (void)zMsg;
+}
+
+// 在当前进程中编译 BENCH_COMPILE_N 次（与请求处理进程编译缓存时相同：编译为目标文件，不链接），返回每次的平均时间
+static double BenchCompileRun(const char *zSource) {
+    int64_t tStart = now_us();
+    for (int i = 0; i < BENCH_COMPILE_N; i++) {
+        TCCState *s = tcc_new();
+        if (!s) return -1;
+        tcc_set_error_func(s, NULL, BenchCompileError);
+        tcc_set_output_type(s, TCC_OUTPUT_OBJ);
+        int rc = tcc_configure_object(s) == 0 ? tcc_compile_string(s, zSource) : -1;
+        tcc_delete(s);
+        if (rc != 0) return -1;
+    }
+    return (now_us() - tStart) / 1000.0 / BENCH_COMPILE_N;
+}
+
+// 编译场景：同一个脚本直接编译和使用系统头文件快照（见 tcc_snapshot_apply()）编译的时间
+static void BenchCompile(bench_compile *r) {
+    r->rPlainMs = BenchCompileRun(s_zCompileScript);
+    r->rSnapshotMs = -1;
+    char *zSnapshot = tcc_snapshot_apply(s_zCompileScript, true);
+    if (zSnapshot) {
+        r->rSnapshotMs = BenchCompileRun(zSnapshot);
+        free(zSnapshot);
+    }
+}
+
+// 创建临时的 Web 根目录和静态文件场景、c-handler 场景使用的文件
+static int BenchRoot(char *zRoot, size_t nRoot) {
+    // 路径过长（TMPDIR）时放弃，而不是使用截断后的路径
+    if ((size_t)snprintf(zRoot, nRoot, "%s/wpp-bench-XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") >= nRoot) return -1;
+    if (!mkdtemp(zRoot)) return -1;
+    chmod(zRoot, 0755);
+
+    char zPath[PATH_MAX];
+    if ((size_t)snprintf(zPath, sizeof(zPath), "%s/" BENCH_STATIC_FILE, zRoot) >= sizeof(zPath)) return -1;
+    FILE *pFile = fopen(zPath, "w");
+    if (!pFile) return -1;
+    int n = fprintf(pFile, "<!DOCTYPE html>\n<html><head><title>wpp bench</title></head><body>\n");
+    while (n < BENCH_STATIC_SIZE - 16) n += fprintf(pFile, "<p>%04d</p>\n", n);
+    fprintf(pFile, "%*s</body></html>\n", BENCH_STATIC_SIZE - 16 - n, "");
+    fclose(pFile);
+    chmod(zPath, 0644);
+
+    char zScript[PATH_MAX];
+    if ((size_t)snprintf(zScript, sizeof(zScript), "%s/" BENCH_SCRIPT_FILE, zRoot) >= sizeof(zScript)) return -1;
+    pFile = fopen(zScript, "w");
+    if (!pFile) return -1;
+    fputs(s_zBenchScript, pFile);
+    fclose(pFile);
+    chmod(zScript, 0644);
+
+    // 服务器不能以 root 身份运行：以 root 运行时，把根目录交给 nobody（httpd_main 以根目录的所有者身份运行）
+    if (getuid() == 0) {
+        struct passwd *pPwd = getpwnam("nobody");
+        if (!pPwd || chown(zRoot, pPwd->pw_uid, pPwd->pw_gid) < 0 || chown(zPath, pPwd->pw_uid, pPwd->pw_gid) < 0
+            || chown(zScript, pPwd->pw_uid, pPwd->pw_gid) < 0) return -1;
+    }
+    return 0;
+}
+
+// 删除临时的 Web 根目录（包括其中的日志等文件，不含子目录）
+static void BenchRootRemove(const char *zRoot) {
+    DIR *pDir = opendir(zRoot);
+    if (pDir) {
+        struct dirent *pEnt;
+        char zPath[PATH_MAX];
+        while ((pEnt = readdir(pDir)) != NULL) {
+            if (strcmp(pEnt->d_name, ".") == 0 || strcmp(pEnt->d_name, "..") == 0) continue;
+            snprintf(zPath, sizeof(zPath), "%s/%s", zRoot, pEnt->d_name);
+            unlink(zPath);
+        }
+        closedir(pDir);
+    }
+    rmdir(zRoot);
+}
+
+// 等待服务器写入 PID 文件（"PID:PORT"），返回监听的端口，服务器退出或者超时时返回 0
+static int BenchWaitServer(pid_t pidServer, const char *zPidFile) {
+    for (int i = 0; i < BENCH_START_TIMEOUT / 10; i++) {
+        int pid = 0, port = 0;
+        FILE *pFile = fopen(zPidFile, "r");
+        if (pFile) {
+            int n = fscanf(pFile, "%d:%d", &pid, &port);
+            fclose(pFile);
+            if (n == 2 && pid == pidServer && port > 0) return port;
+        }
+        if (waitpid(pidServer, NULL, WNOHANG) == pidServer) return 0;
+        sleep_ms(10);
+    }
+    return 0;
+}
+
+static const char *BenchMode(const http_params_st *pParams, char *zBuf, size_t nBuf) {
+    if (pParams->iWorkers == 0 && !pParams->bReusePort && !pParams->bEventLoop && !pParams->bParkIdle) {
+        snprintf(zBuf, nBuf, "fork per connection");
+    }
+    else {
+        char zWorkers[16] = "per CPU";
+        if (pParams->iWorkers > 0) snprintf(zWorkers, sizeof(zWorkers), "%d", pParams->iWorkers);
+        snprintf(zBuf, nBuf, "prefork (%s workers%s%s)", zWorkers,
+                 pParams->bEventLoop ? ", event loop" : "", pParams->bReusePort ? ", SO_REUSEPORT" : "");
+    }
+    return zBuf;
+}
+
+static void BenchJsonMs(FILE *pOut, const char *zName, double rMs) {
+    if (rMs >= 0) fprintf(pOut, "\"%s\":%.3f", zName, rMs);
+    else fprintf(pOut, "\"%s\":null", zName);
+}
+
+static void BenchJson(FILE *pOut, const http_params_st *pParams, const http_bench_st *pBench,
+                      const bench_result *aResult, const bench_compile *pCompile) {
+    char zMode[64];
+    fprintf(pOut, "{\"time\":%lld,\"cpus\":%ld,\"duration_seconds\":%d,\"threads\":%d,\"connections\":%d,",
+            (long long)time(0), sysconf(_SC_NPROCESSORS_ONLN), pBench->nSeconds, pBench->nThreads, pBench->nConns);
+    fprintf(pOut, "\"server\":{\"mode\":\"%s\",\"workers\":%d,\"evloop\":%s,\"path_cache\":%u,\"file_cache_kb\":%u,"
+                  "\"gzip_level\":%u,\"log_ring_kb\":%u},\"scenarios\":[",
+            BenchMode(pParams, zMode, sizeof(zMode)), pParams->iWorkers, pParams->bEventLoop ? "true" : "false",
+            pParams->iPathCache, pParams->iFileCacheKB, pParams->iGzipLevel, pParams->iLogRingKB);
+    for (int i = 0; i < BENCH_SCENARIO_N; i++) {
+        const bench_result *r = &aResult[i];
+        fprintf(pOut, "%s{\"name\":\"%s\",\"requests\":%llu,\"errors\":%llu,\"bytes\":%llu,\"rps\":%.1f,"
+                      "\"p50_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"cpu_us_per_request\":",
+                i ? "," : "", s_aScenario[i].zName, (unsigned long long)r->nReq, (unsigned long long)r->nErrors,
+                (unsigned long long)r->nBytes, r->rRps, (long long)r->p50, (long long)r->p99, (long long)r->p999);
+        if (r->rCpuUs >= 0) fprintf(pOut, "%.1f}", r->rCpuUs);
+        else fprintf(pOut, "null}");
+    }
+    fprintf(pOut, "],\"compile\":{\"script\":\"sqlite3.h\",\"compiles\":%d,", BENCH_COMPILE_N);
+    BenchJsonMs(pOut, "plain_ms", pCompile->rPlainMs);
+    fprintf(pOut, ",");
+    BenchJsonMs(pOut, "snapshot_ms", pCompile->rSnapshotMs);
+    fprintf(pOut, "}}\n");
+}
+
+int http_bench_main(http_params_st *pParams, const http_bench_st *pBench) {
+    http_bench_st bench = *pBench;
+    char zRoot[PATH_MAX], zPidFile[PATH_MAX + 8], zOutFile[PATH_MAX + 8], zMode[64];
+
+    if (bench.nSeconds <= 0) bench.nSeconds = 5;
+    if (bench.nConns <= 0) bench.nConns = 32;
+    if (bench.nThreads <= 0) {
+        long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+        bench.nThreads = nCpu > 1 ? (int)(nCpu / 2) : 1;
+    }
+    if (bench.nThreads > bench.nConns) bench.nThreads = bench.nConns;
+
+    if (BenchRoot(zRoot, sizeof(zRoot)) < 0) {
+        fprintf(stderr, "❌ 无法创建临时的 Web 根目录: %s\n", strerror(errno));
+        return 1;
+    }
+    snprintf(zPidFile, sizeof(zPidFile), "%s/.pid", zRoot);
+    snprintf(zOutFile, sizeof(zOutFile), "%s/.out", zRoot);
+
+    // 服务器进程（及其所有子进程）自成一个进程组，用于统计 CPU 时间和最后一起终止
+    fflush(stdout);
+    pid_t pidServer = fork();
+    if (pidServer < 0) {
+        fprintf(stderr, "❌ fork() 失败: %s\n", strerror(errno));
+        BenchRootRemove(zRoot);
+        return 1;
+    }
+    if (pidServer == 0) {
+        // 服务器的输出（每个请求一行的跟踪信息等）写入临时目录，不和测试结果混在一起
+        setpgid(0, 0);
+        int fd = open(zOutFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        httpd_main(0, 0, true, false, NULL, NULL, zRoot, pParams, NULL, zPidFile);
+        _exit(0);
+    }
+    setpgid(pidServer, pidServer);
+
+    int iPort = BenchWaitServer(pidServer, zPidFile);
+    if (iPort == 0) {
+        fprintf(stderr, "❌ 服务器没有启动\n");
+        FILE *pOut = fopen(zOutFile, "r");
+        if (pOut) {
+            char zLine[1024];
+            while (fgets(zLine, sizeof(zLine), pOut)) fputs(zLine, stderr);
+            fclose(pOut);
+        }
+        kill(-pidServer, SIGKILL);
+        waitpid(pidServer, NULL, 0);
+        BenchRootRemove(zRoot);
+        return 1;
+    }
+    memset(&s_addr, 0, sizeof(s_addr));
+    s_addr.sin6_family = AF_INET6;
+    s_addr.sin6_addr = in6addr_loopback;
+    s_addr.sin6_port = htons((uint16_t)iPort);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("\n=== 压力测试 ===\n\n");
+    printf("服务器: %s, 端口 %d\n", BenchMode(pParams, zMode, sizeof(zMode)), iPort);
+    printf("客户端: %d 个线程, %d 个 Keep-Alive 连接, 每个场景预热 %.1fs + 测量 %ds\n\n",
+           bench.nThreads, bench.nConns, bench.nSeconds * 0.2 < 0.2 ? 0.2 : bench.nSeconds * 0.2, bench.nSeconds);
+    printf("%-18s %12s %10s %10s %10s %12s %8s\n", "scenario", "req/s", "p50(ms)", "p99(ms)", "p999(ms)", "cpu/req(us)", "errors");
+    fflush(stdout);
+
+    bench_result aResult[BENCH_SCENARIO_N];
+    for (int i = 0; i < BENCH_SCENARIO_N; i++) {
+        bench_result *r = &aResult[i];
+        BenchRun(&bench, &s_aScenario[i], pidServer, r);
+        printf("%-18s %12.1f %10.3f %10.3f %10.3f ", s_aScenario[i].zName, r->rRps,
+               r->p50 / 1000.0, r->p99 / 1000.0, r->p999 / 1000.0);
+        if (r->rCpuUs >= 0) printf("%12.1f", r->rCpuUs);
+        else printf("%12s", "-");
+        printf(" %8llu\n", (unsigned long long)r->nErrors);
+        fflush(stdout);
+    }
+
+    kill(-pidServer, SIGTERM);
+    waitpid(pidServer, NULL, 0);
+    BenchRootRemove(zRoot);
+
+    // 编译场景在当前进程中运行，与服务器无关
+    bench_compile compile;
+    BenchCompile(&compile);
+    printf("\n%-18s %12s %12s\n", "compile", "plain(ms)", "snapshot(ms)");
+    printf("%-18s ", "sqlite3.h");
+    if (compile.rPlainMs >= 0) printf("%12.3f ", compile.rPlainMs);
+    else printf("%12s ", "error");
+    if (compile.rSnapshotMs >= 0) printf("%12.3f\n", compile.rSnapshotMs);
+    else printf("%12s\n", "-");
+    fflush(stdout);
+
+    if (bench.csJson) {
+        FILE *pOut = strcmp(bench.csJson, "-") == 0 ? stdout : fopen(bench.csJson, "w");
+        if (!pOut) {
+            fprintf(stderr, "❌ 无法写入 %s: %s\n", bench.csJson, strerror(errno));
+            return 1;
+        }
+        if (pOut == stdout) printf("\n");
+        BenchJson(pOut, pParams, &bench, aResult, &compile);
+        if (pOut != stdout) fclose(pOut);
+    }
+    return 0;
+}
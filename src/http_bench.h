@@ -0,0 +1,45 @@
+/*
+ * Bench - Header
+ *
+ * 内置的压力测试（wpp --bench）：在临时的 Web 根目录上以回环端口启动服务器（使用与正常运行相同的参数），
+ * 然后由多线程、支持 Keep-Alive 的 HTTP/1.1 客户端依次运行内置的各个场景：
+ * buildins 的 /hello.html（gzip 和不压缩）、文件系统中的静态文件、/hello.c（C 脚本）、
+ * 同时定义 main() 和 handle_request() 的小脚本（-R 时常驻运行）、共享内存数据库上的 SQTP-SELECT
+ *
+ * 每个场景先预热，再在固定的时间内测量：每秒请求数、延迟的 p50/p99/p999（每个请求从发出到收完回复），
+ * 以及服务器（主进程及其所有子进程）每个请求消耗的 CPU 时间。最后在当前进程中测量包含 <sqlite3.h> 的脚本的编译时间
+ * （直接编译和使用系统头文件快照）。结果以文本输出，也可以输出为 JSON，便于在不同的提交之间比较
+ */
+
+#ifndef HTTP_BENCH_H
+#define HTTP_BENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "httpd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct http_bench {
+    int                         nSeconds;                   // 每个场景的测量时长（秒），之前另有 1/5 的时间用于预热
+    int                         nConns;                     // 并发的 Keep-Alive 连接数
+    int                         nThreads;                   // 客户端线程数，连接平均分配到各线程
+    const char*                 csJson;                     // JSON 结果输出到该文件（"-" 表示标准输出），NULL 不输出
+} http_bench_st;
+
+/**
+ * 运行压力测试：启动服务器、运行所有场景、停止服务器
+ * + 需要在 buildins、TinyCC 环境和共享内存数据库初始化之后调用（服务器进程由 fork 继承）
+ *
+ * @param pParams 服务器参数（与正常运行时相同）
+ * @return 0: 成功；1: 服务器无法启动
+ */
+int http_bench_main(http_params_st *pParams, const http_bench_st *pBench);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_BENCH_H */
@@ -8,21 +8,684 @@
 // + 输出格式遵循标准 CGI 规范：可选的 CGI 头 + 空行 + 内容
 // + C 脚本的 printf() 输出会通过管道传给父进程，最终发送给客户端
 
+//
+// 已编译脚本的缓存（-X/--script-cache）：
+// + 请求处理进程（prefork worker、每连接子进程）在 fork CGI 子子进程之前查找缓存，未命中时在自己的进程中
+//   以新的 TCCState 编译并重定位，CGI 子子进程由 fork 继承已重定位的机器码，直接调用 main()，不再编译
+// + 以脚本路径、mtime、大小和内容的哈希为键：mtime 和大小不变时直接命中；mtime 改变（或者与上次核对在同一秒内）时
+//   重新读取内容计算哈希，内容不变时仍然命中，否则重新编译
+// + 脚本所在的目录作为 include 路径（CGI 子子进程在该目录中编译，请求处理进程的当前目录是 Web 根目录）；
+//   编译时打开的头文件（系统 include 路径中的除外）也记录 stat，任何一个改变时重新编译
+// + 编译失败也缓存（连同错误信息），CGI 子子进程直接输出错误，不再编译；内容不变时每 CGI_C_FAIL_RETRY 秒才重新尝试一次
+// + 目标文件缓存（-O/--script-cache-dir）：编译的结果同时以目标文件写入缓存目录，文件名是内容的哈希、wpp 可执行文件的哈希
+//   （包括 libtcc、tcc_configure() 的设置和 buildins 中的头文件、运行时库）、脚本所在目录和脚本包含的头文件的 stat 合成的键
+//   （见 cgi_c_object_key()）；重新启动后，缓存中没有的脚本先查找目标文件，找到时只需加载和重定位，不再预处理、编译
+// + 常驻模式（-R/--resident）：缓存中的脚本如果定义了 handle_request(wpp_req*, wpp_res*)，请求处理进程直接调用它，
+//   不再 fork CGI 子子进程，回复经 wpp_*() 输出（见 httpd.c）。脚本在请求处理进程中运行，只适用于可信的脚本
+// + 后台预编译（-W/--watch，见 http_watch.c）：监视进程在脚本被部署或修改时调用 httpd_cgi_c_precompile()，
+//   把目标文件提前写入缓存目录，请求处理进程第一次遇到该脚本时只需加载；脚本改变或删除后，原来的目标文件被删除
+// + main() 只在 CGI 子子进程中运行。常驻脚本的 handle_request() 在请求处理进程中运行，会修改数据段，所以编译后保存一份
+//   数据段（.data/.bss）的初始内容，调用过 handle_request() 之后 CGI 子子进程先恢复它再调用 main()：main() 看到的
+//   全局变量总是初值，handle_request() 看到的是同一进程中之前的请求留下的值
+
 #include "httpd.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <setjmp.h>
+#include <time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
 #include <libtcc.h>
 #include "tcc_evn.h"
 #include "buildins.h"
+#include "http_scoreboard.h"
+
+#ifdef __APPLE__
+#define ST_MTIM(st)     ((st).st_mtimespec)
+#else
+#define ST_MTIM(st)     ((st).st_mtim)
+#endif
+
+#define CGI_C_PARK          "__wpp_park"            // 编译缓存时 tcc_run() 的入口：只完成重定位，不运行 main()
+#define CGI_C_EXIT_ZERO     ((int)0xE0E00E0E)       // 脚本调用 exit(0) 时经 longjmp 传回的值（见 tccrun.c 的 RT_EXIT_ZERO）
+#define CGI_C_FAIL_RETRY    2                       // 编译失败的脚本（和它的头文件）没有改变时，重新尝试编译的间隔（秒）
+
+typedef int (*cgi_c_main_fn)(int, char**, char**);
+typedef int (*cgi_c_handle_fn)(wpp_req*, wpp_res*);
+
+// 编译每个脚本时加在源代码之前的声明：常驻模式的 API（wpp_*()，在 httpd.c 中实现）
+// + tcc_configure() 中预编译的声明是单独的编译单元，对脚本不可见，所以直接加在脚本之前，以 #line 保持错误信息中的行号
+static const char CGI_C_PRELUDE[] =
+    "typedef struct wpp_req wpp_req;\n"
+    "typedef struct wpp_res wpp_res;\n"
+    "const char *wpp_param(wpp_req *req, const char *name);\n"
+    "const char *wpp_body(wpp_req *req, __SIZE_TYPE__ *len);\n"
+    "void wpp_status(wpp_res *res, const char *status);\n"
+    "void wpp_header(wpp_res *res, const char *name, const char *value);\n"
+    "__SIZE_TYPE__ wpp_write(wpp_res *res, const void *data, __SIZE_TYPE__ len);\n"
+    "int wpp_printf(wpp_res *res, const char *format, ...);\n"
+    "#line 1\n";
+
+// 编译时打开的一个头文件（路径相对于当前目录），文件不存在时 nSize 为 -1
+typedef struct cgi_c_dep {
+    char*                       zPath;
+    dev_t                       dev;
+    ino_t                       ino;
+    off_t                       nSize;
+    time_t                      tMtime;
+    long                        nMtimeNs;
+} cgi_c_dep;
+
+// 在请求处理进程中编译的附带结果：错误信息（以 CGI 子子进程编译时的格式记录，不直接输出）和打开过的头文件
+typedef struct cgi_c_out {
+    char*                       zErrors;
+    size_t                      nErrors;
+    char**                      azDep;
+    int                         nDep;
+} cgi_c_out;
+
+// 一个已编译并重定位的脚本（或者编译失败的脚本）
+typedef struct cgi_c_prog {
+    char*                       zPath;          // 文件系统中的脚本路径，或者 buildins 的 URI
+    buildin_file_info_st*       pBuildin;       // buildins 中的脚本（内容不会改变，不需要核对）
+    dev_t                       dev;
+    ino_t                       ino;
+    off_t                       nSize;
+    time_t                      tMtime;
+    long                        nMtimeNs;
+    time_t                      tChecked;       // 最后一次核对内容的时间
+    uint64_t                    iHash;          // 内容的 FNV-1a 哈希
+    uint64_t                    iUsed;          // 最后一次使用的序号（缓存满时淘汰最久未使用的）
+    cgi_c_dep*                  aDep;           // 编译时打开的头文件
+    int                         nDep;
+    char*                       zErrors;        // 编译失败时的错误信息（此时 s 为 NULL）
+    time_t                      tFailed;        // 编译失败的时间
+    TCCState*                   s;
+    cgi_c_main_fn               xRunMain;       // runmain.o 的 _runmain()：运行构造函数后调用 main()
+    cgi_c_handle_fn             xHandle;        // 脚本的 handle_request()（常驻模式的入口），没有定义时为 NULL
+    void*                       pData;          // 重定位后的数据段（.data/.bss），定义了 handle_request() 时才记录
+    unsigned                    nData;
+    void*                       pPristine;      // 数据段的初始内容
+    bool                        bDirty;         // 调用过 handle_request()，数据段可能已被修改
+} cgi_c_prog;
+
+static cgi_c_prog*              s_aProg = NULL;
+static int                      s_nProg = 0;
+static int                      s_nProgMax = 0;
+static uint64_t                 s_iUse = 0;
+static cgi_c_prog*              s_pReady = NULL;    // 当前请求的脚本，由 CGI 子子进程继承
+static const char*              s_zObjDir = NULL;   // 目标文件缓存目录（jail 中的路径），NULL 表示不使用
+static uint64_t                 s_iBuildId = 0;     // wpp 可执行文件的哈希，目标文件缓存的键的一部分
+
+// 后台预编译过的脚本（只在监视进程中使用）：脚本路径和最近一次编译的内容对应的键
+// + 有目标文件缓存时 iKey 是目标文件的键（编译失败时是第一级的键），iDeps 是 .d 文件的键（第一级的键）
+typedef struct cgi_c_watched {
+    char*                       zPath;
+    uint64_t                    iKey;
+    uint64_t                    iDeps;
+    bool                        bFailed;        // 该内容编译失败（内容不变时不再重复编译）
+} cgi_c_watched;
+
+static cgi_c_watched*           s_aWatched = NULL;
+static int                      s_nWatched = 0;
+static int                      s_nWatchedAlloc = 0;
 
 // 前向声明
+static int cgi_c_compile(TCCState *s, const char *zSource, bool bBuild);
+static void cgi_c_add_api(TCCState *s);
 static void cgi_c_error_func(void *opaque, const char *msg);
+static void cgi_c_collect_error(void *opaque, const char *msg);
+static void cgi_c_diag_func(void *opaque, const char *msg);
+static void cgi_c_mark_relocated(TCCState *s);
 static int cgi_c_read_file(const char* filename, char** content, size_t* size);
+static int cgi_c_run(cgi_c_prog *p, char *script);
 
 // 使用 main() 中预配置的 TCCState（fork 后继承）
 extern TCCState *cgi_tcc_state;
+extern char **environ;
+
+#define CGI_C_HASH_SEED     0xcbf29ce484222325ULL
+
+// FNV-1a，从 h 继续
+static uint64_t cgi_c_hash(uint64_t h, const void *p, size_t n) {
+    const unsigned char *z = p;
+    for (size_t i = 0; i < n; i++) {
+        h ^= z[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// 计算 wpp 可执行文件的哈希（chroot 之前调用）：libtcc、tcc_configure() 的设置、buildins 中的头文件和运行时库都编译在其中，
+// 任何一项改变都使原来的目标文件失效。失败时返回 0
+static uint64_t cgi_c_build_id(void) {
+    char zExe[PATH_MAX];
+    char zBuf[65536];
+    uint64_t h = CGI_C_HASH_SEED;
+    ssize_t n;
+#ifdef __APPLE__
+    uint32_t nExe = sizeof(zExe);
+    if (_NSGetExecutablePath(zExe, &nExe) != 0) return 0;
+#else
+    n = readlink("/proc/self/exe", zExe, sizeof(zExe) - 1);
+    if (n <= 0) return 0;
+    zExe[n] = 0;
+#endif
+    int fd = open(zExe, O_RDONLY);
+    if (fd < 0) return 0;
+    while ((n = read(fd, zBuf, sizeof(zBuf))) > 0) h = cgi_c_hash(h, zBuf, (size_t)n);
+    close(fd);
+    return n < 0 ? 0 : h;
+}
+
+void httpd_cgi_c_cache_init(int nMax, const char *zObjDir) {
+    s_nProgMax = nMax > 0 ? nMax : 0;
+    s_aProg = s_nProgMax ? calloc((size_t)s_nProgMax, sizeof(cgi_c_prog)) : NULL;
+    if (!s_aProg) s_nProgMax = 0;
+    if (s_nProgMax && zObjDir && *zObjDir) {
+        s_iBuildId = cgi_c_build_id();
+        if (s_iBuildId) s_zObjDir = zObjDir;
+        else fprintf(stderr, "[cgi_c] cannot hash the executable, object cache disabled\n");
+    }
+}
+
+void httpd_cgi_c_snapshot_init(const char *zSets, bool bNow) {
+    if (tcc_snapshot_init(zSets) > 0 && bNow) tcc_snapshot_ready();
+}
+
+// 脚本所在的目录（相对于当前目录），作为编译时的 include 路径
+static void cgi_c_dir(const char *zScript, char *zDir, size_t nDir) {
+    const char *z = strrchr(zScript, '/');
+    if (!z) snprintf(zDir, nDir, ".");
+    else snprintf(zDir, nDir, "%.*s", (int)(z - zScript), zScript);
+}
+
+// 编译前的设置：脚本所在的目录作为 include 路径，记录打开的头文件（-MMD），错误信息收集到 pOut 中
+static void cgi_c_setup(TCCState *s, const char *zDir, cgi_c_out *pOut) {
+    tcc_set_error_func(s, pOut, cgi_c_collect_error);
+    if (zDir) tcc_add_include_path(s, zDir);
+    tcc_set_options(s, "-MMD");
+}
+
+// 取出编译时打开的头文件（tcc_delete() 之前），转换为绝对路径：目标文件缓存的 .d 文件由当前目录不同的进程共用
+static void cgi_c_take_deps(TCCState *s, cgi_c_out *pOut) {
+    char zReal[PATH_MAX];
+    const char **azDep;
+    int n = tcc_get_dependencies(s, &azDep);
+    if (!pOut || n <= 0 || pOut->azDep) return;
+    pOut->azDep = calloc((size_t)n, sizeof(char*));
+    if (!pOut->azDep) return;
+    for (int i = 0; i < n; i++) {
+        const char *z = realpath(azDep[i], zReal) ? zReal : azDep[i];
+        if ((pOut->azDep[pOut->nDep] = strdup(z))) pOut->nDep++;
+    }
+}
+
+static void cgi_c_out_free(cgi_c_out *pOut) {
+    for (int i = 0; i < pOut->nDep; i++) free(pOut->azDep[i]);
+    free(pOut->azDep);
+    free(pOut->zErrors);
+    memset(pOut, 0, sizeof(*pOut));
+}
+
+// 目标文件缓存的键分两级：
+// + 第一级由内容的哈希、wpp 可执行文件的哈希和脚本所在的目录（绝对路径）合成，<键>.d 记录该脚本上次编译时打开的头文件
+// + 第二级由第一级的键和 .d 中每个头文件当前的 stat 合成，<键>.o 是目标文件：任何一个头文件改变时得到新的键
+static uint64_t cgi_c_object_key(uint64_t iHash, const char *zDir) {
+    char zReal[PATH_MAX];
+    uint64_t h = cgi_c_hash(s_iBuildId, &iHash, sizeof(iHash));
+    if (zDir) {
+        const char *z = realpath(zDir, zReal) ? zReal : zDir;
+        h = cgi_c_hash(h, z, strlen(z));
+    }
+    return h;
+}
+
+// 把头文件当前的 stat 合成到键中（不存在的头文件也合成一个标记：新建时得到新的键）
+static uint64_t cgi_c_deps_key(uint64_t h, char **azDep, int nDep) {
+    struct stat st;
+    for (int i = 0; i < nDep; i++) {
+        if (stat(azDep[i], &st) != 0) h = cgi_c_hash(h, "-", 1);
+        else {
+            uint64_t a[5] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                              (uint64_t)ST_MTIM(st).tv_sec, (uint64_t)ST_MTIM(st).tv_nsec };
+            h = cgi_c_hash(h, a, sizeof(a));
+        }
+    }
+    return h;
+}
+
+// 缓存目录中的文件：zExt 为 ".o"（目标文件）或者 ".d"（头文件列表）
+static void cgi_c_object_path(uint64_t iKey, const char *zExt, char *zObj, size_t nObj) {
+    snprintf(zObj, nObj, "%s/%016llx%s", s_zObjDir, (unsigned long long)iKey, zExt);
+}
+
+// 读取第一级的键对应的 .d 文件（每行一个头文件），头文件列表放在 pDeps 中；文件不存在时返回 -1
+static int cgi_c_deps_load(uint64_t iKey, cgi_c_out *pDeps) {
+    char zFile[PATH_MAX];
+    char *z, *zLine;
+    size_t n;
+    int nLine = 0;
+    cgi_c_object_path(iKey, ".d", zFile, sizeof(zFile));
+    if (cgi_c_read_file(zFile, &z, &n) != 0) return -1;
+    for (size_t i = 0; i < n; i++) nLine += z[i] == '\n';
+    pDeps->azDep = calloc((size_t)nLine + 1, sizeof(char*));
+    if (!pDeps->azDep) {
+        free(z);
+        return -1;
+    }
+    for (zLine = z; *zLine; ) {
+        char *zEnd = strchr(zLine, '\n');
+        if (!zEnd) break;               // 没有写完的最后一行
+        *zEnd = 0;
+        if (*zLine && (pDeps->azDep[pDeps->nDep] = strdup(zLine))) pDeps->nDep++;
+        zLine = zEnd + 1;
+    }
+    free(z);
+    return 0;
+}
+
+// 写入 .d 文件（先写入临时文件再改名）
+static int cgi_c_deps_save(uint64_t iKey, char **azDep, int nDep) {
+    char zFile[PATH_MAX], zTmp[PATH_MAX + 16];
+    cgi_c_object_path(iKey, ".d", zFile, sizeof(zFile));
+    snprintf(zTmp, sizeof(zTmp), "%s.%d", zFile, (int)getpid());
+    FILE *fp = fopen(zTmp, "wb");
+    if (!fp) return -1;
+    for (int i = 0; i < nDep; i++) fprintf(fp, "%s\n", azDep[i]);
+    if (fclose(fp) != 0 || rename(zTmp, zFile) != 0) {
+        unlink(zTmp);
+        return -1;
+    }
+    return 0;
+}
+
+// 编译脚本，以目标文件写入缓存目录（先写入临时文件再改名，其它进程不会读到不完整的文件）
+// + iKey 为第一级的键，0 时只编译（检查错误）；成功时 *piObj 返回目标文件（第二级）的键，.d 文件在目标文件之后写入
+// + zDiag 非 NULL 时编译错误以 zDiag（脚本路径）为前缀输出到 stderr，否则收集到 pOut 中
+// + 返回 0：成功；-1：编译失败；-2：目标文件无法写入
+static int cgi_c_write_object(const char *zSource, const char *zDir, uint64_t iKey, uint64_t *piObj,
+                              const char *zDiag, cgi_c_out *pOut) {
+    char zObj[PATH_MAX], zTmp[PATH_MAX + 16];
+    cgi_c_out deps;
+    cgi_c_out *pDeps = pOut ? pOut : &deps;
+    int rc = -1;
+    TCCState *s = tcc_new();
+    if (!s) return -1;
+    memset(&deps, 0, sizeof(deps));
+    tcc_set_output_type(s, TCC_OUTPUT_OBJ);
+    if (tcc_configure_object(s) == 0) {
+        cgi_c_setup(s, zDir, zDiag ? NULL : pOut);
+        if (zDiag) tcc_set_error_func(s, (void*)zDiag, cgi_c_diag_func);
+        if (cgi_c_compile(s, zSource, true) == 0) {
+            cgi_c_take_deps(s, pDeps);
+            if (!iKey) rc = 0;
+            else {
+                *piObj = cgi_c_deps_key(iKey, pDeps->azDep, pDeps->nDep);
+                cgi_c_object_path(*piObj, ".o", zObj, sizeof(zObj));
+                snprintf(zTmp, sizeof(zTmp), "%s.%d", zObj, (int)getpid());
+                rc = tcc_output_file(s, zTmp) == 0 && rename(zTmp, zObj) == 0 ? 0 : -2;
+                if (rc) unlink(zTmp);
+                else if (cgi_c_deps_save(iKey, pDeps->azDep, pDeps->nDep) != 0) rc = -2;
+            }
+        }
+        else cgi_c_take_deps(s, pOut);
+    }
+    tcc_delete(s);
+    cgi_c_out_free(&deps);
+    return rc;
+}
+
+// 以新的 TCCState 编译并重定位脚本（在请求处理进程中），失败时返回 NULL
+// + tcc_run() 之外没有公开的接口能链接 runmain.o（exit() 和构造函数的支持），所以以 -Wl,-e 把入口换成一个空函数，
+//   tcc_run() 重定位后只调用它；之后由 _runmain() 运行 main()
+// + zObj 非 NULL 时加载该目标文件，而不是编译源代码，此时不需要预编译 API 声明（tcc_configure_link()）
+// + 入口所在的单元同时提供一个弱定义的 main()：只定义 handle_request() 的常驻脚本也能链接 runmain.o
+// + 编译的错误信息和打开过的头文件记录在 pOut 中
+static TCCState *cgi_c_link(const char *zSource, const char *zDir, const char *zObj, cgi_c_out *pOut) {
+    char *argv[] = { CGI_C_PARK, NULL };
+    TCCState *s = tcc_new();
+    if (!s) return NULL;
+    tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+    if ((zObj ? tcc_configure_link(s) : tcc_configure(s)) < 0 || tcc_set_options(s, "-Wl,-e=" CGI_C_PARK) < 0) goto fail;
+    cgi_c_setup(s, zObj ? NULL : zDir, pOut);
+    if (httpd_timing_enabled()) cgi_c_mark_relocated(s);
+    cgi_c_add_api(s);
+    if (tcc_compile_string(s, "int " CGI_C_PARK "(int argc, char **argv, char **envp) { return 0; }\n"
+                              "__attribute__((weak)) int main(void) { return 1; }\n") < 0
+        || (zObj ? tcc_add_file(s, zObj) : cgi_c_compile(s, zSource, true)) < 0
+        || tcc_run(s, 1, argv) != 0) goto fail;
+    if (!zObj) cgi_c_take_deps(s, pOut);
+    if (tcc_get_symbol(s, "_runmain")) return s;
+fail:
+    if (!zObj) cgi_c_take_deps(s, pOut);
+    tcc_delete(s);
+    return NULL;
+}
+
+// 取得脚本重定位后的 TCCState：使用目标文件缓存时先查找目标文件，没有时编译并写入目标文件后加载
+// + *pzFrom 返回结果的来源（"loaded"：目标文件缓存，"compiled"：编译）
+// + 失败时返回 NULL，pOut 中有编译的错误信息；加载目标文件时 pOut 中的头文件来自 .d 文件
+static TCCState *cgi_c_build(const char *zSource, const char *zDir, uint64_t iHash, const char **pzFrom, cgi_c_out *pOut) {
+    char zObj[PATH_MAX];
+    TCCState *s;
+    *pzFrom = "compiled";
+    if (s_zObjDir) {
+        uint64_t iKey = cgi_c_object_key(iHash, zDir), iObj;
+        if (cgi_c_deps_load(iKey, pOut) == 0) {
+            cgi_c_object_path(cgi_c_deps_key(iKey, pOut->azDep, pOut->nDep), ".o", zObj, sizeof(zObj));
+            if (access(zObj, R_OK) == 0) {
+                if ((s = cgi_c_link(NULL, NULL, zObj, NULL))) {
+                    *pzFrom = "loaded";
+                    return s;
+                }
+                unlink(zObj);       // 损坏的目标文件
+            }
+            cgi_c_out_free(pOut);
+        }
+        int rc = cgi_c_write_object(zSource, zDir, iKey, &iObj, NULL, pOut);
+        if (rc == -1) return NULL;                  // 编译错误：不需要在内存中再编译一次
+        if (rc == 0) {
+            cgi_c_object_path(iObj, ".o", zObj, sizeof(zObj));
+            if ((s = cgi_c_link(NULL, NULL, zObj, NULL))) return s;
+        }
+        cgi_c_out_free(pOut);
+    }
+    return cgi_c_link(zSource, zDir, NULL, pOut);
+}
+
+// 记录头文件当前的 stat
+static void cgi_c_deps_record(cgi_c_prog *p, char **azDep, int nDep) {
+    struct stat st;
+    p->aDep = nDep > 0 ? calloc((size_t)nDep, sizeof(cgi_c_dep)) : NULL;
+    if (!p->aDep) return;
+    for (int i = 0; i < nDep; i++) {
+        cgi_c_dep *d = &p->aDep[p->nDep];
+        if (!(d->zPath = strdup(azDep[i]))) continue;
+        if (stat(d->zPath, &st) != 0) d->nSize = -1;
+        else {
+            d->dev = st.st_dev;
+            d->ino = st.st_ino;
+            d->nSize = st.st_size;
+            d->tMtime = ST_MTIM(st).tv_sec;
+            d->nMtimeNs = ST_MTIM(st).tv_nsec;
+        }
+        p->nDep++;
+    }
+}
+
+// 编译时打开的头文件是否都没有改变
+static bool cgi_c_deps_same(const cgi_c_prog *p) {
+    struct stat st;
+    for (int i = 0; i < p->nDep; i++) {
+        const cgi_c_dep *d = &p->aDep[i];
+        if (stat(d->zPath, &st) != 0) {
+            if (d->nSize >= 0) return false;
+        } else if (d->nSize != st.st_size || d->dev != st.st_dev || d->ino != st.st_ino
+                   || d->tMtime != ST_MTIM(st).tv_sec || d->nMtimeNs != ST_MTIM(st).tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 取得缓存中的位置：已有的同一脚本，或者空闲的、最久未使用的位置
+static cgi_c_prog *cgi_c_slot(const char *script, buildin_file_info_st *buildin_info) {
+    cgi_c_prog *pOld = NULL;
+    for (int i = 0; i < s_nProg; i++) {
+        cgi_c_prog *p = &s_aProg[i];
+        if (p->zPath && p->pBuildin == buildin_info && strcmp(p->zPath, script) == 0) return p;
+        if (!pOld || p->iUsed < pOld->iUsed) pOld = p;
+    }
+    if (s_nProg < s_nProgMax) return &s_aProg[s_nProg++];
+    return pOld;
+}
+
+// 保存常驻脚本的数据段的初始内容（重定位之后、第一次调用 handle_request() 之前）
+// + 无法保存时不使用常驻模式：否则 CGI 子子进程的 main() 会看到 handle_request() 修改过的全局变量
+static void cgi_c_keep_data(cgi_c_prog *p) {
+    p->pData = tcc_get_data_range(p->s, &p->nData);
+    if (!p->pData || !p->nData) return;
+    p->pPristine = malloc(p->nData);
+    if (p->pPristine) memcpy(p->pPristine, p->pData, p->nData);
+    else p->xHandle = NULL;
+}
+
+static void cgi_c_release(cgi_c_prog *p) {
+    if (p->s) tcc_delete(p->s);
+    for (int i = 0; i < p->nDep; i++) free(p->aDep[i].zPath);
+    free(p->aDep);
+    free(p->zErrors);
+    free(p->pPristine);
+    free(p->zPath);
+    memset(p, 0, sizeof(*p));
+}
+
+void httpd_cgi_c_prepare(char* script, buildin_file_info_st* buildin_info) {
+    struct stat st;
+    char *source_code = NULL;
+    size_t code_size = 0;
+    uint64_t iHash = 0;
+    time_t tNow = time(0);
+
+    s_pReady = NULL;
+    if (!s_nProgMax) {
+        // 不缓存时由 CGI 子子进程编译：在 fork 之前建立 -I 登记的快照，之后的 CGI 子子进程都能使用（只建立一次）
+        tcc_snapshot_ready();
+        return;
+    }
+    scoreboard_state(SB_COMPILE);
+
+    cgi_c_prog *p = cgi_c_slot(script, buildin_info);
+    bool bSame = p->zPath && p->pBuildin == buildin_info && strcmp(p->zPath, script) == 0;
+    bool bDeps = bSame && cgi_c_deps_same(p);
+    bool bRetry = bSame && !p->s && tNow - p->tFailed >= CGI_C_FAIL_RETRY;
+
+    if (buildin_info) {
+        // buildins 中的脚本编译进了可执行文件，内容不会改变
+        if (!bSame || !bDeps) {
+            source_code = (char*)buildins_decompressed(buildin_info);
+            if (!source_code || source_code == (void*)1) return;
+            code_size = buildin_info->orig_sz;
+            if (s_zObjDir) iHash = cgi_c_hash(CGI_C_HASH_SEED, source_code, code_size);
+        }
+    } else {
+        if (stat(script, &st) != 0) return;
+        bool bStat = bSame && p->dev == st.st_dev && p->ino == st.st_ino && p->nSize == st.st_size;
+        bool bMtime = bStat && p->tMtime == ST_MTIM(st).tv_sec && p->nMtimeNs == ST_MTIM(st).tv_nsec;
+
+        // mtime 不变，并且上次核对在 mtime 的一秒之后（同一秒内的修改不一定改变 mtime），不需要读取内容
+        // + 头文件改变，或者到了重新尝试编译失败的脚本的时间，都需要重新编译
+        if (!(bMtime && p->tChecked > p->tMtime + 1) || !bDeps || bRetry) {
+            if (cgi_c_read_file(script, &source_code, &code_size) != 0) return;
+            iHash = cgi_c_hash(CGI_C_HASH_SEED, source_code, code_size);
+            if (bStat && p->iHash == iHash && bDeps && !bRetry) {
+                free(source_code);
+                source_code = NULL;
+                p->tMtime = ST_MTIM(st).tv_sec;
+                p->nMtimeNs = ST_MTIM(st).tv_nsec;
+                p->tChecked = tNow;
+            }
+        }
+    }
+
+    // 未命中：编译新的版本，替换原来的（已经 fork 出的 CGI 子子进程有自己的副本，不受影响）
+    // + 编译失败时记录错误信息，CGI 子子进程直接输出
+    if (source_code) {
+        struct timespec t0, t1;
+        const char *zFrom;
+        char zDir[PATH_MAX];
+        cgi_c_out out;
+        memset(&out, 0, sizeof(out));
+        if (!buildin_info) cgi_c_dir(script, zDir, sizeof(zDir));
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        TCCState *s = cgi_c_build(source_code, buildin_info ? NULL : zDir, iHash, &zFrom, &out);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (!buildin_info) free(source_code);
+        if (p->zPath) cgi_c_release(p);
+        p->zPath = strdup(script);
+        if (!p->zPath) {
+            if (s) tcc_delete(s);
+            cgi_c_out_free(&out);
+            return;
+        }
+        p->pBuildin = buildin_info;
+        p->s = s;
+        if (s) {
+            p->xRunMain = (cgi_c_main_fn)tcc_get_symbol(s, "_runmain");
+            p->xHandle = (cgi_c_handle_fn)tcc_get_symbol(s, "handle_request");
+            if (p->xHandle) cgi_c_keep_data(p);
+        } else {
+            p->zErrors = out.zErrors;
+            out.zErrors = NULL;
+            p->tFailed = tNow;
+            zFrom = "failed to compile";
+        }
+        cgi_c_deps_record(p, out.azDep, out.nDep);
+        cgi_c_out_free(&out);
+        if (!buildin_info) {
+            p->dev = st.st_dev;
+            p->ino = st.st_ino;
+            p->nSize = st.st_size;
+            p->tMtime = ST_MTIM(st).tv_sec;
+            p->nMtimeNs = ST_MTIM(st).tv_nsec;
+            p->tChecked = tNow;
+            p->iHash = iHash;
+        }
+        fprintf(stderr, "[cgi_c] %s %s in %.3f ms (pid %d)\n", zFrom, script,
+                (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, (int)getpid());
+    }
+
+    if (!p->zPath) return;
+    p->iUsed = ++s_iUse;
+    s_pReady = p;
+    httpd_phase(HTTPD_PHASE_COMPILE);
+}
+
+bool httpd_cgi_c_resident(void) {
+    return s_pReady && s_pReady->xHandle;
+}
+
+int httpd_cgi_c_handle(wpp_req *req, wpp_res *res) {
+    cgi_c_prog *p = s_pReady;
+    jmp_buf jb;
+    int ret;
+
+    // 脚本调用 exit() 时经 longjmp 回到这里，而不是结束请求处理进程
+    scoreboard_state(SB_RUN);
+    p->bDirty = true;
+    ret = tcc_setjmp(p->s, jb, (void*)p->xHandle);
+    if (ret == 0) ret = p->xHandle(req, res);
+    else if (ret == CGI_C_EXIT_ZERO) ret = 0;
+    httpd_phase(HTTPD_PHASE_EXECUTE);
+    return ret;
+}
+
+// 删除后台预编译的一项；没有其它脚本的内容与它相同时，同时删除它的目标文件和 .d 文件
+// + iKeep：仍然使用的 .d 文件的键（脚本改变后重新编译时，内容相同的 .d 文件已经被重新写入），没有时为 0
+// + 请求处理进程中已经加载的副本不受影响，它们在下次核对内容时发现改变而重新加载
+static void cgi_c_unwatch(int i, uint64_t iKeep) {
+    uint64_t iKey = s_aWatched[i].iKey;
+    uint64_t iDeps = s_aWatched[i].iDeps;
+    bool bObj = true, bDeps = iDeps != iKeep;
+    char zFile[PATH_MAX];
+    free(s_aWatched[i].zPath);
+    s_aWatched[i] = s_aWatched[--s_nWatched];
+    if (!s_zObjDir) return;
+    for (int j = 0; j < s_nWatched; j++) {
+        if (s_aWatched[j].iKey == iKey) bObj = false;
+        if (s_aWatched[j].iDeps == iDeps) bDeps = false;
+    }
+    cgi_c_object_path(iKey, ".o", zFile, sizeof(zFile));
+    if (bObj) unlink(zFile);
+    cgi_c_object_path(iDeps, ".d", zFile, sizeof(zFile));
+    if (bDeps) unlink(zFile);
+}
+
+int httpd_cgi_c_precompile(const char *zPath) {
+    char zObj[PATH_MAX];
+    char zDir[PATH_MAX];
+    char *source_code = NULL;
+    size_t code_size = 0;
+    struct timespec t0, t1;
+    cgi_c_watched *w = NULL;
+    cgi_c_out deps;
+    bool bObj = false;
+    int i, rc;
+
+    if (cgi_c_read_file(zPath, &source_code, &code_size) != 0) return -1;
+    cgi_c_dir(zPath, zDir, sizeof(zDir));
+    uint64_t iKey = cgi_c_hash(CGI_C_HASH_SEED, source_code, code_size);
+    uint64_t iDeps = 0;
+    if (s_zObjDir) {
+        // 已经有 .d 文件时，目标文件的键由其中的头文件决定；否则先以第一级的键代表这个内容
+        iKey = iDeps = cgi_c_object_key(iKey, zDir);
+        memset(&deps, 0, sizeof(deps));
+        if (cgi_c_deps_load(iDeps, &deps) == 0) {
+            iKey = cgi_c_deps_key(iDeps, deps.azDep, deps.nDep);
+            cgi_c_object_path(iKey, ".o", zObj, sizeof(zObj));
+            bObj = access(zObj, R_OK) == 0;
+            cgi_c_out_free(&deps);
+        }
+    }
+    for (i = 0; i < s_nWatched && strcmp(s_aWatched[i].zPath, zPath) != 0; i++) {}
+    if (i < s_nWatched) w = &s_aWatched[i];
+
+    // 内容没有改变（编辑器只是重新保存），或者目标文件已经存在（重新启动，或者与另一个脚本相同）
+    if (w && w->iKey == iKey && (w->bFailed || !s_zObjDir || bObj)) {
+        free(source_code);
+        return 0;
+    }
+    if (bObj) rc = 0;
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        rc = cgi_c_write_object(source_code, zDir, iDeps, &iKey, zPath, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (rc == 0) {
+            fprintf(stderr, "[cgi_c] precompiled %s in %.3f ms\n", zPath,
+                    (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+        } else {
+            fprintf(stderr, "[cgi_c] precompile %s failed\n", zPath);
+        }
+        rc = rc == 0 ? 1 : -1;
+    }
+    free(source_code);
+
+    // 新的目标文件就位之后，才删除原来的（请求处理进程看到新内容时，新的目标文件已经可以加载）
+    if (w && w->iKey == iKey) {
+        w->bFailed = rc < 0;
+        return rc;
+    }
+    if (w) {
+        cgi_c_unwatch(i, iDeps);
+    } else if (s_nWatched == s_nWatchedAlloc) {
+        int nNew = s_nWatchedAlloc ? s_nWatchedAlloc * 2 : 64;
+        cgi_c_watched *aNew = realloc(s_aWatched, nNew * sizeof(cgi_c_watched));
+        if (!aNew) return rc;
+        s_aWatched = aNew;
+        s_nWatchedAlloc = nNew;
+    }
+    s_aWatched[s_nWatched].zPath = strdup(zPath);
+    s_aWatched[s_nWatched].iKey = iKey;
+    s_aWatched[s_nWatched].iDeps = iDeps;
+    s_aWatched[s_nWatched].bFailed = rc < 0;
+    if (s_aWatched[s_nWatched].zPath) s_nWatched++;
+    return rc;
+}
+
+void httpd_cgi_c_forget(const char *zPath) {
+    size_t n = strlen(zPath);
+    for (int i = s_nWatched - 1; i >= 0; i--) {
+        const char *z = s_aWatched[i].zPath;
+        if (strncmp(z, zPath, n) == 0 && (z[n] == 0 || z[n] == '/')) cgi_c_unwatch(i, 0);
+    }
+}
 
 // TinyCC CGI 主处理函数
 // 注意：此函数在 CGI 子子进程中运行，stdout 已重定向到管道
@@ -34,6 +697,22 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
     char* source_code = NULL;
     size_t code_size = 0;
     int need_free_source = 0;
+
+    // 请求处理进程已经编译好了该脚本：直接运行
+    if (s_pReady && s_pReady->pBuildin == buildin_info && strcmp(s_pReady->zPath, script) == 0) {
+        // 编译失败的结果同样被缓存：输出记录的错误信息，不再重新编译
+        if (!s_pReady->s) {
+            if (s_pReady->zErrors) fputs(s_pReady->zErrors, stderr);
+            printf("Status: 500 Internal Server Error\r\n");
+            printf("Content-Type: text/plain\r\n\r\n");
+            printf("Error: Failed to compile C script (see stderr for details)\n");
+            exit(1);
+        }
+        scoreboard_state(SB_RUN);
+        int exit_code = cgi_c_run(s_pReady, script);
+        httpd_phase(HTTPD_PHASE_EXECUTE);
+        exit(exit_code);
+    }
     
     // 根据是否为 buildin 文件选择不同的源代码获取方式
     if (buildin_info) {
@@ -58,8 +737,9 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
         // 注意：buildins 解压的内存由 buildins 模块管理，不需要 free
         need_free_source = 0;
     } else {
-        // 从文件系统读取 C 脚本文件
-        if (cgi_c_read_file(script, &source_code, &code_size) != 0) {
+        // 从文件系统读取 C 脚本文件（CGI 子子进程已经进入脚本所在的目录）
+        const char *zBase = strrchr(script, '/');
+        if (cgi_c_read_file(zBase ? zBase + 1 : script, &source_code, &code_size) != 0) {
             printf("Status: 404 Not Found\r\n");
             printf("Content-Type: text/plain\r\n\r\n");
             printf("Error: C script file not found: %s\n", script);
@@ -70,7 +750,7 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
     
     // 使用预配置的 TCCState（由 fork 继承，无需重新创建）
     // 设计说明：
-    // + 主进程预先配置 cgi_tcc_state（路径、符号、预编译头文件等）
+    // + 主进程预先配置 cgi_tcc_state（路径、符号、API 声明等），系统头文件快照也由 fork 继承
     // + fork 后子进程继承这个 State 的完整副本（写时复制）
     // + 每个子进程使用自己的副本，互不干扰，无状态污染风险
     // + 避免每次请求都重新初始化，提升性能
@@ -86,8 +766,12 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
     // 设置错误回调（错误信息输出到 stderr，父进程可捕获）
     tcc_set_error_func(s, NULL, cgi_c_error_func);
     
+    // 记录请求阶段时（-t），在脚本之前编译一个标记重定位完成的构造函数
+    if (httpd_timing_enabled()) cgi_c_mark_relocated(s);
+    cgi_c_add_api(s);
+
     // 编译 C 代码
-    if (tcc_compile_string(s, source_code) < 0) {
+    if (cgi_c_compile(s, source_code, false) < 0) {
         if (need_free_source) free(source_code);
         // 注意：在子进程中 tcc_delete 不影响父进程（fork 后内存独立）
         tcc_delete(s);
@@ -98,6 +782,8 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
     }
     
     if (need_free_source) free(source_code);
+    httpd_phase(HTTPD_PHASE_COMPILE);
+    scoreboard_state(SB_RUN);
     
     // 刷新输出缓冲区
     fflush(stdout);
@@ -111,17 +797,92 @@ void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildi
     // + fork 的子进程有独立的 TCCState 副本，tcc_run() 的状态修改不影响其他子进程
     char *argv[] = { script, NULL };
     int exit_code = tcc_run(s, 1, argv);
+    httpd_phase(HTTPD_PHASE_EXECUTE);
     
     // 子进程退出（系统自动回收资源，无需手动清理 TCCState）
     exit(exit_code);
 }
 
+// 编译脚本：源代码之前加上 CGI_C_PRELUDE，开头的 #include <...> 有系统头文件快照时以快照代替（见 tcc_snapshot_apply()）
+// + bBuild：没有合适的快照时建立一个，只在请求处理进程、监视进程中使用（CGI 子子进程编译后就退出）
+static int cgi_c_compile(TCCState *s, const char *zSource, bool bBuild) {
+    char *zSnapshot = tcc_snapshot_apply(zSource, bBuild);
+    if (zSnapshot) zSource = zSnapshot;
+    size_t nPrelude = sizeof(CGI_C_PRELUDE) - 1;
+    size_t nSource = strlen(zSource);
+    char *z = malloc(nPrelude + nSource + 1);
+    int rc = -1;
+    if (z) {
+        memcpy(z, CGI_C_PRELUDE, nPrelude);
+        memcpy(z + nPrelude, zSource, nSource + 1);
+        rc = tcc_compile_string(s, z);
+        free(z);
+    }
+    free(zSnapshot);
+    return rc;
+}
+
+// 注册常驻模式 API 的地址（链接时需要，CGI 子子进程中调用时没有作用）
+static void cgi_c_add_api(TCCState *s) {
+    tcc_add_symbol(s, "wpp_param", wpp_param);
+    tcc_add_symbol(s, "wpp_body", wpp_body);
+    tcc_add_symbol(s, "wpp_status", wpp_status);
+    tcc_add_symbol(s, "wpp_header", wpp_header);
+    tcc_add_symbol(s, "wpp_write", wpp_write);
+    tcc_add_symbol(s, "wpp_printf", wpp_printf);
+}
+
 // TCC 错误回调函数
 static void cgi_c_error_func(void *opaque, const char *msg) {
     (void)opaque;
     fprintf(stderr, "TCC Error: %s\n", msg);
 }
 
+// 在请求处理进程中编译时不输出错误，而是以 cgi_c_error_func() 的格式收集起来，由 CGI 子子进程输出（opaque 为 NULL 时丢弃）
+static void cgi_c_collect_error(void *opaque, const char *msg) {
+    cgi_c_out *pOut = opaque;
+    if (!pOut) return;
+    size_t n = strlen(msg) + 12;
+    char *z = realloc(pOut->zErrors, pOut->nErrors + n + 1);
+    if (!z) return;
+    pOut->zErrors = z;
+    pOut->nErrors += (size_t)snprintf(z + pOut->nErrors, n + 1, "TCC Error: %s\n", msg);
+}
+
+// 后台预编译的错误输出到 stderr（服务器的日志），以脚本的路径为前缀
+static void cgi_c_diag_func(void *opaque, const char *msg) {
+    fprintf(stderr, "[cgi_c] %s: %s\n", (const char*)opaque, msg);
+}
+
+// 运行缓存中已重定位的脚本（CGI 子子进程中），和 tcc_run() 在重定位之后的部分相同
+static int cgi_c_run(cgi_c_prog *p, char *script) {
+    char *argv[] = { script, NULL };
+    jmp_buf jb;
+    int ret;
+
+    fflush(stdout);
+    fflush(stderr);
+    // 请求处理进程调用过 handle_request()：恢复数据段的初始内容（只影响本进程的副本）
+    if (p->bDirty && p->pPristine) memcpy(p->pData, p->pPristine, p->nData);
+    ret = tcc_setjmp(p->s, jb, tcc_get_symbol(p->s, "main"));
+    if (ret == 0) ret = p->xRunMain(1, argv, environ);
+    else if (ret == CGI_C_EXIT_ZERO) ret = 0;
+    return ret;
+}
+
+// 重定位完成的标记
+// + tcc_run() 在内部完成重定位后直接调用 main()，两者之间没有回调；而 runmain 在 main() 之前会调用所有的构造函数，
+//   因此编译一个调用 httpd_phase() 的构造函数作为重定位完成的时间
+static void cgi_c_mark_relocated(TCCState *s) {
+    char zSrc[200];
+    snprintf(zSrc, sizeof(zSrc),
+             "void httpd_phase(int);\n"
+             "__attribute__((constructor)) static void __wpp_relocated(void) { httpd_phase(%d); }\n",
+             HTTPD_PHASE_RELOCATE);
+    tcc_add_symbol(s, "httpd_phase", httpd_phase);
+    tcc_compile_string(s, zSrc);
+}
+
 // 读取文件内容
 static int cgi_c_read_file(const char* filename, char** content, size_t* size) {
     FILE* fp = fopen(filename, "rb");
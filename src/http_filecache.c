@@ -0,0 +1,277 @@
+/*
+ * Static Content Cache - Implementation
+ *
+ * 共享内存的布局：fc_header | 槽位表（开放寻址的哈希表）| 写入顺序队列 | 环形数据缓冲
+ *
+ * 每一项的数据（头部 + 内容）在环形缓冲中连续存放，不跨越缓冲末尾。追加时按写入顺序队列从最早的一项开始，
+ * 淘汰数据区域会被覆盖的项；被改写过的项（提升或更新后重新追加）在队列中留下的旧记录通过偏移比较识别并跳过
+ */
+
+#include "http_filecache.h"
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define FILE_CACHE_PATH         480     /* 文件路径的最大长度 */
+#define FILE_CACHE_PROBE        4       /* 每个键探测的槽位数 */
+
+#ifdef __APPLE__
+#define ST_MTIM(st)     ((st).st_mtimespec)
+#define ST_CTIM(st)     ((st).st_ctimespec)
+#else
+#define ST_MTIM(st)     ((st).st_mtim)
+#define ST_CTIM(st)     ((st).st_ctim)
+#endif
+
+typedef struct fc_entry {
+    uint32_t            seq;            /* 序号锁：奇数表示正在写入 */
+    uint32_t            nHdr;
+    uint32_t            nBody;
+    uint8_t             iEnc;
+    uint64_t            hash;           /* 0 表示空槽位 */
+    uint64_t            off;            /* 数据在环形缓冲中的逻辑偏移（单调递增，物理位置为 off % nData） */
+    time_t              tStored;
+    ino_t               ino;            /* 原文件的 stat()，用于校验 */
+    off_t               size;
+    struct timespec     mtime;
+    struct timespec     ctime;
+    char                zPath[FILE_CACHE_PATH];
+} fc_entry;
+
+typedef struct fc_order {
+    uint32_t            iSlot;
+    uint64_t            off;            /* 写入时的逻辑偏移，和槽位当前的偏移不同时说明该记录已过时 */
+} fc_order;
+
+typedef struct fc_header {
+    uint32_t            lock;           /* 写入锁：持有者的 pid，0 表示空闲 */
+    uint32_t            nSlot;          /* 槽位数（2 的幂） */
+    uint32_t            nQueue;         /* 写入顺序队列的容量 */
+    uint64_t            nData;          /* 环形缓冲的大小（字节预算） */
+    uint64_t            iHead;          /* 下一次追加的逻辑位置 */
+    uint64_t            qHead;          /* 写入顺序队列中最早的一项 */
+    uint64_t            qTail;          /* 写入顺序队列的下一个写入位置 */
+    uint64_t            nHit, nMiss, nInsert, nEvict, nBytes;
+} fc_header;
+
+static fc_header*           s_pHdr = NULL;
+static fc_entry*            s_aSlot = NULL;
+static fc_order*            s_aQueue = NULL;
+static char*                s_aData = NULL;
+
+int file_cache_init(size_t nBudget) {
+
+    unsigned nSlot = 256;
+    while (nSlot < nBudget / 1024) nSlot <<= 1;             // 按平均每项 1KB 估计
+    unsigned nQueue = nSlot * 2;
+
+    size_t nMap = sizeof(fc_header) + sizeof(fc_entry) * nSlot + sizeof(fc_order) * nQueue + nBudget;
+    void *p = mmap(0, nMap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return -1;
+
+    s_pHdr = (fc_header*)p;
+    s_aSlot = (fc_entry*)(s_pHdr + 1);
+    s_aQueue = (fc_order*)(s_aSlot + nSlot);
+    s_aData = (char*)(s_aQueue + nQueue);
+    s_pHdr->nSlot = nSlot;
+    s_pHdr->nQueue = nQueue;
+    s_pHdr->nData = nBudget;
+    return 0;
+}
+
+bool file_cache_enabled(void) {
+    return s_pHdr != NULL;
+}
+
+// FNV-1a
+static uint64_t key_hash(const char *zPath, int iEnc) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *z = (const unsigned char *)zPath; *z; z++) h = (h ^ *z) * 0x100000001b3ULL;
+    h = (h ^ (unsigned)iEnc) * 0x100000001b3ULL;
+    return h | 1;                       // 0 留给空槽位
+}
+
+static bool ts_equal(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* ============ 写入（持有写入锁） ============ */
+
+// 尝试获取写入锁，不等待。持有者已经不存在（进程被强制终止）时接管
+static bool fc_lock(void) {
+    uint32_t me = (uint32_t)getpid(), cur = 0;
+    if (__atomic_compare_exchange_n(&s_pHdr->lock, &cur, me, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+    if (cur != 0 && kill((pid_t)cur, 0) != 0 && errno == ESRCH
+        && __atomic_compare_exchange_n(&s_pHdr->lock, &cur, me, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+    return false;
+}
+
+static void fc_unlock(void) {
+    __atomic_store_n(&s_pHdr->lock, 0, __ATOMIC_RELEASE);
+}
+
+// 序号锁的写入开始和结束：开始后其它进程的读取一定会发现该项被改写
+static void fc_write_begin(fc_entry *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void fc_write_end(fc_entry *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void fc_evict(fc_entry *e) {
+    if (e->hash == 0) return;
+    fc_write_begin(e);
+    e->hash = 0;
+    fc_write_end(e);
+    s_pHdr->nBytes -= e->nHdr + e->nBody;
+    __atomic_fetch_add(&s_pHdr->nEvict, 1, __ATOMIC_RELAXED);
+}
+
+// 弹出写入顺序队列中最早的一项，如果它仍然有效则淘汰
+static void fc_pop_oldest(void) {
+    fc_order *q = &s_aQueue[s_pHdr->qHead % s_pHdr->nQueue];
+    fc_entry *e = &s_aSlot[q->iSlot];
+    if (e->hash && e->off == q->off) fc_evict(e);
+    s_pHdr->qHead++;
+}
+
+// 在环形缓冲中预留 n 字节，淘汰数据区域会被覆盖的项，返回预留区域的逻辑偏移
+static uint64_t fc_reserve(size_t n) {
+    uint64_t nData = s_pHdr->nData;
+    uint64_t off = s_pHdr->iHead;
+    uint64_t pos = off % nData;
+    if (pos + n > nData) off += nData - pos;                // 不跨越缓冲末尾
+    uint64_t end = off + n;
+
+    // 缓冲中保留的是逻辑区间 [end - nData, end) 的数据，起始偏移早于它的项都要淘汰
+    while (s_pHdr->qHead < s_pHdr->qTail
+           && s_aQueue[s_pHdr->qHead % s_pHdr->nQueue].off + nData < end) {
+        fc_pop_oldest();
+    }
+    if (s_pHdr->qTail - s_pHdr->qHead >= s_pHdr->nQueue) fc_pop_oldest();
+
+    s_pHdr->iHead = end;
+    return off;
+}
+
+static void fc_store(const char *zPath, int iEnc, const struct stat *pStat,
+                     const char *zHdr, size_t nHdr, const void *pBody, size_t nBody, bool bPromote) {
+
+    size_t nPath = strlen(zPath);
+    if (nHdr > FILE_CACHE_MAX_HDR || nBody > FILE_CACHE_MAX_FILE || nPath >= FILE_CACHE_PATH) return;
+    if (nHdr + nBody > s_pHdr->nData / 4) return;           // 相对于预算过大的项不缓存
+
+    // 写入期间屏蔽信号：SIGALRM 等信号的处理函数可能通过 siglongjmp 离开这里，导致写入锁无法释放
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+    if (!fc_lock()) {
+        sigprocmask(SIG_SETMASK, &old, 0);
+        return;
+    }
+
+    // 在探测范围内选择槽位：同一个键的旧项，或者空槽位，或者数据最旧的一项
+    uint64_t h = key_hash(zPath, iEnc);
+    fc_entry *pSlot = NULL;
+    for (unsigned k = 0; k < FILE_CACHE_PROBE; k++) {
+        fc_entry *e = &s_aSlot[(h + k) & (s_pHdr->nSlot - 1)];
+        if (e->hash == h && e->iEnc == iEnc && strcmp(e->zPath, zPath) == 0) { pSlot = e; break; }
+        if (e->hash == 0) { if (pSlot == NULL || pSlot->hash) pSlot = e; continue; }
+        if (pSlot == NULL || (pSlot->hash && e->off < pSlot->off)) pSlot = e;
+    }
+    fc_evict(pSlot);
+
+    // 复制数据，然后填写槽位并记入写入顺序队列
+    uint64_t off = fc_reserve(nHdr + nBody);
+    char *z = s_aData + off % s_pHdr->nData;
+    memcpy(z, zHdr, nHdr);
+    memcpy(z + nHdr, pBody, nBody);
+
+    fc_write_begin(pSlot);
+    pSlot->hash = h;
+    pSlot->iEnc = (uint8_t)iEnc;
+    pSlot->nHdr = (uint32_t)nHdr;
+    pSlot->nBody = (uint32_t)nBody;
+    pSlot->off = off;
+    pSlot->tStored = bPromote ? pSlot->tStored : time(NULL);
+    pSlot->ino = pStat->st_ino;
+    pSlot->size = pStat->st_size;
+    pSlot->mtime = ST_MTIM(*pStat);
+    pSlot->ctime = ST_CTIM(*pStat);
+    memcpy(pSlot->zPath, zPath, nPath + 1);
+    fc_write_end(pSlot);
+
+    fc_order *q = &s_aQueue[s_pHdr->qTail % s_pHdr->nQueue];
+    q->iSlot = (uint32_t)(pSlot - s_aSlot);
+    q->off = off;
+    s_pHdr->qTail++;
+    s_pHdr->nBytes += nHdr + nBody;
+    if (!bPromote) __atomic_fetch_add(&s_pHdr->nInsert, 1, __ATOMIC_RELAXED);
+
+    fc_unlock();
+    sigprocmask(SIG_SETMASK, &old, 0);
+}
+
+void file_cache_put(const char *zPath, int iEnc, const struct stat *pStat,
+                    const char *zHdr, size_t nHdr, const void *pBody, size_t nBody) {
+    if (s_pHdr == NULL) return;
+    fc_store(zPath, iEnc, pStat, zHdr, nHdr, pBody, nBody, false);
+}
+
+/* ============ 读取（不加锁） ============ */
+
+bool file_cache_get(const char *zPath, int iEnc, const struct stat *pStat,
+                    char *zBuf, size_t *pnHdr, size_t *pnBody) {
+
+    if (s_pHdr == NULL) return false;
+
+    size_t nPath = strlen(zPath);
+    uint64_t h = key_hash(zPath, iEnc);
+    for (unsigned k = 0; k < FILE_CACHE_PROBE && nPath < FILE_CACHE_PATH; k++) {
+        fc_entry *e = &s_aSlot[(h + k) & (s_pHdr->nSlot - 1)];
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        if (e->hash != h || e->iEnc != iEnc || memcmp(e->zPath, zPath, nPath + 1) != 0) continue;
+
+        // 复制元数据和数据，之后再确认序号没有变化（期间被淘汰或改写时读到的内容可能不完整）
+        fc_entry v;
+        memcpy(&v, e, offsetof(fc_entry, zPath));
+        uint64_t pos = v.off % s_pHdr->nData;
+        if (v.nHdr > FILE_CACHE_MAX_HDR || v.nBody > FILE_CACHE_MAX_FILE || pos + v.nHdr + v.nBody > s_pHdr->nData) break;
+        memcpy(zBuf, s_aData + pos, v.nHdr + v.nBody);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) break;
+
+        // 原文件已经改变，或者缓存时间过长（.br / .gz 文件可能已经改变），由调用者重新生成后覆盖
+        if (v.ino != pStat->st_ino || v.size != pStat->st_size
+            || !ts_equal(v.mtime, ST_MTIM(*pStat)) || !ts_equal(v.ctime, ST_CTIM(*pStat))
+            || time(NULL) - v.tStored > FILE_CACHE_TTL) break;
+
+        __atomic_fetch_add(&s_pHdr->nHit, 1, __ATOMIC_RELAXED);
+        *pnHdr = v.nHdr;
+        *pnBody = v.nBody;
+
+        // 已经位于环形缓冲较旧一半的项重新追加到最新的位置，避免常用的文件被淘汰
+        if (__atomic_load_n(&s_pHdr->iHead, __ATOMIC_RELAXED) - v.off > s_pHdr->nData / 2)
+            fc_store(zPath, iEnc, pStat, zBuf, v.nHdr, zBuf + v.nHdr, v.nBody, true);
+        return true;
+    }
+    __atomic_fetch_add(&s_pHdr->nMiss, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void file_cache_stats(file_cache_stat *pStat) {
+    memset(pStat, 0, sizeof(*pStat));
+    if (s_pHdr == NULL) return;
+    pStat->nHit = __atomic_load_n(&s_pHdr->nHit, __ATOMIC_RELAXED);
+    pStat->nMiss = __atomic_load_n(&s_pHdr->nMiss, __ATOMIC_RELAXED);
+    pStat->nInsert = __atomic_load_n(&s_pHdr->nInsert, __ATOMIC_RELAXED);
+    pStat->nEvict = __atomic_load_n(&s_pHdr->nEvict, __ATOMIC_RELAXED);
+    pStat->nBytes = s_pHdr->nBytes;
+    pStat->nBudget = s_pHdr->nData;
+}
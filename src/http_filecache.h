@@ -0,0 +1,80 @@
+/*
+ * Static Content Cache - Header
+ *
+ * 小静态文件的共享内存内容缓存：以（文件路径, 客户端接受的编码）为键，保存 SendFile() 为该文件生成的响应头部
+ * （状态行、Connection、Date 之外的部分：Last-Modified、Cache-Control、ETag、Content-type 等）和响应体
+ * （原文件或 .br / .gz 压缩版本的内容）。命中时 worker 直接从缓存复制出头部和内容，一次 writev 发出，
+ * 不需要打开、探测或读取任何文件
+ *
+ * 缓存位于主进程 fork 之前创建的匿名共享内存中，数据按写入顺序追加到一个环形缓冲（大小即字节预算），
+ * 空间不足时从最早写入的一项开始淘汰；命中的项如果已经位于环形缓冲较旧的一半，会被重新追加到最新的位置，
+ * 因此淘汰顺序近似于 LRU
+ *
+ * 并发：读取不加锁，通过每一项的序号锁（seqlock）检查复制期间该项是否被淘汰或改写；
+ * 写入（插入、淘汰、提升）使用一个只尝试一次的进程间锁，拿不到锁时直接放弃本次写入
+ */
+
+#ifndef HTTP_FILECACHE_H
+#define HTTP_FILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FILE_CACHE_MAX_FILE     (64 * 1024) /* 可以缓存的文件（响应体）的最大大小 */
+#define FILE_CACHE_MAX_HDR      1024        /* 可以缓存的响应头部的最大大小 */
+#define FILE_CACHE_TTL          10          /* 缓存项的最长有效时间（秒），用于发现 .br / .gz 文件的变化 */
+
+/**
+ * 统计信息（所有进程累计）
+ */
+typedef struct file_cache_stat {
+    uint64_t            nHit;           /* 命中次数 */
+    uint64_t            nMiss;          /* 不命中次数（只统计可以缓存的请求） */
+    uint64_t            nInsert;        /* 插入次数 */
+    uint64_t            nEvict;         /* 淘汰次数 */
+    uint64_t            nBytes;         /* 当前缓存的数据量 */
+    uint64_t            nBudget;        /* 字节预算 */
+} file_cache_stat;
+
+/**
+ * 创建字节预算为 nBudget 的共享缓存，必须在 fork 任何子进程之前调用
+ *
+ * @return 0: 成功；-1: 分配共享内存失败（此时缓存不可用）
+ */
+int file_cache_init(size_t nBudget);
+
+/**
+ * 缓存是否可用
+ */
+bool file_cache_enabled(void);
+
+/**
+ * 查找文件 zPath 在编码类别 iEnc 下的缓存，命中时把头部和内容依次复制到 zBuf 中
+ * + zBuf 的大小至少为 FILE_CACHE_MAX_HDR + FILE_CACHE_MAX_FILE
+ * + pStat 是原文件当前的 stat()，和缓存时记录的 inode、大小、修改时间不一致时视为失效
+ */
+bool file_cache_get(const char *zPath, int iEnc, const struct stat *pStat,
+                    char *zBuf, size_t *pnHdr, size_t *pnBody);
+
+/**
+ * 保存文件 zPath 在编码类别 iEnc 下的头部和内容。写入锁被其它进程占用，或者大小超出限制时不缓存
+ */
+void file_cache_put(const char *zPath, int iEnc, const struct stat *pStat,
+                    const char *zHdr, size_t nHdr, const void *pBody, size_t nBody);
+
+/**
+ * 读取统计信息
+ */
+void file_cache_stats(file_cache_stat *pStat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_FILECACHE_H */
@@ -0,0 +1,968 @@
+/*
+ * HTTP/2 (h2c) - Implementation
+ *
+ * 多路复用器运行在单个进程中，用 poll() 同时等待连接和各个流的 socketpair：
+ * + 请求：HEADERS 的头部块解码后拼成 HTTP/1.x 请求头，DATA 的内容原样（或者以 chunked 编码）写给处理进程；
+ *   流的接收窗口在数据写给处理进程之后才归还，处理进程读得慢时对端自然被限流
+ * + 回复：从处理进程读入 HTTP/1.x 回复，状态行和头部转为 HEADERS，内容（按 Content-Length、chunked 或者
+ *   连接关闭界定）转为 DATA，每个流最多缓冲 H2_RSP_BUF 字节，发送窗口耗尽时暂停读取该流
+ * 连接上的输出先写入缓冲，每轮循环结束时一次写出
+ */
+
+#include "http_h2.h"
+#include "http_hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define H2_MAX_FRAME        16384       /* 帧的最大长度（SETTINGS_MAX_FRAME_SIZE 的默认值，收发都使用） */
+#define H2_WINDOW           65535       /* 初始的流量控制窗口 */
+#define H2_MAX_WINDOW       0x7fffffff  /* 流量控制窗口的上限 */
+#define H2_MAX_HEADER_BLOCK 65536       /* 一个请求头部块（HEADERS + CONTINUATION）的最大长度 */
+#define H2_HEADER_TABLE     4096        /* HPACK 动态表的大小（SETTINGS_HEADER_TABLE_SIZE 的默认值） */
+#define H2_RSP_BUF          65536       /* 每个流从处理进程读入、尚未发送的回复数据的上限 */
+#define H2_IN_BUF           65536       /* 连接输入缓冲的大小（至少容纳一个完整的帧） */
+
+/* 帧类型 */
+enum {
+    FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM     0x1
+#define FLAG_ACK            0x1
+#define FLAG_END_HEADERS    0x4
+#define FLAG_PADDED         0x8
+#define FLAG_PRIORITY       0x20
+
+/* SETTINGS 参数 */
+#define SETTINGS_HEADER_TABLE_SIZE          0x1
+#define SETTINGS_ENABLE_PUSH                0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS     0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE        0x4
+#define SETTINGS_MAX_FRAME_SIZE             0x5
+
+/* 错误码 */
+enum {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+
+/* 回复的解析状态 */
+enum {
+    RSP_HEADER,         /* 等待状态行和头部 */
+    RSP_LENGTH,         /* 按 Content-Length 转发内容 */
+    RSP_EOF,            /* 转发内容直到处理进程关闭连接 */
+    RSP_CHUNK_SIZE,     /* chunked 编码：等待块大小行 */
+    RSP_CHUNK_DATA,     /* chunked 编码：转发块的内容 */
+    RSP_CHUNK_CRLF,     /* chunked 编码：块内容之后的换行 */
+    RSP_TRAILER,        /* chunked 编码：跳过尾部字段 */
+};
+
+typedef struct h2_stream {
+    uint32_t            id;             /* 0 表示空闲的槽位 */
+    int                 fd;             /* 和处理进程之间的 socketpair（多路复用器一端） */
+    pid_t               pid;            /* 处理进程 */
+    bool                bHead;          /* HEAD 请求（回复没有内容） */
+    bool                bRemoteEnd;     /* 请求已经结束（收到 END_STREAM） */
+    bool                bChunked;       /* 请求没有 content-length，请求体以 chunked 编码写给处理进程 */
+    bool                bReqDrop;       /* 处理进程不再读取请求，之后的请求体直接丢弃 */
+    char*               zReq;           /* 等待写给处理进程的请求数据 */
+    size_t              nReq, iReq, nReqAlloc;
+    size_t              nCredit;        /* 已经从流的接收窗口扣除、写给处理进程之后归还的字节数 */
+    int64_t             nRecvWin;       /* 对端还可以在这个流上发送的数据量 */
+    int64_t             nSendWin;       /* 我们还可以在这个流上发送的数据量 */
+    char*               zRsp;           /* 从处理进程读入、尚未转发的回复数据 */
+    size_t              nRsp, iRsp;
+    int                 eRsp;           /* 回复的解析状态 */
+    long long           nLeft;          /* RSP_LENGTH / RSP_CHUNK_DATA 时剩余的长度 */
+    bool                bRspEof;        /* 处理进程的输出已经结束 */
+} h2_stream;
+
+static int              s_fdIn, s_fdOut;
+static h2_run           s_xRun;
+static struct sigaction s_saPipe;           // 调用者原来的 SIGPIPE 处理方式（处理进程中恢复）
+static hpack_dec        s_dec;
+static h2_stream        s_aStream[H2_MAX_STREAMS];
+static int              s_nStream;
+static uint32_t         s_iLastId;          // 对端创建的最大的流 id
+static int64_t          s_nSendWin;         // 连接级的发送窗口
+static int64_t          s_nPeerWin;         // 对端的 SETTINGS_INITIAL_WINDOW_SIZE
+static size_t           s_nPreface;         // 已经收到的连接前言字节数
+static bool             s_bGoaway;          // 对端发送了 GOAWAY，不再接受新的流
+static bool             s_bGoawaySent;
+static bool             s_bDone;            // 结束会话
+static bool             s_bBroken;          // 连接已经无法写入
+
+static uint8_t*         s_zIn;              // 连接输入缓冲
+static size_t           s_nIn, s_nInAlloc;
+static uint8_t*         s_zOut;             // 连接输出缓冲
+static size_t           s_nOut, s_nOutAlloc;
+static uint8_t*         s_zHdr;             // 正在接收的头部块（HEADERS + CONTINUATION）
+static size_t           s_nHdr;
+static uint32_t         s_iHdrStream;       // 正在接收头部块的流，0 表示没有
+static uint8_t          s_hdrFlags;         // 该头部块的 HEADERS 帧的标志
+
+static void *h2_realloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (p == NULL) {
+        fprintf(stderr, "[h2] out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* ============ 输出 ============ */
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// 在输出缓冲中追加一个帧，p 为 NULL 时只预留内容的空间，返回内容的位置
+static uint8_t *out_frame(int type, int flags, uint32_t id, const void *p, size_t n) {
+
+    if (s_nOut + 9 + n > s_nOutAlloc) {
+        size_t nNew = s_nOutAlloc ? s_nOutAlloc : 65536;
+        while (nNew < s_nOut + 9 + n) nNew *= 2;
+        s_zOut = h2_realloc(s_zOut, nNew);
+        s_nOutAlloc = nNew;
+    }
+    uint8_t *h = s_zOut + s_nOut;
+    h[0] = (uint8_t)(n >> 16); h[1] = (uint8_t)(n >> 8); h[2] = (uint8_t)n;
+    h[3] = (uint8_t)type;
+    h[4] = (uint8_t)flags;
+    put32(h + 5, id & 0x7fffffff);
+    if (p && n) memcpy(h + 9, p, n);
+    s_nOut += 9 + n;
+    return h + 9;
+}
+
+static void out_u32(int type, int flags, uint32_t id, uint32_t v) {
+    put32(out_frame(type, flags, id, NULL, 4), v);
+}
+
+static void out_rst(uint32_t id, uint32_t code) {
+    out_u32(FRAME_RST_STREAM, 0, id, code);
+}
+
+static void out_goaway(uint32_t code) {
+    if (s_bGoawaySent) return;
+    uint8_t *p = out_frame(FRAME_GOAWAY, 0, 0, NULL, 8);
+    put32(p, s_iLastId);
+    put32(p + 4, code);
+    s_bGoawaySent = true;
+}
+
+// 头部块超过帧的最大长度时拆分为 HEADERS + CONTINUATION
+static void out_headers(uint32_t id, const uint8_t *p, size_t n, bool bEnd) {
+    size_t k = n < H2_MAX_FRAME ? n : H2_MAX_FRAME;
+    out_frame(FRAME_HEADERS, (bEnd ? FLAG_END_STREAM : 0) | (k == n ? FLAG_END_HEADERS : 0), id, p, k);
+    for (size_t i = k; i < n; i += k) {
+        k = n - i < H2_MAX_FRAME ? n - i : H2_MAX_FRAME;
+        out_frame(FRAME_CONTINUATION, i + k == n ? FLAG_END_HEADERS : 0, id, p + i, k);
+    }
+}
+
+// 把输出缓冲写到连接上（连接是非阻塞的，写不出时最多等待 H2_IDLE_TIMEOUT 秒）
+static void out_flush(void) {
+
+    size_t i = 0;
+    while (i < s_nOut && !s_bBroken) {
+        ssize_t k = write(s_fdOut, s_zOut + i, s_nOut - i);
+        if (k > 0) { i += (size_t)k; continue; }
+        if (k < 0 && errno == EINTR) continue;
+        if (k < 0 && errno == EAGAIN) {
+            struct pollfd pfd = { s_fdOut, POLLOUT, 0 };
+            if (poll(&pfd, 1, H2_IDLE_TIMEOUT * 1000) > 0) continue;
+        }
+        s_bBroken = s_bDone = true;
+    }
+    s_nOut = 0;
+}
+
+static void conn_error(uint32_t code) {
+    out_goaway(code);
+    s_bDone = true;
+}
+
+/* ============ 流 ============ */
+
+static h2_stream *stream_find(uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (s_aStream[i].id == id && id != 0) return &s_aStream[i];
+    }
+    return NULL;
+}
+
+// 释放流，bAbort 表示回复没有完成，处理进程可能还在运行
+static void stream_close(h2_stream *s, bool bAbort) {
+    close(s->fd);
+    if (bAbort) kill(s->pid, SIGTERM);
+    free(s->zReq);
+    free(s->zRsp);
+    memset(s, 0, sizeof(*s));
+    s_nStream--;
+}
+
+static void stream_error(h2_stream *s, uint32_t code) {
+    out_rst(s->id, code);
+    stream_close(s, true);
+}
+
+static void req_append(h2_stream *s, const void *p, size_t n) {
+    if (s->bReqDrop) return;
+    if (s->nReq + n > s->nReqAlloc) {
+        size_t nNew = s->nReqAlloc ? s->nReqAlloc : 4096;
+        while (nNew < s->nReq + n) nNew *= 2;
+        s->zReq = h2_realloc(s->zReq, nNew);
+        s->nReqAlloc = nNew;
+    }
+    memcpy(s->zReq + s->nReq, p, n);
+    s->nReq += n;
+}
+
+// 把请求数据写给处理进程，全部写出后归还对端的流窗口
+static void stream_write(h2_stream *s) {
+
+    while (s->iReq < s->nReq) {
+        ssize_t k = write(s->fd, s->zReq + s->iReq, s->nReq - s->iReq);
+        if (k > 0) { s->iReq += (size_t)k; continue; }
+        if (k < 0 && errno == EINTR) continue;
+        if (k < 0 && errno == EAGAIN) return;
+        s->bReqDrop = true;                 // 处理进程已经关闭了连接（比如不读取请求体就回复了）
+        break;
+    }
+    s->iReq = s->nReq = 0;
+    if (s->nCredit > 0 && !s->bRemoteEnd) {
+        out_u32(FRAME_WINDOW_UPDATE, 0, s->id, (uint32_t)s->nCredit);
+        s->nRecvWin += (int64_t)s->nCredit;
+    }
+    s->nCredit = 0;
+}
+
+static void stream_read(h2_stream *s) {
+
+    if (s->iRsp > 0) {
+        memmove(s->zRsp, s->zRsp + s->iRsp, s->nRsp - s->iRsp);
+        s->nRsp -= s->iRsp;
+        s->iRsp = 0;
+    }
+    if (s->nRsp == H2_RSP_BUF) return;
+    ssize_t k = read(s->fd, s->zRsp + s->nRsp, H2_RSP_BUF - s->nRsp);
+    if (k > 0) s->nRsp += (size_t)k;
+    else if (k == 0 || (errno != EAGAIN && errno != EINTR)) s->bRspEof = true;
+}
+
+// 创建流：启动处理进程，请求头 zReq 作为最先写给它的数据
+static void stream_open(uint32_t id, const char *zReq, size_t nReq, bool bHead, bool bEnd, bool bChunked) {
+
+    h2_stream *s = NULL;
+    for (int i = 0; i < H2_MAX_STREAMS && s == NULL; i++) {
+        if (s_aStream[i].id == 0) s = &s_aStream[i];
+    }
+    int sv[2];
+    if (s == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        out_rst(id, H2_REFUSED_STREAM);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        out_rst(id, H2_REFUSED_STREAM);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            if (s_aStream[i].id) close(s_aStream[i].fd);
+        }
+        sigaction(SIGPIPE, &s_saPipe, NULL);
+        s_xRun(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->fd = sv[0];
+    s->pid = pid;
+    s->bHead = bHead;
+    s->bRemoteEnd = bEnd;
+    s->bChunked = bChunked;
+    s->nRecvWin = H2_WINDOW;
+    s->nSendWin = s_nPeerWin;
+    s->zRsp = h2_realloc(NULL, H2_RSP_BUF);
+    s->eRsp = RSP_HEADER;
+    s_nStream++;
+    req_append(s, zReq, nReq);
+    stream_write(s);
+}
+
+/* ============ 回复：HTTP/1.x -> HEADERS / DATA ============ */
+
+static bool name_is(const char *z, size_t n, const char *zName) {
+    return strlen(zName) == n && memcmp(z, zName, n) == 0;
+}
+
+// 连接相关的头部字段，HTTP/2 中不允许出现（RFC 7540 8.1.2.2）
+static bool is_hop_header(const char *z, size_t n) {
+    return name_is(z, n, "connection") || name_is(z, n, "keep-alive") || name_is(z, n, "proxy-connection")
+        || name_is(z, n, "transfer-encoding") || name_is(z, n, "upgrade") || name_is(z, n, "te");
+}
+
+// 回复结束（已经发送了 END_STREAM）。请求还没有结束时通知对端不必再发送（RFC 7540 8.1）
+static void stream_done(h2_stream *s) {
+    if (!s->bRemoteEnd) out_rst(s->id, H2_NO_ERROR);
+    stream_close(s, false);
+}
+
+// 解析回复的状态行和头部，转为 HEADERS 帧。返回 false 表示头部还不完整
+static bool rsp_headers(h2_stream *s) {
+
+    char *z = s->zRsp + s->iRsp;
+    size_t n = s->nRsp - s->iRsp, nEnd = 0;
+    for (size_t i = 0; i + 1 < n && nEnd == 0; i++) {
+        if (z[i] != '\n') continue;
+        if (z[i + 1] == '\n') nEnd = i + 2;
+        else if (z[i + 1] == '\r' && i + 2 < n && z[i + 2] == '\n') nEnd = i + 3;
+    }
+    if (nEnd == 0) {
+        if (s->bRspEof || n == H2_RSP_BUF) stream_error(s, H2_INTERNAL_ERROR);
+        return false;
+    }
+
+    // 状态行：HTTP/1.x NNN ...
+    char *zLine = z, *zEol = memchr(z, '\n', nEnd);
+    if (strncmp(zLine, "HTTP/", 5) != 0 || (zLine = memchr(zLine, ' ', (size_t)(zEol - zLine))) == NULL) {
+        stream_error(s, H2_INTERNAL_ERROR);
+        return false;
+    }
+    int iStatus = atoi(zLine + 1);
+    if (iStatus < 100 || iStatus > 999) {
+        stream_error(s, H2_INTERNAL_ERROR);
+        return false;
+    }
+
+    uint8_t *pBlock = h2_realloc(NULL, nEnd * 2 + 16), *p = pBlock;
+    p += hpack_encode_status(p, iStatus);
+    bool bChunked = false;
+    long long nLen = -1;
+    for (zLine = zEol + 1; zLine < z + nEnd; zLine = zEol + 1) {
+        zEol = memchr(zLine, '\n', (size_t)(z + nEnd - zLine));
+        char *zColon = memchr(zLine, ':', (size_t)(zEol - zLine));
+        if (zColon == NULL || zColon == zLine) continue;
+        size_t nName = (size_t)(zColon - zLine);
+        for (size_t i = 0; i < nName; i++) {
+            if (zLine[i] >= 'A' && zLine[i] <= 'Z') zLine[i] |= 0x20;
+        }
+        char *zValue = zColon + 1, *zValueEnd = zEol;
+        while (zValue < zValueEnd && (*zValue == ' ' || *zValue == '\t')) zValue++;
+        while (zValueEnd > zValue && (zValueEnd[-1] == '\r' || zValueEnd[-1] == ' ' || zValueEnd[-1] == '\t')) zValueEnd--;
+        size_t nValue = (size_t)(zValueEnd - zValue);
+        if (name_is(zLine, nName, "transfer-encoding")) {
+            bChunked = nValue >= 7 && memcmp(zValueEnd - 7, "chunked", 7) == 0;
+        } else if (name_is(zLine, nName, "content-length")) {
+            nLen = strtoll(zValue, NULL, 10);
+        }
+        if (is_hop_header(zLine, nName)) continue;
+        p += hpack_encode(p, (size_t)(pBlock + nEnd * 2 + 16 - p), zLine, nName, zValue, nValue);
+    }
+    s->iRsp += nEnd;
+
+    // 1xx 的中间回复直接丢弃，继续等待最终的回复
+    if (iStatus < 200) {
+        free(pBlock);
+        return true;
+    }
+
+    bool bNoBody = s->bHead || iStatus == 204 || iStatus == 304 || (!bChunked && nLen == 0);
+    out_headers(s->id, pBlock, (size_t)(p - pBlock), bNoBody);
+    free(pBlock);
+    if (bNoBody) {
+        stream_done(s);
+        return false;
+    }
+    if (bChunked) s->eRsp = RSP_CHUNK_SIZE;
+    else if (nLen > 0) { s->eRsp = RSP_LENGTH; s->nLeft = nLen; }
+    else s->eRsp = RSP_EOF;
+    return true;
+}
+
+// 从回复数据中取出一行（chunked 编码的块大小行、尾部字段），没有完整的一行时返回 NULL
+static char *rsp_line(h2_stream *s, size_t *pn) {
+    char *z = s->zRsp + s->iRsp, *zEol = memchr(z, '\n', s->nRsp - s->iRsp);
+    if (zEol == NULL) return NULL;
+    *pn = (size_t)(zEol - z);
+    s->iRsp += *pn + 1;
+    if (*pn > 0 && z[*pn - 1] == '\r') (*pn)--;
+    return z;
+}
+
+// 转发流的回复：尽可能多地转为帧，直到数据不足、窗口耗尽或者回复结束
+static void stream_pump(h2_stream *s) {
+
+    for (;;) {
+        size_t nAvail = s->nRsp - s->iRsp, nLine;
+        char *zLine;
+        switch (s->eRsp) {
+
+        case RSP_HEADER:
+            if (!rsp_headers(s)) return;
+            break;
+
+        case RSP_CHUNK_SIZE:
+        case RSP_CHUNK_CRLF:
+        case RSP_TRAILER:
+            if ((zLine = rsp_line(s, &nLine)) == NULL) {
+                if (s->bRspEof || nAvail == H2_RSP_BUF) stream_error(s, H2_INTERNAL_ERROR);
+                return;
+            }
+            if (s->eRsp == RSP_CHUNK_CRLF) {
+                s->eRsp = RSP_CHUNK_SIZE;
+            } else if (s->eRsp == RSP_CHUNK_SIZE) {
+                s->nLeft = strtoll(zLine, NULL, 16);
+                s->eRsp = s->nLeft > 0 ? RSP_CHUNK_DATA : RSP_TRAILER;
+            } else if (nLine == 0) {
+                out_frame(FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+                stream_done(s);
+                return;
+            }
+            break;
+
+        default: {  /* RSP_LENGTH、RSP_EOF、RSP_CHUNK_DATA */
+            if (s->eRsp != RSP_EOF && (long long)nAvail > s->nLeft) nAvail = (size_t)s->nLeft;
+            if (nAvail == 0) {
+                if (!s->bRspEof) return;
+                if (s->eRsp != RSP_EOF) {           // 回复在声明的长度之前结束
+                    stream_error(s, H2_INTERNAL_ERROR);
+                    return;
+                }
+                out_frame(FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+                stream_done(s);
+                return;
+            }
+            int64_t nWin = s_nSendWin < s->nSendWin ? s_nSendWin : s->nSendWin;
+            if (nWin <= 0) return;
+            size_t k = nAvail;
+            if ((int64_t)k > nWin) k = (size_t)nWin;
+            if (k > H2_MAX_FRAME) k = H2_MAX_FRAME;
+            bool bEnd = s->eRsp == RSP_LENGTH && (long long)k == s->nLeft;
+            out_frame(FRAME_DATA, bEnd ? FLAG_END_STREAM : 0, s->id, s->zRsp + s->iRsp, k);
+            s->iRsp += k;
+            s->nLeft -= (long long)k;
+            s_nSendWin -= (int64_t)k;
+            s->nSendWin -= (int64_t)k;
+            if (bEnd) {
+                stream_done(s);
+                return;
+            }
+            if (s->eRsp == RSP_CHUNK_DATA && s->nLeft == 0) s->eRsp = RSP_CHUNK_CRLF;
+            break;
+        }
+        }
+    }
+}
+
+/* ============ 请求：HEADERS -> HTTP/1.x ============ */
+
+typedef struct req_build {
+    char*               zMethod;        /* 伪头部 */
+    char*               zPath;
+    char*               zAuthority;
+    char*               zHdr;           /* 普通头部，已经按 HTTP/1.x 格式排列 */
+    size_t              nHdr, nHdrAlloc;
+    bool                bRegular;       /* 已经出现过普通头部（之后不能再有伪头部） */
+    bool                bLength;        /* 有 content-length */
+    bool                bBad;           /* 请求格式错误（流错误） */
+} req_build;
+
+static void req_build_append(req_build *r, const char *z, size_t n) {
+    if (r->nHdr + n > r->nHdrAlloc) {
+        size_t nNew = r->nHdrAlloc ? r->nHdrAlloc : 1024;
+        while (nNew < r->nHdr + n) nNew *= 2;
+        r->zHdr = h2_realloc(r->zHdr, nNew);
+        r->nHdrAlloc = nNew;
+    }
+    memcpy(r->zHdr + r->nHdr, z, n);
+    r->nHdr += n;
+}
+
+static int req_field(void *pArg, const char *zName, size_t nName, const char *zValue, size_t nValue) {
+
+    req_build *r = (req_build *)pArg;
+    if (r->bBad) return 0;
+
+    // 值中不能有换行和 NUL（拼成 HTTP/1.x 请求头时会被当作新的字段）；名称必须是小写的 token
+    if (nName == 0 || memchr(zValue, '\r', nValue) || memchr(zValue, '\n', nValue) || memchr(zValue, 0, nValue)) {
+        r->bBad = true;
+        return 0;
+    }
+    for (size_t i = zName[0] == ':' ? 1 : 0; i < nName; i++) {
+        unsigned char c = (unsigned char)zName[i];
+        if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z')) {
+            r->bBad = true;
+            return 0;
+        }
+    }
+
+    if (zName[0] == ':') {
+        char **pz = name_is(zName, nName, ":method") ? &r->zMethod
+                  : name_is(zName, nName, ":path") ? &r->zPath
+                  : name_is(zName, nName, ":authority") ? &r->zAuthority : NULL;
+        if (r->bRegular || (pz == NULL && !name_is(zName, nName, ":scheme"))) {
+            r->bBad = true;
+        } else if (pz) {
+            if (*pz || memchr(zValue, ' ', nValue)) { r->bBad = true; return 0; }
+            *pz = h2_realloc(NULL, nValue + 1);
+            memcpy(*pz, zValue, nValue);
+            (*pz)[nValue] = 0;
+        }
+        return 0;
+    }
+    r->bRegular = true;
+
+    // 连接相关的字段由多路复用器处理，不交给处理进程
+    if (is_hop_header(zName, nName) || name_is(zName, nName, "expect") || name_is(zName, nName, "http2-settings")) return 0;
+    if (name_is(zName, nName, "host") && r->zAuthority) return 0;
+    if (name_is(zName, nName, "content-length")) r->bLength = true;
+
+    req_build_append(r, zName, nName);
+    req_build_append(r, ": ", 2);
+    req_build_append(r, zValue, nValue);
+    req_build_append(r, "\r\n", 2);
+    return 0;
+}
+
+// 头部块接收完整：解码并创建流（或者结束已有流的请求）
+static void headers_done(void) {
+
+    uint32_t id = s_iHdrStream;
+    bool bEnd = (s_hdrFlags & FLAG_END_STREAM) != 0;
+    s_iHdrStream = 0;
+
+    req_build r;
+    memset(&r, 0, sizeof(r));
+    if (hpack_decode(&s_dec, s_zHdr, s_nHdr, req_field, &r) != 0) {
+        conn_error(H2_COMPRESSION_ERROR);
+        goto done;
+    }
+
+    if (id <= s_iLastId) {
+        // 已有的流：请求的尾部字段（内容忽略），必须同时结束请求
+        h2_stream *s = stream_find(id);
+        if (s && !s->bRemoteEnd) {
+            if (!bEnd) {
+                stream_error(s, H2_PROTOCOL_ERROR);
+                goto done;
+            }
+            s->bRemoteEnd = true;
+            if (s->bChunked) req_append(s, "0\r\n\r\n", 5);
+            stream_write(s);
+        }
+        goto done;
+    }
+    s_iLastId = id;
+
+    if (s_bGoaway || s_nStream >= H2_MAX_STREAMS) {
+        out_rst(id, H2_REFUSED_STREAM);
+    } else if (r.bBad || r.zMethod == NULL || r.zPath == NULL || r.zPath[0] == 0) {
+        out_rst(id, H2_PROTOCOL_ERROR);
+    } else {
+        // 拼成 HTTP/1.x 请求头，协议版本为 HTTP/2.0
+        bool bChunked = !bEnd && !r.bLength;
+        size_t nReq = strlen(r.zMethod) + strlen(r.zPath) + (r.zAuthority ? strlen(r.zAuthority) : 0) + r.nHdr + 64;
+        char *zReq = h2_realloc(NULL, nReq);
+        int n = snprintf(zReq, nReq, "%s %s HTTP/2.0\r\n", r.zMethod, r.zPath);
+        if (r.zAuthority) n += snprintf(zReq + n, nReq - (size_t)n, "Host: %s\r\n", r.zAuthority);
+        if (r.nHdr) memcpy(zReq + n, r.zHdr, r.nHdr);
+        n += (int)r.nHdr;
+        n += snprintf(zReq + n, nReq - (size_t)n, "%s\r\n", bChunked ? "Transfer-Encoding: chunked\r\n" : "");
+        stream_open(id, zReq, (size_t)n, strcmp(r.zMethod, "HEAD") == 0, bEnd, bChunked);
+        free(zReq);
+    }
+
+done:
+    free(r.zMethod);
+    free(r.zPath);
+    free(r.zAuthority);
+    free(r.zHdr);
+}
+
+/* ============ 帧处理 ============ */
+
+// 去掉 PADDED 标志的填充，返回 false 表示格式错误
+static bool unpad(int flags, const uint8_t **pp, size_t *pn) {
+    if (!(flags & FLAG_PADDED)) return true;
+    if (*pn < 1 || (*pp)[0] >= *pn) return false;
+    *pn -= 1 + (*pp)[0];
+    *pp += 1;
+    return true;
+}
+
+static void hdr_append(const uint8_t *p, size_t n) {
+    if (s_nHdr + n > H2_MAX_HEADER_BLOCK) {
+        conn_error(H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (s_zHdr == NULL) s_zHdr = h2_realloc(NULL, H2_MAX_HEADER_BLOCK);
+    memcpy(s_zHdr + s_nHdr, p, n);
+    s_nHdr += n;
+}
+
+static void settings_apply(const uint8_t *p, size_t n) {
+
+    for (size_t i = 0; i + 6 <= n; i += 6) {
+        uint16_t k = (uint16_t)(p[i] << 8 | p[i + 1]);
+        uint32_t v = get32(p + i + 2);
+        if (k == SETTINGS_ENABLE_PUSH && v > 1) {
+            conn_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (k == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (v > H2_MAX_WINDOW) {
+                conn_error(H2_FLOW_CONTROL_ERROR);
+                return;
+            }
+            for (int j = 0; j < H2_MAX_STREAMS; j++) {
+                if (s_aStream[j].id) s_aStream[j].nSendWin += (int64_t)v - s_nPeerWin;
+            }
+            s_nPeerWin = v;
+        }
+        if (k == SETTINGS_MAX_FRAME_SIZE && (v < 16384 || v > 16777215)) {
+            conn_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        // HEADER_TABLE_SIZE：编码器不使用动态表，不需要处理；MAX_FRAME_SIZE：总是按默认值发送
+    }
+}
+
+static void frame_data(int flags, uint32_t id, const uint8_t *p, size_t n) {
+
+    if (id == 0) {
+        conn_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+    // 连接级的接收窗口收到即归还，由各个流的窗口限流
+    size_t nFrame = n;
+    if (nFrame > 0) out_u32(FRAME_WINDOW_UPDATE, 0, 0, (uint32_t)nFrame);
+    if (!unpad(flags, &p, &n)) {
+        conn_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    h2_stream *s = stream_find(id);
+    if (s == NULL || s->bRemoteEnd) {
+        if (id > s_iLastId) conn_error(H2_PROTOCOL_ERROR);
+        else if (s) stream_error(s, H2_STREAM_CLOSED);
+        return;                             // 已经结束（或者被我们重置）的流，忽略
+    }
+    if ((int64_t)nFrame > s->nRecvWin) {
+        stream_error(s, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    s->nRecvWin -= (int64_t)nFrame;
+    s->nCredit += nFrame;
+    if (n > 0) {
+        if (s->bChunked) {
+            char zSize[24];
+            req_append(s, zSize, (size_t)snprintf(zSize, sizeof(zSize), "%zx\r\n", n));
+        }
+        req_append(s, p, n);
+        if (s->bChunked) req_append(s, "\r\n", 2);
+    }
+    if (flags & FLAG_END_STREAM) {
+        s->bRemoteEnd = true;
+        if (s->bChunked) req_append(s, "0\r\n\r\n", 5);
+    }
+    stream_write(s);
+}
+
+static void frame(int type, int flags, uint32_t id, const uint8_t *p, size_t n) {
+
+    h2_stream *s;
+
+    // 头部块必须由连续的 CONTINUATION 帧完成，中间不能插入其它帧
+    if (s_iHdrStream && (type != FRAME_CONTINUATION || id != s_iHdrStream)) {
+        conn_error(H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+
+    case FRAME_DATA:
+        frame_data(flags, id, p, n);
+        break;
+
+    case FRAME_HEADERS:
+        if (id == 0 || (id & 1) == 0 || !unpad(flags, &p, &n)) {
+            conn_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & FLAG_PRIORITY) {
+            if (n < 5) {
+                conn_error(H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            p += 5;
+            n -= 5;
+        }
+        s_nHdr = 0;
+        s_iHdrStream = id;
+        s_hdrFlags = (uint8_t)flags;
+        hdr_append(p, n);
+        if (flags & FLAG_END_HEADERS) headers_done();
+        break;
+
+    case FRAME_CONTINUATION:
+        if (s_iHdrStream == 0) {
+            conn_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        hdr_append(p, n);
+        if ((flags & FLAG_END_HEADERS) && !s_bDone) headers_done();
+        break;
+
+    case FRAME_PRIORITY:
+        if (id == 0) conn_error(H2_PROTOCOL_ERROR);
+        else if (n != 5) out_rst(id, H2_FRAME_SIZE_ERROR);
+        break;
+
+    case FRAME_RST_STREAM:
+        if (id == 0 || n != 4) {
+            conn_error(id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if ((s = stream_find(id)) != NULL) stream_close(s, true);
+        break;
+
+    case FRAME_SETTINGS:
+        if (id != 0 || ((flags & FLAG_ACK) ? n != 0 : n % 6 != 0)) {
+            conn_error(id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (flags & FLAG_ACK) break;
+        settings_apply(p, n);
+        out_frame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+
+    case FRAME_PING:
+        if (id != 0 || n != 8) {
+            conn_error(id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & FLAG_ACK)) out_frame(FRAME_PING, FLAG_ACK, 0, p, 8);
+        break;
+
+    case FRAME_GOAWAY:
+        s_bGoaway = true;
+        break;
+
+    case FRAME_WINDOW_UPDATE: {
+        if (n != 4) {
+            conn_error(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        uint32_t nInc = get32(p) & 0x7fffffff;
+        if (id == 0) {
+            s_nSendWin += nInc;
+            if (nInc == 0 || s_nSendWin > H2_MAX_WINDOW) conn_error(nInc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        } else if ((s = stream_find(id)) != NULL) {
+            s->nSendWin += nInc;
+            if (nInc == 0 || s->nSendWin > H2_MAX_WINDOW) stream_error(s, nInc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        }
+        break;
+    }
+
+    case FRAME_PUSH_PROMISE:                // 客户端不能推送
+        conn_error(H2_PROTOCOL_ERROR);
+        break;
+
+    default:                                // 未知类型的帧必须忽略
+        break;
+    }
+}
+
+// 处理输入缓冲中所有完整的帧
+static void conn_parse(void) {
+
+    size_t i = 0;
+    if (s_nPreface < sizeof(H2_PREFACE) - 1) {
+        size_t nNeed = sizeof(H2_PREFACE) - 1 - s_nPreface;
+        if (nNeed > s_nIn) nNeed = s_nIn;
+        if (memcmp(s_zIn, H2_PREFACE + s_nPreface, nNeed) != 0) {
+            conn_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        s_nPreface += nNeed;
+        i = nNeed;
+    }
+    while (!s_bDone && s_nIn - i >= 9) {
+        const uint8_t *h = s_zIn + i;
+        size_t n = (size_t)h[0] << 16 | (size_t)h[1] << 8 | h[2];
+        if (n > H2_MAX_FRAME) {
+            conn_error(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (s_nIn - i < 9 + n) break;
+        frame(h[3], h[4], get32(h + 5) & 0x7fffffff, h + 9, n);
+        i += 9 + n;
+    }
+    memmove(s_zIn, s_zIn + i, s_nIn - i);
+    s_nIn -= i;
+}
+
+// 从连接读入数据
+static void conn_input(void) {
+
+    ssize_t k = read(s_fdIn, s_zIn + s_nIn, s_nInAlloc - s_nIn);
+    if (k < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (k <= 0) {
+        s_bDone = true;
+        return;
+    }
+    s_nIn += (size_t)k;
+    conn_parse();
+}
+
+/* ============ 会话 ============ */
+
+// base64url 解码（HTTP2-Settings），返回输出的字节数
+static size_t b64url_decode(const char *z, uint8_t *pOut) {
+    uint32_t acc = 0;
+    int nBits = 0;
+    size_t n = 0;
+    for (; *z && *z != '='; z++) {
+        int c = (unsigned char)*z, v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else continue;
+        acc = acc << 6 | (uint32_t)v;
+        nBits += 6;
+        if (nBits >= 8) {
+            nBits -= 8;
+            pOut[n++] = (uint8_t)(acc >> nBits);
+        }
+    }
+    return n;
+}
+
+void h2_serve(int fdIn, int fdOut, const char *pPre, size_t nPre, size_t nPrefaceDone,
+              const h2_upgrade *pUp, h2_run xRun) {
+
+    // prefork worker 在同一进程中处理多个连接，会话状态每次重新初始化
+    memset(s_aStream, 0, sizeof(s_aStream));
+    s_nStream = 0;
+    s_iLastId = s_iHdrStream = 0;
+    s_bGoaway = s_bGoawaySent = s_bDone = s_bBroken = false;
+    s_nIn = s_nOut = s_nOutAlloc = s_nHdr = 0;
+    s_fdIn = fdIn;
+    s_fdOut = fdOut;
+    s_xRun = xRun;
+    s_nSendWin = H2_WINDOW;
+    s_nPeerWin = H2_WINDOW;
+    s_nPreface = nPrefaceDone;
+
+    // 写处理进程的 socketpair 时对方可能已经退出：忽略 SIGPIPE，由 write() 的返回值处理
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &s_saPipe);
+
+    fcntl(fdIn, F_SETFL, fcntl(fdIn, F_GETFL) | O_NONBLOCK);
+    fcntl(fdOut, F_SETFL, fcntl(fdOut, F_GETFL) | O_NONBLOCK);
+    hpack_dec_init(&s_dec, H2_HEADER_TABLE);
+
+    s_nInAlloc = nPre + H2_IN_BUF;
+    s_zIn = h2_realloc(NULL, s_nInAlloc);
+
+    // 服务端的连接前言：SETTINGS
+    uint8_t aSet[6] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS };
+    out_frame(FRAME_SETTINGS, 0, 0, aSet, sizeof(aSet));
+
+    // h2c 升级：HTTP2-Settings 视为对端的第一个 SETTINGS（101 即为确认），升级请求成为流 1（请求已经结束）
+    if (pUp) {
+        uint8_t *pSet = h2_realloc(NULL, strlen(pUp->zSettings) + 1);
+        size_t nSet = b64url_decode(pUp->zSettings, pSet);
+        settings_apply(pSet, nSet - nSet % 6);
+        free(pSet);
+        s_iLastId = 1;
+        stream_open(1, pUp->pReq, pUp->nReq, pUp->bHead, true, false);
+    }
+
+    // 已经读入的数据和之后从连接读入的数据一样处理
+    if (nPre > 0) {
+        memcpy(s_zIn, pPre, nPre);
+        s_nIn = nPre;
+        conn_parse();
+    }
+
+    struct pollfd aPoll[1 + H2_MAX_STREAMS];
+    h2_stream *apPoll[1 + H2_MAX_STREAMS];
+    while (!s_bDone) {
+        out_flush();
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+        if (s_bDone || (s_bGoaway && s_nStream == 0)) break;
+
+        int nPoll = 0;
+        aPoll[nPoll].fd = fdIn;
+        aPoll[nPoll].events = POLLIN;
+        apPoll[nPoll++] = NULL;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            h2_stream *s = &s_aStream[i];
+            short ev = 0;
+            if (s->id == 0) continue;
+            if (!s->bRspEof && s->nRsp - s->iRsp < H2_RSP_BUF) ev |= POLLIN;
+            if (s->iReq < s->nReq) ev |= POLLOUT;
+            if (ev == 0) continue;              // 等待对端的窗口（POLLHUP 总是会报告，不能留在集合中）
+            aPoll[nPoll].fd = s->fd;
+            aPoll[nPoll].events = ev;
+            apPoll[nPoll++] = s;
+        }
+        int rc = poll(aPoll, (nfds_t)nPoll, H2_IDLE_TIMEOUT * 1000);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;                     // 空闲超时
+
+        if (aPoll[0].revents) conn_input();
+        for (int i = 1; i < nPoll && !s_bDone; i++) {
+            h2_stream *s = apPoll[i];
+            if (s->id == 0 || aPoll[i].revents == 0) continue;  // 已经被重置
+            if (aPoll[i].revents & (POLLOUT | POLLERR | POLLHUP)) stream_write(s);
+            if (aPoll[i].revents & (POLLIN | POLLERR | POLLHUP)) stream_read(s);
+        }
+        for (int i = 0; i < H2_MAX_STREAMS && !s_bDone; i++) {
+            if (s_aStream[i].id) stream_pump(&s_aStream[i]);
+        }
+    }
+
+    out_goaway(H2_NO_ERROR);
+    out_flush();
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (s_aStream[i].id) stream_close(&s_aStream[i], true);
+    }
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    hpack_dec_free(&s_dec);
+    free(s_zIn);
+    free(s_zOut);
+    free(s_zHdr);
+    s_zIn = s_zOut = s_zHdr = NULL;
+    sigaction(SIGPIPE, &s_saPipe, NULL);
+}
@@ -0,0 +1,56 @@
+/*
+ * HTTP/2 (h2c) - Header
+ *
+ * 明文 HTTP/2 连接的多路复用器：在连接上处理帧、HPACK 和流量控制，每个流由 fork 出的子进程按普通的
+ * HTTP/1.x 请求处理（调用者提供的 xRun），请求和回复经过 socketpair 以 HTTP/1.x 报文传递，
+ * 在这里和 HEADERS / DATA 帧相互转换。同一连接上的多个流同时处理，回复按流量控制窗口交错发送
+ *
+ * 不支持服务器推送（SETTINGS_ENABLE_PUSH 总是视为 0）和优先级（PRIORITY 帧被忽略）
+ */
+
+#ifndef HTTP_H2_H
+#define HTTP_H2_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"  /* 客户端连接前言 */
+#define H2_PREFACE_LINE     18          /* 前言中 "PRI * HTTP/2.0\r\n\r\n" 部分的长度（会被当作 HTTP/1.x 请求头读入） */
+#define H2_MAX_STREAMS      32          /* 同时处理的流数（SETTINGS_MAX_CONCURRENT_STREAMS） */
+#define H2_IDLE_TIMEOUT     60          /* 没有活动的流时，连接的空闲超时（秒） */
+
+/**
+ * 在子进程中处理一个流：fd 是 socketpair 的一端，从中读出 HTTP/1.x 请求，写回 HTTP/1.x 回复，不返回
+ */
+typedef void (*h2_run)(int fd);
+
+/**
+ * h2c 升级（RFC 7540 3.2）时已经读入的升级请求，作为流 1 处理（已经回复了 101）
+ */
+typedef struct h2_upgrade {
+    const char*         pReq;           /* 完整的请求头（没有请求体） */
+    size_t              nReq;
+    const char*         zSettings;      /* HTTP2-Settings 头字段（base64url 编码的 SETTINGS 帧内容） */
+    bool                bHead;          /* 升级请求是 HEAD 请求（回复没有内容） */
+} h2_upgrade;
+
+/**
+ * 在连接上运行 HTTP/2 会话，直到连接关闭、对端发送 GOAWAY 并且所有的流都已结束，或者空闲超时
+ *
+ * @param fdIn/fdOut 连接的读、写描述符（阻塞模式）
+ * @param pPre/nPre 已经从连接读入、还没有处理的数据
+ * @param nPrefaceDone 连接前言中已经被读取、消费的字节数（prior knowledge 时为 H2_PREFACE_LINE）
+ * @param pUp h2c 升级时的升级请求，NULL 表示客户端直接以连接前言开始
+ */
+void h2_serve(int fdIn, int fdOut, const char *pPre, size_t nPre, size_t nPrefaceDone,
+              const h2_upgrade *pUp, h2_run xRun);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_H2_H */
@@ -0,0 +1,390 @@
+/*
+ * HPACK (RFC 7541) - Implementation
+ */
+
+#include "http_hpack.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_ENTRY_OVERHEAD    32      /* 动态表中每一项额外计算的大小 */
+
+/* ============ 静态表（RFC 7541 附录 A） ============ */
+
+static const struct {
+    const char*         zName;
+    const char*         zValue;
+} s_aStatic[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+#define HPACK_STATIC_COUNT  ((uint32_t)(sizeof(s_aStatic) / sizeof(s_aStatic[0])))
+
+/* ============ Huffman 解码（RFC 7541 附录 B） ============ */
+
+/*
+ * HPACK 的 Huffman 编码是规范（canonical）编码：相同码长的符号按符号值顺序分配连续的编码，
+ * 因此只需要每个符号的码长，解码表在第一次使用时生成。最后一项（256）是 EOS
+ */
+static const uint8_t s_aHuffLen[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static uint16_t         s_aHuffSym[257];    // 按（码长, 符号）排序的符号
+static uint32_t         s_aHuffFirst[31];   // 每种码长的第一个编码
+static uint16_t         s_aHuffCount[31];   // 每种码长的符号数
+static uint16_t         s_aHuffIndex[31];   // 每种码长的第一个符号在 s_aHuffSym 中的位置
+static int              s_bHuffInit = 0;
+
+static void huff_init(void) {
+    uint32_t code = 0;
+    uint16_t aNext[31];
+    for (int i = 0; i < 257; i++) s_aHuffCount[s_aHuffLen[i]]++;
+    for (int len = 1, k = 0; len <= 30; len++) {
+        code = (code + s_aHuffCount[len - 1]) << 1;
+        s_aHuffFirst[len] = code;
+        s_aHuffIndex[len] = aNext[len] = (uint16_t) k;
+        k += s_aHuffCount[len];
+    }
+    for (int i = 0; i < 257; i++) s_aHuffSym[aNext[s_aHuffLen[i]]++] = (uint16_t) i;
+    s_bHuffInit = 1;
+}
+
+// 解码 Huffman 编码的字符串到 zOut（空间至少为 nIn * 8 / 5），返回解码后的长度，格式错误时返回 -1
+static long huff_decode(const uint8_t *pIn, size_t nIn, char *zOut) {
+    uint32_t code = 0;
+    int len = 0;
+    long k = 0;
+    if (!s_bHuffInit) huff_init();
+    for (size_t i = 0; i < nIn; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((pIn[i] >> b) & 1);
+            if (++len > 30) return -1;
+            if (code - s_aHuffFirst[len] < s_aHuffCount[len]) {
+                uint16_t sym = s_aHuffSym[s_aHuffIndex[len] + code - s_aHuffFirst[len]];
+                if (sym == 256) return -1;      // 字符串中不能出现 EOS
+                zOut[k++] = (char) sym;
+                code = 0;
+                len = 0;
+            }
+        }
+    }
+    // 结尾的填充必须是 EOS 编码的前缀（全 1），且不超过 7 位
+    if (len > 7 || code != (1u << len) - 1) return -1;
+    return k;
+}
+
+/* ============ 整数和字符串 ============ */
+
+// 解码前缀为 nPrefix 位的整数，返回消耗的字节数，格式错误或超出范围时返回 0
+static size_t dec_int(const uint8_t *p, size_t n, int nPrefix, uint32_t *pVal) {
+    uint32_t mask = (1u << nPrefix) - 1;
+    uint64_t v;
+    size_t i = 1;
+    int shift = 0;
+    if (n == 0) return 0;
+    v = p[0] & mask;
+    if (v < mask) {
+        *pVal = (uint32_t) v;
+        return 1;
+    }
+    for (;;) {
+        if (i >= n || shift > 28) return 0;
+        uint8_t b = p[i++];
+        v += (uint64_t) (b & 0x7f) << shift;
+        if (v > 0x7fffffff) return 0;
+        shift += 7;
+        if ((b & 0x80) == 0) break;
+    }
+    *pVal = (uint32_t) v;
+    return i;
+}
+
+// 编码前缀为 nPrefix 位的整数（第一个字节的高位为 iFlags），返回写入的字节数，空间不足时返回 0
+static size_t enc_int(uint8_t *p, size_t n, int nPrefix, uint8_t iFlags, uint32_t v) {
+    uint32_t mask = (1u << nPrefix) - 1;
+    size_t i = 1;
+    if (n == 0) return 0;
+    if (v < mask) {
+        p[0] = iFlags | (uint8_t) v;
+        return 1;
+    }
+    p[0] = iFlags | (uint8_t) mask;
+    v -= mask;
+    while (v >= 0x80) {
+        if (i >= n) return 0;
+        p[i++] = (uint8_t) (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    if (i >= n) return 0;
+    p[i++] = (uint8_t) v;
+    return i;
+}
+
+// 解码一个字符串：Huffman 编码的解码到 zBuf 中，否则直接指向输入。返回消耗的字节数，格式错误时返回 0
+static size_t dec_str(const uint8_t *p, size_t n, char *zBuf, const char **pz, size_t *pn) {
+    uint32_t len;
+    size_t k = dec_int(p, n, 7, &len);
+    if (k == 0 || len > n - k) return 0;
+    if (p[0] & 0x80) {
+        long m = huff_decode(p + k, len, zBuf);
+        if (m < 0) return 0;
+        *pz = zBuf;
+        *pn = (size_t) m;
+    } else {
+        *pz = (const char *) p + k;
+        *pn = len;
+    }
+    return k + len;
+}
+
+/* ============ 动态表 ============ */
+
+void hpack_dec_init(hpack_dec *p, size_t nLimit) {
+    memset(p, 0, sizeof(*p));
+    p->nMax = p->nLimit = nLimit;
+}
+
+void hpack_dec_free(hpack_dec *p) {
+    for (int i = 0; i < p->nEnt; i++) free(p->aEnt[i].zName);
+    free(p->aEnt);
+    memset(p, 0, sizeof(*p));
+}
+
+// 淘汰最旧的项，直到动态表的大小不超过 nMax
+static void table_evict(hpack_dec *p, size_t nMax) {
+    while (p->nSize > nMax && p->nEnt > 0) {
+        hpack_entry *e = &p->aEnt[--p->nEnt];
+        p->nSize -= e->nName + e->nValue + HPACK_ENTRY_OVERHEAD;
+        free(e->zName);
+    }
+}
+
+static int table_insert(hpack_dec *p, const char *zName, size_t nName, const char *zValue, size_t nValue) {
+    size_t nEntry = nName + nValue + HPACK_ENTRY_OVERHEAD;
+    if (nEntry > p->nMax) {             // 比整个表还大：清空动态表，不插入
+        table_evict(p, 0);
+        return 0;
+    }
+    // 名称可能引用了即将被淘汰的项，先复制
+    char *z = (char *) malloc(nName + nValue + 1);
+    if (z == NULL) return -1;
+    memcpy(z, zName, nName);
+    memcpy(z + nName, zValue, nValue);
+    table_evict(p, p->nMax - nEntry);
+    if (p->nEnt == p->nEntAlloc) {
+        int nAlloc = p->nEntAlloc ? p->nEntAlloc * 2 : 16;
+        hpack_entry *a = (hpack_entry *) realloc(p->aEnt, sizeof(hpack_entry) * (size_t) nAlloc);
+        if (a == NULL) {
+            free(z);
+            return -1;
+        }
+        p->aEnt = a;
+        p->nEntAlloc = nAlloc;
+    }
+    memmove(&p->aEnt[1], &p->aEnt[0], sizeof(hpack_entry) * (size_t) p->nEnt);
+    p->aEnt[0].zName = z;
+    p->aEnt[0].nName = nName;
+    p->aEnt[0].zValue = z + nName;
+    p->aEnt[0].nValue = nValue;
+    p->nEnt++;
+    p->nSize += nEntry;
+    return 0;
+}
+
+// 按索引（从 1 开始，静态表之后是动态表）查找，索引无效时返回 -1
+static int table_get(hpack_dec *p, uint32_t idx, const char **pzName, size_t *pnName,
+                     const char **pzValue, size_t *pnValue) {
+    if (idx == 0) return -1;
+    if (idx <= HPACK_STATIC_COUNT) {
+        *pzName = s_aStatic[idx - 1].zName;
+        *pnName = strlen(*pzName);
+        *pzValue = s_aStatic[idx - 1].zValue;
+        *pnValue = strlen(*pzValue);
+        return 0;
+    }
+    idx -= HPACK_STATIC_COUNT + 1;
+    if (idx >= (uint32_t) p->nEnt) return -1;
+    *pzName = p->aEnt[idx].zName;
+    *pnName = p->aEnt[idx].nName;
+    *pzValue = p->aEnt[idx].zValue;
+    *pnValue = p->aEnt[idx].nValue;
+    return 0;
+}
+
+/* ============ 解码 ============ */
+
+int hpack_decode(hpack_dec *p, const uint8_t *pIn, size_t nIn, hpack_emit xEmit, void *pArg) {
+    size_t i = 0;
+    int rc = 0;
+    int bField = 0;                     // 已经解码了字段（之后不能再出现动态表大小更新）
+    char *zBuf = (char *) malloc(nIn * 2 + 16);     // Huffman 解码的名称和值（解码后不超过 8/5 倍）
+    if (zBuf == NULL) return -1;
+
+    while (i < nIn && rc == 0) {
+        const uint8_t *q = pIn + i;
+        size_t n = nIn - i, k;
+        uint32_t idx;
+        const char *zName, *zValue;
+        size_t nName, nValue;
+
+        if (q[0] & 0x80) {
+            // 索引的字段
+            if ((k = dec_int(q, n, 7, &idx)) == 0
+                || table_get(p, idx, &zName, &nName, &zValue, &nValue)) goto error;
+            i += k;
+            bField = 1;
+            rc = xEmit(pArg, zName, nName, zValue, nValue);
+            continue;
+        }
+        if ((q[0] & 0xe0) == 0x20) {
+            // 动态表大小更新
+            if (bField || (k = dec_int(q, n, 5, &idx)) == 0 || idx > p->nLimit) goto error;
+            i += k;
+            p->nMax = idx;
+            table_evict(p, p->nMax);
+            continue;
+        }
+
+        // 字面量：01 增量索引（6 位前缀），0001 从不索引、0000 不索引（4 位前缀）
+        int bIndex = (q[0] & 0xc0) == 0x40;
+        if ((k = dec_int(q, n, bIndex ? 6 : 4, &idx)) == 0) goto error;
+        size_t nUsed = 0;
+        if (idx) {
+            const char *zV;
+            size_t nV;
+            if (table_get(p, idx, &zName, &nName, &zV, &nV)) goto error;
+        } else {
+            size_t m = dec_str(q + k, n - k, zBuf, &zName, &nName);
+            if (m == 0) goto error;
+            k += m;
+            nUsed = nName;
+        }
+        size_t m = dec_str(q + k, n - k, zBuf + nUsed, &zValue, &nValue);
+        if (m == 0) goto error;
+        i += k + m;
+        bField = 1;
+        if (bIndex && table_insert(p, zName, nName, zValue, nValue)) goto error;
+        rc = xEmit(pArg, zName, nName, zValue, nValue);
+    }
+    free(zBuf);
+    return rc;
+
+error:
+    free(zBuf);
+    return -1;
+}
+
+/* ============ 编码 ============ */
+
+size_t hpack_encode(uint8_t *pOut, size_t nOut, const char *zName, size_t nName, const char *zValue, size_t nValue) {
+    uint32_t idx = 0;
+    size_t i, k;
+
+    for (uint32_t j = 0; j < HPACK_STATIC_COUNT; j++) {
+        if (strlen(s_aStatic[j].zName) == nName && memcmp(s_aStatic[j].zName, zName, nName) == 0) {
+            idx = j + 1;
+            break;
+        }
+    }
+    if ((i = enc_int(pOut, nOut, 4, 0x00, idx)) == 0) return 0;
+    if (idx == 0) {
+        if ((k = enc_int(pOut + i, nOut - i, 7, 0x00, (uint32_t) nName)) == 0 || nName > nOut - i - k) return 0;
+        i += k;
+        memcpy(pOut + i, zName, nName);
+        i += nName;
+    }
+    if ((k = enc_int(pOut + i, nOut - i, 7, 0x00, (uint32_t) nValue)) == 0 || nValue > nOut - i - k) return 0;
+    i += k;
+    memcpy(pOut + i, zValue, nValue);
+    return i + nValue;
+}
+
+size_t hpack_encode_status(uint8_t *pOut, int iStatus) {
+    for (uint32_t j = 7; j < 14; j++) {     // 静态表 8 ~ 14 为常见的 :status
+        if (atoi(s_aStatic[j].zValue) == iStatus) {
+            pOut[0] = (uint8_t) (0x80 | (j + 1));
+            return 1;
+        }
+    }
+    pOut[0] = 0x08;                         // 不索引的字面量，名称为静态表第 8 项（:status）
+    pOut[1] = 3;
+    pOut[2] = (uint8_t) ('0' + iStatus / 100 % 10);
+    pOut[3] = (uint8_t) ('0' + iStatus / 10 % 10);
+    pOut[4] = (uint8_t) ('0' + iStatus % 10);
+    return 5;
+}
@@ -0,0 +1,72 @@
+/*
+ * HPACK (RFC 7541) - Header
+ *
+ * HTTP/2 头部压缩：解码器完整实现静态表、动态表（包括大小更新）和 Huffman 编码的字符串；
+ * 编码器不使用动态表，字段总是以“不索引的字面量”输出（名称在静态表中时引用静态表），
+ * 因此编码不需要保存状态，对端解码器的动态表也不会因为我们的输出而改变
+ */
+
+#ifndef HTTP_HPACK_H
+#define HTTP_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 动态表中的一项，名称和值保存在同一块内存中（zName 指向其起始位置）
+ */
+typedef struct hpack_entry {
+    char*               zName;
+    size_t              nName;
+    char*               zValue;
+    size_t              nValue;
+} hpack_entry;
+
+/**
+ * 解码器状态（每个连接一个）
+ */
+typedef struct hpack_dec {
+    hpack_entry*        aEnt;           /* 动态表，aEnt[0] 是最新插入的一项 */
+    int                 nEnt;
+    int                 nEntAlloc;
+    size_t              nSize;          /* 动态表当前的大小（每项为名称 + 值 + 32 字节） */
+    size_t              nMax;           /* 动态表的最大大小（对端通过大小更新设置，不超过 nLimit） */
+    size_t              nLimit;         /* 我们通过 SETTINGS_HEADER_TABLE_SIZE 允许的最大大小 */
+} hpack_dec;
+
+/**
+ * 解码出一个头部字段时的回调，名称和值只在回调期间有效（不以 null 结尾）
+ * + 返回非 0 时停止解码，hpack_decode() 返回该值
+ */
+typedef int (*hpack_emit)(void *pArg, const char *zName, size_t nName, const char *zValue, size_t nValue);
+
+void hpack_dec_init(hpack_dec *p, size_t nLimit);
+void hpack_dec_free(hpack_dec *p);
+
+/**
+ * 解码一个完整的头部块（HEADERS 以及之后的 CONTINUATION 帧的内容）
+ *
+ * @return 0: 成功；-1: 格式错误（连接级的 COMPRESSION_ERROR）；其它: xEmit 返回的值
+ * + 即使 xEmit 要求停止，也应当视为连接错误：动态表的状态已经无法和对端保持一致
+ */
+int hpack_decode(hpack_dec *p, const uint8_t *pIn, size_t nIn, hpack_emit xEmit, void *pArg);
+
+/**
+ * 编码一个头部字段（不索引的字面量），返回写入 pOut 的字节数，空间不足时返回 0
+ */
+size_t hpack_encode(uint8_t *pOut, size_t nOut, const char *zName, size_t nName, const char *zValue, size_t nValue);
+
+/**
+ * 编码 :status 伪头部（静态表中有的状态码只需 1 字节），返回写入 pOut 的字节数（pOut 至少 5 字节）
+ */
+size_t hpack_encode_status(uint8_t *pOut, int iStatus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_HPACK_H */
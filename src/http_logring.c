@@ -0,0 +1,183 @@
+/*
+ * Access Log Ring - Implementation
+ *
+ * 写入位置（head）和读取位置（tail）都是单调递增的 64 位偏移，对缓冲大小取模得到实际位置。
+ * 每条记录以 8 字节的记录头开始，记录总长按 8 字节对齐，因此记录头不会跨越缓冲的末尾，
+ * 记录的内容可能跨越末尾（分两段复制）。
+ *
+ * 记录头是一个 64 位的字：高 32 位是记录位置的标记（位置 / 8），低 32 位是记录总长 | 状态。
+ * 写入者先以 CAS 在 head 所在的位置写入记录头（长度随之公开），再推进 head：
+ * + 推进 head 的值总是“head + head 处记录头中的长度”，任何写入者看到 head 处已有记录头时都可以代为推进，
+ *   预留之后、推进 head 之前退出的写入者不会挡住其它写入者
+ * + head 之前的每一个记录头都已经写入，读取者总是知道记录的长度：长时间没有提交的记录可以跳过
+ * + 位置的标记区分上一圈留下的记录头，以及位置已经过时（该位置已被读取）的写入者写入的记录头
+ * 读取者在推进 tail 之前清零记录的内容，推进 tail 之后才清零记录头：过时的写入者在记录头上的 CAS
+ * 只能在 tail 越过该位置之后成功，写入者在 CAS 之后检查 tail 以发现这种情况并撤销
+ */
+
+#include "http_logring.h"
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define LOG_REC_WRITING     1           /* 记录状态：正在写入 */
+#define LOG_REC_COMMITTED   2           /* 记录状态：已提交 */
+#define LOG_RING_STALL      2           /* 正在写入的记录超过该时间（秒）没有提交时被跳过 */
+
+#define LOG_REC_HDR         8           /* 记录头的长度 */
+
+// 记录头：位置 pos 的记录，总长 nRec（8 字节对齐，低 3 位用于状态）
+#define REC_HDR(pos, nRec, state)   ((uint64_t)(uint32_t)((pos) >> 3) << 32 | (uint32_t)(nRec) | (state))
+#define REC_LEN(w)                  ((uint32_t)(w) & ~(uint32_t)7)
+#define REC_STATE(w)                ((uint32_t)(w) & 7)
+#define REC_MAX                     ((LOG_REC_HDR + LOG_RING_MAX_REC + 7) & ~7)
+#define REC_AT(w, pos)              (REC_LEN(w) != 0 && REC_LEN(w) <= REC_MAX && (uint32_t)((w) >> 32) == (uint32_t)((pos) >> 3))
+
+typedef struct log_ring {
+    uint64_t            head;           /* 写入者预留到的位置 */
+    char                pad1[56];       /* head 和 tail 位于不同的缓存行 */
+    uint64_t            tail;           /* 读取者读到的位置 */
+    char                pad2[56];
+    uint64_t            nPut;
+    uint64_t            nFull;
+} log_ring;
+
+static log_ring*        s_pRing = NULL;     // 共享内存中的缓冲头部，数据紧随其后
+static uint8_t*         s_aData = NULL;
+static uint64_t         s_nSize = 0;        // 数据区的大小（2 的幂）
+
+#define REC_SLOT(pos)       ((uint64_t*)(s_aData + ((pos) & (s_nSize - 1))))
+
+static uint64_t         s_tailStall = 0;    // 读取者：等待提交的记录的位置
+static time_t           s_tStall = 0;       // 读取者：开始等待该记录的时间
+
+int log_ring_init(size_t nSize) {
+
+    uint64_t n = 4096;
+    while (n < nSize) n <<= 1;
+
+    void *p = mmap(0, sizeof(log_ring) + n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_pRing = (log_ring*)p;
+    s_aData = (uint8_t*)p + sizeof(log_ring);
+    s_nSize = n;
+    return 0;
+}
+
+bool log_ring_enabled(void) {
+    return s_pRing != NULL;
+}
+
+// 在数据区的 iPos 位置（可能跨越末尾）复制、清零
+static void ring_write(uint64_t iPos, const void *p, size_t n) {
+    size_t off = (size_t)(iPos & (s_nSize - 1)), k = s_nSize - off < n ? (size_t)(s_nSize - off) : n;
+    memcpy(s_aData + off, p, k);
+    memcpy(s_aData, (const uint8_t*)p + k, n - k);
+}
+
+static void ring_read(uint64_t iPos, void *p, size_t n) {
+    size_t off = (size_t)(iPos & (s_nSize - 1)), k = s_nSize - off < n ? (size_t)(s_nSize - off) : n;
+    memcpy(p, s_aData + off, k);
+    memcpy((uint8_t*)p + k, s_aData, n - k);
+}
+
+static void ring_zero(uint64_t iPos, size_t n) {
+    size_t off = (size_t)(iPos & (s_nSize - 1)), k = s_nSize - off < n ? (size_t)(s_nSize - off) : n;
+    memset(s_aData + off, 0, k);
+    memset(s_aData, 0, n - k);
+}
+
+bool log_ring_put(const void *p, size_t n) {
+
+    if (s_pRing == NULL || n > LOG_RING_MAX_REC) return false;
+    uint32_t nRec = (uint32_t)((LOG_REC_HDR + n + 7) & ~(size_t)7);
+    uint64_t pos = __atomic_load_n(&s_pRing->head, __ATOMIC_ACQUIRE);
+    uint64_t *ph;
+
+    // 预留空间：在 head 处写入记录头，然后推进 head，空间不足时放弃
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&s_pRing->tail, __ATOMIC_ACQUIRE);
+        if ((int64_t)(tail - pos) > 0) {
+            pos = __atomic_load_n(&s_pRing->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (pos + nRec - tail > s_nSize) {
+            __atomic_fetch_add(&s_pRing->nFull, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        ph = REC_SLOT(pos);
+        uint64_t w = __atomic_load_n(ph, __ATOMIC_ACQUIRE);
+        if (REC_AT(w, pos)) {
+            // 其它写入者已经在这里预留（可能已经退出）：代为推进 head
+            uint64_t next = pos + REC_LEN(w);
+            if (__atomic_compare_exchange_n(&s_pRing->head, &pos, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) pos = next;
+            continue;
+        }
+        // 记录头中是上一圈留下的（读取者还没有清零），或者位置已经过时：head 仍然是 pos 时才写入
+        uint64_t head = __atomic_load_n(&s_pRing->head, __ATOMIC_ACQUIRE);
+        if (head != pos) {
+            pos = head;
+            continue;
+        }
+        uint64_t hdr = REC_HDR(pos, nRec, LOG_REC_WRITING);
+        if (!__atomic_compare_exchange_n(ph, &w, hdr, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+        if ((int64_t)(__atomic_load_n(&s_pRing->tail, __ATOMIC_ACQUIRE) - pos) > 0) {
+            // 该位置在检查 head 之后已经被读取：写入的是已经交还的空间，撤销
+            __atomic_compare_exchange_n(ph, &hdr, w, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            pos = __atomic_load_n(&s_pRing->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        // 失败时 head 已经由其它写入者代为推进
+        __atomic_compare_exchange_n(&s_pRing->head, &pos, pos + nRec, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        break;
+    }
+
+    ring_write(pos + LOG_REC_HDR, p, n);
+    uint64_t hdr = REC_HDR(pos, nRec, LOG_REC_WRITING);
+    __atomic_compare_exchange_n(ph, &hdr, REC_HDR(pos, nRec, LOG_REC_COMMITTED), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s_pRing->nPut, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+size_t log_ring_get(void *pBuf) {
+
+    if (s_pRing == NULL) return 0;
+    uint64_t tail = s_pRing->tail;
+    if (tail == __atomic_load_n(&s_pRing->head, __ATOMIC_ACQUIRE)) return 0;
+
+    // head 已经越过 tail：tail 处的记录头一定已经写入
+    uint64_t *ph = REC_SLOT(tail);
+    uint64_t w = __atomic_load_n(ph, __ATOMIC_ACQUIRE);
+    if (!REC_AT(w, tail)) return 0;
+    size_t n = 0;
+    if (REC_STATE(w) != LOG_REC_COMMITTED) {
+        // 写入者还没有提交：等待；长时间没有提交（写入者已经退出）时跳过该记录
+        time_t tNow = time(NULL);
+        if (s_tailStall != tail || s_tStall == 0) {
+            s_tailStall = tail;
+            s_tStall = tNow;
+            return 0;
+        }
+        if (tNow - s_tStall < LOG_RING_STALL) return 0;
+    } else {
+        n = REC_LEN(w) - LOG_REC_HDR;
+        ring_read(tail + LOG_REC_HDR, pBuf, n);
+        // 记录内容按 8 字节对齐，末尾的填充也被复制了；实际的长度由记录自己描述
+    }
+    s_tStall = 0;
+
+    uint32_t nRec = REC_LEN(w);
+    ring_zero(tail + LOG_REC_HDR, nRec - LOG_REC_HDR);
+    __atomic_store_n(&s_pRing->tail, tail + nRec, __ATOMIC_RELEASE);
+    __atomic_compare_exchange_n(ph, &w, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return n ? n : log_ring_get(pBuf);
+}
+
+void log_ring_stats(log_ring_stat *pStat) {
+    memset(pStat, 0, sizeof(*pStat));
+    if (s_pRing == NULL) return;
+    pStat->nPut = __atomic_load_n(&s_pRing->nPut, __ATOMIC_RELAXED);
+    pStat->nFull = __atomic_load_n(&s_pRing->nFull, __ATOMIC_RELAXED);
+    pStat->nPending = __atomic_load_n(&s_pRing->head, __ATOMIC_RELAXED) - __atomic_load_n(&s_pRing->tail, __ATOMIC_RELAXED);
+    pStat->nSize = s_nSize;
+}
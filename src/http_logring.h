@@ -0,0 +1,72 @@
+/*
+ * Access Log Ring - Header
+ *
+ * 访问日志的共享内存环形缓冲：请求处理进程把日志记录（二进制）追加到环形缓冲中，由单独的日志进程按顺序取出、
+ * 格式化后成批写入日志文件，请求处理中不再有打开、写入、关闭日志文件的系统调用
+ *
+ * 多个写入者之间不加锁：写入者以 CAS 在写入位置写入记录头（包括记录的长度）来预留空间，再推进写入位置，
+ * 写完后把记录的状态设为已提交；
+ * 唯一的读取者（日志进程）按顺序读取已提交的记录，读取后把该段空间清零交还给写入者。
+ * 缓冲已满时写入失败，调用者应当退回到直接写日志文件
+ */
+
+#ifndef HTTP_LOGRING_H
+#define HTTP_LOGRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_RING_MAX_REC    8192        /* 一条记录（不含记录头）的最大长度 */
+
+/**
+ * 统计信息（所有进程累计）
+ */
+typedef struct log_ring_stat {
+    uint64_t            nPut;           /* 写入的记录数 */
+    uint64_t            nFull;          /* 缓冲已满而写入失败的次数 */
+    uint64_t            nPending;       /* 当前尚未被读取的字节数 */
+    uint64_t            nSize;          /* 缓冲的大小 */
+} log_ring_stat;
+
+/**
+ * 创建大小约为 nSize 字节（向上取 2 的幂）的共享环形缓冲，必须在 fork 任何子进程之前调用
+ *
+ * @return 0: 成功；-1: 分配共享内存失败（此时缓冲不可用）
+ */
+int log_ring_init(size_t nSize);
+
+/**
+ * 缓冲是否可用
+ */
+bool log_ring_enabled(void);
+
+/**
+ * 追加一条记录（可以在信号处理函数中调用）
+ *
+ * @return false: 缓冲不可用、已满，或者记录超过 LOG_RING_MAX_REC
+ */
+bool log_ring_put(const void *p, size_t n);
+
+/**
+ * 取出下一条已提交的记录（只能由唯一的读取者调用），pBuf 至少 LOG_RING_MAX_REC 字节
+ *
+ * @return 记录的长度；0 表示没有可以读取的记录
+ * + 写入者在预留空间之后、提交之前异常退出时，该记录在 2 秒之后被跳过，之后的记录不受影响
+ */
+size_t log_ring_get(void *pBuf);
+
+/**
+ * 读取统计信息
+ */
+void log_ring_stats(log_ring_stat *pStat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_LOGRING_H */
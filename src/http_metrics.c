@@ -0,0 +1,255 @@
+/*
+ * Metrics - Implementation
+ */
+
+#include "http_metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define METRICS_STATUS_N        6       /* 1xx ~ 5xx，以及其它 */
+
+typedef struct metrics_slot {
+    uint64_t            nReq;
+    uint64_t            nIn;
+    uint64_t            nOut;
+    uint64_t            nUsSum;         /* 处理时间之和（微秒） */
+    uint64_t            aStatus[METRICS_STATUS_N];
+    uint64_t            aHist[METRICS_HIST_N];
+} metrics_slot;
+
+typedef struct metrics_block {
+    int64_t             tStart;         /* 服务器启动的时间 */
+    int64_t             nChildren;      /* 每连接 fork 模式下的请求处理子进程数 */
+    uint64_t            aFork[METRICS_FORK_N];
+    metrics_slot        aSlot[METRICS_HANDLER_N];
+} metrics_block;
+
+static metrics_block*   s_pBlock = NULL;
+
+static const char *const s_azHandler[METRICS_SQTP] = {
+    "static", "buildins", "c_cgi", "c_resident", "cgi", "scgi", "other"
+};
+static const char *const s_azSqtp[METRICS_SQTP_N] = {
+    "SELECT", "INSERT", "UPDATE", "DELETE", "UPSERT", "RESET", "BEGIN",
+    "COMMIT", "ROLLBACK", "SAVEPOINT", "CREATE", "DROP", "ALTER", "OTHER"
+};
+static const char *const s_azFork[METRICS_FORK_N] = {
+    "connection", "worker", "cgi", "handoff", "h2_stream", "post"
+};
+static const char *const s_azStatus[METRICS_STATUS_N] = {
+    "1xx", "2xx", "3xx", "4xx", "5xx", "other"
+};
+
+int metrics_init(void) {
+    void *p = mmap(0, sizeof(metrics_block), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_pBlock = (metrics_block*)p;
+    memset(s_pBlock, 0, sizeof(*s_pBlock));
+    s_pBlock->tStart = (int64_t)time(0);
+    return 0;
+}
+
+bool metrics_enabled(void) {
+    return s_pBlock != NULL;
+}
+
+int metrics_sqtp_handler(const char *zMethod) {
+    int i;
+    for (i = 0; i < METRICS_SQTP_N - 1 && strcmp(zMethod, s_azSqtp[i]) != 0; i++) {}
+    return METRICS_SQTP + i;
+}
+
+// 直方图的桶：第 d 个 10 的幂次中的第 m 个桶（m = 1..9）覆盖 [m * 10^d, (m + 1) * 10^d) 微秒
+static int hist_index(uint64_t nUs) {
+    uint64_t p = 1;
+    for (int d = 0; d < METRICS_HIST_DECADES; d++, p *= 10) {
+        if (nUs < p * 10) {
+            int m = (int)(nUs / p);
+            return d * 9 + (m < 1 ? 1 : m) - 1;
+        }
+    }
+    return METRICS_HIST_N - 1;
+}
+
+// 桶的宽度（微秒）
+static uint64_t hist_width(int i) {
+    uint64_t p = 1;
+    for (int d = 0; d < i / 9; d++) p *= 10;
+    return p;
+}
+
+// 桶的下界（微秒）；溢出桶的下界正好是直方图覆盖范围的上界
+static uint64_t hist_lower(int i) {
+    return (uint64_t)(i % 9 + 1) * hist_width(i);
+}
+
+void metrics_request(int iHandler, const char *zStatus, uint64_t nIn, uint64_t nOut, uint64_t nUs) {
+    if (s_pBlock == NULL) return;
+    if (iHandler < 0 || iHandler >= METRICS_HANDLER_N) iHandler = METRICS_OTHER;
+    metrics_slot *p = &s_pBlock->aSlot[iHandler];
+    int iStatus = zStatus && zStatus[0] >= '1' && zStatus[0] <= '5' ? zStatus[0] - '1' : METRICS_STATUS_N - 1;
+    __atomic_fetch_add(&p->nReq, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->nIn, nIn, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->nOut, nOut, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->nUsSum, nUs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->aStatus[iStatus], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->aHist[hist_index(nUs)], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_fork(int iKind) {
+    if (s_pBlock == NULL || iKind < 0 || iKind >= METRICS_FORK_N) return;
+    __atomic_fetch_add(&s_pBlock->aFork[iKind], 1, __ATOMIC_RELAXED);
+}
+
+void metrics_children(int n) {
+    if (s_pBlock == NULL) return;
+    __atomic_store_n(&s_pBlock->nChildren, (int64_t)n, __ATOMIC_RELAXED);
+}
+
+// 由直方图估计分位数（秒）：在目标所在的桶内按线性插值
+static double hist_quantile(const uint64_t *aHist, uint64_t nTotal, double q) {
+    uint64_t nTarget = (uint64_t)(q * (double)nTotal + 0.999999), nCum = 0;
+    if (nTarget == 0) nTarget = 1;
+    for (int i = 0; i < METRICS_HIST_N; i++) {
+        if (aHist[i] == 0 || nCum + aHist[i] < nTarget) {
+            nCum += aHist[i];
+            continue;
+        }
+        double lo = (double)hist_lower(i);
+        if (i == METRICS_HIST_N - 1) return lo / 1e6;
+        double w = (double)hist_width(i);
+        return (lo + w * (double)(nTarget - nCum) / (double)aHist[i]) / 1e6;
+    }
+    return 0;
+}
+
+typedef struct out_buf {
+    char*               z;
+    size_t              n;
+    size_t              nAlloc;
+    bool                bFull;
+} out_buf;
+
+// 追加一行，放不下时丢弃该行以及之后的所有输出
+static void out(out_buf *p, const char *zFormat, ...) {
+    va_list ap;
+    if (p->bFull) return;
+    va_start(ap, zFormat);
+    int n = vsnprintf(p->z + p->n, p->nAlloc - p->n, zFormat, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= p->nAlloc - p->n) {
+        p->z[p->n] = 0;
+        p->bFull = true;
+        return;
+    }
+    p->n += (size_t)n;
+}
+
+// 处理方式的标签
+static const char *handler_labels(int i, char *zBuf, size_t nBuf) {
+    if (i < METRICS_SQTP) snprintf(zBuf, nBuf, "handler=\"%s\"", s_azHandler[i]);
+    else snprintf(zBuf, nBuf, "handler=\"sqtp\",method=\"%s\"", s_azSqtp[i - METRICS_SQTP]);
+    return zBuf;
+}
+
+size_t metrics_format(char *zBuf, size_t nBuf, const metrics_procs *pProcs) {
+    out_buf o = { zBuf, 0, nBuf, nBuf == 0 };
+    metrics_slot aSlot[METRICS_HANDLER_N];
+    char zLabel[64];
+
+    if (nBuf) zBuf[0] = 0;
+    if (s_pBlock == NULL) return 0;
+
+    // 先复制一份，输出过程中计数器仍在变化
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        const uint64_t *pSrc = (const uint64_t*)&s_pBlock->aSlot[i];
+        uint64_t *pDst = (uint64_t*)&aSlot[i];
+        for (size_t k = 0; k < sizeof(metrics_slot) / sizeof(uint64_t); k++)
+            pDst[k] = __atomic_load_n(&pSrc[k], __ATOMIC_RELAXED);
+    }
+
+    out(&o, "# HELP wpp_requests_total Requests handled, by handler and status class.\n"
+            "# TYPE wpp_requests_total counter\n");
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        for (int k = 0; k < METRICS_STATUS_N; k++) {
+            if (aSlot[i].aStatus[k] == 0) continue;
+            out(&o, "wpp_requests_total{%s,code=\"%s\"} %llu\n", handler_labels(i, zLabel, sizeof(zLabel)),
+                s_azStatus[k], (unsigned long long)aSlot[i].aStatus[k]);
+        }
+    }
+
+    out(&o, "# HELP wpp_received_bytes_total Bytes received (request headers and bodies).\n"
+            "# TYPE wpp_received_bytes_total counter\n");
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        if (aSlot[i].nReq == 0) continue;
+        out(&o, "wpp_received_bytes_total{%s} %llu\n", handler_labels(i, zLabel, sizeof(zLabel)),
+            (unsigned long long)aSlot[i].nIn);
+    }
+    out(&o, "# HELP wpp_sent_bytes_total Bytes sent (reply headers and bodies).\n"
+            "# TYPE wpp_sent_bytes_total counter\n");
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        if (aSlot[i].nReq == 0) continue;
+        out(&o, "wpp_sent_bytes_total{%s} %llu\n", handler_labels(i, zLabel, sizeof(zLabel)),
+            (unsigned long long)aSlot[i].nOut);
+    }
+
+    // 直方图只输出上界为 1、2、5 x 10^d 的桶（累计值，Prometheus 要求）
+    out(&o, "# HELP wpp_request_duration_seconds Time from the request header being read to the reply being logged.\n"
+            "# TYPE wpp_request_duration_seconds histogram\n");
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        uint64_t nCum = 0;
+        if (aSlot[i].nReq == 0) continue;
+        handler_labels(i, zLabel, sizeof(zLabel));
+        for (int k = 0; k < METRICS_HIST_N - 1; k++) {
+            nCum += aSlot[i].aHist[k];
+            int m = k % 9 + 2;          // 桶的上界是 m x 10^d
+            if (m != 2 && m != 5 && m != 10) continue;
+            out(&o, "wpp_request_duration_seconds_bucket{%s,le=\"%g\"} %llu\n", zLabel,
+                (double)(hist_lower(k) + hist_width(k)) / 1e6, (unsigned long long)nCum);
+        }
+        nCum += aSlot[i].aHist[METRICS_HIST_N - 1];
+        out(&o, "wpp_request_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n", zLabel, (unsigned long long)nCum);
+        out(&o, "wpp_request_duration_seconds_sum{%s} %.6f\n", zLabel, (double)aSlot[i].nUsSum / 1e6);
+        out(&o, "wpp_request_duration_seconds_count{%s} %llu\n", zLabel, (unsigned long long)nCum);
+    }
+
+    out(&o, "# HELP wpp_request_duration_quantile_seconds Latency quantiles estimated from the histogram.\n"
+            "# TYPE wpp_request_duration_quantile_seconds gauge\n");
+    for (int i = 0; i < METRICS_HANDLER_N; i++) {
+        static const double aQ[] = { 0.5, 0.99, 0.999 };
+        uint64_t nTotal = 0;
+        for (int k = 0; k < METRICS_HIST_N; k++) nTotal += aSlot[i].aHist[k];
+        if (nTotal == 0) continue;
+        handler_labels(i, zLabel, sizeof(zLabel));
+        for (size_t k = 0; k < sizeof(aQ) / sizeof(aQ[0]); k++) {
+            out(&o, "wpp_request_duration_quantile_seconds{%s,quantile=\"%g\"} %.6f\n", zLabel, aQ[k],
+                hist_quantile(aSlot[i].aHist, nTotal, aQ[k]));
+        }
+    }
+
+    out(&o, "# HELP wpp_forks_total Successful fork() calls, by purpose.\n"
+            "# TYPE wpp_forks_total counter\n");
+    for (int i = 0; i < METRICS_FORK_N; i++) {
+        out(&o, "wpp_forks_total{kind=\"%s\"} %llu\n", s_azFork[i],
+            (unsigned long long)__atomic_load_n(&s_pBlock->aFork[i], __ATOMIC_RELAXED));
+    }
+
+    if (pProcs) {
+        out(&o, "# HELP wpp_workers Prefork workers, by state.\n"
+                "# TYPE wpp_workers gauge\n"
+                "wpp_workers{state=\"busy\"} %d\n"
+                "wpp_workers{state=\"idle\"} %d\n", pProcs->nBusy, pProcs->nIdle);
+    } else {
+        out(&o, "# HELP wpp_connection_processes Per-connection request processes.\n"
+                "# TYPE wpp_connection_processes gauge\n"
+                "wpp_connection_processes %lld\n",
+                (long long)__atomic_load_n(&s_pBlock->nChildren, __ATOMIC_RELAXED));
+    }
+    out(&o, "# HELP wpp_start_time_seconds Server start time since the Unix epoch.\n"
+            "# TYPE wpp_start_time_seconds gauge\n"
+            "wpp_start_time_seconds %lld\n", (long long)s_pBlock->tStart);
+    return o.n;
+}
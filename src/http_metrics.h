@@ -0,0 +1,110 @@
+/*
+ * Metrics - Header
+ *
+ * 运行统计：位于所有进程共享的内存中，请求处理进程在每个请求结束时以 relaxed 原子操作累加，
+ * 读取时不加锁（各计数器之间不保证严格一致，对统计用途足够）。以 Prometheus 文本格式输出（/-/metrics）
+ *
+ * 按处理方式（静态文件、buildins、C 脚本、CGI、SCGI、SQTP 的各个方法）分别统计请求数、收发字节数、状态码类别，
+ * 以及对数线性分桶的延迟直方图（每个 10 的幂次再等分为 9 个桶，相对误差不超过 1/2 个桶宽），由此计算 p50/p99/p999
+ */
+
+#ifndef HTTP_METRICS_H
+#define HTTP_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 请求的处理方式
+ */
+enum {
+    METRICS_STATIC = 0,                 /* 文件系统中的静态文件 */
+    METRICS_BUILDINS,                   /* 编译进可执行文件的 buildins 文件 */
+    METRICS_C_CGI,                      /* C 脚本（TinyCC） */
+    METRICS_C_RESIDENT,                 /* 常驻 C 脚本（-R，请求处理进程直接调用 handle_request()） */
+    METRICS_CGI,                        /* 传统 CGI */
+    METRICS_SCGI,                       /* SCGI */
+    METRICS_OTHER,                      /* 其它：错误、重定向、目录等在选择处理方式之前就结束的请求 */
+    METRICS_SQTP,                       /* SQTP，之后依次是各个方法，最后一项是不支持的方法 */
+    METRICS_SQTP_N = 14,
+    METRICS_HANDLER_N = METRICS_SQTP + METRICS_SQTP_N
+};
+
+/**
+ * fork 的用途
+ */
+enum {
+    METRICS_FORK_CONNECTION = 0,        /* 每连接 fork 的请求处理子进程 */
+    METRICS_FORK_WORKER,                /* prefork worker（包括回收后重建的） */
+    METRICS_FORK_CGI,                   /* CGI / C 脚本子进程 */
+    METRICS_FORK_HANDOFF,               /* 事件循环把请求交给子进程 */
+    METRICS_FORK_H2_STREAM,             /* HTTP/2 的流处理进程 */
+    METRICS_FORK_POST,                  /* 向 CGI 复制请求体的进程 */
+    METRICS_FORK_N
+};
+
+#define METRICS_HIST_DECADES    8       /* 直方图覆盖 1us ~ 100s */
+#define METRICS_HIST_N          (METRICS_HIST_DECADES * 9 + 1)  /* 最后一个桶是溢出桶 */
+
+/**
+ * prefork worker 的状态统计，由调用者在输出时提供
+ */
+typedef struct metrics_procs {
+    int                 nBusy;          /* 正在处理请求的 worker */
+    int                 nIdle;          /* 空闲的 worker */
+} metrics_procs;
+
+/**
+ * 创建共享的统计内存，必须在 fork 任何子进程之前调用
+ *
+ * @return 0: 成功；-1: 分配共享内存失败（此时不统计）
+ */
+int metrics_init(void);
+
+/**
+ * 是否在统计
+ */
+bool metrics_enabled(void);
+
+/**
+ * 由 SQTP 的方法名（不含 "SQTP-" 前缀）得到处理方式
+ */
+int metrics_sqtp_handler(const char *zMethod);
+
+/**
+ * 记录一个已结束的请求（可以在信号处理函数中调用）
+ *
+ * @param iHandler 处理方式
+ * @param zStatus 回复的状态码（"200" 等，NULL 或者不是 1xx-5xx 时计入“其它”）
+ * @param nUs 请求的处理时间（微秒）
+ */
+void metrics_request(int iHandler, const char *zStatus, uint64_t nIn, uint64_t nOut, uint64_t nUs);
+
+/**
+ * 记录一次成功的 fork
+ */
+void metrics_fork(int iKind);
+
+/**
+ * 每连接 fork 模式下，主进程更新当前的请求处理子进程数
+ */
+void metrics_children(int n);
+
+/**
+ * 以 Prometheus 文本格式输出统计信息
+ *
+ * @param pProcs prefork 模式下各 worker 的状态，NULL 表示每连接 fork 模式（输出请求处理子进程数）
+ * @return 输出的长度（不含结尾的 0）；zBuf 不够大时输出被截断在完整的行上
+ */
+size_t metrics_format(char *zBuf, size_t nBuf, const metrics_procs *pProcs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_METRICS_H */
@@ -0,0 +1,137 @@
+/*
+ * HTTP Request Parser - Implementation
+ *
+ * 请求头在连接缓冲中一次性解析：每行只扫描一遍，字段名通过完美哈希分派，
+ * 结果以 (偏移, 长度) 的形式记录，调用者按需直接引用缓冲中的内容
+ */
+
+#include "http_parser.h"
+#include <string.h>
+
+/* ============ 字段名完美哈希 ============ */
+
+/*
+ * 哈希函数：(长度 * 26 + 首字符 + 末字符 * 11) & 31，字符均转为小写
+ * 对下表中的字段名没有冲突。修改字段集合后需要重新确认没有冲突
+ */
+#define HDR_HASH_SIZE   32
+#define HDR_LOWER(c)    ((unsigned char)((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c)))
+#define HDR_HASH(z, n)  ((((unsigned)(n) * 26u) + HDR_LOWER((z)[0]) + HDR_LOWER((z)[(n) - 1]) * 11u) & (HDR_HASH_SIZE - 1))
+
+typedef struct hdr_slot {
+    const char*         zName;
+    uint8_t             nName;
+    uint8_t             id;
+} hdr_slot;
+
+static const hdr_slot s_aHdrSlot[HDR_HASH_SIZE] = {
+    [21] = { "User-Agent",          10, HTTP_HDR_USER_AGENT },
+    [25] = { "Accept",              6,  HTTP_HDR_ACCEPT },
+    [20] = { "Accept-Encoding",     15, HTTP_HDR_ACCEPT_ENCODING },
+    [7]  = { "Content-Length",      14, HTTP_HDR_CONTENT_LENGTH },
+    [18] = { "Content-Type",        12, HTTP_HDR_CONTENT_TYPE },
+    [14] = { "Referer",             7,  HTTP_HDR_REFERER },
+    [22] = { "Cookie",              6,  HTTP_HDR_COOKIE },
+    [1]  = { "Connection",          10, HTTP_HDR_CONNECTION },
+    [12] = { "Host",                4,  HTTP_HDR_HOST },
+    [13] = { "Authorization",       13, HTTP_HDR_AUTHORIZATION },
+    [19] = { "If-None-Match",       13, HTTP_HDR_IF_NONE_MATCH },
+    [26] = { "If-Modified-Since",   17, HTTP_HDR_IF_MODIFIED_SINCE },
+    [11] = { "Range",               5,  HTTP_HDR_RANGE },
+    [27] = { "Transfer-Encoding",   17, HTTP_HDR_TRANSFER_ENCODING },
+    [29] = { "Expect",              6,  HTTP_HDR_EXPECT },
+    [16] = { "If-Range",            8,  HTTP_HDR_IF_RANGE },
+    [2]  = { "Upgrade",             7,  HTTP_HDR_UPGRADE },
+    [5]  = { "HTTP2-Settings",      14, HTTP_HDR_HTTP2_SETTINGS },
+};
+
+http_hdr_id http_header_lookup(const char *zName, size_t nName) {
+
+    if (nName == 0 || nName > 255) return HTTP_HDR_UNKNOWN;
+    const hdr_slot *p = &s_aHdrSlot[HDR_HASH(zName, nName)];
+    if (p->nName != nName) return HTTP_HDR_UNKNOWN;
+
+    for (size_t i = 0; i < nName; i++) {
+        if (HDR_LOWER(zName[i]) != HDR_LOWER(p->zName[i])) return HTTP_HDR_UNKNOWN;
+    }
+    return (http_hdr_id)p->id;
+}
+
+const char *http_header_name(http_hdr_id id) {
+    for (int i = 0; i < HDR_HASH_SIZE; i++) {
+        if (s_aHdrSlot[i].zName && s_aHdrSlot[i].id == id) return s_aHdrSlot[i].zName;
+    }
+    return "";
+}
+
+/* ============ 请求头解析 ============ */
+
+#define IS_SPACE(c)     ((c) == ' ' || (c) == '\t')
+
+// 在 z[i..n) 中查找下一个换行，返回换行的位置，没有时返回 n
+static size_t find_newline(const char *z, size_t i, size_t n) {
+    const char *p = memchr(z + i, '\n', n - i);
+    return p ? (size_t)(p - z) : n;
+}
+
+// 从 z[i..e) 中取出下一个以空白分隔的元素
+static size_t next_token(const char *z, size_t i, size_t e, http_slice *pOut) {
+    while (i < e && IS_SPACE(z[i])) i++;
+    size_t s = i;
+    while (i < e && !IS_SPACE(z[i])) i++;
+    pOut->off = (uint32_t)s;
+    pOut->len = (uint32_t)(i - s);
+    return i;
+}
+
+int http_parse_request(const char *zBuf, size_t nBuf, http_request *pReq) {
+
+    size_t i = 0, e;
+
+    pReq->nHeader = 0;
+
+    // 跳过请求行之前的空行（RFC 7230 3.5：上一个请求体后面可能多出一个 CRLF）
+    while (i < nBuf && (zBuf[i] == '\r' || zBuf[i] == '\n')) i++;
+    pReq->nSkip = (uint32_t)i;
+
+    // 请求行：METHOD URI PROTOCOL
+    e = find_newline(zBuf, i, nBuf);
+    if (e == nBuf) return HTTP_PARSE_INCOMPLETE;
+    pReq->nLine = (uint32_t)(e + 1 - i);
+    if (e > i && zBuf[e - 1] == '\r') e--;
+    i = next_token(zBuf, i, e, &pReq->method);
+    i = next_token(zBuf, i, e, &pReq->uri);
+    next_token(zBuf, i, e, &pReq->protocol);
+    if (pReq->method.len == 0) return HTTP_PARSE_ERROR;
+    i = pReq->nSkip + pReq->nLine;
+
+    // 头部字段，直到空行
+    for (;;) {
+        e = find_newline(zBuf, i, nBuf);
+        if (e == nBuf) return HTTP_PARSE_INCOMPLETE;
+        size_t next = e + 1;
+        if (e > i && zBuf[e - 1] == '\r') e--;
+        if (e == i) {
+            pReq->nHead = (uint32_t)next;
+            return (int)next;
+        }
+
+        // 字段名到冒号为止；续行（以空白开头）和没有冒号的行都忽略
+        size_t c = i;
+        while (c < e && zBuf[c] != ':' && !IS_SPACE(zBuf[c])) c++;
+        if (c < e && zBuf[c] == ':' && c > i) {
+            http_hdr_id id = http_header_lookup(zBuf + i, c - i);
+            if (id != HTTP_HDR_UNKNOWN) {
+                if (pReq->nHeader >= HTTP_MAX_HEADERS) return HTTP_PARSE_ERROR;
+                size_t v = c + 1, ve = e;
+                while (v < ve && IS_SPACE(zBuf[v])) v++;
+                while (ve > v && IS_SPACE(zBuf[ve - 1])) ve--;
+                http_header *h = &pReq->aHeader[pReq->nHeader++];
+                h->id = id;
+                h->value.off = (uint32_t)v;
+                h->value.len = (uint32_t)(ve - v);
+            }
+        }
+        i = next;
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * HTTP Request Parser - Header
+ *
+ * 零拷贝的 HTTP/1.x 请求头解析器：请求头整体读入一个连接缓冲后再解析，
+ * 解析结果只记录各字段在缓冲中的位置（偏移 + 长度），不复制数据、不分配内存
+ */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 缓冲中的一个片段（相对于缓冲起始位置）
+ */
+typedef struct http_slice {
+    uint32_t            off;        /* 起始偏移 */
+    uint32_t            len;        /* 长度（不含结尾的 \r\n） */
+} http_slice;
+
+/**
+ * 需要识别的请求头字段，其它字段在解析时直接跳过
+ */
+typedef enum http_hdr_id {
+    HTTP_HDR_UNKNOWN = 0,
+    HTTP_HDR_USER_AGENT,
+    HTTP_HDR_ACCEPT,
+    HTTP_HDR_ACCEPT_ENCODING,
+    HTTP_HDR_CONTENT_LENGTH,
+    HTTP_HDR_CONTENT_TYPE,
+    HTTP_HDR_REFERER,
+    HTTP_HDR_COOKIE,
+    HTTP_HDR_CONNECTION,
+    HTTP_HDR_HOST,
+    HTTP_HDR_AUTHORIZATION,
+    HTTP_HDR_IF_NONE_MATCH,
+    HTTP_HDR_IF_MODIFIED_SINCE,
+    HTTP_HDR_RANGE,
+    HTTP_HDR_TRANSFER_ENCODING,
+    HTTP_HDR_EXPECT,
+    HTTP_HDR_IF_RANGE,
+    HTTP_HDR_UPGRADE,
+    HTTP_HDR_HTTP2_SETTINGS,
+    HTTP_HDR__COUNT
+} http_hdr_id;
+
+#define HTTP_MAX_HEADERS    64      /* 单个请求中最多记录的（已识别的）头部字段数 */
+
+/**
+ * 一个已识别的头部字段
+ */
+typedef struct http_header {
+    http_hdr_id         id;
+    http_slice          value;      /* 字段值（已去掉首尾空白） */
+} http_header;
+
+/**
+ * 请求头的解析结果
+ *
+ * 同一字段出现多次时（比如 Cookie），aHeader 中按出现顺序保留每一项
+ */
+typedef struct http_request {
+    http_slice          method;     /* 请求方法：GET、POST、SQTP-SELECT 等 */
+    http_slice          uri;        /* 请求的 URI（含查询字符串） */
+    http_slice          protocol;   /* 协议版本：HTTP/1.1 等，可能为空 */
+    uint32_t            nSkip;      /* 请求行之前被跳过的空行长度 */
+    uint32_t            nLine;      /* 请求行的长度（含换行） */
+    uint32_t            nHead;      /* 整个请求头的长度（含结尾空行），即请求体（或下一个请求）的起始偏移 */
+    int                 nHeader;
+    http_header         aHeader[HTTP_MAX_HEADERS];
+} http_request;
+
+#define HTTP_PARSE_INCOMPLETE   0   /* 请求头尚未完整到达 */
+#define HTTP_PARSE_ERROR        (-1)/* 请求头格式错误（或已识别的字段过多） */
+
+/**
+ * 解析 zBuf[0..nBuf) 中的请求头
+ *
+ * @return > 0: 请求头完整，返回请求头的长度（同 pReq->nHead）
+ *         HTTP_PARSE_INCOMPLETE: 需要读入更多数据后重新解析
+ *         HTTP_PARSE_ERROR: 格式错误
+ */
+int http_parse_request(const char *zBuf, size_t nBuf, http_request *pReq);
+
+/**
+ * 通过完美哈希查找头部字段名（不区分大小写），未识别的字段返回 HTTP_HDR_UNKNOWN
+ */
+http_hdr_id http_header_lookup(const char *zName, size_t nName);
+
+/**
+ * 返回已识别字段的规范名称（用于调试输出）
+ */
+const char *http_header_name(http_hdr_id id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_PARSER_H */
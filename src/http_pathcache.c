@@ -0,0 +1,132 @@
+/*
+ * Path Resolution Cache - Implementation
+ *
+ * 开放寻址的哈希表，每个键最多探测 PATH_CACHE_PROBE 个相邻的槽位，没有空位时替换其中最旧的一项
+ */
+
+#include "http_pathcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PATH_CACHE_KEY          512     /* 键（虚拟主机目录 + \0 + URI）的最大长度 */
+#define PATH_CACHE_PROBE        4       /* 每个键探测的槽位数 */
+
+#ifdef __APPLE__
+#define ST_MTIM(st)     ((st).st_mtimespec)
+#define ST_CTIM(st)     ((st).st_ctimespec)
+#else
+#define ST_MTIM(st)     ((st).st_mtim)
+#define ST_CTIM(st)     ((st).st_ctim)
+#endif
+
+typedef struct path_cache_entry {
+    uint32_t            seq;            /* 序号锁：奇数表示正在写入，0 表示空槽位 */
+    uint64_t            hash;
+    char                zKey[PATH_CACHE_KEY];
+    path_cache_val      val;
+} path_cache_entry;
+
+static path_cache_entry*    s_aEntry = NULL;    // 共享内存中的哈希表
+static unsigned             s_mask = 0;         // 槽位数 - 1（槽位数为 2 的幂）
+
+int path_cache_init(unsigned nEntry) {
+
+    unsigned n = 1;
+    while (n < nEntry) n <<= 1;
+
+    void *p = mmap(0, sizeof(path_cache_entry) * n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_aEntry = (path_cache_entry*)p;
+    s_mask = n - 1;
+    return 0;
+}
+
+// FNV-1a
+static uint64_t key_hash(const char *zVhost, const char *zUri) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *z = (const unsigned char *)zVhost; *z; z++) h = (h ^ *z) * 0x100000001b3ULL;
+    h = (h ^ 0) * 0x100000001b3ULL;
+    for (const unsigned char *z = (const unsigned char *)zUri; *z; z++) h = (h ^ *z) * 0x100000001b3ULL;
+    return h | 1;                       // 0 留给空槽位
+}
+
+static bool ts_equal(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+bool path_cache_get(const char *zVhost, const char *zUri, path_cache_val *pVal) {
+
+    if (s_aEntry == NULL) return false;
+    size_t nVhost = strlen(zVhost), nUri = strlen(zUri);
+    if (nVhost + 1 + nUri + 1 > PATH_CACHE_KEY) return false;
+
+    uint64_t h = key_hash(zVhost, zUri);
+    for (unsigned k = 0; k < PATH_CACHE_PROBE; k++) {
+        path_cache_entry *e = &s_aEntry[(h + k) & s_mask];
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || (seq & 1)) continue;
+        if (e->hash != h
+            || memcmp(e->zKey, zVhost, nVhost + 1) != 0
+            || memcmp(e->zKey + nVhost + 1, zUri, nUri + 1) != 0) continue;
+        memcpy(pVal, &e->val, sizeof(*pVal));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) return false;   // 读取期间被其它进程改写
+        goto found;
+    }
+    return false;
+
+found:
+    if (time(NULL) - pVal->tStored > PATH_CACHE_TTL) return false;
+    if (pVal->kind == PATH_CACHE_FILE && pVal->bBuildin) return true;   // buildins 的内容不会改变
+
+    struct stat st;
+    if (pVal->kind == PATH_CACHE_FILE) {
+        char zFile[sizeof(pVal->zHome) + sizeof(pVal->zRealScript)];
+        snprintf(zFile, sizeof(zFile), "%s%s", pVal->zHome, pVal->zRealScript);
+        if (stat(zFile, &st) != 0
+            || st.st_ino != pVal->st.st_ino
+            || st.st_size != pVal->st.st_size
+            || !ts_equal(ST_MTIM(st), ST_MTIM(pVal->st))
+            || !ts_equal(ST_CTIM(st), ST_CTIM(pVal->st))) return false;     // ctime 也会随权限的修改而改变
+        pVal->st = st;
+    }
+    if (stat(pVal->zDir, &st) != 0 || !ts_equal(ST_MTIM(st), pVal->tmDir)) return false;
+    return true;
+}
+
+void path_cache_put(const char *zVhost, const char *zUri, path_cache_val *pVal) {
+
+    if (s_aEntry == NULL) return;
+    size_t nVhost = strlen(zVhost), nUri = strlen(zUri);
+    if (nVhost + 1 + nUri + 1 > PATH_CACHE_KEY) return;
+
+    pVal->tStored = time(NULL);
+    if (!(pVal->kind == PATH_CACHE_FILE && pVal->bBuildin)) {
+        struct stat st;
+        if (stat(pVal->zDir, &st) != 0) return;
+        pVal->tmDir = ST_MTIM(st);
+    }
+
+    // 在探测范围内选择槽位：同一个键的旧项，或者空槽位，或者最旧的一项
+    uint64_t h = key_hash(zVhost, zUri);
+    path_cache_entry *pSlot = NULL;
+    for (unsigned k = 0; k < PATH_CACHE_PROBE; k++) {
+        path_cache_entry *e = &s_aEntry[(h + k) & s_mask];
+        if (e->hash == h) { pSlot = e; break; }
+        if (e->seq == 0) { pSlot = e; break; }
+        if (pSlot == NULL || e->val.tStored < pSlot->val.tStored) pSlot = e;
+    }
+
+    // 获取写锁（序号变为奇数），其它进程正在写入同一槽位时放弃
+    uint32_t seq = __atomic_load_n(&pSlot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return;
+    if (!__atomic_compare_exchange_n(&pSlot->seq, &seq, seq + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+
+    pSlot->hash = h;
+    memcpy(pSlot->zKey, zVhost, nVhost + 1);
+    memcpy(pSlot->zKey + nVhost + 1, zUri, nUri + 1);
+    memcpy(&pSlot->val, pVal, sizeof(*pVal));
+
+    __atomic_store_n(&pSlot->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,79 @@
+/*
+ * Path Resolution Cache - Header
+ *
+ * 请求路径解析结果的共享内存缓存：以（虚拟主机目录, URI）为键，保存 ProcessOneRequest() 逐段解析 URI 得到的结果
+ * （实际脚本路径、PATH_INFO 位置、文件 stat、MIME 类型、目录中是否有 -auth 文件），找不到的路径也会缓存（负缓存）
+ *
+ * 缓存位于 fork 之前创建的匿名共享内存中，所有 worker（子进程）共享。每一项使用序号锁（seqlock）保护：
+ * 写入时序号为奇数，读取时复制整项后再次检查序号，不需要跨进程的锁
+ *
+ * 缓存项通过修改时间校验：命中时重新 stat() 目标文件（文件系统中的文件）和所在目录，
+ * 和缓存时记录的 inode、大小、修改时间不一致就视为失效；另外超过 PATH_CACHE_TTL 秒的项也视为失效，
+ * 以覆盖不会改变这两者修改时间的情况（比如新建了 <host>.website 目录）
+ */
+
+#ifndef HTTP_PATHCACHE_H
+#define HTTP_PATHCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PATH_CACHE_TTL          10      /* 缓存项的最长有效时间（秒） */
+
+/**
+ * 解析结果的类型
+ */
+typedef enum path_cache_kind {
+    PATH_CACHE_FILE = 1,                /* 找到了文件（buildins 或文件系统中） */
+    PATH_CACHE_NOT_FOUND,               /* 路径不存在，且没有可用的 not-found.html */
+    PATH_CACHE_NO_INDEX,                /* 路径是目录，但没有索引文件 */
+} path_cache_kind;
+
+/**
+ * 一个路径的解析结果
+ */
+typedef struct path_cache_val {
+    uint8_t             kind;           /* path_cache_kind */
+    uint8_t             bBuildin;       /* 文件位于 buildins 中（不需要校验） */
+    uint8_t             bAuth;          /* 文件所在目录中有可读的 -auth 文件 */
+    uint16_t            iPathInfo;      /* PATH_INFO 在 URI 中的起始位置 */
+    const void*         pMime;          /* MIME 表项（fork 出的进程共享同一个映像，指针在所有 worker 中有效） */
+    time_t              tStored;        /* 缓存的时间 */
+    struct stat         st;             /* 文件的 stat()（文件系统中的文件） */
+    struct timespec     tmDir;          /* zDir 的修改时间 */
+    char                zHome[256];     /* 虚拟主机的根目录 */
+    char                zRealScript[512];   /* 实际文件相对于 zHome 的路径（以 / 开头） */
+    char                zDir[512];      /* 校验用的目录：文件所在目录，或不存在的路径最近的上级目录 */
+} path_cache_val;
+
+/**
+ * 创建可容纳 nEntry 项的共享缓存，必须在 fork worker 之前调用
+ *
+ * @return 0: 成功；-1: 分配共享内存失败（此时缓存不可用，查找总是不命中）
+ */
+int path_cache_init(unsigned nEntry);
+
+/**
+ * 查找并校验（zVhost, zUri）的解析结果，命中时复制到 *pVal
+ * + 文件系统中的文件命中时，pVal->st 会更新为本次 stat() 的结果
+ */
+bool path_cache_get(const char *zVhost, const char *zUri, path_cache_val *pVal);
+
+/**
+ * 保存（zVhost, zUri）的解析结果。键或路径过长时不缓存
+ * + 调用者需要填写 kind、bBuildin、bAuth、iPathInfo、pMime、st（文件系统中的文件）、zHome、zRealScript、zDir，
+ *   其余字段（tStored、tmDir）在这里填写
+ */
+void path_cache_put(const char *zVhost, const char *zUri, path_cache_val *pVal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_PATHCACHE_H */
@@ -0,0 +1,322 @@
+/*
+ * Scoreboard - Implementation
+ */
+
+#include "http_scoreboard.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SB_MAX_SLOTS            16384   /* 记分板的最大位置数 */
+#define SB_ROW_MAX              2048    /* 一项输出的最大长度 */
+
+typedef struct sb_slot {
+    int32_t             pid;            /* 占用该位置的进程，0 表示空闲 */
+    int32_t             ppid;           /* 父进程（CGI 子进程据此对应到请求处理进程） */
+    uint8_t             kind;
+    uint8_t             state;
+    uint16_t            reserved;
+    uint32_t            nRequest;       /* 该进程已开始处理的请求数 */
+    int64_t             tStart;         /* 当前请求开始的时间（微秒，CLOCK_REALTIME） */
+    int64_t             tState;         /* 进入当前状态的时间 */
+    uint64_t            nOut;           /* 当前请求已发送的字节数 */
+    char                zMethod[16];
+    char                zClient[48];
+    char                zUri[160];
+} sb_slot;
+
+typedef struct sb_board {
+    int32_t             nSlots;
+    int32_t             nChildren;      /* 每连接 fork 模式：当前的请求处理子进程数，-1 表示 prefork 模式 */
+    int32_t             nMaxChildren;
+    int32_t             bStalled;
+    int64_t             tStalled;       /* 主进程开始阻塞的时间 */
+    uint64_t            nStalls;        /* 主进程阻塞的次数 */
+    int64_t             tStart;         /* 服务器启动的时间 */
+    sb_slot             aSlot[];
+} sb_board;
+
+static sb_board*        s_pBoard = NULL;
+static sb_slot*         s_pSlot = NULL;     // 当前进程占用的位置（fork 之后指向父进程的位置，直到 scoreboard_claim()）
+
+static const char *const s_azKind[SB_KIND_N] = {
+    "connection", "worker", "handoff", "h2_stream", "cgi"
+};
+static const char *const s_azState[SB_STATE_N] = {
+    "idle", "reading", "keepalive", "resolving", "compiling", "running", "writing", "h2"
+};
+static const char s_zStateChar[SB_STATE_N + 1] = "_RKPCXWH";
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 复制字符串，截断在 n - 1 个字节
+static void copy_str(char *zDst, const char *zSrc, size_t n) {
+    size_t i = 0;
+    if (zSrc) for (; i < n - 1 && zSrc[i]; i++) zDst[i] = zSrc[i];
+    zDst[i] = 0;
+}
+
+// 进程是否仍然存在（EPERM 表示存在但属于其它用户）
+static bool pid_alive(pid_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// 进程正常退出时归还位置（atexit，fork 出的子进程都会继承，只归还自己占用的位置）
+static void sb_exit(void) {
+    if (s_pSlot && s_pSlot->pid == (int32_t)getpid()) __atomic_store_n(&s_pSlot->pid, 0, __ATOMIC_RELEASE);
+}
+
+int scoreboard_init(int nSlots) {
+
+    if (nSlots < 16) nSlots = 16;
+    if (nSlots > SB_MAX_SLOTS) nSlots = SB_MAX_SLOTS;
+    size_t n = sizeof(sb_board) + (size_t)nSlots * sizeof(sb_slot);
+    void *p = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    s_pBoard = (sb_board*)p;
+    memset(s_pBoard, 0, n);
+    s_pBoard->nSlots = nSlots;
+    s_pBoard->nChildren = -1;
+    s_pBoard->tStart = now_us();
+    atexit(sb_exit);
+    return 0;
+}
+
+bool scoreboard_enabled(void) {
+    return s_pBoard != NULL;
+}
+
+void scoreboard_claim(int iKind) {
+
+    if (s_pBoard == NULL) return;
+    sb_slot *pParent = s_pSlot;
+    int32_t pid = (int32_t)getpid(), n = s_pBoard->nSlots;
+    s_pSlot = NULL;
+
+    // 从 pid 决定的位置开始找空闲的位置，找不到时再找已经不存在的进程留下的位置
+    for (int pass = 0; pass < 2 && s_pSlot == NULL; pass++) {
+        for (int i = 0; i < n; i++) {
+            sb_slot *p = &s_pBoard->aSlot[(pid + i) % n];
+            int32_t old = __atomic_load_n(&p->pid, __ATOMIC_RELAXED);
+            if (pass == 0 ? old != 0 : (old == 0 || pid_alive(old))) continue;
+            if (__atomic_compare_exchange_n(&p->pid, &old, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                s_pSlot = p;
+                break;
+            }
+        }
+    }
+    if (s_pSlot == NULL) return;
+
+    s_pSlot->ppid = (int32_t)getppid();
+    s_pSlot->kind = (uint8_t)iKind;
+    s_pSlot->nRequest = 0;
+    s_pSlot->tState = now_us();
+    if (pParent && iKind != SB_KIND_CONNECTION && iKind != SB_KIND_WORKER) {
+        // 继续显示父进程的请求：事件循环转交的子进程接着处理该请求，HTTP/2 的流处理进程随后会开始自己的请求
+        s_pSlot->state = iKind == SB_KIND_CGI ? SB_RUN : pParent->state;
+        s_pSlot->tStart = pParent->tStart;
+        s_pSlot->nOut = 0;
+        memcpy(s_pSlot->zMethod, pParent->zMethod, sizeof(s_pSlot->zMethod));
+        memcpy(s_pSlot->zClient, pParent->zClient, sizeof(s_pSlot->zClient));
+        memcpy(s_pSlot->zUri, pParent->zUri, sizeof(s_pSlot->zUri));
+        s_pSlot->zMethod[sizeof(s_pSlot->zMethod) - 1] = 0;
+        s_pSlot->zClient[sizeof(s_pSlot->zClient) - 1] = 0;
+        s_pSlot->zUri[sizeof(s_pSlot->zUri) - 1] = 0;
+    } else {
+        s_pSlot->state = SB_IDLE;
+        s_pSlot->tStart = 0;
+        s_pSlot->nOut = 0;
+        s_pSlot->zMethod[0] = s_pSlot->zClient[0] = s_pSlot->zUri[0] = 0;
+    }
+}
+
+void scoreboard_request(const char *zMethod, const char *zUri, const char *zClient) {
+    if (s_pSlot == NULL) return;
+    s_pSlot->nRequest++;
+    s_pSlot->tStart = s_pSlot->tState = now_us();
+    s_pSlot->nOut = 0;
+    s_pSlot->state = SB_RESOLVE;
+    copy_str(s_pSlot->zMethod, zMethod, sizeof(s_pSlot->zMethod));
+    copy_str(s_pSlot->zClient, zClient, sizeof(s_pSlot->zClient));
+    copy_str(s_pSlot->zUri, zUri, sizeof(s_pSlot->zUri));
+}
+
+void scoreboard_state(int iState) {
+    if (s_pSlot == NULL || s_pSlot->state == iState) return;
+    s_pSlot->state = (uint8_t)iState;
+    s_pSlot->tState = now_us();
+}
+
+void scoreboard_sent(uint64_t nOut) {
+    if (s_pSlot) s_pSlot->nOut = nOut;
+}
+
+void scoreboard_reap(pid_t pid) {
+    if (s_pBoard == NULL) return;
+    for (int i = 0; i < s_pBoard->nSlots; i++) {
+        int32_t old = (int32_t)pid;
+        if (__atomic_load_n(&s_pBoard->aSlot[i].pid, __ATOMIC_RELAXED) != old) continue;
+        __atomic_compare_exchange_n(&s_pBoard->aSlot[i].pid, &old, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        break;
+    }
+}
+
+void scoreboard_master(int nChildren, int nMaxChildren, bool bStalled) {
+    if (s_pBoard == NULL) return;
+    s_pBoard->nChildren = nChildren;
+    s_pBoard->nMaxChildren = nMaxChildren;
+    if (bStalled && !s_pBoard->bStalled) {
+        s_pBoard->tStalled = now_us();
+        s_pBoard->nStalls++;
+    }
+    s_pBoard->bStalled = bStalled;
+}
+
+typedef struct out_buf {
+    char*               z;
+    size_t              n;
+    size_t              nAlloc;
+} out_buf;
+
+// 追加格式化的内容，放不下时截断（调用者预留结尾需要的空间）
+static void out(out_buf *p, const char *zFormat, ...) {
+    va_list ap;
+    if (p->n + 1 >= p->nAlloc) return;
+    va_start(ap, zFormat);
+    int n = vsnprintf(p->z + p->n, p->nAlloc - p->n, zFormat, ap);
+    va_end(ap);
+    if (n < 0) return;
+    p->n += (size_t)n < p->nAlloc - p->n ? (size_t)n : p->nAlloc - p->n - 1;
+}
+
+// 追加转义后的字符串（HTML 或 JSON 字符串的内容）
+static void out_esc(out_buf *p, const char *z, bool bJson) {
+    for (; *z && p->n + 8 < p->nAlloc; z++) {
+        unsigned char c = (unsigned char)*z;
+        if (bJson) {
+            if (c == '"' || c == '\\') out(p, "\\%c", c);
+            else if (c < 0x20) out(p, "\\u%04x", c);
+            else p->z[p->n++] = (char)c;
+        } else {
+            if (c == '<') out(p, "&lt;");
+            else if (c == '>') out(p, "&gt;");
+            else if (c == '&') out(p, "&amp;");
+            else if (c == '"') out(p, "&quot;");
+            else p->z[p->n++] = (char)c;
+        }
+    }
+    p->z[p->n] = 0;
+}
+
+// 一项的输出（先复制位置的内容，输出过程中它仍在变化）
+static void out_slot(out_buf *p, const sb_slot *pSrc, int64_t tNow, bool bJson) {
+    sb_slot s = *pSrc;
+    s.zMethod[sizeof(s.zMethod) - 1] = s.zClient[sizeof(s.zClient) - 1] = s.zUri[sizeof(s.zUri) - 1] = 0;
+    int iState = s.state < SB_STATE_N ? s.state : SB_IDLE;
+    const char *zKind = s.kind < SB_KIND_N ? s_azKind[s.kind] : "?";
+    double rAge = s.tStart ? (double)(tNow - s.tStart) / 1e6 : 0;
+    double rState = (double)(tNow - s.tState) / 1e6;
+
+    if (bJson) {
+        out(p, "{\"pid\":%d,\"ppid\":%d,\"kind\":\"%s\",\"state\":\"%s\",\"state_seconds\":%.3f,\"requests\":%u,",
+            s.pid, s.ppid, zKind, s_azState[iState], rState, s.nRequest);
+        out(p, "\"method\":\"");
+        out_esc(p, s.zMethod, true);
+        out(p, "\",\"uri\":\"");
+        out_esc(p, s.zUri, true);
+        out(p, "\",\"client\":\"");
+        out_esc(p, s.zClient, true);
+        out(p, "\",\"request_seconds\":%.3f,\"sent_bytes\":%llu}", rAge, (unsigned long long)s.nOut);
+    } else {
+        out(p, "<tr><td>%d</td><td>%d</td><td>%s</td><td>%c %s</td><td>%.1f</td><td>%u</td><td>",
+            s.pid, s.ppid, zKind, s_zStateChar[iState], s_azState[iState], rState, s.nRequest);
+        out_esc(p, s.zMethod, false);
+        out(p, "</td><td>");
+        out_esc(p, s.zUri, false);
+        out(p, "</td><td>");
+        out_esc(p, s.zClient, false);
+        if (s.tStart) out(p, "</td><td>%.3f</td><td>%llu</td></tr>\n", rAge, (unsigned long long)s.nOut);
+        else out(p, "</td><td></td><td></td></tr>\n");
+    }
+}
+
+size_t scoreboard_format(char *zBuf, size_t nBuf, bool bJson) {
+    out_buf o = { zBuf, 0, nBuf > 64 ? nBuf - 64 : 0 };   // 预留结尾的空间
+    char zMap[SB_MAX_SLOTS + 1];
+    int aCount[SB_STATE_N] = {0}, nProc = 0;
+    int64_t tNow = now_us();
+
+    if (nBuf) zBuf[0] = 0;
+    if (s_pBoard == NULL || nBuf <= 64) return 0;
+
+    // 记分板字符串：每个存活的进程一个字符
+    for (int i = 0; i < s_pBoard->nSlots; i++) {
+        const sb_slot *p = &s_pBoard->aSlot[i];
+        int32_t pid = __atomic_load_n(&p->pid, __ATOMIC_ACQUIRE);
+        if (pid == 0 || !pid_alive(pid)) continue;
+        int iState = p->state < SB_STATE_N ? p->state : SB_IDLE;
+        zMap[nProc++] = s_zStateChar[iState];
+        aCount[iState]++;
+    }
+    zMap[nProc] = 0;
+
+    if (bJson) {
+        out(&o, "{\"time\":%.3f,\"uptime_seconds\":%.0f,", (double)tNow / 1e6, (double)(tNow - s_pBoard->tStart) / 1e6);
+        if (s_pBoard->nChildren >= 0) {
+            out(&o, "\"master\":{\"children\":%d,\"max_children\":%d,\"stalled\":%s,\"stalled_seconds\":%.3f,\"stalls\":%llu},",
+                s_pBoard->nChildren, s_pBoard->nMaxChildren, s_pBoard->bStalled ? "true" : "false",
+                s_pBoard->bStalled ? (double)(tNow - s_pBoard->tStalled) / 1e6 : 0.0,
+                (unsigned long long)s_pBoard->nStalls);
+        }
+        out(&o, "\"scoreboard\":\"%s\",\"states\":{", zMap);
+        for (int k = 0; k < SB_STATE_N; k++) out(&o, "%s\"%s\":%d", k ? "," : "", s_azState[k], aCount[k]);
+        out(&o, "},\"processes\":[");
+    } else {
+        out(&o, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>wpp status</title>\n"
+                "<style>body{font-family:sans-serif}table{border-collapse:collapse}"
+                "td,th{border:1px solid #ccc;padding:2px 6px;font-size:90%%}td:nth-child(8){max-width:40em;word-break:break-all}</style>\n"
+                "</head><body>\n<h1>wpp status</h1>\n<p>Uptime: %.0f s</p>\n", (double)(tNow - s_pBoard->tStart) / 1e6);
+        if (s_pBoard->nChildren >= 0) {
+            out(&o, "<p>Connection processes: %d / %d", s_pBoard->nChildren, s_pBoard->nMaxChildren);
+            if (s_pBoard->bStalled)
+                out(&o, " &mdash; <b>limit reached, master blocked in wait() for %.1f s</b>",
+                    (double)(tNow - s_pBoard->tStalled) / 1e6);
+            out(&o, " (stalled %llu times)</p>\n", (unsigned long long)s_pBoard->nStalls);
+        }
+        out(&o, "<p>Scoreboard: <code>%s</code></p>\n<p>", zMap);
+        for (int k = 0; k < SB_STATE_N; k++) out(&o, "%c %s: %d&nbsp;&nbsp; ", s_zStateChar[k], s_azState[k], aCount[k]);
+        out(&o, "</p>\n<table>\n<tr><th>PID</th><th>Parent</th><th>Kind</th><th>State</th><th>In state (s)</th>"
+                "<th>Requests</th><th>Method</th><th>URI</th><th>Client</th><th>Request (s)</th><th>Sent</th></tr>\n");
+    }
+
+    // 各个进程：每一项先输出到临时缓冲，放得下才追加，保证输出截断在完整的一项上
+    int nOut = 0;
+    for (int i = 0; i < s_pBoard->nSlots; i++) {
+        const sb_slot *p = &s_pBoard->aSlot[i];
+        int32_t pid = __atomic_load_n(&p->pid, __ATOMIC_ACQUIRE);
+        if (pid == 0 || !pid_alive(pid)) continue;
+        char zRow[SB_ROW_MAX + 2];
+        out_buf r = { zRow, 0, sizeof(zRow) };
+        if (bJson && nOut) out(&r, ",");
+        out_slot(&r, p, tNow, bJson);
+        if (o.n + r.n >= o.nAlloc) break;
+        memcpy(o.z + o.n, zRow, r.n + 1);
+        o.n += r.n;
+        nOut++;
+    }
+
+    o.nAlloc = nBuf;
+    if (bJson) out(&o, "]}\n");
+    else out(&o, "</table>\n</body></html>\n");
+    return o.n;
+}
@@ -0,0 +1,107 @@
+/*
+ * Scoreboard - Header
+ *
+ * 进程记分板：位于所有进程共享的内存中，每个请求处理进程（每连接子进程、prefork worker、事件循环转交的子进程、
+ * HTTP/2 的流处理进程）和 CGI 子进程各占一个位置，记录自己的 PID、状态、当前请求（方法、URI、客户端地址）、
+ * 请求开始的时间和已发送的字节数。/-/status 以 HTML 或 JSON 输出当前所有的进程
+ *
+ * 每个位置只由占用它的进程写入，读取时不加锁：输出时看到的字符串可能正在被改写（截断在缓冲末尾，不会越界），
+ * 对于观察用途足够。进程正常退出时归还位置；异常退出的进程留下的位置在输出时跳过，在没有空闲位置时被重新占用
+ */
+
+#ifndef HTTP_SCOREBOARD_H
+#define HTTP_SCOREBOARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 进程的种类
+ */
+enum {
+    SB_KIND_CONNECTION = 0,             /* 每连接 fork 的请求处理子进程 */
+    SB_KIND_WORKER,                     /* prefork worker */
+    SB_KIND_HANDOFF,                    /* 事件循环把请求交给的子进程 */
+    SB_KIND_H2_STREAM,                  /* HTTP/2 的流处理进程 */
+    SB_KIND_CGI,                        /* CGI / C 脚本子进程 */
+    SB_KIND_N
+};
+
+/**
+ * 进程的状态（括号中是记分板中的字符）
+ */
+enum {
+    SB_IDLE = 0,                        /* (_) 等待新的连接 */
+    SB_READ,                            /* (R) 读取请求头 */
+    SB_KEEPALIVE,                       /* (K) Keep-Alive 连接上等待下一个请求 */
+    SB_RESOLVE,                         /* (P) 解释请求、解析路径 */
+    SB_COMPILE,                         /* (C) 编译 C 脚本 */
+    SB_RUN,                             /* (X) 运行 CGI / C 脚本（请求处理进程：等待 CGI 的输出） */
+    SB_WRITE,                           /* (W) 发送回复 */
+    SB_H2,                              /* (H) HTTP/2 多路复用 */
+    SB_STATE_N
+};
+
+/**
+ * 创建共享的记分板（nSlots 个位置），必须在 fork 任何子进程之前调用
+ *
+ * @return 0: 成功；-1: 分配共享内存失败（此时记分板不可用）
+ */
+int scoreboard_init(int nSlots);
+
+/**
+ * 记分板是否可用
+ */
+bool scoreboard_enabled(void);
+
+/**
+ * 当前进程（刚 fork 出的子进程）占用一个位置
+ * + CGI 子进程、事件循环转交的子进程和 HTTP/2 的流处理进程保留父进程的请求信息，每连接子进程和 worker 从空闲状态开始
+ * + 没有可用的位置时，该进程不出现在记分板中
+ */
+void scoreboard_claim(int iKind);
+
+/**
+ * 当前进程开始处理一个新的请求：记录方法、URI、客户端地址，开始计时，已发送的字节数清零
+ */
+void scoreboard_request(const char *zMethod, const char *zUri, const char *zClient);
+
+/**
+ * 更新当前进程的状态
+ */
+void scoreboard_state(int iState);
+
+/**
+ * 更新当前请求已发送的字节数
+ */
+void scoreboard_sent(uint64_t nOut);
+
+/**
+ * 父进程回收子进程后调用，归还它（异常退出时）没有归还的位置
+ */
+void scoreboard_reap(pid_t pid);
+
+/**
+ * 每连接 fork 模式下，主进程更新子进程数；bStalled 表示子进程数已达上限，主进程阻塞在 wait() 中不再接受新的连接
+ */
+void scoreboard_master(int nChildren, int nMaxChildren, bool bStalled);
+
+/**
+ * 输出记分板
+ *
+ * @param bJson true: JSON；false: HTML
+ * @return 输出的长度（不含结尾的 0）；zBuf 不够大时输出被截断在完整的一项上
+ */
+size_t scoreboard_format(char *zBuf, size_t nBuf, bool bJson);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_SCOREBOARD_H */
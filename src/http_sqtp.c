@@ -38,6 +38,7 @@ typedef struct {
     char* content_type;          // Content-Type header
     char* content_length;        // Content-Length header
     char* view_format;           // X-SQTP-View-Format header
+    char* accept_encoding;       // Accept-Encoding header（结果集的压缩）
     char* on_conflict;           // ON-CONFLICT header (for INSERT)
     
     // DDL headers (for CREATE/DROP/ALTER)
@@ -73,7 +74,6 @@ typedef struct {
 
 // 前向声明
 static void sqtp_parse_headers(sqtp_headers_t* headers);
-static void sqtp_free_headers(sqtp_headers_t* headers);
 static void sqtp_handle_select(sqtp_headers_t* headers);
 static void sqtp_handle_insert(sqtp_headers_t* headers);
 static void sqtp_handle_update(sqtp_headers_t* headers);
@@ -97,8 +97,10 @@ static bool sqtp_database_exists(const char* uri_path);
 
 // 开始 SQTP 响应
 static void sqtp_start_response(const char* status) {
+    httpd_reply_status(status);
     althttpd_printf("%s %s\r\n", zProtocol, status);
     althttpd_printf("X-SQTP-Protocol: SQTP/1.0\r\n");
+    httpd_reply_begin();
 }
 
 // SQTP 主处理函数
@@ -160,9 +162,7 @@ void httpd_sqtp(char* method, char* script, char* protocol, size_t* out) {
     else {
         sqtp_send_error(501, "Unsupported SQTP method");
     }
-    
-    // 释放资源
-    sqtp_free_headers(&headers);
+
     MakeLogEntry(1, 0);
 }
 
@@ -171,19 +171,19 @@ static void sqtp_parse_headers(sqtp_headers_t* headers) {
     char zLine[10000];
     
     // 初始化 DML 数组
-    headers->where_clauses = malloc(sizeof(char*) * 100);  // 最多 100 个 WHERE
-    headers->where_in_clauses = malloc(sizeof(char*) * 100);
+    headers->where_clauses = ReqAlloc(sizeof(char*) * 100);  // 最多 100 个 WHERE
+    headers->where_in_clauses = ReqAlloc(sizeof(char*) * 100);
     headers->where_count = 0;
     headers->where_in_count = 0;
     
     // 初始化 DDL 数组
-    headers->column_defs = malloc(sizeof(char*) * 100);  // 最多 100 个 COLUMN
+    headers->column_defs = ReqAlloc(sizeof(char*) * 100);  // 最多 100 个 COLUMN
     headers->column_def_count = 0;
-    headers->unique_constraints = malloc(sizeof(char*) * 100);
+    headers->unique_constraints = ReqAlloc(sizeof(char*) * 100);
     headers->unique_constraint_count = 0;
-    headers->foreign_keys = malloc(sizeof(char*) * 100);
+    headers->foreign_keys = ReqAlloc(sizeof(char*) * 100);
     headers->foreign_key_count = 0;
-    headers->actions = malloc(sizeof(char*) * 100);  // 最多 100 个 ACTION
+    headers->actions = ReqAlloc(sizeof(char*) * 100);  // 最多 100 个 ACTION
     headers->action_count = 0;
     
     // 读取头部字段
@@ -237,6 +237,9 @@ static void sqtp_parse_headers(sqtp_headers_t* headers) {
         else if (strcasecmp(zFieldName, "X-SQTP-View-Format:") == 0) {
             headers->view_format = StrDup(zVal);
         }
+        else if (strcasecmp(zFieldName, "Accept-Encoding:") == 0) {
+            headers->accept_encoding = StrDup(zVal);
+        }
         else if (strcasecmp(zFieldName, "ON-CONFLICT:") == 0) {
             headers->on_conflict = StrDup(zVal);
         }
@@ -307,75 +310,6 @@ static void sqtp_parse_headers(sqtp_headers_t* headers) {
     }
 }
 
-// 释放 headers 资源
-static void sqtp_free_headers(sqtp_headers_t* headers) {
-    if (headers->table) free(headers->table);
-    if (headers->from) free(headers->from);
-    if (headers->columns) free(headers->columns);
-    if (headers->order_by) free(headers->order_by);
-    if (headers->group_by) free(headers->group_by);
-    if (headers->having) free(headers->having);
-    if (headers->limit) free(headers->limit);
-    if (headers->offset) free(headers->offset);
-    if (headers->join) free(headers->join);
-    if (headers->content_type) free(headers->content_type);
-    if (headers->content_length) free(headers->content_length);
-    if (headers->view_format) free(headers->view_format);
-    if (headers->on_conflict) free(headers->on_conflict);
-    
-    // Free DDL fields
-    if (headers->name) free(headers->name);
-    if (headers->type) free(headers->type);
-    if (headers->if_not_exists) free(headers->if_not_exists);
-    if (headers->if_exists) free(headers->if_exists);
-    if (headers->without_rowid) free(headers->without_rowid);
-    if (headers->unique) free(headers->unique);
-    if (headers->primary_key) free(headers->primary_key);
-    if (headers->not_null) free(headers->not_null);
-    if (headers->autoinc) free(headers->autoinc);
-    
-    for (int i = 0; i < headers->where_count; i++) {
-        if (headers->where_clauses[i]) free(headers->where_clauses[i]);
-    }
-    if (headers->where_clauses) free(headers->where_clauses);
-    
-    for (int i = 0; i < headers->where_in_count; i++) {
-        if (headers->where_in_clauses[i]) free(headers->where_in_clauses[i]);
-    }
-    if (headers->where_in_clauses) free(headers->where_in_clauses);
-    
-    for (int i = 0; i < headers->column_def_count; i++) {
-        if (headers->column_defs[i]) free(headers->column_defs[i]);
-    }
-    if (headers->column_defs) free(headers->column_defs);
-    
-    for (int i = 0; i < headers->unique_constraint_count; i++) {
-        if (headers->unique_constraints[i]) free(headers->unique_constraints[i]);
-    }
-    if (headers->unique_constraints) free(headers->unique_constraints);
-    
-    for (int i = 0; i < headers->foreign_key_count; i++) {
-        if (headers->foreign_keys[i]) free(headers->foreign_keys[i]);
-    }
-    if (headers->foreign_keys) free(headers->foreign_keys);
-    
-    // Free TRIGGER fields
-    if (headers->timing) free(headers->timing);
-    if (headers->event) free(headers->event);
-    if (headers->for_each_row) free(headers->for_each_row);
-    if (headers->when) free(headers->when);
-    if (headers->update_of) free(headers->update_of);
-    
-    for (int i = 0; i < headers->action_count; i++) {
-        if (headers->actions[i]) free(headers->actions[i]);
-    }
-    if (headers->actions) free(headers->actions);
-    
-    // Free ALTER fields
-    if (headers->action) free(headers->action);
-    if (headers->new_name) free(headers->new_name);
-}
-
 // JSON 字符串转义函数 - 转义特殊字符以生成有效的 JSON
 static void sqtp_json_escape(const char* input) {
     if (!input) {
@@ -504,7 +438,8 @@ static void sqtp_handle_select(sqtp_headers_t* headers) {
     
     // 发送响应头
     sqtp_start_response("200 OK");
-    nOut += althttpd_printf("Content-Type: application/json; charset=utf-8\r\n\r\n");
+    nOut += althttpd_printf("Content-Type: application/json; charset=utf-8\r\n");
+    httpd_body_begin("application/json", -1, headers->accept_encoding);    // 结果集的大小未知，客户端接受时压缩
     
     // 输出 JSON 数组开始
     nOut += althttpd_printf("[");
@@ -547,6 +482,7 @@ static void sqtp_handle_select(sqtp_headers_t* headers) {
     }
     
     nOut += althttpd_printf("\n]\n");
+    httpd_body_end();
     
     // 清理
     sqlite3_finalize(stmt);
@@ -562,13 +498,12 @@ static char* sqtp_read_body(const char* content_length_str) {
         return NULL;
     }
     
-    char* body = malloc(content_length + 1);
-    if (!body) return NULL;
+    char* body = ReqAlloc(content_length + 1);      // 请求结束时随请求级内存池一起释放
     
     size_t total_read = 0;
     while (total_read < (size_t)content_length) {
         size_t remaining = content_length - total_read;
-        size_t chunk = fread(body + total_read, 1, remaining, stdin);
+        size_t chunk = althttpd_fread(body + total_read, 1, remaining, stdin);
         if (chunk == 0) break;
         total_read += chunk;
     }
@@ -705,7 +640,6 @@ static void sqtp_handle_insert(sqtp_headers_t* headers) {
     
     // 解析 JSON body
     yyjson_doc* doc = yyjson_read(body, strlen(body), 0);
-    free(body);
     
     if (!doc) {
         sqtp_send_error(400, "Invalid JSON in request body");
@@ -862,7 +796,6 @@ static void sqtp_handle_update(sqtp_headers_t* headers) {
     
     // 解析 JSON body
     yyjson_doc* doc = yyjson_read(body, strlen(body), 0);
-    free(body);
     
     if (!doc) {
         sqtp_send_error(400, "Invalid JSON in request body");
@@ -1066,7 +999,6 @@ static void sqtp_handle_upsert(sqtp_headers_t* headers) {
     
     // 解析 JSON body
     yyjson_doc* doc = yyjson_read(body, strlen(body), 0);
-    free(body);
     
     if (!doc) {
         sqtp_send_error(400, "Invalid JSON in request body");
@@ -1190,7 +1122,6 @@ static void sqtp_handle_reset(sqtp_headers_t* headers) {
     
     // 解析 JSON body
     yyjson_doc* doc = yyjson_read(body, strlen(body), 0);
-    free(body);
     
     if (!doc) {
         sqtp_send_error(400, "Invalid JSON in request body");
@@ -0,0 +1,231 @@
+/*
+ * Script Watch - Implementation
+ */
+
+#include "http_watch.h"
+#include "httpd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_SETTLE_MS         200     /* 最后一个事件之后静默这么久再处理 */
+#define WATCH_MAX_DELAY_MS      2000    /* 事件持续不断时，最早的事件最多等待这么久 */
+#define WATCH_MASK              (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+typedef struct watch_pending {
+    char*               zPath;
+    bool                bGone;          /* 脚本（或目录）已被删除或移走 */
+} watch_pending;
+
+static int                      s_fd = -1;
+static char**                   s_aDir = NULL;      /* 以 inotify 的 wd 为下标：监视的目录（相对根目录，根目录为 ""） */
+static int                      s_nDir = 0;
+static int                      s_nDirWatched = 0;
+static watch_pending*           s_aPending = NULL;
+static int                      s_nPending = 0;
+static int                      s_nPendingAlloc = 0;
+
+static bool is_script(const char *zName) {
+    size_t n = strlen(zName);
+    return n > 2 && strcmp(zName + n - 2, ".c") == 0;
+}
+
+static void watch_path(char *zBuf, size_t nBuf, const char *zDir, const char *zName) {
+    if (*zDir) snprintf(zBuf, nBuf, "%s/%s", zDir, zName);
+    else snprintf(zBuf, nBuf, "%s", zName);
+}
+
+// 记录一个待处理的脚本（或目录）：同一路径只保留最后一个事件
+static void watch_pend(const char *zPath, bool bGone) {
+    for (int i = 0; i < s_nPending; i++) {
+        if (strcmp(s_aPending[i].zPath, zPath) == 0) {
+            s_aPending[i].bGone = bGone;
+            return;
+        }
+    }
+    if (s_nPending == s_nPendingAlloc) {
+        int nNew = s_nPendingAlloc ? s_nPendingAlloc * 2 : 64;
+        watch_pending *aNew = realloc(s_aPending, nNew * sizeof(watch_pending));
+        if (!aNew) return;
+        s_aPending = aNew;
+        s_nPendingAlloc = nNew;
+    }
+    if (!(s_aPending[s_nPending].zPath = strdup(zPath))) return;
+    s_aPending[s_nPending++].bGone = bGone;
+}
+
+// 监视目录及其所有子目录，其中的脚本加入待处理列表
+// + 新建或移入的目录中可能在开始监视之前就已经有了文件，所以同样需要扫描
+static void watch_dir(const char *zDir) {
+    char zPath[PATH_MAX];
+    struct stat st;
+    struct dirent *pEntry;
+    int wd = inotify_add_watch(s_fd, *zDir ? zDir : ".", WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        fprintf(stderr, "[watch] cannot watch %s: %s\n", *zDir ? zDir : ".", strerror(errno));
+        return;
+    }
+    if (wd >= s_nDir) {
+        int nNew = wd + 64;
+        char **aNew = realloc(s_aDir, nNew * sizeof(char*));
+        if (!aNew) return;
+        memset(aNew + s_nDir, 0, (nNew - s_nDir) * sizeof(char*));
+        s_aDir = aNew;
+        s_nDir = nNew;
+    }
+    if (!s_aDir[wd]) s_nDirWatched++;
+    free(s_aDir[wd]);
+    s_aDir[wd] = strdup(zDir);
+
+    DIR *d = opendir(*zDir ? zDir : ".");
+    if (!d) return;
+    while ((pEntry = readdir(d)) != NULL) {
+        if (pEntry->d_name[0] == '.') continue;
+        watch_path(zPath, sizeof(zPath), zDir, pEntry->d_name);
+        if (lstat(zPath, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) watch_dir(zPath);
+        else if (S_ISREG(st.st_mode) && is_script(pEntry->d_name)) watch_pend(zPath, false);
+    }
+    closedir(d);
+}
+
+// 目录被移走：停止监视它和它的所有子目录（被删除的目录由内核自动移除，之后收到 IN_IGNORED）
+static void watch_undir(const char *zDir) {
+    size_t n = strlen(zDir);
+    for (int wd = 0; wd < s_nDir; wd++) {
+        const char *z = s_aDir[wd];
+        if (z && strncmp(z, zDir, n) == 0 && (z[n] == 0 || z[n] == '/')) inotify_rm_watch(s_fd, wd);
+    }
+}
+
+// 处理收集到的事件：先编译新的和改变了的脚本，再处理删除和移走的
+// + 改名时同一内容的新路径先登记，删除旧路径时就不会删除仍然需要的目标文件
+static void watch_flush(int *pnCompiled, int *pnFailed) {
+    struct stat st;
+    for (int i = 0; i < s_nPending; i++) {
+        const char *zPath = s_aPending[i].zPath;
+        if (s_aPending[i].bGone) continue;
+        if (stat(zPath, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_mode & 0022) {
+            // 与请求处理时的检查相同：可以被其他用户写的脚本不会被执行
+            fprintf(stderr, "[watch] skip %s: writable by group or others\n", zPath);
+            continue;
+        }
+        int rc = httpd_cgi_c_precompile(zPath);
+        if (rc > 0) (*pnCompiled)++;
+        else if (rc < 0) (*pnFailed)++;
+    }
+    for (int i = 0; i < s_nPending; i++) {
+        if (s_aPending[i].bGone) httpd_cgi_c_forget(s_aPending[i].zPath);
+        free(s_aPending[i].zPath);
+    }
+    s_nPending = 0;
+}
+
+static void watch_event(const struct inotify_event *ev) {
+    char zPath[PATH_MAX];
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // 丢失了事件：重新扫描整个根目录（内容没有改变的脚本不会重新编译）
+        watch_dir("");
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= s_nDir || !s_aDir[ev->wd]) return;
+    if (ev->mask & IN_IGNORED) {
+        free(s_aDir[ev->wd]);
+        s_aDir[ev->wd] = NULL;
+        s_nDirWatched--;
+        return;
+    }
+    if (!ev->len || ev->name[0] == '.') return;
+    watch_path(zPath, sizeof(zPath), s_aDir[ev->wd], ev->name);
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watch_dir(zPath);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            if (ev->mask & IN_MOVED_FROM) watch_undir(zPath);
+            watch_pend(zPath, true);
+        }
+    } else if (is_script(ev->name)) {
+        // 新建的文件等到写完（IN_CLOSE_WRITE）再编译
+        if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)) watch_pend(zPath, false);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) watch_pend(zPath, true);
+    }
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool script_watch_supported(void) {
+    return true;
+}
+
+void script_watch_main(void) {
+    static char zBuf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    pid_t ppid = getppid();
+    long long tFirst = 0;
+    int nCompiled = 0, nFailed = 0;
+
+    s_fd = inotify_init1(IN_CLOEXEC);
+    if (s_fd < 0) {
+        fprintf(stderr, "[watch] inotify_init1() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // 启动时编译所有的脚本（目标文件已经存在的只登记）
+    watch_dir("");
+    int nScripts = s_nPending;
+    watch_flush(&nCompiled, &nFailed);
+    fprintf(stderr, "[watch] watching %d directories, %d scripts (%d compiled, %d failed) (pid %d)\n",
+            s_nDirWatched, nScripts, nCompiled, nFailed, (int)getpid());
+
+    for (;;) {
+        struct pollfd pfd = { s_fd, POLLIN, 0 };
+        int nWait = 1000;
+        if (s_nPending) {
+            nWait = (int)(tFirst + WATCH_MAX_DELAY_MS - now_ms());
+            if (nWait > WATCH_SETTLE_MS) nWait = WATCH_SETTLE_MS;
+            if (nWait < 0) nWait = 0;
+        }
+        int n = poll(&pfd, 1, nWait);
+        if (getppid() != ppid) exit(0);     // 主进程已经退出
+        if (n < 0) continue;
+
+        if (n > 0) {
+            ssize_t nRead = read(s_fd, zBuf, sizeof(zBuf));
+            for (char *p = zBuf; nRead > 0 && p < zBuf + nRead; ) {
+                const struct inotify_event *ev = (const struct inotify_event*)p;
+                if (!s_nPending) tFirst = now_ms();
+                watch_event(ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+            if (!s_nPending || now_ms() - tFirst < WATCH_MAX_DELAY_MS) continue;
+        }
+        if (s_nPending) watch_flush(&nCompiled, &nFailed);
+    }
+}
+
+#else
+
+bool script_watch_supported(void) {
+    return false;
+}
+
+void script_watch_main(void) {
+    exit(0);
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Script Watch - Header
+ *
+ * C 脚本的后台预编译（-W/--watch，仅 Linux）：主进程 fork 出单独的监视进程，以 inotify 监视 Web 根目录下的所有子目录
+ * （包括各虚拟主机的目录）。启动时编译所有的 .c 脚本，之后脚本被创建、修改或者改名移入时重新编译，被删除或移走时
+ * 删除不再需要的目标文件。编译由 httpd_cgi_c_precompile() 完成：结果写入目标文件缓存（-O），请求处理进程第一次
+ * 遇到该脚本时只需加载；编译错误输出到服务器的日志（stderr），部署时就能发现，不必等到第一个请求
+ *
+ * 一次部署通常在很短的时间内产生许多事件（编辑器先截断再写入、复制整个目录），事件先收集起来，
+ * 静默 WATCH_SETTLE_MS 之后再统一处理，每个脚本只编译一次
+ */
+
+#ifndef HTTP_WATCH_H
+#define HTTP_WATCH_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 当前平台是否支持后台预编译（inotify）
+ */
+bool script_watch_supported(void);
+
+/**
+ * 监视进程的主循环，不会返回：父进程（主进程）退出或者收到 SIGTERM 时结束进程
+ * + 在降权之后调用，当前目录是 Web 根目录（chroot 时就是 jail 的根）
+ * + 目录名以 . 开头的子目录（包括目标文件缓存目录）和文件不监视
+ */
+void script_watch_main(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HTTP_WATCH_H */
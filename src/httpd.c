@@ -1,5 +1,16 @@
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sched_setaffinity() 等 Linux 扩展接口 */
+#endif
 #include "httpd.h"
+#include "http_parser.h"
+#include "http_pathcache.h"
+#include "http_filecache.h"
+#include "http_h2.h"
+#include "http_logring.h"
+#include "http_metrics.h"
+#include "http_scoreboard.h"
+#include "http_watch.h"
 
 #include <stdio.h>
 #include <ctype.h>
@@ -12,6 +23,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <stdarg.h>
@@ -21,9 +33,23 @@
 #include <signal.h>
 #include <dirent.h>
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <zlib.h>
 
 #ifdef linux
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#endif
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#  define althttpd_fpurge fpurge
+#else
+#  include <stdio_ext.h>
+#  define althttpd_fpurge __fpurge
 #endif
 
 /*
@@ -35,6 +61,9 @@
 #ifndef MAX_CONTENT_LENGTH
 #define MAX_CONTENT_LENGTH 250000000  /* Max length of HTTP request content */
 #endif
+#ifndef MAX_RANGES
+#define MAX_RANGES 16                 /* 一个 Range 请求中最多的范围数，超过时忽略整个 Range */
+#endif
 #ifndef MAX_CPU
 #define MAX_CPU 30                    /* Max CPU cycles in seconds */
 #endif
@@ -43,6 +72,25 @@
 #define BANISH_TIME 300               /* How long to banish for abuse (sec) */
 #endif
 
+#ifndef EVLOOP_INLINE_MAX
+#define EVLOOP_INLINE_MAX 262144      /* 事件循环中直接发送的静态内容大小上限（回复先完整地写入内存），更大的交给子进程发送 */
+#endif
+#ifndef EVLOOP_SEND_TIMEOUT
+#define EVLOOP_SEND_TIMEOUT 30        /* 事件循环中回复发送没有任何进展（客户端不读取）时关闭连接的超时（秒） */
+#endif
+#ifndef MAX_HEADER_SIZE
+#define MAX_HEADER_SIZE 65536         /* 请求头（请求行 + 所有头部字段）的最大长度 */
+#endif
+#ifndef EVLOOP_IDLE_TIMEOUT
+#define EVLOOP_IDLE_TIMEOUT 60        /* 事件循环中空闲 Keep-Alive 连接的超时（秒） */
+#endif
+#ifndef PARK_IDLE_MS
+#define PARK_IDLE_MS 100              /* Keep-Alive 连接空闲超过该时间（毫秒）后，worker 将其交还主进程托管 */
+#endif
+#ifndef PARK_IDLE_TIMEOUT
+#define PARK_IDLE_TIMEOUT 60          /* 主进程托管的空闲连接的超时（秒） */
+#endif
+
 #ifndef SERVER_SOFTWARE
 #  define SERVER_SOFTWARE "wpp-httpd/1.0"
 #endif
@@ -111,6 +159,18 @@ static int                          g_maxCpu = MAX_CPU;         // 每个进程
 static int                          g_mxChild = 1000;           // 最大子进程数
 static bool                         g_useTimeout = true;        // 是否开启超时限制机制
 static bool                         g_enableSAB = false;        // 允许添加回复头以启用 SharedArrayBuffer
+static int                          g_nWorkers = 0;             // prefork worker 进程数，0 表示使用每连接 fork 的模型
+static int                          g_workerMaxReqs = 10000;    // 每个 worker 最多处理的请求数，超过后退出并由主进程重建，0 表示不限
+static long                         g_workerMaxRssKB = 0;       // 每个 worker 允许的最大常驻内存（KB），超过后退出并由主进程重建，0 表示不限
+static bool                         g_reusePort = false;        // 每个 worker 使用独立的 SO_REUSEPORT 监听套接字，并绑定到一个 CPU 核心
+static bool                         g_evLoop = false;           // worker 以 epoll 事件循环模式运行（静态内容和 buildins 在事件循环中直接处理）
+static bool                         g_parkIdle = false;         // worker 将空闲的 Keep-Alive 连接交还主进程托管，自己继续处理新的连接
+static int                          g_gzipLevel = 0;            // 动态响应（CGI、C 脚本、SQTP）的 gzip 压缩级别，0 表示不压缩
+static size_t                       g_gzipMin = 1024;           // 动态响应体小于该字节数时不压缩
+static bool                         g_h2c = false;              // 接受明文 HTTP/2（prior knowledge 或 Upgrade: h2c）
+static bool                         g_h2Stream = false;         // 当前进程在处理 HTTP/2 连接上的一个流
+static const char*                  g_zGzipTypes =              // 允许压缩的 MIME 类型（逗号分隔，以 / 结尾的项匹配整个大类）
+        "text/,application/json,application/javascript,application/xml,image/svg+xml";
 
 
 static char*                        g_zHttps = 0;               // 作为 CGI 变量：HTTPS
@@ -119,6 +179,7 @@ static char*                        g_zServerSoftware = NULL;   // 当前服务
 
 static char*                        g_zRemoteAddr = NULL;       // 远程请求的IP地址，作为 CGI 变量：REMOTE_ADDR
 static char*                        g_zHttpHost = NULL;         // 来自远程请求的主机名。作为 CGI 变量：HTTP_HOST，并可基于该值实现虚拟主机功能
+static char*                        g_zDefaultHost = NULL;      // 默认主机名（请求中没有 Host 头时 g_zHttpHost 的取值）
                                                                 // + 具体来说就是将 /$HTTP_HOST.website/ 作为站点根目录
 
 static char*                        zHome = NULL;               // 当前请求的站点根目录，基于 HTTP_HOST 请求头（虚拟主机机制）计算得出
@@ -145,6 +206,11 @@ static char*                        zQueryString = NULL;        // zQuerySuffix
 
 static char*                        zPostData = NULL;           // 请求提交（上传）的 POST 数据
 static size_t                       nPostData = 0;              // zPostData 的大小（字节数）
+static bool                         g_postPending = false;      // 请求体还没有从连接中读取（见 ReadPostData()、FeedPostData()）
+static bool                         g_postChunked = false;      // 请求体使用 chunked 传输编码（长度未知）
+static size_t                       g_nPostLen = 0;             // 请求体的长度（Content-Length）
+static bool                         g_expectContinue = false;   // 客户端在等待 100 Continue 之后才发送请求体（Expect: 100-continue）
+static pid_t                        g_postFeeder = 0;           // 把请求体写入 CGI 标准输入的子进程
 
 static char*                        zServerName = NULL;         // 服务器名称，即 http:// 后面的主机名部分
 static char*                        zServerPort = NULL;         // 服务器端口号，即 http://host:port/ 中的 port 部分
@@ -155,6 +221,8 @@ static char*                        zAgent = NULL;              // HTTP 请求
 static char*                        zAccept = NULL;             // HTTP 请求的 Accept 头字段，表示客户端可接受的内容格式
 static char*                        zAcceptEncoding = NULL;     // HTTP 请求的 Accept-Encoding 头字段，表示客户端可接受的内容编码方式。（gzip 或默认）
 static char*                        zContentLength = NULL;      // HTTP 请求的 Content-Length 头字段，表示请求返回的数据长度（字节数）
+static char*                        zTransferEncoding = NULL;   // HTTP 请求的 Transfer-Encoding 头字段，表示请求体的传输编码（只支持 chunked）
+static char*                        zExpect = NULL;             // HTTP 请求的 Expect 头字段（只支持 100-continue）
 static char*                        zContentType = NULL;        // HTTP 请求的 Content-Type 头字段，表示请求返回的数据内容类型
 static char*                        zReferer = NULL;            // HTTP 请求的 Referer 头字段，表示发起请求的来源页面
 static char*                        zCookie = NULL;             // HTTP 请求的 Cookie 头字段，表示随请求发送的 Cookie 信息
@@ -165,8 +233,14 @@ static char*                        zRemoteUser = NULL;         // CGI 变量：
 
 static char*                        zIfNoneMatch = NULL;        // HTTP 请求的 If-None-Match 头字段，表示客户端缓存的资源的 ETag 值
 static char*                        zIfModifiedSince = NULL;    // HTTP 请求的 If-Modified-Since 头字段，表示客户端缓存的资源的最后修改时间
-static ssize_t                      rangeStart = 0;             // HTTP 请求的 Range 头字段的起始字节位置（如果存在 Range 请求）
-static ssize_t                      rangeEnd = 0;               // HTTP 请求的 Range 头字段的结束字节位置（如果存在 Range 请求）
+// Range 请求中的一个字节范围
+typedef struct ByteRange {
+    long long                       iFirst;                     // 起始位置；-1 表示后缀范围（内容的最后 iLast 字节）
+    long long                       iLast;                      // 结束位置（包含）；-1 表示到内容末尾
+} ByteRange;
+static char*                        zIfRange = NULL;            // HTTP 请求的 If-Range 头字段（ETag 或日期），和当前内容不一致时忽略 Range
+static ByteRange                    g_aRange[MAX_RANGES];       // HTTP 请求的 Range 头字段中的字节范围，RangeResolve() 之后为按内容长度计算出的实际范围
+static int                          g_nRange = 0;               // g_aRange 中的范围数，0 表示不是 Range 请求
 
 static char*                        zScgi = NULL;               // 作为 CGI 变量：SCGI。表示当前请求是否为 SCGI 请求
 
@@ -180,6 +254,16 @@ static bool                         closeConnection = false;    // 表示当前
 static struct timeval               beginTime;                  // HTTP 请求处理开始的时间，使用 gettimeofday() 获取
 static struct timespec              tsBeginTime;                // HTTP 请求处理开始的时间，使用 clock_gettime() 获取。
                                                                 // + 使用 ALTHTTPD_CLOCK_ID 定义的时钟获取的，可以是 CLOCK_MONOTONIC 或 CLOCK_REALTIME
+static struct timespec              tsHeadDone;                 // 请求头读取完成的时间（运行统计中请求的处理时间从这里开始计算，不含 Keep-Alive 连接上的等待）
+static int                          g_iHandler = METRICS_OTHER; // 当前请求的处理方式（运行统计按处理方式分类）
+static bool                         g_metricsUri = false;       // 提供 /-/metrics（运行统计）
+static bool                         g_statusUri = false;        // 提供 /-/status（进程记分板）
+static bool                         g_bTiming = false;          // 记录请求各阶段的时间（Server-Timing 头部和日志的附加字段）
+static bool                         g_residentC = false;        // 定义了 handle_request() 的 C 脚本在请求处理进程中直接调用（-R）
+static const char*                  g_zHeaderSnapshot = 0;      // 系统头文件快照的头文件组（-I），进入 jail 之后建立
+static int64_t                      g_aPhaseLocal[HTTPD_PHASE_N];
+static int64_t*                     g_aPhase = g_aPhaseLocal;   // 各阶段结束的时间（相对 tsHeadDone 的微秒数，-1 表示没有经过该阶段）
+static pid_t                        g_phasePid = 0;             // g_aPhase 指向的共享内存所属的进程（CGI 子进程需要写入父进程能看到的位置）
 
 static int                          nRequest = 0;               // 请求统计计数（仅在独立服务器模式下使用）
 static size_t                       nIn = 0;                    // 上行数据量统计（字节数）。包括 HTTP 请求头和请求体的总字节数
@@ -198,6 +282,48 @@ static char                         zExpLogFile[500] = {0};     //* %-扩展后
 static int                          omitLog = 0;                /* Do not make logfile entries if true */
 static int                          inSignalHandler = 0;        /* True if running a signal handler */
 
+static uint32_t                     g_logRingKB = 0;            // 异步访问日志的环形缓冲大小（KB），0 表示每个请求直接写日志文件
+static bool                         g_isLogger = false;         // 当前进程是异步访问日志的日志进程
+static pid_t                        g_logWriter = 0;            // 日志进程的 PID（主进程中使用）
+
+static bool                         g_scriptWatch = false;      // fork 监视进程，在后台预编译 C 脚本（-W）
+static bool                         g_isWatcher = false;        // 当前进程是 C 脚本的监视进程
+static pid_t                        g_scriptWatcher = 0;        // 监视进程的 PID（主进程中使用）
+
+static bool                         g_isWorker = false;         // 当前进程是否为 prefork worker（连接结束时不退出进程，而是返回 accept 循环）
+static sigjmp_buf                   g_workerJmp;                // worker 中 althttpd_exit() 的跳转点，即当前连接的结束位置
+static pid_t                        g_masterPid = 0;            // prefork 主进程的 PID（worker 用来检测主进程是否已退出）
+static int                          g_listener = -1;            // worker 继承的 HTTP 监听套接字
+static int                          g_listenTLS = -1;           // worker 继承的 TLS 监听套接字
+static int                          g_nWorkerReqs = 0;          // 当前 worker 已处理的请求总数
+
+// prefork worker 的统计信息，位于主进程和所有 worker 共享的内存中（每个 worker 槽位一项，worker 重建后继续累计）
+typedef struct WorkerStat {
+    pid_t                           pid;                        // 当前占用该槽位的 worker 进程 PID
+    int                             iCpu;                       // worker 绑定的 CPU 核心，-1 表示未绑定
+    volatile uint64_t               nAccept;                    // 该槽位 accept 的连接总数
+    volatile uint64_t               nRequest;                   // 该槽位处理的请求总数
+    volatile uint64_t               nPark;                      // 该槽位交还主进程托管的空闲连接数
+    volatile int                    bBusy;                      // worker 正在处理请求（读完请求头到写完日志之间）
+} WorkerStat;
+static WorkerStat*                  g_aWorkerStat = NULL;       // 共享的 worker 统计数组（g_nWorkers 项）
+static int                          g_iWorker = -1;             // 当前 worker 的槽位序号
+
+// 连接的输入缓冲：请求头整体读入这里后再解析，头部字段直接引用缓冲中的内容
+// + 随请求头一起读入的请求体、管线化的后续请求也保留在缓冲中，althttpd_fgets/althttpd_fread 都从这里读取
+static char*                        g_zConnIn = NULL;
+static size_t                       g_nConnInAlloc = 0;         // g_zConnIn 的分配大小
+static size_t                       g_iConnIn = 0;              // 下一个未消费字节的位置
+static size_t                       g_nConnIn = 0;              // 缓冲中有效数据的长度
+static bool                         g_evChild = false;          // 当前进程是事件循环 fork 出来接手单个请求的子进程
+static pid_t                        g_evHandOff = 0;            // 事件循环中最近一次接手请求的子进程 PID
+static int                          g_evOutFd = -1;             // 事件循环进程中直接处理请求时的标准输出（memfd），回复由事件循环以非阻塞方式发送
+
+// 空闲连接托管：worker 通过 g_parkSock[1] 将空闲连接（SCM_RIGHTS）交还主进程，主进程在连接有新数据时通过 g_dispatchSock[1] 分派，
+// 由任意一个空闲的 worker 从 g_dispatchSock[0] 接收
+static int                          g_parkSock[2] = {-1, -1};
+static int                          g_dispatchSock[2] = {-1, -1};
+
 /* Forward reference */
 static void Malfunction(int linenum, const char *zFormat, ...);
 
@@ -232,54 +358,21 @@ static struct TlsState {
 };
 
 /*
-** Read a single line of text from the client and stores it in zBuf
-** (which must be at least nBuf bytes long). On error it
-** calls Malfunction().
-**
-** If it reads anything, it returns zBuf.
+** Reads up to nBuf bytes of TLS-decoded bytes from the client and
+** stores them in zBuf. Returns after a single SSL_read(), with however
+** many bytes were available. Fails fatally if SSL_read() fails. Once
+** pServerArg reaches EOF, this function simply returns 0.
 */
-static char *tls_gets(void *pServerArg, char *zBuf, int nBuf) {
-    int n = 0, err = 0;
-    int i;
-    TlsServerConn * const pServer = (TlsServerConn*)pServerArg;
-    if( BIO_eof(pServer->bio) ) return 0;
-    for (i=0; i<nBuf-1; i++) {
-        n = SSL_read(pServer->ssl, &zBuf[i], 1);
-        err = SSL_get_error(pServer->ssl, n);
-        if( err!=0 ){
-            Malfunction(525,"SSL read error.");
-        } 
-        else if( 0==n || zBuf[i]=='\n' ) break;
-    }
-    zBuf[i+1] = 0;
-    return zBuf;
-}
+static size_t tls_read_some(void *pServerArg, void *zBuf, size_t nBuf) {
 
-/*
-** Reads up tp nBuf bytes of TLS-decoded bytes from the client and
-** stores them in zBuf, which must be least nBuf bytes long.  Returns
-** the number of bytes read. Fails fatally if nBuf is "too big" or if
-** SSL_read() fails. Once pServerArg reaches EOF, this function simply
-** returns 0 with no side effects.
-*/
-static size_t tls_read_server(void *pServerArg, void *zBuf, size_t nBuf) {
-    
     TlsServerConn * const pServer = (TlsServerConn*)pServerArg;
-    if (nBuf>0x7fffffff ) {
-        Malfunction(526,"SSL read too big"); /* LOG: SSL read too big */
-    }
+    if (BIO_eof(pServer->bio)) return 0;
+    if (nBuf > 0x7fffffff) nBuf = 0x7fffffff;
 
-    int err = 0; size_t rc = 0;
-    while (0==err && nBuf!=rc && 0==BIO_eof(pServer->bio)) {
-
-        const int n = SSL_read(pServer->ssl, (char*)zBuf + rc, (int)(nBuf - rc));
-        if( n==0 ) break;
-    
-        err = SSL_get_error(pServer->ssl, n);
-        if(0==err) rc += n;
-        else Malfunction(527,"SSL read error."); /* LOG: SSL read error */
-    }
-    return rc;
+    const int n = SSL_read(pServer->ssl, zBuf, (int)nBuf);
+    if (n == 0) return 0;
+    if (SSL_get_error(pServer->ssl, n) != 0) Malfunction(527,"SSL read error.");
+    return (size_t)n;
 }
 
 /*
@@ -333,20 +426,28 @@ static int althttpd_vprintf(char const * fmt, va_list va){
 #define althttpd_vprintf vprintf
 #endif
 
-#ifdef ENABLE_TLS
+// 动态响应体的输出方式（见 httpd_body_begin()）
+#define BODY_DIRECT         0               // 直接输出（响应头部，或者已知长度且不压缩的响应体）
+#define BODY_PENDING        1               // 暂存在缓冲中，还不能确定是否压缩
+#define BODY_GZIP           2               // gzip 压缩
+#define BODY_STREAM         3               // 不压缩，长度未知
+
+static int g_bodyMode = BODY_DIRECT;
+static int BodyVprintf(char const *fmt, va_list va);
+
+// 响应体输出期间（httpd_body_begin() 之后），输出的内容经过压缩和分块编码
 int althttpd_printf(char const * fmt, ...){
   int rc;
   va_list va;
   va_start(va,fmt);
-  rc = althttpd_vprintf(fmt, va);
+  rc = g_bodyMode != BODY_DIRECT ? BodyVprintf(fmt, va) : althttpd_vprintf(fmt, va);
   va_end(va);
   return rc;
 }
+#ifdef ENABLE_TLS
 static void *tls_new_server(int iSocket);
 static void tls_close_server(void *pServerArg);
 static void tls_atexit(void);
-#else
-#define althttpd_printf printf
 #endif
 
 
@@ -357,16 +458,24 @@ static void tls_close_conn(void);
 
 static void althttpd_fflush(FILE *f);
 
+static size_t althttpd_fwrite(void const *src, size_t sz, size_t nmemb, FILE *out);
+
 /*
 ** Flush stdout then exit() with the given result code.  This must
 ** always be used instead of exit() so that a corner case involving
 ** post-exit() signal handling via Timeout() can be accounted for.
 */
+static void PostFeederWait(void);
 static void althttpd_exit(int iErrCode) {
     assert(isExiting == 0);
     isExiting = iErrCode ? iErrCode : 1;
+    // 连接结束之前，请求体需要已经读完（否则关闭套接字时会丢弃未读数据并发送 RST，客户端可能收不到回复）
+    if (g_postFeeder > 0 && inSignalHandler) kill(g_postFeeder, SIGKILL);
+    PostFeederWait();
     althttpd_fflush(stdout);
     tls_close_conn();
+    // prefork worker 中只结束当前连接，返回到 http_worker() 的 accept 循环
+    if (g_isWorker) siglongjmp(g_workerJmp, 1);
     exit(iErrCode);
 }
 
@@ -641,68 +750,45 @@ static char *log_DateTime(
 #endif
 
 /*
-** Make an entry in the log file.  If the HTTP connection should be
-** closed, then terminate this process.  Otherwise return.
-**
-** This routine might be called from a signal handler.  Make sure
-** this routine does not invoke any subroutines that are not signal-safe
-** if the global variable inSignalHandler is set.  Note that fprintf()
-** is not signal-safe on all systems.
+** 一条访问日志记录
+** + 同步写日志时由 LogFormat() 直接格式化；异步写日志时序列化到日志环形缓冲中（LogRecord 中 az 之前的部分，
+**   之后依次是 LOG_STR_N 个以 0 结尾的字符串），由日志进程反序列化、格式化后成批写入日志文件
 */
-void MakeLogEntry(int exitCode, int lineNum) {
-    int logfd;
-    if (zPostData) {
-        if (inSignalHandler == 0) {
-            free(zPostData);
-        }
-        zPostData = 0;
-    }
-    if (g_zLogFile && !omitLog) {
-        struct rusage self, children;
-        int waitStatus;
-        const char *zRM = zRemoteUser ? zRemoteUser : "";
-        const char *zFilename;
+enum {
+    LOG_STR_REMOTE_ADDR, LOG_STR_SCHEME, LOG_STR_HOST, LOG_STR_SCRIPT, LOG_STR_QUERY, LOG_STR_REFERER,
+    LOG_STR_STATUS, LOG_STR_AGENT, LOG_STR_REMOTE_USER, LOG_STR_REAL_SCRIPT, LOG_STR_METHOD, LOG_STR_PROTOCOL,
+    LOG_STR_N
+};
+typedef struct LogRecord {
+    int64_t         tBegin;         // 请求开始的时间（秒），用于 %-扩展日志文件名
+    int64_t         tNow;           // (1) 写日志的时间
+    int64_t         nIn;            // (6)
+    int64_t         nOut;           // (7)
+    int64_t         aMs[5];         // (8)-(12) 耗时（毫秒）
+    int64_t         aPhase[HTTPD_PHASE_N];  // 仅 -t：各阶段结束的时间（微秒），追加在最后
+    int32_t         nRequest;       // (13)
+    int32_t         lineNum;        // (17)
+    int32_t         pid;            // (18) 仅 ALTHTTPD_LOG_PID
+    int32_t         reserved;
+    const char*     az[LOG_STR_N];  // 各个字符串字段
+} LogRecord;
 
-        if (zScript == 0) zScript = "";
-        if (zRealScript == 0) zRealScript = "";
-        if (g_zRemoteAddr == 0) g_zRemoteAddr = "";
-        if (g_zHttpHost == 0) g_zHttpHost = "";
-        if (zReferer == 0) zReferer = "";
-        if (zAgent == 0) zAgent = "";
-        if (zQuerySuffix == 0) zQuerySuffix = "";
-        if (zExpLogFile[0] != 0) {
-            zFilename = zExpLogFile;
-        } else {
-            zFilename = g_zLogFile;
-        }
-        waitpid(-1, &waitStatus, WNOHANG);
-        if (inSignalHandler != 0) {
-            /* getrusage() is not signal-safe, so fall back to 0. */
-            self = priorSelf;
-            children = priorChild;
-        } else {
-            getrusage(RUSAGE_SELF, &self);
-            getrusage(RUSAGE_CHILDREN, &children);
-        }
-        if ((logfd = open(zFilename, O_WRONLY | O_CREAT | O_APPEND, 0640)) > 0) {
-            time_t tNow;              /* current time */
-            struct timespec tsNow;    /* current time (again!) */
-            struct DateTime dt;       /* high-level tNow */
-            char msgbuf[5000];        /* message buffer */
-            const char *const zEnd = &msgbuf[0] + sizeof(msgbuf);
-            char *zPos = &msgbuf[0]; /* current write pos */
-            long long int t;          /* Elapse CGI time */
-            size_t szRS;              /* size of zRealScript */
-            size_t szOther;           /* Size of other components of (16) */
+/*
+** 将日志记录格式化为一行追加到 zPos，空间不足时返回 0，否则返回行尾的位置
+** + 这里和写日志的其它部分一样可能在信号处理函数中执行，只能调用信号安全的函数
+*/
+static char *LogFormat(char *zPos, const char *zEnd, const LogRecord *r) {
+    const char *const *az = r->az;
+    struct DateTime dt;       /* high-level tNow */
+    size_t szRS;              /* size of zRealScript */
+    size_t szOther;           /* Size of other components of (16) */
 
 #define astr(STR) log_str( zPos, zEnd, (STR), &zPos )
 #define acomma astr(",")
 #define astr2(STR) astr( STR ); acomma
 #define aint(N) log_int( zPos, zEnd, (N), 1, &zPos ); acomma
 
-            clock_gettime(ALTHTTPD_CLOCK_ID, &tsNow);
-            time(&tNow);
-            unixToDateTime(tNow, &dt);
+    unixToDateTime((time_t)r->tNow, &dt);
 #ifdef COMBINED_LOG_FORMAT
                                                                                                                                     /* COMBINED_LOG_FORMAT is a log-file format used by some other
       ** web servers.  Support for COMBINED_LOG_FORMAT was added at some
@@ -717,23 +803,23 @@ void MakeLogEntry(int exitCode, int lineNum) {
         char zDate[200];
         DateTime_toTm(&dt, &vTm);
         strftime(zDate, sizeof(zDate), "%d/%b/%Y:%H:%M:%S %Z", &vTm);
-        astr( g_zRemoteAddr );
+        astr( az[LOG_STR_REMOTE_ADDR] );
         astr( " - - [" );
         astr( zDate );
         astr( "] \"" );
-        astr( zMethod );
+        astr( az[LOG_STR_METHOD] );
         astr( " " );
-        astr( zScript );
+        astr( az[LOG_STR_SCRIPT] );
         astr( " " );
-        astr( zProtocol );
+        astr( az[LOG_STR_PROTOCOL] );
         astr( "\" " );
-        astr( zReplyStatus );
+        astr( az[LOG_STR_STATUS] );
         astr( " " );
-        aint( nOut );
+        aint( r->nOut );
         astr( " \"" );
-        astr( zReferer );
+        astr( az[LOG_STR_REFERER] );
         astr( "\" \"" );
-        astr( zAgent );
+        astr( az[LOG_STR_AGENT] );
         astr( "\"\n" );
       }
 #else
@@ -761,95 +847,325 @@ void MakeLogEntry(int exitCode, int lineNum) {
       ** (17) Line number in source file
       */
 #define escstr(X) log_escstr( zPos, zEnd, X, &zPos )
-            /* (1) */ log_DateTime(zPos, zEnd, &dt, &zPos);
-            astr(",");
-            /* (2) */ astr2(g_zRemoteAddr);
-            /* (3) */ astr("\"");
-            astr(g_zHttpScheme);
-            astr("://");
-            escstr(g_zHttpHost);
-            escstr(zScript);
-            escstr(zQuerySuffix);
-            astr2("\"");
-            /* (4) */ astr("\"");
-            escstr(zReferer);
-            astr2("\"");
-            /* (5) */ astr2(zReplyStatus);
-            /* (6) */ aint(nIn);
-            /* (7) */ aint(nOut);
-            /* (8) */ aint(tvms(&self.ru_utime) - tvms(&priorSelf.ru_utime));
-            /* (9) */ aint(tvms(&self.ru_stime) - tvms(&priorSelf.ru_stime));
-            t = tvms(&children.ru_utime) - tvms(&priorChild.ru_utime);
-            if (isCGI) {
-                if (t == 0) t = 1;
-                isCGI = false;
-            }
-            /* (10) */ aint(t);
-            /* (11) */ aint(tvms(&children.ru_stime) - tvms(&priorChild.ru_stime));
-            /* (12) */ aint(tsms(&tsNow) - tsms(&tsBeginTime));
-            /* (13) */ aint(nRequest);
-            /* (14) */ astr("\"");
-            escstr(zAgent);
-            astr2("\"");
-            /* (15) */ astr("\"");
-            escstr(zRM);
-            astr2("\"");
-            szRS = strlen(zRealScript);
-            szOther = strlen(g_zHttpScheme) + strlen(g_zHttpHost) + 3;
-            if (zScript != 0 && strncmp(zRealScript, zScript, szRS) == 0) {
-                /* (16) */ aint(szOther + szRS);
-            } else {
-                /* (16) */ astr("\"");
-                log_int(zPos, zEnd, (int64_t)szOther, 1, &zPos);
-                astr("+");
-                escstr(zRealScript);
-                astr2("\"");
-            }
-            if (lineNum == 0) lineNum = isRobot;
-            isRobot = 0;
-            /* (17) */ log_int(zPos, zEnd, lineNum, 1, &zPos);
+    /* (1) */ log_DateTime(zPos, zEnd, &dt, &zPos);
+    astr(",");
+    /* (2) */ astr2(az[LOG_STR_REMOTE_ADDR]);
+    /* (3) */ astr("\"");
+    astr(az[LOG_STR_SCHEME]);
+    astr("://");
+    escstr(az[LOG_STR_HOST]);
+    escstr(az[LOG_STR_SCRIPT]);
+    escstr(az[LOG_STR_QUERY]);
+    astr2("\"");
+    /* (4) */ astr("\"");
+    escstr(az[LOG_STR_REFERER]);
+    astr2("\"");
+    /* (5) */ astr2(az[LOG_STR_STATUS]);
+    /* (6) */ aint(r->nIn);
+    /* (7) */ aint(r->nOut);
+    /* (8) */ aint(r->aMs[0]);
+    /* (9) */ aint(r->aMs[1]);
+    /* (10) */ aint(r->aMs[2]);
+    /* (11) */ aint(r->aMs[3]);
+    /* (12) */ aint(r->aMs[4]);
+    /* (13) */ aint(r->nRequest);
+    /* (14) */ astr("\"");
+    escstr(az[LOG_STR_AGENT]);
+    astr2("\"");
+    /* (15) */ astr("\"");
+    escstr(az[LOG_STR_REMOTE_USER]);
+    astr2("\"");
+    szRS = strlen(az[LOG_STR_REAL_SCRIPT]);
+    szOther = strlen(az[LOG_STR_SCHEME]) + strlen(az[LOG_STR_HOST]) + 3;
+    if (strncmp(az[LOG_STR_REAL_SCRIPT], az[LOG_STR_SCRIPT], szRS) == 0) {
+        /* (16) */ aint(szOther + szRS);
+    } else {
+        /* (16) */ astr("\"");
+        log_int(zPos, zEnd, (int64_t)szOther, 1, &zPos);
+        astr("+");
+        escstr(az[LOG_STR_REAL_SCRIPT]);
+        astr2("\"");
+    }
+    /* (17) */ log_int(zPos, zEnd, r->lineNum, 1, &zPos);
 #undef escstr
 #ifdef ALTHTTPD_LOG_PID
                                                                                                                                     /* Appending of PID to the log is used only to assist in
       ** debugging of hanging althttpd processes:
       ** https://sqlite.org/althttpd/forumpost/4dc31619341ce947 */
       acomma;
-      /* (18) */ log_int( zPos, zEnd, getpid(), 1, &zPos );
+      /* (18) */ log_int( zPos, zEnd, r->pid, 1, &zPos );
 #endif /* ALTHTTPD_LOG_PID */
-            astr("\n");
-            priorSelf = self;
-            priorChild = children;
+    /* 仅 -t：请求各阶段（parse ... last_byte）结束的时间，相对读完请求头的微秒数，没有经过的阶段为空 */
+    if (g_bTiming) {
+        for (int i = 0; i < HTTPD_PHASE_N; i++) {
+            acomma;
+            if (r->aPhase[i] >= 0) log_int(zPos, zEnd, r->aPhase[i], 1, &zPos);
+        }
+    }
+    astr("\n");
 #endif
-            if (zPos != 0) {
-                size_t iStart = 0;
-                size_t toSend;
-                size_t nSent;
-                assert(zPos < zEnd - 1);
-                assert(zPos > &msgbuf[0]);
-                *zPos = 0;
-                toSend = zPos - &msgbuf[0];
-                while (1 /*exit-by-break*/ ) {
-                    nSent = write(logfd, msgbuf + iStart, toSend);
-                    if (nSent <= 0) break;
-                    if (nSent >= toSend) break;
-                    iStart += nSent;
-                    toSend -= nSent;
-                }
-            }
-            close(logfd);
-            nIn = nOut = 0;
 #undef astr
 #undef astr2
 #undef aint
 #undef acomma
+    return zPos;
+}
+
+/*
+** 同步写日志：格式化日志记录，打开日志文件追加写入后关闭
+*/
+static void LogWrite(const char *zFilename, const LogRecord *r) {
+    int logfd;
+    if ((logfd = open(zFilename, O_WRONLY | O_CREAT | O_APPEND, 0640)) > 0) {
+        char msgbuf[5000];        /* message buffer */
+        char *zPos = LogFormat(msgbuf, msgbuf + sizeof(msgbuf), r);
+        if (zPos != 0) {
+            size_t iStart = 0;
+            size_t toSend;
+            size_t nSent;
+            assert(zPos < msgbuf + sizeof(msgbuf) - 1);
+            assert(zPos > &msgbuf[0]);
+            *zPos = 0;
+            toSend = zPos - &msgbuf[0];
+            while (1 /*exit-by-break*/ ) {
+                nSent = write(logfd, msgbuf + iStart, toSend);
+                if (nSent <= 0) break;
+                if (nSent >= toSend) break;
+                iStart += nSent;
+                toSend -= nSent;
+            }
+        }
+        close(logfd);
+    }
+}
+
+/*
+** 异步写日志：将日志记录序列化到日志环形缓冲中
+** + 返回 false（缓冲不可用、已满或者记录过长）时，调用者改为同步写日志，日志不会丢失
+*/
+static bool LogRingPut(const LogRecord *r) {
+    char zRec[LOG_RING_MAX_REC];
+    size_t n = offsetof(LogRecord, az);
+    if (!log_ring_enabled()) return false;
+    memcpy(zRec, r, n);
+    for (int i = 0; i < LOG_STR_N; i++) {
+        size_t k = strlen(r->az[i]) + 1;
+        if (n + k > sizeof(zRec)) return false;
+        memcpy(zRec + n, r->az[i], k);
+        n += k;
+    }
+    return log_ring_put(zRec, n);
+}
+
+/*
+** 从日志环形缓冲中取出的记录反序列化，字符串字段指向 zRec 中的内容
+*/
+static bool LogRecordDecode(const char *zRec, size_t n, LogRecord *r) {
+    size_t i = offsetof(LogRecord, az);
+    if (n < i) return false;
+    memcpy(r, zRec, i);
+    for (int k = 0; k < LOG_STR_N; k++) {
+        const char *z = memchr(zRec + i, 0, n - i);
+        if (z == 0) return false;
+        r->az[k] = zRec + i;
+        i = z - zRec + 1;
+    }
+    return true;
+}
+
+/*
+** Make an entry in the log file.  If the HTTP connection should be
+** closed, then terminate this process.  Otherwise return.
+**
+** This routine might be called from a signal handler.  Make sure
+** this routine does not invoke any subroutines that are not signal-safe
+** if the global variable inSignalHandler is set.  Note that fprintf()
+** is not signal-safe on all systems.
+*/
+void MakeLogEntry(int exitCode, int lineNum) {
+    if (g_isWorker) {
+        g_nWorkerReqs++;
+        g_aWorkerStat[g_iWorker].nRequest++;
+        if (!g_evChild) g_aWorkerStat[g_iWorker].bBusy = 0;
+    }
+    if (!omitLog && metrics_enabled()) {
+        struct timespec tsNow;
+        clock_gettime(ALTHTTPD_CLOCK_ID, &tsNow);
+        long long nUs = (tsNow.tv_sec - tsHeadDone.tv_sec) * 1000000LL + (tsNow.tv_nsec - tsHeadDone.tv_nsec) / 1000;
+        metrics_request(g_iHandler, zReplyStatus, nIn, nOut, nUs > 0 ? (uint64_t)nUs : 0);
+        g_iHandler = METRICS_OTHER;
+    }
+    if (zPostData) {
+        if (inSignalHandler == 0) {
+            free(zPostData);
         }
+        zPostData = 0;
     }
-    if (closeConnection || inSignalHandler) {
+    if (g_zLogFile && !omitLog) {
+        struct rusage self, children;
+        int waitStatus;
+        struct timespec tsNow;    /* current time */
+        LogRecord r;
+        long long int t;          /* Elapse CGI time */
+
+        if (zScript == 0) zScript = "";
+        if (zRealScript == 0) zRealScript = "";
+        if (g_zRemoteAddr == 0) g_zRemoteAddr = "";
+        if (g_zHttpHost == 0) g_zHttpHost = "";
+        if (zReferer == 0) zReferer = "";
+        if (zAgent == 0) zAgent = "";
+        if (zQuerySuffix == 0) zQuerySuffix = "";
+        if (!g_evLoop) waitpid(-1, &waitStatus, WNOHANG);     // 事件循环进程的子进程由事件循环自己回收
+        if (inSignalHandler != 0) {
+            /* getrusage() is not signal-safe, so fall back to 0. */
+            self = priorSelf;
+            children = priorChild;
+        } else {
+            getrusage(RUSAGE_SELF, &self);
+            getrusage(RUSAGE_CHILDREN, &children);
+        }
+        clock_gettime(ALTHTTPD_CLOCK_ID, &tsNow);
+
+        r.tBegin = beginTime.tv_sec;
+        r.tNow = time(0);
+        r.nIn = (int64_t)nIn;
+        r.nOut = (int64_t)nOut;
+        r.aMs[0] = tvms(&self.ru_utime) - tvms(&priorSelf.ru_utime);
+        r.aMs[1] = tvms(&self.ru_stime) - tvms(&priorSelf.ru_stime);
+        t = tvms(&children.ru_utime) - tvms(&priorChild.ru_utime);
+        if (isCGI) {
+            if (t == 0) t = 1;
+            isCGI = false;
+        }
+        r.aMs[2] = t;
+        r.aMs[3] = tvms(&children.ru_stime) - tvms(&priorChild.ru_stime);
+        r.aMs[4] = tsms(&tsNow) - tsms(&tsBeginTime);
+        httpd_phase(HTTPD_PHASE_LAST_BYTE);
+        memcpy(r.aPhase, g_aPhase, sizeof(r.aPhase));
+        r.nRequest = nRequest;
+        if (lineNum == 0) lineNum = isRobot;
+        isRobot = 0;
+        r.lineNum = lineNum;
+        r.pid = (int32_t)getpid();
+        r.reserved = 0;
+        r.az[LOG_STR_REMOTE_ADDR] = g_zRemoteAddr;
+        r.az[LOG_STR_SCHEME] = g_zHttpScheme;
+        r.az[LOG_STR_HOST] = g_zHttpHost;
+        r.az[LOG_STR_SCRIPT] = zScript;
+        r.az[LOG_STR_QUERY] = zQuerySuffix;
+        r.az[LOG_STR_REFERER] = zReferer;
+        r.az[LOG_STR_STATUS] = zReplyStatus;
+        r.az[LOG_STR_AGENT] = zAgent;
+        r.az[LOG_STR_REMOTE_USER] = zRemoteUser ? zRemoteUser : "";
+        r.az[LOG_STR_REAL_SCRIPT] = zRealScript;
+        r.az[LOG_STR_METHOD] = zMethod ? zMethod : "";
+        r.az[LOG_STR_PROTOCOL] = zProtocol ? zProtocol : "";
+        priorSelf = self;
+        priorChild = children;
+
+        // 优先交给日志进程写入，请求处理中没有日志文件的 I/O
+        if (!LogRingPut(&r)) LogWrite(zExpLogFile[0] != 0 ? zExpLogFile : g_zLogFile, &r);
+    }
+    if (!omitLog) {
+        scoreboard_sent(nOut);
+        scoreboard_state(SB_KEEPALIVE);
+        nIn = nOut = 0;
+    }
+    if (closeConnection || g_postPending || inSignalHandler) {   // 没有读取的请求体仍在连接中，无法继续下一个请求
         althttpd_exit(exitCode);
     }
     statusSent = 0;
 }
 
+/*
+** 日志进程：从日志环形缓冲中取出日志记录，格式化后成批写入日志文件
+** + 日志文件名按每条记录的请求开始时间 %-扩展（和同步写日志相同），文件名变化时关闭旧文件、打开新文件（轮转）
+** + 每秒检查一次日志文件是否已被移走或删除（外部的日志轮转工具），是则重新打开
+** + 收到 SIGTERM/SIGINT 或者主进程已经退出时，写完缓冲中剩余的记录后退出
+*/
+#define LOG_WRITER_BUF      (256*1024)  // 日志进程的输出缓冲大小，一批记录格式化后一次写入
+#define LOG_WRITER_LINE     5000        // 一行日志的最大长度（和同步写日志的缓冲大小相同）
+
+static volatile sig_atomic_t        g_logStop = 0;
+
+static void LogWriterSignal(int iSig) {
+    (void)iSig;
+    g_logStop = 1;
+}
+
+static void LogWriterFlush(int fd, const char *zBuf, size_t *pnBuf) {
+    size_t i = 0;
+    while (fd >= 0 && i < *pnBuf) {
+        ssize_t n = write(fd, zBuf + i, *pnBuf - i);
+        if (n <= 0) break;
+        i += (size_t)n;
+    }
+    *pnBuf = 0;
+}
+
+static void LogWriterMain(void) {
+    static char zRec[LOG_RING_MAX_REC];
+    static char zBuf[LOG_WRITER_BUF];
+    char zExp[sizeof(zExpLogFile)];     // 最近一次 %-扩展的日志文件名
+    char zOpen[sizeof(zExpLogFile)];    // 当前打开的日志文件名
+    const char *zFile = g_zLogFile;
+    size_t nBuf = 0;
+    int fd = -1;
+    time_t tExp = -1, tCheck = 0;
+    pid_t ppid = getppid();
+
+    signal(SIGTERM, LogWriterSignal);
+    signal(SIGINT, LogWriterSignal);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    zOpen[0] = 0;
+
+    for (;;) {
+        bool bStop = g_logStop || getppid() != ppid;    // 先判断，保证此前写入缓冲的记录都能被写出
+        int nRec = 0;
+        size_t n;
+        LogRecord r;
+
+        while ((n = log_ring_get(zRec)) > 0) {
+            if (!LogRecordDecode(zRec, n, &r)) continue;
+            nRec++;
+            if (r.tBegin != tExp) {
+                struct tm vTm;
+                time_t tBegin = (time_t)r.tBegin;
+                size_t sz;
+                gmtime_r(&tBegin, &vTm);
+                sz = strftime(zExp, sizeof(zExp), g_zLogFile, &vTm);
+                zFile = (sz == 0 || sz >= sizeof(zExp) - 2) ? g_zLogFile : zExp;
+                tExp = r.tBegin;
+            }
+            if (fd < 0 || strcmp(zFile, zOpen) != 0) {
+                LogWriterFlush(fd, zBuf, &nBuf);
+                if (fd >= 0) close(fd);
+                fd = open(zFile, O_WRONLY | O_CREAT | O_APPEND, 0640);
+                snprintf(zOpen, sizeof(zOpen), "%s", zFile);
+            }
+            if (nBuf + LOG_WRITER_LINE > sizeof(zBuf)) LogWriterFlush(fd, zBuf, &nBuf);
+            char *zEnd = LogFormat(zBuf + nBuf, zBuf + nBuf + LOG_WRITER_LINE, &r);
+            if (zEnd) nBuf = zEnd - zBuf;
+        }
+        LogWriterFlush(fd, zBuf, &nBuf);
+        if (bStop) break;
+
+        if (fd >= 0 && time(0) != tCheck) {
+            struct stat stOpen, stName;
+            tCheck = time(0);
+            if (fstat(fd, &stOpen) != 0 || stat(zOpen, &stName) != 0
+                || stOpen.st_ino != stName.st_ino || stOpen.st_dev != stName.st_dev) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        usleep(nRec ? 2000 : 20000);    // 有记录时很快再次检查，空闲时降低轮询频率
+    }
+    if (fd >= 0) close(fd);
+    exit(0);
+}
+
 /*
 ** Allocate memory safely
 */
@@ -865,6 +1181,62 @@ static char *SafeMalloc(size_t size) {
     return p;
 }
 
+/*
+** 请求级内存池（bump arena）
+** + 请求处理期间产生的字符串（StrDup、StrAppend 等）都从这里分配，用完不需要逐个释放，
+**   下一个请求开始时（ReqArenaReset）整体重置，prefork worker 和事件循环的进程因此不会随请求数增长而占用更多内存
+** + 第一个块是静态的，不够时追加 malloc 的块，重置后这些块保留下来供后续请求复用；
+**   超过块大小 1/4 的分配单独 malloc（挂在 g_pReqLarge 链表上），重置时释放
+** + 跨请求保留的内存（进程或连接级别的状态、putenv 的环境变量等）仍然使用 SafeMalloc 或静态缓冲
+*/
+#define REQ_ARENA_BLOCK     16384       // 每个块的大小
+#define REQ_ARENA_ALIGN     16          // 分配的对齐字节数
+
+typedef struct ReqArenaBlock {
+    struct ReqArenaBlock*   pNext;
+    size_t                  nUsed;
+    char                    a[REQ_ARENA_BLOCK] __attribute__((aligned(REQ_ARENA_ALIGN)));
+} ReqArenaBlock;
+
+static ReqArenaBlock                g_reqArena0;                // 第一个块
+static ReqArenaBlock*               g_pReqArena = &g_reqArena0; // 当前正在分配的块
+static void*                        g_pReqLarge = NULL;         // 单独分配的大块链表（每块开头保存下一块的指针）
+
+void *ReqAlloc(size_t size) {
+    ReqArenaBlock *pBlk = g_pReqArena;
+    char *p;
+
+    size = (size + REQ_ARENA_ALIGN - 1) & ~(size_t)(REQ_ARENA_ALIGN - 1);
+    if (size > REQ_ARENA_BLOCK / 4) {
+        p = SafeMalloc(REQ_ARENA_ALIGN + size);
+        *(void **) p = g_pReqLarge;
+        g_pReqLarge = p;
+        return p + REQ_ARENA_ALIGN;
+    }
+    if (pBlk->nUsed + size > REQ_ARENA_BLOCK) {
+        if (pBlk->pNext == 0) {
+            pBlk->pNext = (ReqArenaBlock *) SafeMalloc(sizeof(ReqArenaBlock));
+            pBlk->pNext->pNext = 0;
+        }
+        pBlk = g_pReqArena = pBlk->pNext;
+        pBlk->nUsed = 0;
+    }
+    p = pBlk->a + pBlk->nUsed;
+    pBlk->nUsed += size;
+    return p;
+}
+
+// 丢弃当前请求从 arena 分配的全部内存
+static void ReqArenaReset(void) {
+    g_pReqArena = &g_reqArena0;
+    g_reqArena0.nUsed = 0;
+    while (g_pReqLarge) {
+        void *pNext = *(void **) g_pReqLarge;
+        free(g_pReqLarge);
+        g_pReqLarge = pNext;
+    }
+}
+
 /* Forward reference */
 static void BlockIPAddress(void);
 
@@ -916,10 +1288,10 @@ char *GetFirstElement(char *zInput, char **zLeftOver) {
 }
 
 /*
-** Make a copy of a string into memory obtained from malloc.
+** Make a copy of a string into memory obtained from the request arena.
 */
 /*
-** 复制字符串
+** 复制字符串（从请求级内存池分配，请求结束后失效）
 */
 char *StrDup(const char *zSrc) {
     char *zDest;
@@ -927,8 +1299,8 @@ char *StrDup(const char *zSrc) {
 
     if (zSrc == 0) return 0;
     size = strlen(zSrc) + 1;
-    zDest = (char *) SafeMalloc(size);
-    strcpy(zDest, zSrc);
+    zDest = (char *) ReqAlloc(size);
+    memcpy(zDest, zSrc, size);
     return zDest;
 }
 
@@ -943,9 +1315,8 @@ static char *StrAppend(char *zPrior, const char *zSep, const char *zSrc) {
     n1 = strlen(zSep);
     n2 = strlen(zSrc);
     size = n0 + n1 + n2 + 1;
-    zDest = (char *) SafeMalloc(size);
+    zDest = (char *) ReqAlloc(size);
     memcpy(zDest, zPrior, n0);
-    free(zPrior);
     memcpy(&zDest[n0], zSep, n1);
     memcpy(&zDest[n0 + n1], zSrc, n2 + 1);
     return zDest;
@@ -991,20 +1362,35 @@ void RemoveNewline(char *z) {
 /* Render seconds since 1970 as an RFC822 date string.  Return
 ** a pointer to that string in a static buffer.
 */
+/*
+** 同一个文件的 Last-Modified 在连续的请求中通常相同，这里缓存最近一次的结果
+*/
 static char *Rfc822Date(time_t t) {
-    struct tm *tm;
+    struct tm tm;
     static char zDate[100];
-    tm = gmtime(&t);
-    strftime(zDate, sizeof(zDate), "%a, %d %b %Y %H:%M:%S GMT", tm);
+    static time_t tLast = -1;
+    if (t != tLast) {
+        gmtime_r(&t, &tm);
+        strftime(zDate, sizeof(zDate), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        tLast = t;
+    }
     return zDate;
 }
 
-/*
-** Print a date tag in the header.  The name of the tag is zTag.
-** The date is determined from the unix timestamp given.
-*/
-static int DateTag(const char *zTag, time_t t) {
-    return althttpd_printf("%s: %s" CRLF, zTag, Rfc822Date(t));
+// 返回当前时间的 "Date: ..." 头部行（含 CRLF），每秒只格式化一次
+static const char *DateHeaderNow(size_t *pN) {
+    static char zHdr[64];
+    static size_t nHdr;
+    static time_t tLast = -1;
+    time_t now = time(NULL);
+    if (now != tLast) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        nHdr = strftime(zHdr, sizeof(zHdr), "Date: %a, %d %b %Y %H:%M:%S GMT" CRLF, &tm);
+        tLast = now;
+    }
+    *pN = nHdr;
+    return zHdr;
 }
 
 /*
@@ -1050,32 +1436,278 @@ void TestParseRfc822Date(void) {
 }
 
 /*
-** Print the first line of a response followed by the server type.
+** 请求各阶段的时间（-t/--timing）
+** + 每个阶段记录它结束的时间（相对读完请求头的微秒数）。Server-Timing 头部给出相邻两个经过的阶段之间的间隔，
+**   日志的附加字段给出各阶段结束的时间
+** + C 脚本的编译、重定位、执行发生在 CGI 子进程中，因此 fork CGI 之前把记录移到共享内存中（每个进程只需一次）
 */
-static void StartResponse(const char *zResultCode) {
-    time_t now;
-    time(&now);
+static const char *const g_azPhase[HTTPD_PHASE_N] = {
+        "parse", "resolve", "auth", "fork", "compile", "relocate", "execute", "first_byte", "last_byte"
+};
+
+bool httpd_timing_enabled(void) {
+    return g_bTiming;
+}
+
+void httpd_phase(int iPhase) {
+    struct timespec ts;
+    long long n;
+    if (!g_bTiming || iPhase < 0 || iPhase >= HTTPD_PHASE_N) return;
+    clock_gettime(ALTHTTPD_CLOCK_ID, &ts);
+    n = (ts.tv_sec - tsHeadDone.tv_sec) * 1000000LL + (ts.tv_nsec - tsHeadDone.tv_nsec) / 1000;
+    g_aPhase[iPhase] = n > 0 ? n : 0;
+}
+
+// 新的请求开始，清除各阶段的时间
+// + 从父进程继承的共享内存（HTTP/2 的流处理进程、事件循环转交的子进程等）不能继续使用，否则和父进程、兄弟进程互相覆盖
+static void PhaseReset(void) {
+    if (!g_bTiming) return;
+    if (g_aPhase != g_aPhaseLocal && g_phasePid != getpid()) g_aPhase = g_aPhaseLocal;
+    for (int i = 0; i < HTTPD_PHASE_N; i++) g_aPhase[i] = -1;
+}
+
+// fork CGI 之前调用，使 CGI 子进程记录的阶段对本进程可见。分配失败时只是缺少子进程中的阶段
+static void PhaseShare(void) {
+    void *p;
+    if (!g_bTiming || g_aPhase != g_aPhaseLocal) return;
+    p = mmap(0, sizeof(g_aPhaseLocal), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return;
+    memcpy(p, g_aPhaseLocal, sizeof(g_aPhaseLocal));
+    g_aPhase = (int64_t *) p;
+    g_phasePid = getpid();
+}
+
+// 开始发送回复：记录 first_byte，并把到此为止的各阶段格式化为 Server-Timing 头部（含 CRLF）。返回长度，未开启时返回 0
+// + 各阶段按时间顺序输出：C 脚本由请求处理进程编译时（-X），compile 在 fork 之前
+static size_t PhaseHeader(char *zBuf, size_t nBuf) {
+    size_t n;
+    int64_t iPrev = 0;
+    const char *zSep = "";
+    int aOrder[HTTPD_PHASE_N], nOrder = 0;
+    if (!g_bTiming) return 0;
+    httpd_phase(HTTPD_PHASE_FIRST_BYTE);
+    for (int i = 0; i <= HTTPD_PHASE_FIRST_BYTE; i++) {
+        int j;
+        if (g_aPhase[i] < 0) continue;
+        for (j = nOrder++; j > 0 && g_aPhase[aOrder[j - 1]] > g_aPhase[i]; j--) aOrder[j] = aOrder[j - 1];
+        aOrder[j] = i;
+    }
+    n = (size_t) snprintf(zBuf, nBuf, "Server-Timing: ");
+    for (int k = 0; k < nOrder && n < nBuf; k++) {
+        int i = aOrder[k];
+        int64_t t = g_aPhase[i];
+        n += (size_t) snprintf(zBuf + n, nBuf - n, "%s%s;dur=%.3f", zSep, g_azPhase[i], (t > iPrev ? t - iPrev : 0) / 1000.0);
+        if (t > iPrev) iPrev = t;
+        zSep = ", ";
+    }
+    if (n + 3 > nBuf) return 0;
+    memcpy(zBuf + n, CRLF, 3);
+    return n + 2;
+}
+
+void httpd_reply_begin(void) {
+    char zTiming[400];
+    size_t n = PhaseHeader(zTiming, sizeof(zTiming));
+    if (n) nOut += althttpd_fwrite(zTiming, 1, n, stdout);
+    scoreboard_state(SB_WRITE);
+}
+
+/*
+** 响应头部构造器
+** + 头部字段不再逐个通过 printf 格式化输出，而是收集为 iovec：固定不变的头部块直接引用，
+**   动态内容（状态行、ETag、Content-length 等）格式化到 zBuf 中，相邻的格式化内容合并为一个 iovec
+** + RespSend() 把头部和内存中的响应体通过一次 writev 发出；响应体来自文件时，头部以 MSG_MORE 发送，
+**   和随后 sendfile() 的数据合并在同一个 TCP 报文中
+*/
+#define RESP_MAX_IOV        16          // 头部块的最大数量（包括最后的响应体）
+#define RESP_BUF_SIZE       2048        // 动态头部内容的格式化缓冲大小
+
+#ifndef MSG_MORE
+#define MSG_MORE            0
+#endif
+
+typedef struct RespHdr {
+    struct iovec        aIov[RESP_MAX_IOV];
+    int                 nIov;
+    size_t              nBuf;               // zBuf 中已使用的字节数
+    size_t              nTotal;             // 所有 iovec 的总字节数
+    char                zBuf[RESP_BUF_SIZE];
+} RespHdr;
+
+// 固定不变的头部块
+static const char g_zSabHeaders[] =         // 使用 SharedArrayBuffer 的 JavaScript 需要这两个头部字段
+        "Cross-Origin-Opener-Policy: same-origin" CRLF
+        "Cross-Origin-Embedder-Policy: require-corp" CRLF;
+static const char g_zNoCacheHeaders[] =     // 错误响应（4xx, 5xx）不应该被缓存，后两个字段用于兼容 HTTP/1.0
+        "Cache-Control: no-cache, no-store, must-revalidate" CRLF
+        "Pragma: no-cache" CRLF
+        "Expires: 0" CRLF;
+static const char g_zConnClose[] = "Connection: close" CRLF;
+static const char g_zConnKeepAlive[] = "Connection: keep-alive" CRLF;
+static char g_zMaxAgeHeader[64];            // "Cache-Control: max-age=N"，g_mxAge 在启动后不再改变，首次使用时生成
+static size_t g_nMaxAgeHeader = 0;
+static char *g_zFileCacheBuf = 0;            // 内容缓存的头部和内容在本进程中的副本，首次使用时分配
+
+#define RespAddConst(p, z)  RespAdd(p, z, sizeof(z) - 1)
+
+static void RespInit(RespHdr *p) {
+    p->nIov = 0;
+    p->nBuf = 0;
+    p->nTotal = 0;
+}
+
+// 追加一个头部块（z 在 RespSend 之前必须保持有效）
+static void RespAdd(RespHdr *p, const char *z, size_t n) {
+    if (n == 0) return;
+    p->nTotal += n;
+    if (p->nIov > 0) {
+        struct iovec *pLast = &p->aIov[p->nIov - 1];
+        if ((const char *) pLast->iov_base + pLast->iov_len == z) {
+            pLast->iov_len += n;
+            return;
+        }
+    }
+    if (p->nIov >= RESP_MAX_IOV) {
+        Malfunction(534, /* LOG: Too many response header blocks */
+                    "Too many response header blocks");
+    }
+    p->aIov[p->nIov].iov_base = (void *) z;
+    p->aIov[p->nIov].iov_len = n;
+    p->nIov++;
+}
+
+// 格式化一段头部内容并追加
+static void RespPrintf(RespHdr *p, const char *zFormat, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, zFormat);
+    n = vsnprintf(p->zBuf + p->nBuf, sizeof(p->zBuf) - p->nBuf, zFormat, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n >= sizeof(p->zBuf) - p->nBuf) {
+        Malfunction(535, /* LOG: Response header too large */
+                    "Response header too large");
+    }
+    RespAdd(p, p->zBuf + p->nBuf, (size_t) n);
+    p->nBuf += (size_t) n;
+}
+
+static void RespAddMaxAge(RespHdr *p) {
+    if (g_nMaxAgeHeader == 0) {
+        g_nMaxAgeHeader = (size_t) snprintf(g_zMaxAgeHeader, sizeof(g_zMaxAgeHeader),
+                                            "Cache-Control: max-age=%d" CRLF, g_mxAge);
+    }
+    RespAdd(p, g_zMaxAgeHeader, g_nMaxAgeHeader);
+}
+
+// 响应的状态行以及每个响应都有的头部字段（Connection、Date）
+static void RespStatus(RespHdr *p, const char *zResultCode) {
+    const char *zDate;
+    size_t nDate;
     if (statusSent) return;
-    nOut += althttpd_printf("%s %s" CRLF,
-                            zProtocol ? zProtocol : "HTTP/1.1", zResultCode);
+    RespPrintf(p, "%s %s" CRLF, zProtocol ? zProtocol : "HTTP/1.1", zResultCode);
     strncpy(zReplyStatus, zResultCode, 3);
     zReplyStatus[3] = 0;
     if (zReplyStatus[0] >= '4') {
         closeConnection = true;
-        // 错误响应（4xx, 5xx）不应该被缓存，避免浏览器缓存错误信息
-        nOut += althttpd_printf("Cache-Control: no-cache, no-store, must-revalidate" CRLF);
-        nOut += althttpd_printf("Pragma: no-cache" CRLF);  // HTTP/1.0 兼容
-        nOut += althttpd_printf("Expires: 0" CRLF);        // HTTP/1.0 兼容
+        RespAddConst(p, g_zNoCacheHeaders);
     }
     if (closeConnection) {
-        nOut += althttpd_printf("Connection: close" CRLF);
+        RespAddConst(p, g_zConnClose);
     } else {
-        nOut += althttpd_printf("Connection: keep-alive" CRLF);
+        RespAddConst(p, g_zConnKeepAlive);
     }
-    nOut += DateTag("Date", now);
+    zDate = DateHeaderNow(&nDate);
+    RespAdd(p, zDate, nDate);
+    if (g_bTiming) {
+        char zTiming[400];
+        if (PhaseHeader(zTiming, sizeof(zTiming))) RespPrintf(p, "%s", zTiming);
+    }
+    scoreboard_state(SB_WRITE);
     statusSent = 1;
 }
 
+// 发送收集到的头部，以及紧随其后的响应体 pBody（可以为空）。返回发送的字节数
+// + bMore：后面还有数据（sendfile 发送的文件内容），以 MSG_MORE 发送，避免头部单独成为一个 TCP 报文
+// + 内置 TLS 模式下通过 althttpd_fwrite() 逐块写入
+static size_t RespSend(RespHdr *p, const void *pBody, size_t nBody, int bMore) {
+    struct iovec *pIov = p->aIov;
+    int nIov;
+    size_t nLeft, nSent = 0;
+    int bSock = g_evOutFd < 0;  // 事件循环进程中标准输出是 memfd
+
+    RespAdd(p, pBody, nBody);
+    nIov = p->nIov;
+    nLeft = p->nTotal;
+    if (g_useHttps == 2) {
+        for (int i = 0; i < nIov; i++) althttpd_fwrite(pIov[i].iov_base, 1, pIov[i].iov_len, stdout);
+        return nLeft;
+    }
+    fflush(stdout);             // 之前通过 stdio 输出的内容必须先发出
+    while (nLeft > 0) {
+        ssize_t n;
+        if (bSock) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = pIov;
+            msg.msg_iovlen = nIov;
+            n = sendmsg(1, &msg, bMore ? MSG_MORE : 0);
+            if (n < 0 && errno == ENOTSOCK) { bSock = 0; continue; }     // 标准输出不是套接字（比如 inetd 之外的调试运行）
+        } else n = writev(1, pIov, nIov);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        nSent += (size_t) n;
+        nLeft -= (size_t) n;
+        while (nIov > 0 && (size_t) n >= pIov->iov_len) {
+            n -= (ssize_t) pIov->iov_len;
+            pIov++;
+            nIov--;
+        }
+        if (nIov > 0) {
+            pIov->iov_base = (char *) pIov->iov_base + n;
+            pIov->iov_len -= (size_t) n;
+        }
+    }
+    return nSent;
+}
+
+// 把已收集的头部（跳过开头的 nSkip 字节）复制到 zOut 中。返回复制的字节数，放不下时返回 0
+static size_t RespGather(const RespHdr *p, size_t nSkip, char *zOut, size_t nOut) {
+    size_t n = 0;
+    if (p->nTotal - nSkip > nOut) return 0;
+    for (int i = 0; i < p->nIov; i++) {
+        const char *z = (const char *) p->aIov[i].iov_base;
+        size_t nLen = p->aIov[i].iov_len;
+        if (nSkip >= nLen) { nSkip -= nLen; continue; }
+        memcpy(zOut + n, z + nSkip, nLen - nSkip);
+        n += nLen - nSkip;
+        nSkip = 0;
+    }
+    return n;
+}
+
+// 记录回复的状态码（用于日志和运行统计），自己输出状态行的处理方式（SQTP）需要调用
+void httpd_reply_status(const char *zStatus) {
+    if (strlen(zStatus) < 3) return;
+    memcpy(zReplyStatus, zStatus, 3);
+    zReplyStatus[3] = 0;
+}
+
+/*
+** Print the first line of a response followed by the server type.
+*/
+/* + 之后的头部字段由调用者继续通过 althttpd_printf 输出，因此这里写入 stdio 的缓冲，而不是直接发送
+*/
+static void StartResponse(const char *zResultCode) {
+    RespHdr r;
+    if (statusSent) return;
+    RespInit(&r);
+    RespStatus(&r, zResultCode);
+    for (int i = 0; i < r.nIov; i++) althttpd_fwrite(r.aIov[i].iov_base, 1, r.aIov[i].iov_len, stdout);
+    nOut += r.nTotal;
+}
+
 /*
 ** Check all of the files in the g_zIPShunDir directory.  Unlink any
 ** files in that directory that have expired.
@@ -1348,6 +1980,9 @@ static void Timeout(int iSig) {
             }
             --inSignalHandler;
         }
+        // 对于 prefork worker，除了超时和连接断开，其它信号（如 SIGSEGV、SIGXCPU）都意味着进程状态已不可信，
+        // 此时直接退出 worker 进程，由主进程重新 fork 一个新的 worker
+        if (iSig != SIGALRM && iSig != SIGPIPE) g_isWorker = false;
         althttpd_exit(0);
     }
 }
@@ -2142,42 +2777,355 @@ static void tls_atexit(void){
 }
 #endif /* ENABLE_TLS */
 
+// 从连接读取数据（内置 TLS 模式下为解密后的数据），最多一次系统调用
+// + 返回读取的字节数，连接关闭或出错时返回 0
+static size_t ConnRead(void *zBuf, size_t nBuf) {
+
+    if (g_useHttps == 2) {
+#ifdef ENABLE_TLS
+        assert(NULL!=tlsState.sslCon);
+        return tls_read_some(tlsState.sslCon, zBuf, nBuf);
+#else
+        Malfunction(509, "SSL not available"); /* LOG: SSL not available */
+        return 0;
+#endif
+    }
+    for (;;) {
+        ssize_t n = read(0, zBuf, nBuf);
+        if (n >= 0) return (size_t)n;
+        if (errno != EINTR) return 0;
+    }
+}
+
+// 从连接读入更多数据到连接输入缓冲（先丢弃已消费的部分），返回读入的字节数
+// + 注意这会移动缓冲中的数据，此前指向缓冲的指针都将失效
+static size_t ConnFill(void) {
+
+    if (g_iConnIn > 0) {
+        g_nConnIn -= g_iConnIn;
+        if (g_nConnIn) memmove(g_zConnIn, g_zConnIn + g_iConnIn, g_nConnIn);
+        g_iConnIn = 0;
+    }
+    if (g_nConnInAlloc - g_nConnIn < 1024) {
+        g_nConnInAlloc = g_nConnInAlloc ? g_nConnInAlloc * 2 : 8192;
+        g_zConnIn = (char*)realloc(g_zConnIn, g_nConnInAlloc);
+        if (g_zConnIn == 0) Malfunction(533/* LOG: Out of memory */, "out of memory for the input buffer");
+    }
+    size_t n = ConnRead(g_zConnIn + g_nConnIn, g_nConnInAlloc - g_nConnIn);
+    g_nConnIn += n;
+    return n;
+}
+
 // 执行和 fgets() 一样的功能
-/* + 从输入流 in 中读取一行文本到 s[] 中，确保 s[] 以 null 结尾。s[] 的大小为 size 字节，因此最多读取 size-1 字节。
+/* + 从连接中读取一行文本到 s[] 中，确保 s[] 以 null 结尾。s[] 的大小为 size 字节，因此最多读取 size-1 字节。
  | 成功时，返回指向 s[] 的指针，输入结束时返回 NULL
- | 对于内置 TLS 模式，最后一个参数被忽略，并改为从 TLS 连接中读取
-*/
-/*
-** 从输入流读取一行
+ | 数据总是从连接输入缓冲中读取（不足时从连接读入），最后一个参数被忽略
 */
 char *althttpd_fgets(char *s, int size, FILE *in) {
 
-    if (g_useHttps != 2) return fgets(s, size, in);
-
-#ifdef ENABLE_TLS
-    assert(NULL!=tlsState.sslCon);
-  return tls_gets(tlsState.sslCon, s, size);
-#else
-    Malfunction(508, "SSL not available"); /* LOG: SSL not available */
-    return NULL;
-#endif
+    int n = 0;
+    (void)in;
+    while (n < size - 1) {
+        if (g_iConnIn == g_nConnIn && ConnFill() == 0) break;
+        size_t avail = g_nConnIn - g_iConnIn;
+        if (avail > (size_t)(size - 1 - n)) avail = (size_t)(size - 1 - n);
+        const char *zNl = memchr(g_zConnIn + g_iConnIn, '\n', avail);
+        size_t k = zNl ? (size_t)(zNl - (g_zConnIn + g_iConnIn)) + 1 : avail;
+        memcpy(s + n, g_zConnIn + g_iConnIn, k);
+        n += (int)k;
+        g_iConnIn += k;
+        if (zNl) break;
+    }
+    s[n] = 0;
+    return n ? s : 0;
 }
 
 // 行和 fread() 一样的功能
-/* + 对于内置 TLS 模式，会使用 libssl 来读取数据（在这种情况下，最后一个参数被忽略）
+/* + 先消费连接输入缓冲中已有的数据，其余部分直接从连接读入到目标缓冲（不经过连接输入缓冲），最后一个参数被忽略
  |  注意目标缓冲区必须至少为 (sz*nmemb) 字节。
 */
-static size_t althttpd_fread(void *tgt, size_t sz, size_t nmemb, FILE *in) {
+size_t althttpd_fread(void *tgt, size_t sz, size_t nmemb, FILE *in) {
+
+    size_t want = sz * nmemb, n = 0;
+    (void)in;
+    if (want == 0) return 0;
+    if (g_iConnIn < g_nConnIn) {
+        n = g_nConnIn - g_iConnIn;
+        if (n > want) n = want;
+        memcpy(tgt, g_zConnIn + g_iConnIn, n);
+        g_iConnIn += n;
+    }
+    while (n < want) {
+        size_t got = ConnRead((char*)tgt + n, want - n);
+        if (got == 0) break;
+        n += got;
+    }
+    return n / sz;
+}
 
-    if (g_useHttps != 2) return fread(tgt, sz, nmemb, in);
+// 将完整的请求头读入连接输入缓冲并解析，解析结果中的偏移都相对于 g_zConnIn + g_iConnIn
+// + 返回请求头的长度；连接在请求开始前已关闭时返回 0；请求头格式错误时返回 HTTP_PARSE_ERROR；请求头过长时返回 REQ_HEADER_TOO_LARGE
+#define REQ_HEADER_TOO_LARGE (-2)
+static int ReadRequestHeader(http_request *pReq) {
 
-#ifdef ENABLE_TLS
-    assert(NULL!=tlsState.sslCon);
-    return tls_read_server(tlsState.sslCon, tgt, sz*nmemb);
-#else
-    Malfunction(509, "SSL not available"); /* LOG: SSL not available */
-    return 0;
+    for (;;) {
+        int rc = http_parse_request(g_zConnIn + g_iConnIn, g_nConnIn - g_iConnIn, pReq);
+        if (rc != HTTP_PARSE_INCOMPLETE) return rc;
+        if (g_nConnIn - g_iConnIn >= MAX_HEADER_SIZE) return REQ_HEADER_TOO_LARGE;
+        if (ConnFill() == 0) return 0;
+    }
+}
+
+// 将请求头中的一个片段以 null 结尾（就地修改连接输入缓冲），返回指向它的指针
+static char *ConnSlice(char *zHead, http_slice x) {
+    zHead[x.off + x.len] = 0;
+    return zHead + x.off;
+}
+
+// ---------------------------
+// 请求体（POST 数据）
+/* + 请求体在解析请求头时不会读取，只记录长度（g_postPending），由最终处理请求的分支按需读取：
+ |   - CGI：FeedPostData() 在 CGI 运行的同时把请求体写入它的标准输入，不在内存中缓存整个请求体
+ |   - SCGI 和 chunked 编码的请求体：ReadPostData() 一次读入 zPostData
+ |   - 其它（静态文件等）：不读取，回复之后关闭连接
+ | + Expect: 100-continue 的客户端在收到 100 Continue 之后才发送请求体，因此在第一次读取之前回复（SendContinue()）
+*/
+
+// 写入全部数据，失败（比如对端已关闭管道）时返回 false
+static bool WriteAll(int fd, const char *z, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, z, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        z += k;
+        n -= (size_t) k;
+    }
+    return true;
+}
+
+// 从连接读取一部分请求体：先取连接输入缓冲中剩余的数据，否则直接从连接读入（不经过连接输入缓冲，
+// 因此不会移动缓冲中的请求头，指向请求头的指针保持有效），返回读取的字节数，连接关闭时返回 0
+static size_t PostReadSome(char *z, size_t n) {
+    if (g_iConnIn < g_nConnIn) {
+        size_t k = g_nConnIn - g_iConnIn;
+        if (k > n) k = n;
+        memcpy(z, g_zConnIn + g_iConnIn, k);
+        g_iConnIn += k;
+        return k;
+    }
+    return ConnRead(z, n);
+}
+
+// 回复 100 Continue（只对 HTTP/1.1 客户端）
+static void SendContinue(void) {
+    static const char zContinue[] = "HTTP/1.1 100 Continue" CRLF CRLF;
+    if (!g_expectContinue) return;
+    g_expectContinue = false;
+    if (zProtocol == 0 || strcmp(zProtocol, "HTTP/1.1") != 0) return;
+    althttpd_fwrite(zContinue, 1, sizeof(zContinue) - 1, stdout);
+    althttpd_fflush(stdout);
+    nOut += sizeof(zContinue) - 1;
+}
+
+// chunked 编码请求体的解码状态
+typedef struct ChunkIn {
+    char                zBuf[16384];    /* 从连接读入的原始数据 */
+    size_t              i, n;           /* zBuf 中下一个未处理的字节、有效数据的长度 */
+    long long           nLeft;          /* 当前分块中剩余的数据长度，-1 表示需要读取下一个分块的长度行 */
+} ChunkIn;
+
+// 读取一行（丢弃 CRLF），过长的行或者连接关闭时返回 false
+static bool ChunkLine(ChunkIn *p, char *zLine, size_t nLine) {
+    size_t k = 0;
+    for (;;) {
+        if (p->i == p->n) {
+            p->i = 0;
+            if ((p->n = PostReadSome(p->zBuf, sizeof(p->zBuf))) == 0) return false;
+        }
+        char c = p->zBuf[p->i++];
+        if (c == '\n') break;
+        if (k + 1 >= nLine) return false;
+        if (c != '\r') zLine[k++] = c;
+    }
+    zLine[k] = 0;
+    return true;
+}
+
+// 解码下一段请求体数据到 zOut，返回解码的字节数，请求体结束时返回 0，格式错误或连接关闭时返回 -1
+static ssize_t ChunkRead(ChunkIn *p, char *zOut, size_t nOut) {
+    char zLine[256];
+    if (p->nLeft < 0) {
+        char *zEnd;
+        if (!ChunkLine(p, zLine, sizeof(zLine))) return -1;
+        p->nLeft = strtoll(zLine, &zEnd, 16);               // 长度之后可能还有 ;ext=... 分块扩展
+        if (zEnd == zLine || p->nLeft < 0 || (*zEnd && *zEnd != ';' && *zEnd != ' ' && *zEnd != '\t')) return -1;
+        if (p->nLeft == 0) {
+            // 最后一个分块：丢弃尾部字段，直到空行
+            do {
+                if (!ChunkLine(p, zLine, sizeof(zLine))) return -1;
+            } while (zLine[0]);
+            return 0;
+        }
+    }
+    if (p->i == p->n) {
+        p->i = 0;
+        if ((p->n = PostReadSome(p->zBuf, sizeof(p->zBuf))) == 0) return -1;
+    }
+    size_t k = p->n - p->i;
+    if ((long long) k > p->nLeft) k = (size_t) p->nLeft;
+    if (k > nOut) k = nOut;
+    memcpy(zOut, p->zBuf + p->i, k);
+    p->i += k;
+    if ((p->nLeft -= (long long) k) == 0) {
+        if (!ChunkLine(p, zLine, sizeof(zLine)) || zLine[0]) return -1;    // 分块数据之后的 CRLF
+        p->nLeft = -1;
+    }
+    return (ssize_t) k;
+}
+
+// 把尚未读取的请求体完整读入 zPostData（nPostData 为长度），chunked 编码的请求体同时解码，
+// 并把 zContentLength 改为解码后的长度（CGI / SCGI 需要通过 CONTENT_LENGTH 得到请求体的长度）
+static void ReadPostData(void) {
+    if (!g_postPending) return;
+    g_postPending = false;
+    SendContinue();
+    if (!g_postChunked) {
+        zPostData = SafeMalloc(g_nPostLen + 1);
+        SetTimeout(15 + (int) g_nPostLen / 2000, 803/* 日志：POST 数据超时 */);
+        nPostData = althttpd_fread(zPostData, 1, g_nPostLen, stdin);
+        nIn += nPostData;
+        if (nPostData < g_nPostLen) closeConnection = true;     // 客户端提前关闭了连接
+    } else {
+        ChunkIn *p = (ChunkIn*) SafeMalloc(sizeof(ChunkIn));
+        size_t nAlloc = 0;
+        ssize_t got;
+        char zLen[24];
+        p->i = p->n = 0;
+        p->nLeft = -1;
+        SetTimeout(60, 803/* 日志：POST 数据超时 */);
+        do {
+            if (nAlloc - nPostData < 16384) {
+                nAlloc = nAlloc ? nAlloc * 2 : 65536;
+                if (nAlloc > MAX_CONTENT_LENGTH + 16384) {
+                    free(p);
+                    closeConnection = true;
+                    StartResponse("413 Content Too Large");
+                    nOut += althttpd_printf(
+                            "Content-type: text/plain; charset=utf-8" CRLF
+                            CRLF
+                            "Too much POST data\n"
+                    );
+                    MakeLogEntry(0, 270); /* 日志：请求过大 */
+                    althttpd_exit(0);
+                }
+                zPostData = (char*) realloc(zPostData, nAlloc + 1);
+                if (zPostData == 0) Malfunction(611/* LOG: OOM */, "out of memory for the POST data");
+            }
+            got = ChunkRead(p, zPostData + nPostData, nAlloc - nPostData);
+            if (got > 0) nPostData += (size_t) got;
+        } while (got > 0);
+        if (got < 0 || p->i < p->n) closeConnection = true;    // 格式错误，或者预读了之后的请求，无法继续使用连接
+        free(p);
+        nIn += nPostData;
+        sprintf(zLen, "%zu", nPostData);
+        zContentLength = StrDup(zLen);
+    }
+    SetTimeout(30, 804/* 日志：解码 HTTP 请求超时 */);
+}
+
+// 从连接复制 nLeft 字节的请求体到 fd；fd 写入失败（CGI 不再读取标准输入）之后继续读取并丢弃剩余部分，
+// 保持连接同步。请求体完整读取时返回 true
+static bool PostCopy(int fd, size_t nLeft) {
+    char zBuf[16384];
+    bool bDrop = false;
+
+    // 连接输入缓冲中已有的部分（和请求头一起读入的数据）
+    size_t nBuf = g_nConnIn - g_iConnIn;
+    if (nBuf > nLeft) nBuf = nLeft;
+    if (nBuf > 0) {
+        bDrop = !WriteAll(fd, g_zConnIn + g_iConnIn, nBuf);
+        g_iConnIn += nBuf;
+        nLeft -= nBuf;
+    }
+#ifdef linux
+    // 其余部分由内核从套接字直接转移到管道，不经过用户态缓冲
+    while (nLeft > 0 && !bDrop && g_useHttps != 2) {
+        ssize_t got = splice(0, NULL, fd, NULL, nLeft > 0x100000 ? 0x100000 : nLeft, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (got > 0) {
+            nLeft -= (size_t) got;
+            continue;
+        }
+        if (got == 0) return false;     // 客户端提前关闭了连接
+        if (errno == EINTR) continue;
+        if (errno == EPIPE) bDrop = true;
+        break;                          // 其它错误（比如不支持 splice）改为普通复制
+    }
 #endif
+    while (nLeft > 0) {
+        size_t n = ConnRead(zBuf, nLeft < sizeof(zBuf) ? nLeft : sizeof(zBuf));
+        if (n == 0) return false;
+        nLeft -= n;
+        if (!bDrop) bDrop = !WriteAll(fd, zBuf, n);
+    }
+    return true;
+}
+
+// 把请求体写入 CGI 的标准输入 fd（CGI 已经在运行），完成后关闭 fd
+/* + 已经读入 zPostData 的请求体（chunked 编码）直接写入
+ | + 否则 fork 一个子进程负责复制，当前进程立即开始接收 CGI 的输出：CGI 可以边接收边处理，
+ |   上传占用的内存和请求体的大小无关，管道写满时也不会因为当前进程阻塞在写入上而死锁。
+ |   子进程结束之前当前进程不会再读取连接（见 PostFeederWait()）
+ | + 内置 TLS 模式下数据需要经过 TLS 解密（TLS 会话状态不能在两个进程之间共享），在当前进程中复制
+*/
+static void FeedPostData(int fd) {
+    if (nPostData > 0) {
+        WriteAll(fd, zPostData, nPostData);
+    } else if (g_postPending) {
+        size_t len = g_nPostLen;
+        pid_t pid = -1;
+        g_postPending = false;
+        SendContinue();
+        nIn += len;
+        if (g_useHttps != 2) {
+            fflush(stdout);             // fork 之前刷新缓冲区，避免子进程重复输出缓存中的数据
+            pid = fork();
+        }
+        if (pid == 0) {
+            signal(SIGPIPE, SIG_IGN);   // CGI 不再读取时，写入返回 EPIPE
+            signal(SIGALRM, SIG_DFL);
+            alarm(15 + len / 2000);     // 防止慢速 POST 攻击：15 秒基础 + 每 2KB 数据增加 1 秒
+            _exit(PostCopy(fd, len) ? 0 : 1);
+        }
+        if (pid > 0) {
+            metrics_fork(METRICS_FORK_POST);
+            size_t nBuf = g_nConnIn - g_iConnIn;
+            g_iConnIn += nBuf < len ? nBuf : len;   // 这部分由子进程写入
+            g_postFeeder = pid;
+        } else {
+            SetTimeout(15 + (int) len / 2000, 803/* 日志：POST 数据超时 */);
+            if (!PostCopy(fd, len)) closeConnection = true;
+            SetTimeout(30, 804/* 日志：解码 HTTP 请求超时 */);
+        }
+    }
+    if (zPostData) {
+        free(zPostData);
+        zPostData = 0;
+        nPostData = 0;
+    }
+    close(fd);
+}
+
+// 等待 FeedPostData() 创建的子进程结束，请求体没有完整读取（连接已不同步）时需要关闭连接
+static void PostFeederWait(void) {
+    int status = 0;
+    if (g_postFeeder <= 0) return;
+    while (waitpid(g_postFeeder, &status, 0) < 0) {
+        if (errno == EINTR) continue;
+        status = -1;                    // 已经被回收，无法知道结果
+        break;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) closeConnection = true;
+    g_postFeeder = 0;
 }
 
 // 执行和 fwrite() 一样的功能
@@ -2207,6 +3155,93 @@ static void althttpd_fflush(FILE *f) {
     if (g_useHttps != 2) fflush(f);
 }
 
+/*
+** CGI / SCGI 回复的读取缓冲：回复头部以 read() 直接从 fd 读入这里逐行解析，读过头的响应体开头部分也留在这里，
+** 之后先从这里取数据，取完后才通过文件流读取。CGI 管道的文件流是无缓冲的，因此 splice() 之前只需要发出这里剩下的数据
+*/
+static char g_zCgiIn[4096];
+static size_t g_iCgiIn = 0;                 // g_zCgiIn 中已经取走的字节数
+static size_t g_nCgiIn = 0;                 // g_zCgiIn 中的数据长度
+
+// 和 fgets() 一样从 in 中读取一行，但是经由 g_zCgiIn 以 read() 读入
+static char *CgiGets(char *zLine, int nLine, FILE *in) {
+    int i = 0;
+    while (i < nLine - 1) {
+        if (g_iCgiIn >= g_nCgiIn) {
+            ssize_t got = read(fileno(in), g_zCgiIn, sizeof(g_zCgiIn));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            g_iCgiIn = 0;
+            g_nCgiIn = (size_t) got;
+        }
+        char c = g_zCgiIn[g_iCgiIn++];
+        zLine[i++] = c;
+        if (c == '\n') break;
+    }
+    if (i == 0) return 0;
+    zLine[i] = 0;
+    return zLine;
+}
+
+// 和 fread(z, 1, n, in) 一样读取数据：g_zCgiIn 中还有数据时只返回其中的数据
+static size_t CgiRead(void *z, size_t n, FILE *in) {
+    if (g_iCgiIn < g_nCgiIn) {
+        if (n > g_nCgiIn - g_iCgiIn) n = g_nCgiIn - g_iCgiIn;
+        memcpy(z, g_zCgiIn + g_iCgiIn, n);
+        g_iCgiIn += n;
+        return n;
+    }
+    return fread(z, 1, n, in);
+}
+
+// 把 in 中的 *pnXfer 字节（-1 表示直到结束）通过 splice() 从管道直接转移到套接字（标准输出），数据不经过用户空间
+// + 返回 true 表示已经完成（或者客户端已断开）；返回 false 时 *pnXfer 为剩余的字节数，由调用者以缓冲复制继续：
+//   内置 TLS 模式、in 不是管道或标准输出不是套接字时不能使用 splice()
+// + in 必须是无缓冲的文件流（CgiHandleReply() 中的 CGI 管道），否则 stdio 缓冲中的数据会被跳过
+static bool SpliceOut(FILE *in, ssize_t *pnXfer) {
+#ifdef linux
+    ssize_t nXfer = *pnXfer;
+    struct stat st;
+
+    if (g_useHttps == 2 || nXfer == 0) return false;
+    if (fstat(fileno(in), &st) != 0 || !S_ISFIFO(st.st_mode)) return false;
+
+    // 读取 CGI 头部时一起读入的部分先复制出去
+    if (g_iCgiIn < g_nCgiIn) {
+        size_t n = g_nCgiIn - g_iCgiIn;
+        if (nXfer > 0 && (size_t) nXfer < n) n = (size_t) nXfer;
+        fwrite(g_zCgiIn + g_iCgiIn, 1, n, stdout);
+        g_iCgiIn += n;
+        nOut += n;
+        if (nXfer > 0) nXfer -= (ssize_t) n;
+    }
+    fflush(stdout);
+
+    while (nXfer != 0) {
+        size_t n = nXfer < 0 || nXfer > 0x100000 ? 0x100000 : (size_t) nXfer;
+        ssize_t got = splice(fileno(in), NULL, fileno(stdout), NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == EAGAIN) {
+                *pnXfer = nXfer;
+                return false;
+            }
+            break;                      // 客户端已断开
+        }
+        if (got == 0) break;            // CGI 输出结束
+        nOut += (size_t) got;
+        scoreboard_sent(nOut);
+        if (nXfer > 0) nXfer -= got;
+    }
+    *pnXfer = 0;
+    return true;
+#else
+    (void) in;
+    (void) pnXfer;
+    return false;
+#endif
+}
+
 /*
 ** Transfer nXfer bytes from in to out, after first discarding
 ** nSkip bytes from in.  Increment the nOut global variable
@@ -2223,14 +3258,15 @@ static void xferBytes(FILE *in, FILE *out, ssize_t nXfer, ssize_t nSkip) {
     while (nSkip > 0) {
         n = nSkip;
         if (n > sizeof(zBuf)) n = sizeof(zBuf);
-        got = fread(zBuf, 1, n, in);
+        got = CgiRead(zBuf, n, in);
         if (got == 0) break;
         nSkip -= (ssize_t)got;
     }
+    if (out == stdout && SpliceOut(in, &nXfer)) return;
     while (nXfer > 0) {
         n = nXfer;
         if (n > sizeof(zBuf)) n = sizeof(zBuf);
-        got = fread(zBuf, 1, n, in);
+        got = CgiRead(zBuf, n, in);
         if (got == 0) break;
         althttpd_fwrite(zBuf, got, 1, out);
         nOut += got;
@@ -2238,6 +3274,567 @@ static void xferBytes(FILE *in, FILE *out, ssize_t nXfer, ssize_t nSkip) {
     }
 }
 
+/*
+** 动态响应体（CGI、C 脚本、SQTP）的输出：可选的 gzip 流式压缩，以及长度未知时的 chunked 传输编码
+*/
+static z_stream g_bodyZ;                    // BODY_GZIP 时的压缩流
+static bool g_bodyChunked = false;          // 响应体以 chunked 编码发送（HTTP/1.1），否则以关闭连接结束
+static char *g_zBodyPend = 0;               // BODY_PENDING 时暂存的响应体（g_gzipMin 字节）
+static size_t g_nBodyPend = 0;
+
+static char g_zBodyChunk[16384];            // 编码后的响应体先收集到这里，凑满后作为一个分块输出
+static size_t g_nBodyChunk = 0;
+
+// 输出一个分块（chunked 时加上分块的长度和结尾）
+static void BodyWriteChunk(const void *p, size_t n) {
+    char zHdr[24];
+    int nHdr;
+    if (n == 0) return;
+    if (g_bodyChunked) {
+        nHdr = snprintf(zHdr, sizeof(zHdr), "%zx" CRLF, n);
+        althttpd_fwrite(zHdr, 1, (size_t) nHdr, stdout);
+        nOut += (size_t) nHdr + 2;
+    }
+    althttpd_fwrite(p, 1, n, stdout);
+    if (g_bodyChunked) althttpd_fwrite(CRLF, 1, 2, stdout);
+    nOut += n;
+}
+
+static void BodyFlushChunk(void) {
+    BodyWriteChunk(g_zBodyChunk, g_nBodyChunk);
+    g_nBodyChunk = 0;
+}
+
+// 输出一段编码后的响应体。althttpd_printf() 每次输出的内容很少，收集起来避免产生大量很小的分块
+static void BodyEmit(const void *p, size_t n) {
+    if (g_nBodyChunk + n > sizeof(g_zBodyChunk)) BodyFlushChunk();
+    if (n >= sizeof(g_zBodyChunk)) {
+        BodyWriteChunk(p, n);
+        return;
+    }
+    memcpy(g_zBodyChunk + g_nBodyChunk, p, n);
+    g_nBodyChunk += n;
+}
+
+// 压缩 n 字节（p 可以为空），flush 为 deflate() 的 flush 参数
+static void BodyDeflate(const void *p, size_t n, int flush) {
+    unsigned char zOut[16384];
+    g_bodyZ.next_in = (Bytef *) p;
+    g_bodyZ.avail_in = (uInt) n;
+    do {
+        g_bodyZ.next_out = zOut;
+        g_bodyZ.avail_out = sizeof(zOut);
+        if (deflate(&g_bodyZ, flush) == Z_STREAM_ERROR) break;
+        BodyEmit(zOut, sizeof(zOut) - g_bodyZ.avail_out);
+    } while (g_bodyZ.avail_out == 0);
+}
+
+// 响应的类型是否在允许压缩的列表中
+static bool BodyTypeCompressible(const char *zType) {
+    const char *z = g_zGzipTypes;
+    size_t nType;
+    if (zType == 0) return false;
+    while (isspace((unsigned char) *zType)) zType++;
+    for (nType = 0; zType[nType] && zType[nType] != ';' && !isspace((unsigned char) zType[nType]); nType++) {}
+    while (z && *z) {
+        size_t n = strcspn(z, ",");
+        if (n > 0 && (z[n - 1] == '/' ? n <= nType : n == nType) && strncasecmp(z, zType, n) == 0) return true;
+        z += n;
+        if (*z == ',') z++;
+    }
+    return false;
+}
+
+// Accept-Encoding 是否接受 gzip：逐项比较编码名（gzip、x-gzip，没有列出时看 *），q=0 表示不接受
+static bool AcceptsGzip(const char *zAccept) {
+    int iGzip = -1, iAny = -1;
+    if (zAccept == 0) return false;
+    while (*zAccept) {
+        const char *zName, *z;
+        size_t nName;
+        int bAccept = 1;
+        while (*zAccept == ' ' || *zAccept == '\t' || *zAccept == ',') zAccept++;
+        zName = zAccept;
+        while (*zAccept && *zAccept != ',' && *zAccept != ';' && *zAccept != ' ' && *zAccept != '\t') zAccept++;
+        nName = (size_t)(zAccept - zName);
+        // 参数：只关心 q，值为 0（0、0.0、0.000）时不接受
+        while (*zAccept == ';' || *zAccept == ' ' || *zAccept == '\t') {
+            while (*zAccept == ';' || *zAccept == ' ' || *zAccept == '\t') zAccept++;
+            if ((*zAccept == 'q' || *zAccept == 'Q') && zAccept[1] == '=') {
+                z = zAccept + 2;
+                if (*z == '0') {
+                    for (z++; *z == '.' || *z == '0'; z++) {}
+                    if (*z == 0 || *z == ',' || *z == ';' || *z == ' ' || *z == '\t') bAccept = 0;
+                }
+            }
+            while (*zAccept && *zAccept != ',' && *zAccept != ';') zAccept++;
+        }
+        while (*zAccept && *zAccept != ',') zAccept++;
+        if ((nName == 4 && strncasecmp(zName, "gzip", 4) == 0) || (nName == 6 && strncasecmp(zName, "x-gzip", 6) == 0)) {
+            if (iGzip != 1) iGzip = bAccept;
+        } else if (nName == 1 && *zName == '*') {
+            iAny = bAccept;
+        }
+    }
+    return iGzip >= 0 ? iGzip == 1 : iAny == 1;
+}
+
+// 以 gzip 压缩输出响应体：结束头部并初始化压缩流，初始化失败时不压缩
+static void BodyStartGzip(void) {
+    if (deflateInit2(&g_bodyZ, g_gzipLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        nOut += althttpd_printf("%s" CRLF, g_bodyChunked ? "Transfer-Encoding: chunked" CRLF : "");
+        g_bodyMode = BODY_STREAM;
+        return;
+    }
+    nOut += althttpd_printf("Content-Encoding: gzip" CRLF "%s" CRLF,
+                            g_bodyChunked ? "Transfer-Encoding: chunked" CRLF : "");
+    g_bodyMode = BODY_GZIP;
+}
+
+// 暂存的内容超过了最小压缩大小（或者需要立即发送），开始压缩
+static void BodyStartPending(void) {
+    g_bodyMode = BODY_DIRECT;
+    BodyStartGzip();
+    if (g_bodyMode == BODY_GZIP) BodyDeflate(g_zBodyPend, g_nBodyPend, Z_NO_FLUSH);
+    else BodyEmit(g_zBodyPend, g_nBodyPend);
+    g_nBodyPend = 0;
+}
+
+static void BodyWrite(const void *p, size_t n) {
+    if (n == 0) return;
+    switch (g_bodyMode) {
+        case BODY_PENDING:
+            if (g_nBodyPend + n <= g_gzipMin) {
+                memcpy(g_zBodyPend + g_nBodyPend, p, n);
+                g_nBodyPend += n;
+                return;
+            }
+            BodyStartPending();
+            BodyWrite(p, n);
+            return;
+        case BODY_GZIP:
+            BodyDeflate(p, n, Z_NO_FLUSH);
+            return;
+        case BODY_STREAM:
+            BodyEmit(p, n);
+            return;
+        default:
+            althttpd_fwrite(p, 1, n, stdout);
+            nOut += n;
+    }
+}
+
+// 响应体输出期间的 althttpd_printf()。输出的字节数由 BodyEmit() 计入 nOut，因此返回 0
+static int BodyVprintf(char const *fmt, va_list va) {
+    char zBuf[1000];
+    char *z = zBuf;
+    va_list va2;
+    int n;
+    va_copy(va2, va);
+    n = vsnprintf(zBuf, sizeof(zBuf), fmt, va);
+    if (n >= (int) sizeof(zBuf)) {
+        z = SafeMalloc((size_t) n + 1);
+        vsnprintf(z, (size_t) n + 1, fmt, va2);
+    }
+    va_end(va2);
+    if (n > 0) BodyWrite(z, (size_t) n);
+    if (z != zBuf) free(z);
+    return 0;
+}
+
+// 当前请求的协议版本是否为 HTTP/1.1 及以上（包括 HTTP/2 的流，其协议版本为 "HTTP/2.0"）
+static bool ProtocolAtLeast11(void) {
+    return zProtocol[5] > '1' || (zProtocol[5] == '1' && zProtocol[7] >= '1');
+}
+
+/*
+** 开始输出动态响应体。调用者已经输出了除长度（Content-length）之外的所有头部字段，
+** 这里输出长度或编码相关的头部字段和空行，之后的 althttpd_printf() 输出作为响应体，直到 httpd_body_end()
+**
+** zContentType 为响应的类型，nLength 为响应体的长度（未知时为 -1），zAccept 为请求的 Accept-Encoding。
+** 客户端接受 gzip（q 不为 0）、类型在允许压缩的列表中
+** 并且长度不小于 g_gzipMin 时压缩；长度未知时先暂存 g_gzipMin 字节，不足该长度的响应体不压缩
+** + 类型可以压缩时，不论这次是否压缩都回复 Vary: Accept-Encoding，共享缓存不会把一种编码的回复给了另一种客户端
+*/
+void httpd_body_begin(const char *zContentType, long long nLength, const char *zAccept) {
+    bool bVary = g_gzipLevel > 0 && BodyTypeCompressible(zContentType);
+    bool bGzip = bVary
+                 && AcceptsGzip(zAccept)
+                 && g_nRange == 0
+                 && strcmp(zMethod, "HEAD") != 0
+                 && (nLength < 0 || (size_t) nLength >= g_gzipMin);
+
+    if (bVary) nOut += althttpd_printf("Vary: Accept-Encoding" CRLF);
+
+    g_bodyChunked = ProtocolAtLeast11();
+    if (!g_bodyChunked) closeConnection = true;
+    if (bGzip && nLength < 0 && g_gzipMin > 0) {
+        if (g_zBodyPend == 0) g_zBodyPend = SafeMalloc(g_gzipMin);
+        g_nBodyPend = 0;
+        g_bodyMode = BODY_PENDING;
+    } else if (bGzip) {
+        BodyStartGzip();
+    } else if (nLength >= 0) {
+        nOut += althttpd_printf("Content-length: %lld" CRLF CRLF, nLength);
+    } else {
+        nOut += althttpd_printf("%s" CRLF, g_bodyChunked ? "Transfer-Encoding: chunked" CRLF : "");
+        g_bodyMode = BODY_STREAM;
+    }
+}
+
+// 把 in 中的 nXfer 字节作为响应体输出
+static void BodyCopy(FILE *in, ssize_t nXfer) {
+    char zBuf[16384];
+    size_t got;
+    if (g_bodyMode == BODY_DIRECT) {
+        xferBytes(in, stdout, nXfer, 0);   // 不需要编码时直接转移（可以使用 splice()）
+        return;
+    }
+    while (nXfer > 0) {
+        got = CgiRead(zBuf, nXfer > (ssize_t) sizeof(zBuf) ? sizeof(zBuf) : (size_t) nXfer, in);
+        if (got == 0) break;
+        BodyWrite(zBuf, got);
+        nXfer -= (ssize_t) got;
+    }
+}
+
+// 把已经编码的响应体立即发送给客户端（压缩流以 Z_SYNC_FLUSH 输出已压缩的全部内容）
+static void BodyFlush(void) {
+    int mode;
+    if (g_bodyMode == BODY_PENDING) BodyStartPending();     // 还不能确定长度，按照需要压缩处理
+    mode = g_bodyMode;
+    if (mode == BODY_GZIP) BodyDeflate(0, 0, Z_SYNC_FLUSH);
+    g_bodyMode = BODY_DIRECT;
+    BodyFlushChunk();
+    g_bodyMode = mode;
+    althttpd_fflush(stdout);
+}
+
+// 把 in 的全部剩余内容（长度未知）作为响应体输出，每次读取尽可能多的数据
+// + 暂时没有数据时（CGI 还在运行），如果等待超过 50 毫秒就先把已有的内容发送给客户端，长轮询和逐步输出的 CGI 不会被缓冲住
+static void BodyStream(FILE *in) {
+    char zBuf[65536];
+    int fd = fileno(in);
+    int flags = fcntl(fd, F_GETFL);
+    struct pollfd pfd;
+    size_t got;
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    for (;;) {
+        got = CgiRead(zBuf, sizeof(zBuf), in);
+        if (got > 0) BodyWrite(zBuf, got);
+        if (feof(in)) break;
+        if (!ferror(in)) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+        clearerr(in);
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 50) == 0) {
+            BodyFlush();
+            poll(&pfd, 1, -1);
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+}
+
+// 结束动态响应体：输出压缩流剩余的内容和 chunked 的结尾
+void httpd_body_end(void) {
+    int mode = g_bodyMode;
+    g_bodyMode = BODY_DIRECT;
+    if (mode == BODY_PENDING) {
+        // 响应体不足最小压缩大小，不压缩
+        nOut += althttpd_printf("Content-length: %zu" CRLF CRLF, g_nBodyPend);
+        althttpd_fwrite(g_zBodyPend, 1, g_nBodyPend, stdout);
+        nOut += g_nBodyPend;
+        g_nBodyPend = 0;
+        return;
+    }
+    g_bodyMode = mode;
+    if (mode == BODY_GZIP) {
+        BodyDeflate(0, 0, Z_FINISH);
+        deflateEnd(&g_bodyZ);
+    }
+    g_bodyMode = BODY_DIRECT;
+    BodyFlushChunk();
+    if ((mode == BODY_GZIP || mode == BODY_STREAM) && g_bodyChunked) {
+        althttpd_fwrite("0" CRLF CRLF, 1, 5, stdout);
+        nOut += 5;
+    }
+}
+
+// ---------------------------
+// 常驻 C 脚本（-R/--resident）
+/* + 脚本的 handle_request(wpp_req*, wpp_res*) 在请求处理进程中调用，不 fork CGI 子进程，也不经管道解析 CGI 的头部
+ | + 请求的内容都在全局变量中，wpp_req 只是一个句柄：wpp_param() 以 CGI 环境变量的名字（cgienv）读取
+ | + 状态和头部字段先记录在 wpp_res 中，第一次输出响应体（或者脚本返回）时和通用的头部一起发送，
+ |   响应体经 httpd_body_begin() 输出（可能压缩，长度未知时以 chunked 编码）
+ | + 脚本的 printf() 会直接写到连接上，必须使用 wpp_write()/wpp_printf()
+*/
+struct wpp_req {
+    int                 iUnused;
+};
+struct wpp_res {
+    char                zStatus[64];        /* 回复的状态，默认 "200 OK" */
+    char*               zHdr;               /* 已设置的头部字段（每个以 CRLF 结尾） */
+    size_t              nHdr;
+    size_t              nHdrAlloc;
+    char                zType[200];         /* Content-Type 的值，用于判断是否可以压缩 */
+    bool                bEncoding;          /* 脚本自己设置了 Content-Encoding（不再压缩） */
+    bool                bBody;              /* 已经开始输出响应体，不能再设置状态和头部 */
+};
+static wpp_req g_wppReq;
+static wpp_res g_wppRes;
+
+const char *wpp_param(wpp_req *req, const char *zName) {
+    (void) req;
+    if (strcmp(zName, "GATEWAY_INTERFACE") == 0) return "CGI/1.0";
+    for (size_t i = 0; i < sizeof(cgienv) / sizeof(cgienv[0]); i++) {
+        if (strcmp(cgienv[i].zEnvName, zName) == 0) return *cgienv[i].pzEnvValue;
+    }
+    return 0;
+}
+
+const char *wpp_body(wpp_req *req, size_t *pnBody) {
+    (void) req;
+    if (pnBody) *pnBody = nPostData;
+    return zPostData;
+}
+
+void wpp_status(wpp_res *res, const char *zStatus) {
+    if (res->bBody || strpbrk(zStatus, "\r\n")) return;
+    snprintf(res->zStatus, sizeof(res->zStatus), "%s", zStatus);
+}
+
+// 包含 CR、LF 的名字或值被忽略（不能借此插入其它头部字段或者提前结束头部）
+void wpp_header(wpp_res *res, const char *zName, const char *zValue) {
+    size_t n;
+    if (res->bBody || strpbrk(zName, "\r\n:") || strpbrk(zValue, "\r\n")) return;
+    if (strcasecmp(zName, "Content-Type") == 0) {
+        snprintf(res->zType, sizeof(res->zType), "%s", zValue);
+        return;
+    }
+    if (strcasecmp(zName, "Content-Encoding") == 0) res->bEncoding = true;
+    n = strlen(zName) + strlen(zValue) + 4;
+    if (res->nHdr + n + 1 > res->nHdrAlloc) {
+        res->nHdrAlloc = (res->nHdrAlloc + n) * 2;
+        res->zHdr = realloc(res->zHdr, res->nHdrAlloc);
+        if (res->zHdr == 0) Malfunction(612, /* LOG: OOM */ "Out of memory for resident script headers");
+    }
+    res->nHdr += (size_t) sprintf(res->zHdr + res->nHdr, "%s: %s" CRLF, zName, zValue);
+}
+
+// 发送状态行和头部字段，开始响应体
+static void ResidentBegin(wpp_res *res) {
+    if (res->bBody) return;
+    res->bBody = true;
+    StartResponse(res->zStatus);
+    if (res->nHdr) {
+        althttpd_fwrite(res->zHdr, 1, res->nHdr, stdout);
+        nOut += res->nHdr;
+    }
+    nOut += althttpd_printf("Content-Type: %s" CRLF, res->zType);
+    httpd_body_begin(res->bEncoding ? 0 : res->zType, -1, zAcceptEncoding);
+}
+
+size_t wpp_write(wpp_res *res, const void *pData, size_t nData) {
+    ResidentBegin(res);
+    BodyWrite(pData, nData);
+    return nData;
+}
+
+int wpp_printf(wpp_res *res, const char *zFormat, ...) {
+    va_list ap;
+    int n;
+    ResidentBegin(res);
+    va_start(ap, zFormat);
+    n = vsnprintf(0, 0, zFormat, ap);
+    va_end(ap);
+    va_start(ap, zFormat);
+    BodyVprintf(zFormat, ap);
+    va_end(ap);
+    return n;
+}
+
+// 在本进程中调用常驻脚本处理请求（httpd_cgi_c_prepare() 之后）
+// + 脚本返回非 0 并且还没有输出任何内容时回复 500
+static void ResidentReply(void) {
+    int rc;
+    ReadPostData();             // 请求体完整读入，wpp_body() 直接返回
+    ComputeRequestUri();
+    free(g_wppRes.zHdr);
+    memset(&g_wppRes, 0, sizeof(g_wppRes));
+    strcpy(g_wppRes.zStatus, "200 OK");
+    strcpy(g_wppRes.zType, "text/html; charset=utf-8");
+    rc = httpd_cgi_c_handle(&g_wppReq, &g_wppRes);
+    if (rc != 0 && !g_wppRes.bBody) CgiError();
+    ResidentBegin(&g_wppRes);
+    httpd_body_end();
+}
+
+// ---------------------------
+// Range 请求
+/* + Range 头字段在解析请求头时保存到 g_aRange 中（可以有多个范围，包括 a-、-n 形式），
+ |   发送内容时再根据内容的长度计算实际的范围（RangeResolve()）：一个范围回复 206 和 Content-Range，
+ |   多个范围回复 multipart/byteranges，所有范围都超出内容长度时回复 416
+ | + If-Range 和当前内容的 ETag / 修改时间不一致时忽略 Range，回复完整的内容
+ | + 位置和长度都是 64 位，超过 4GB 的文件也可以定位
+*/
+
+// 解析 Range 头字段（bytes=a-b,c-,-n），格式错误或者范围过多时忽略整个头字段
+static void RangeParse(const char *z) {
+    int n = 0;
+    g_nRange = 0;
+    while (isspace((unsigned char) *z)) z++;
+    if (strncasecmp(z, "bytes=", 6) != 0) return;
+    z += 6;
+    for (;;) {
+        ByteRange r;
+        char *zEnd;
+        while (*z == ' ' || *z == '\t') z++;
+        if (*z == '-') {
+            if (!isdigit((unsigned char) z[1])) return;
+            r.iFirst = -1;
+            r.iLast = strtoll(z + 1, &zEnd, 10);
+        } else {
+            if (!isdigit((unsigned char) *z)) return;
+            r.iFirst = strtoll(z, &zEnd, 10);
+            if (*zEnd != '-') return;
+            z = zEnd + 1;
+            if (isdigit((unsigned char) *z)) {
+                r.iLast = strtoll(z, &zEnd, 10);
+                if (r.iLast < r.iFirst) return;
+            } else {
+                r.iLast = -1;
+                zEnd = (char *) z;
+            }
+        }
+        if (n == MAX_RANGES) return;    // 大量细碎的范围可以用来放大服务器的开销
+        g_aRange[n++] = r;
+        z = zEnd;
+        while (*z == ' ' || *z == '\t') z++;
+        if (*z == 0) break;
+        if (*z++ != ',') return;
+    }
+    g_nRange = n;
+}
+
+// 根据内容的长度 nSize 计算实际的字节范围：丢弃超出内容的范围，按起始位置排序，合并重叠或相邻的范围
+// + 返回范围数；不是 Range 请求时返回 0，所有范围都无法满足时返回 -1
+static int RangeResolve(long long nSize) {
+    int i, n = 0, m = 0;
+    if (g_nRange == 0) return 0;
+    for (i = 0; i < g_nRange; i++) {
+        ByteRange r = g_aRange[i];
+        if (r.iFirst < 0) {
+            if (r.iLast == 0) continue;
+            r.iFirst = r.iLast >= nSize ? 0 : nSize - r.iLast;
+            r.iLast = nSize - 1;
+        } else {
+            if (r.iFirst >= nSize) continue;
+            if (r.iLast < 0 || r.iLast >= nSize) r.iLast = nSize - 1;
+        }
+        int j = n++;                    // 插入排序（j <= i，不会覆盖还没处理的项）
+        while (j > 0 && g_aRange[j - 1].iFirst > r.iFirst) {
+            g_aRange[j] = g_aRange[j - 1];
+            j--;
+        }
+        g_aRange[j] = r;
+    }
+    for (i = 0; i < n; i++) {
+        if (m > 0 && g_aRange[i].iFirst <= g_aRange[m - 1].iLast + 1) {
+            if (g_aRange[i].iLast > g_aRange[m - 1].iLast) g_aRange[m - 1].iLast = g_aRange[i].iLast;
+        } else {
+            g_aRange[m++] = g_aRange[i];
+        }
+    }
+    g_nRange = m;
+    return m ? m : -1;
+}
+
+// If-Range 条件是否成立（没有 If-Range 时总是成立）：强 ETag 和 zETag 比较，日期和内容的修改时间比较
+static bool IfRangeMatch(const char *zETag, time_t tMtime) {
+    size_t n = strlen(zETag);
+    if (zIfRange == 0) return true;
+    if (zIfRange[0] == '"') return strncmp(zIfRange + 1, zETag, n) == 0 && strcmp(zIfRange + 1 + n, "\"") == 0;
+    if (zIfRange[0] == 'W' && zIfRange[1] == '/') return false;    // 弱 ETag 不能用于 If-Range
+    return ParseRfc822Date(zIfRange) == tMtime;
+}
+
+// 回复 416：所有范围都超出了内容的长度
+static void RangeNotSatisfiable(long long nSize) {
+    RespHdr resp;
+    RespInit(&resp);
+    RespStatus(&resp, "416 Range Not Satisfiable");
+    RespPrintf(&resp, "Content-Range: bytes */%lld" CRLF, nSize);
+    RespAddConst(&resp, "Content-length: 0" CRLF CRLF);
+    nOut += RespSend(&resp, 0, 0, 0);
+    MakeLogEntry(0, 490); /* LOG: Range not satisfiable */
+}
+
+static char g_zRangeBoundary[40];           // multipart/byteranges 的分隔符
+
+// 生成第 i 个范围的部分头部（分隔符、Content-type、Content-Range），返回长度
+static size_t RangePartHeader(char *z, size_t n, int i, const char *zType, long long nSize) {
+    return (size_t) snprintf(z, n, CRLF "--%s" CRLF "Content-type: %s" CRLF "Content-Range: bytes %lld-%lld/%lld" CRLF CRLF,
+                             g_zRangeBoundary, zType, g_aRange[i].iFirst, g_aRange[i].iLast, nSize);
+}
+
+// 多个范围：添加 multipart/byteranges 的 Content-type 和 Content-length（预先计算全部部分头部和内容的长度）
+static void RangeMultipartHeader(RespHdr *p, const char *zType, long long nSize) {
+    char zPart[400];
+    long long nBody = 0;
+    snprintf(g_zRangeBoundary, sizeof(g_zRangeBoundary), "%08x%08lx",
+             (unsigned) getpid(), (unsigned long) tsBeginTime.tv_nsec);     // 每个响应不同，不会恰好出现在内容中
+    for (int i = 0; i < g_nRange; i++) {
+        nBody += (long long) RangePartHeader(zPart, sizeof(zPart), i, zType, nSize);
+        nBody += g_aRange[i].iLast + 1 - g_aRange[i].iFirst;
+    }
+    nBody += (long long) strlen(g_zRangeBoundary) + 8;     // CRLF "--" boundary "--" CRLF
+    RespPrintf(p, "Content-type: multipart/byteranges; boundary=%s" CRLF, g_zRangeBoundary);
+    RespPrintf(p, "Content-length: %lld" CRLF CRLF, nBody);
+}
+
+// 发送文件 in 中从 iOfs 开始的 nLen 字节
+// + 普通 TCP 连接上通过 sendfile() 循环发送（单次调用最多 0x7ffff000 字节），任意大小的文件都不经过用户态缓冲
+static void SendFileRange(FILE *in, long long iOfs, long long nLen) {
+#ifdef linux
+    if (g_useHttps != 2) {
+        off_t offset = (off_t) iOfs;
+        long long nMax = scoreboard_enabled() ? 0x100000 : 0x7ffff000;  // 记分板开启时每次最多 1MB，以便随时更新已发送的字节数
+        fflush(stdout);
+        while (nLen > 0) {
+            ssize_t n = sendfile(1, fileno(in), &offset, nLen > nMax ? (size_t) nMax : (size_t) nLen);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;         // 客户端已断开，或者文件被截短
+            nOut += (size_t) n;
+            scoreboard_sent(nOut);
+            nLen -= n;
+        }
+        return;
+    }
+#endif
+    if (fseeko(in, (off_t) iOfs, SEEK_SET) == 0) xferBytes(in, stdout, (ssize_t) nLen, 0);
+}
+
+// 多个范围：依次发送每个部分的头部和内容，内容来自文件 in 或者内存 pMem
+static void RangeMultipartSend(const char *zType, long long nSize, FILE *in, const uint8_t *pMem) {
+    char zPart[400];
+    for (int i = 0; i < g_nRange; i++) {
+        long long nLen = g_aRange[i].iLast + 1 - g_aRange[i].iFirst;
+        size_t n = RangePartHeader(zPart, sizeof(zPart), i, zType, nSize);
+        althttpd_fwrite(zPart, 1, n, stdout);
+        nOut += n;
+        if (pMem) {
+            althttpd_fwrite(pMem + g_aRange[i].iFirst, 1, (size_t) nLen, stdout);
+            nOut += (size_t) nLen;
+        } else {
+            SendFileRange(in, g_aRange[i].iFirst, nLen);
+        }
+    }
+    nOut += (size_t) althttpd_printf(CRLF "--%s--" CRLF, g_zRangeBoundary);
+    althttpd_fflush(stdout);
+}
+
 /*
 ** Send a file from buildins (virtual file system) as the reply.
 ** Supports direct gzip delivery if client accepts gzip encoding.
@@ -2258,6 +3855,11 @@ static int SendBuildins(
     size_t content_length = 0;
     const uint8_t *content_data = NULL;
     void *decompressed_data = NULL;
+    RespHdr resp;
+    int nRange;
+    char zType[200];
+
+    RespInit(&resp);
 
     // 获取 MIME 类型
     pMimeType = GetMimeType(csFile, iLenFile);
@@ -2276,17 +3878,19 @@ static int SendBuildins(
             && (t = ParseRfc822Date(zIfModifiedSince)) > 0
             && t >= time(NULL))  // buildins 文件视为从不修改
     ) {
-        StartResponse("304 Not Modified");
-        nOut += DateTag("Last-Modified", time(NULL));
-        nOut += althttpd_printf("Cache-Control: max-age=%d" CRLF, g_mxAge);
-        nOut += althttpd_printf("ETag: \"%s\"" CRLF CRLF, zETag);
-        fflush(stdout);
+        RespStatus(&resp, "304 Not Modified");
+        RespPrintf(&resp, "Last-Modified: %s" CRLF, Rfc822Date(time(NULL)));
+        RespAddMaxAge(&resp);
+        RespPrintf(&resp, "ETag: \"%s\"" CRLF CRLF, zETag);
+        nOut += RespSend(&resp, 0, 0, 0);
         MakeLogEntry(0, 470);  /* LOG: ETag Cache Hit */
         return 1;
     }
 
+    if (!IfRangeMatch(zETag, t)) g_nRange = 0;
+
     // 决定是否发送压缩数据
-    if (rangeEnd <= 0 && zAcceptEncoding && strstr(zAcceptEncoding, "gzip") != 0) {
+    if (g_nRange == 0 && zAcceptEncoding && strstr(zAcceptEncoding, "gzip") != 0) {
         // 客户端支持 gzip，直接发送压缩数据
         zEncoding = "gzip";
         content_data = info->comp;
@@ -2302,47 +3906,54 @@ static int SendBuildins(
     }
 
     // 处理 Range请求
-    if (rangeEnd > 0 && rangeStart < content_length) {
-        StartResponse("206 Partial Content");
-        if (rangeEnd >= content_length) {
-            rangeEnd = content_length - 1;
-        }
-        nOut += althttpd_printf("Content-Range: bytes %lld-%lld/%zu" CRLF,
-                                (long long) rangeStart, (long long) rangeEnd,
-                                content_length);
-        content_length = rangeEnd + 1 - rangeStart;
-        content_data += rangeStart;
+    nRange = RangeResolve((long long) content_length);
+    if (nRange < 0) {
+        RangeNotSatisfiable((long long) content_length);
+        return 1;
+    }
+    if (nRange > 0) {
+        RespStatus(&resp, "206 Partial Content");
     } else {
-        StartResponse("200 OK");
-        rangeStart = 0;
+        RespStatus(&resp, "200 OK");
     }
 
-    // 发送 HTTP 头部
-    nOut += DateTag("Last-Modified", time(NULL));
-    if (g_enableSAB) {
-        nOut += althttpd_printf("Cross-Origin-Opener-Policy: same-origin" CRLF);
-        nOut += althttpd_printf("Cross-Origin-Embedder-Policy: require-corp" CRLF);
-    }
-    nOut += althttpd_printf("Cache-Control: max-age=%d" CRLF, g_mxAge);
-    nOut += althttpd_printf("ETag: \"%s\"" CRLF, zETag);
-    nOut += althttpd_printf("Content-type: %s%s" CRLF, csContentType,
-                            bAddCharset ? "; charset=utf-8" : "");
-    if (zEncoding) {
-        nOut += althttpd_printf("Content-encoding: %s" CRLF, zEncoding);
+    // HTTP 头部
+    snprintf(zType, sizeof(zType), "%s%s", csContentType, bAddCharset ? "; charset=utf-8" : "");
+    RespPrintf(&resp, "Last-Modified: %s" CRLF, Rfc822Date(time(NULL)));
+    if (g_enableSAB) RespAddConst(&resp, g_zSabHeaders);
+    RespAddMaxAge(&resp);
+    RespPrintf(&resp, "ETag: \"%s\"" CRLF, zETag);
+    if (nRange > 1) {
+        RangeMultipartHeader(&resp, zType, (long long) content_length);
+    } else {
+        if (nRange == 1) {
+            RespPrintf(&resp, "Content-Range: bytes %lld-%lld/%zu" CRLF,
+                       g_aRange[0].iFirst, g_aRange[0].iLast, content_length);
+            content_data += g_aRange[0].iFirst;
+            content_length = (size_t) (g_aRange[0].iLast + 1 - g_aRange[0].iFirst);
+        }
+        RespPrintf(&resp, "Content-type: %s" CRLF, zType);
+        if (zEncoding) {
+            RespPrintf(&resp, "Content-encoding: %s" CRLF, zEncoding);
+        }
+        RespPrintf(&resp, "Content-length: %zu" CRLF CRLF, content_length);
     }
-    nOut += althttpd_printf("Content-length: %zu" CRLF CRLF, content_length);
-    fflush(stdout);
 
     // HEAD 请求只发送头部
     if (strcmp(zMethod, "HEAD") == 0) {
+        nOut += RespSend(&resp, 0, 0, 0);
         MakeLogEntry(0, 2); /* LOG: Normal HEAD reply */
-        fflush(stdout);
         return 1;
     }
 
-    // 发送数据
-    althttpd_fwrite(content_data, 1, content_length, stdout);
-    nOut += content_length;
+    if (nRange > 1) {
+        nOut += RespSend(&resp, 0, 0, 0);
+        RangeMultipartSend(zType, (long long) content_length, NULL, content_data);
+        return 0;
+    }
+
+    // 头部和数据通过一次 writev 发送
+    nOut += RespSend(&resp, content_data, content_length, 0);
 
     return 0;
 }
@@ -2356,20 +3967,30 @@ static int SendBuildins(
 static int SendFile(
         const char *csFile,      /* Name of the file to send */
         int iLenFile,            /* Length of the zFile name in bytes */
-        struct stat *pStat      /* Result of a stat() against zFile */
+        struct stat *pStat,      /* Result of a stat() against zFile */
+        const MimeTypeDef *pMimeType    /* MIME 类型（路径解析缓存中已有），NULL 时根据文件名查找 */
 ) {
     const char *csContentType;
     time_t t;
     FILE *in;
     size_t szFilename;
     char zETag[100];
-    const MimeTypeDef *pMimeType;
     int bAddCharset = 1;
     const char *zEncoding = 0;
     struct stat statbuf;
     char zGzFilename[2000];
-
-    pMimeType = GetMimeType(csFile, iLenFile);
+    RespHdr resp;
+    const char *csOrigFile = csFile;    /* 内容缓存的键：原文件名（而不是 .br / .gz 文件名） */
+    struct stat *pOrigStat = pStat;
+    int iEnc = 0;                       /* 客户端接受的压缩编码：1 gzip，2 br */
+    int bCacheable;
+    size_t nStatus, nHdr, nBody;
+    int nRange;
+    long long iOfs = 0, nLen;
+    char zType[200];
+
+    RespInit(&resp);
+    if (pMimeType == 0) pMimeType = GetMimeType(csFile, iLenFile);
     csContentType = pMimeType
                    ? pMimeType->zMimetype : "application/octet-stream";
     if (pMimeType && (MTF_NOCHARSET & pMimeType->flags)) {
@@ -2379,21 +4000,41 @@ static int SendFile(
         free(zPostData);
         zPostData = 0;
     }
-    sprintf(zETag, "m%xs%x", (int) pStat->st_mtime, (int) pStat->st_size);
+    sprintf(zETag, "m%xs%llx", (int) pStat->st_mtime, (unsigned long long) pStat->st_size);
     if (CompareEtags(zIfNoneMatch, zETag) == 0
         || (zIfModifiedSince != 0
             && (t = ParseRfc822Date(zIfModifiedSince)) > 0
             && t >= pStat->st_mtime)
             ) {
-        StartResponse("304 Not Modified");
-        nOut += DateTag("Last-Modified", pStat->st_mtime);
-        nOut += althttpd_printf("Cache-Control: max-age=%d" CRLF, g_mxAge);
-        nOut += althttpd_printf("ETag: \"%s\"" CRLF CRLF, zETag);
-        fflush(stdout);
+        RespStatus(&resp, "304 Not Modified");
+        RespPrintf(&resp, "Last-Modified: %s" CRLF, Rfc822Date(pStat->st_mtime));
+        RespAddMaxAge(&resp);
+        RespPrintf(&resp, "ETag: \"%s\"" CRLF CRLF, zETag);
+        nOut += RespSend(&resp, 0, 0, 0);
         MakeLogEntry(0, 470);  /* LOG: ETag Cache Hit */
         return 1;
     }
-    if (rangeEnd <= 0
+    if (!IfRangeMatch(zETag, pStat->st_mtime)) g_nRange = 0;
+
+    // 小文件的完整响应（头部和内容）可以直接从共享内存内容缓存中回复，不需要任何文件操作
+    bCacheable = file_cache_enabled() && g_nRange == 0 && pStat->st_size <= FILE_CACHE_MAX_FILE;
+    if (bCacheable) {
+        if (zAcceptEncoding && strstr(zAcceptEncoding, "gzip") != 0) iEnc |= 1;
+        if (zAcceptEncoding && strstr(zAcceptEncoding, "br") != 0) iEnc |= 2;
+        if (g_zFileCacheBuf == 0) g_zFileCacheBuf = SafeMalloc(FILE_CACHE_MAX_HDR + FILE_CACHE_MAX_FILE);
+        if (file_cache_get(csFile, iEnc, pStat, g_zFileCacheBuf, &nHdr, &nBody)) {
+            RespStatus(&resp, "200 OK");
+            RespAdd(&resp, g_zFileCacheBuf, nHdr);
+            if (strcmp(zMethod, "HEAD") == 0) {
+                nOut += RespSend(&resp, 0, 0, 0);
+                MakeLogEntry(0, 2); /* LOG: Normal HEAD reply */
+                return 1;
+            }
+            nOut += RespSend(&resp, g_zFileCacheBuf + nHdr, nBody, 0);
+            return 0;
+        }
+    }
+    if (g_nRange == 0
         && zAcceptEncoding) {
         szFilename = strlen(csFile);
         if (szFilename < sizeof(zGzFilename) - 10) {
@@ -2424,50 +4065,68 @@ static int SendFile(
     }
     in = fopen(csFile, "rb");
     if (in == 0) NotFound(480); /* LOG: fopen() failed for static content */
-    if (rangeEnd > 0 && rangeStart < pStat->st_size) {
-        StartResponse("206 Partial Content");
-        if (rangeEnd >= pStat->st_size) {
-            rangeEnd = pStat->st_size - 1;
-        }
-        nOut += althttpd_printf("Content-Range: bytes %lld-%lld/%llu" CRLF,
-                                (long long) rangeStart, (long long) rangeEnd,
-                                (unsigned long long) pStat->st_size);
-        pStat->st_size = rangeEnd + 1 - rangeStart;
+    nLen = (long long) pStat->st_size;
+    nRange = RangeResolve(nLen);
+    if (nRange < 0) {
+        fclose(in);
+        RangeNotSatisfiable(nLen);
+        return 1;
+    }
+    if (nRange > 0) {
+        RespStatus(&resp, "206 Partial Content");
     } else {
-        StartResponse("200 OK");
-        rangeStart = 0;
+        RespStatus(&resp, "200 OK");
+    }
+    if (nRange == 1) {
+        RespPrintf(&resp, "Content-Range: bytes %lld-%lld/%lld" CRLF,
+                   g_aRange[0].iFirst, g_aRange[0].iLast, nLen);
+        iOfs = g_aRange[0].iFirst;
+        nLen = g_aRange[0].iLast + 1 - iOfs;
     }
-    nOut += DateTag("Last-Modified", pStat->st_mtime);
+    nStatus = resp.nTotal;              /* 状态行、Connection、Date 每次重新生成，不缓存 */
+    RespPrintf(&resp, "Last-Modified: %s" CRLF, Rfc822Date(pStat->st_mtime));
     if (g_enableSAB) {
         /* The following two HTTP reply headers are required if javascript
     ** is to make use of SharedArrayBuffer */
-        nOut += althttpd_printf("Cross-Origin-Opener-Policy: same-origin" CRLF);
-        nOut += althttpd_printf("Cross-Origin-Embedder-Policy: require-corp" CRLF);
-    }
-    nOut += althttpd_printf("Cache-Control: max-age=%d" CRLF, g_mxAge);
-    nOut += althttpd_printf("ETag: \"%s\"" CRLF, zETag);
-    nOut += althttpd_printf("Content-type: %s%s" CRLF, csContentType,
-                            bAddCharset ? "; charset=utf-8" : "");
-    if (zEncoding) {
-        nOut += althttpd_printf("Content-encoding: %s" CRLF, zEncoding);
-    }
-    nOut += althttpd_printf("Content-length: %llu" CRLF CRLF,
-                            (unsigned long long) pStat->st_size);
-    fflush(stdout);
+        RespAddConst(&resp, g_zSabHeaders);
+    }
+    RespAddMaxAge(&resp);
+    RespPrintf(&resp, "ETag: \"%s\"" CRLF, zETag);
+    snprintf(zType, sizeof(zType), "%s%s", csContentType, bAddCharset ? "; charset=utf-8" : "");
+    if (nRange > 1) {
+        RangeMultipartHeader(&resp, zType, (long long) pStat->st_size);
+    } else {
+        RespPrintf(&resp, "Content-type: %s" CRLF, zType);
+        if (zEncoding) {
+            RespPrintf(&resp, "Content-encoding: %s" CRLF, zEncoding);
+        }
+        RespPrintf(&resp, "Content-length: %lld" CRLF CRLF, nLen);
+    }
     if (strcmp(zMethod, "HEAD") == 0) {
+        nOut += RespSend(&resp, 0, 0, 0);
         MakeLogEntry(0, 2); /* LOG: Normal HEAD reply */
         fclose(in);
-        fflush(stdout);
         return 1;
     }
-#ifdef linux
-    if( 2!=g_useHttps && (unsigned long long)pStat->st_size < (unsigned long long)0x7ffff000 /*max sendfile() size*/) {
-        off_t offset = rangeStart;
-        nOut += sendfile(fileno(stdout), fileno(in), &offset, pStat->st_size);
-    } else
-#endif
-    {
-        xferBytes(in, stdout, pStat->st_size, rangeStart);
+
+    // 读入内容，保存到内容缓存，然后和头部一起发送
+    if (bCacheable && nLen <= FILE_CACHE_MAX_FILE) {
+        nBody = (size_t) pStat->st_size;
+        nHdr = RespGather(&resp, nStatus, g_zFileCacheBuf, FILE_CACHE_MAX_HDR);
+        if (nHdr > 0 && fread(g_zFileCacheBuf + nHdr, 1, nBody, in) == nBody) {
+            file_cache_put(csOrigFile, iEnc, pOrigStat, g_zFileCacheBuf, nHdr, g_zFileCacheBuf + nHdr, nBody);
+            nOut += RespSend(&resp, g_zFileCacheBuf + nHdr, nBody, 0);
+            fclose(in);
+            return 0;
+        }
+    }
+    if (nRange > 1) {
+        nOut += RespSend(&resp, 0, 0, 0);
+        RangeMultipartSend(zType, (long long) pStat->st_size, in, NULL);
+    } else {
+        // 头部以 MSG_MORE 发送，和文件内容的第一部分合并为同一个 TCP 报文
+        nOut += RespSend(&resp, 0, 0, g_useHttps != 2 && nLen > 0);
+        SendFileRange(in, iOfs, nLen);
     }
     fclose(in);
     return 0;
@@ -2478,14 +4137,19 @@ static int SendFile(
 ** output stream is ignored and the output instead goes
 ** to the TLS channel.
 */
+/* + 普通 TCP 连接上通过 splice() 直接从管道转移到套接字
+*/
 static void stream_file(FILE *const in, FILE *const out) {
     enum {
-        STREAMBUF_SIZE = 1024 * 4
+        STREAMBUF_SIZE = 1024 * 16      /* 一个 TLS 记录的大小 */
     };
     char streamBuf[STREAMBUF_SIZE];
     size_t n;
-    while ((n = fread(streamBuf, 1, sizeof(STREAMBUF_SIZE), in))) {
+    ssize_t nXfer = -1;
+    if (out == stdout && SpliceOut(in, &nXfer)) return;
+    while ((n = CgiRead(streamBuf, sizeof(streamBuf), in))) {
         althttpd_fwrite(streamBuf, 1, n, out);
+        nOut += n;
     }
 }
 
@@ -2500,33 +4164,40 @@ static void stream_file(FILE *const in, FILE *const out) {
 */
 static void CgiHandleReply(FILE *in, int isNPH) {
     int seenContentLength = 0;   /* True if Content-length: header seen */
-    int contentLength = 0;       /* The content length */
+    long long contentLength = 0; /* The content length */
     size_t nRes = 0;             /* Bytes of payload */
     size_t nMalloc = 0;          /* Bytes of space allocated to aRes */
     char *aRes = 0;              /* Payload */
-    int c;                       /* Next character from in */
     char *z;                     /* Pointer to something inside of zLine */
     int iStatus = 0;             /* Reply status code */
     int seenReply = 0;           /* True if any reply text has been seen */
     char zLine[1000];            /* One line of reply from the CGI script */
+    char zType[200] = "";        /* Content-type 的值，用于判断是否可以压缩 */
+    int seenEncoding = 0;        /* CGI 自己设置了 Content-encoding（不再压缩） */
 
     /* Set a 1-hour timeout, so that we can implement Hanging-GET or
   ** long-poll style CGIs.  The RLIMIT_CPU will serve as a safety
   ** to help prevent a run-away CGI */
     SetTimeout(60 * 60, 800); /* LOG: CGI Handler timeout */
 
+    // CGI 回复的 ETag / Last-Modified 无法预先校验，带 If-Range 的请求总是回复完整的内容
+    if (zIfRange) g_nRange = 0;
+    g_iCgiIn = g_nCgiIn = 0;
+
     if (isNPH) {
         /*
     ** Non-parsed-header output: simply pipe it out as-is. We
     ** need to go through this routine, instead of simply exec()'ing,
     ** in order to go through the TLS output channel.
     */
+        closeConnection = true;         // 响应的长度只有 CGI 自己知道，之后不能再复用连接
         stream_file(in, stdout);
         fclose(in);
+        g_iCgiIn = g_nCgiIn = 0;
         return;
     }
 
-    while (fgets(zLine, sizeof(zLine), in) && !isspace((unsigned char) zLine[0])) {
+    while (CgiGets(zLine, sizeof(zLine), in) && !isspace((unsigned char) zLine[0])) {
         seenReply = 1;
         if (strncasecmp(zLine, "Location:", 9) == 0) {
             StartResponse("302 Redirect");
@@ -2534,14 +4205,14 @@ static void CgiHandleReply(FILE *in, int isNPH) {
             z = &zLine[10];
             while (isspace(*(unsigned char *) z)) { z++; }
             nOut += althttpd_printf("Location: %s" CRLF, z);
-            rangeEnd = 0;
+            g_nRange = 0;
         } else if (strncasecmp(zLine, "Status:", 7) == 0) {
             int i;
             for (i = 7; isspace((unsigned char) zLine[i]); i++) {}
             strncpy(zReplyStatus, &zLine[i], 3);
             zReplyStatus[3] = 0;
             iStatus = (int)strtol(zReplyStatus, NULL, 10);
-            if (rangeEnd == 0 || (iStatus != 200 && iStatus != 206)) {
+            if (g_nRange == 0 || (iStatus != 200 && iStatus != 206)) {
                 if (iStatus == 418) {
                     /* If a CGI returns a status code of 418 ("I'm a teapot", rfc2324)
           ** that is a signal from the CGI to althttpd that the request was
@@ -2551,16 +4222,22 @@ static void CgiHandleReply(FILE *in, int isNPH) {
                     ServiceUnavailable(903);  /* LOG: CGI reports abuse */
                 }
                 nOut += althttpd_printf("%s %s", zProtocol, &zLine[i]);
-                rangeEnd = 0;
+                g_nRange = 0;
                 statusSent = 1;
             }
         } else if (strncasecmp(zLine, "Content-length:", 15) == 0) {
             seenContentLength = 1;
-            contentLength = (int)strtol(zLine + 15, NULL, 10);
+            contentLength = strtoll(zLine + 15, NULL, 10);
         } else if (strncasecmp(zLine, "X-Robot:", 8) == 0) {
             isRobot = (strtol(&zLine[8], NULL, 10) != 0) + 1;
         } else {
             size_t nLine = strlen(zLine);
+            if (strncasecmp(zLine, "Content-type:", 13) == 0) {
+                int nType = (int)(nLine - 13 < sizeof(zType) - 1 ? nLine - 13 : sizeof(zType) - 1);   // 过长的类型截断
+                snprintf(zType, sizeof(zType), "%.*s", nType, zLine + 13);
+            } else if (strncasecmp(zLine, "Content-encoding:", 17) == 0) {
+                seenEncoding = 1;
+            }
             if (nRes + nLine >= nMalloc) {
                 nMalloc += nMalloc + nLine * 2;
                 aRes = realloc(aRes, nMalloc + 1);
@@ -2578,16 +4255,14 @@ static void CgiHandleReply(FILE *in, int isNPH) {
 
     /* Copy everything else thru without change or analysis.
   */
-    if (rangeEnd > 0 && seenContentLength && rangeStart < contentLength) {
+    // + CGI 的输出只支持一个范围，多个范围和无法满足的范围都回复完整的内容
+    if (seenContentLength && RangeResolve(contentLength) == 1) {
         StartResponse("206 Partial Content");
-        if (rangeEnd >= contentLength) {
-            rangeEnd = contentLength - 1;
-        }
-        nOut += althttpd_printf("Content-Range: bytes %lld-%lld/%llu" CRLF,
-                                (long long) rangeStart, (long long) rangeEnd,
-                                (unsigned long long) contentLength);
-        contentLength = (int)(rangeEnd + 1 - rangeStart);
+        nOut += althttpd_printf("Content-Range: bytes %lld-%lld/%lld" CRLF,
+                                g_aRange[0].iFirst, g_aRange[0].iLast, contentLength);
+        contentLength = g_aRange[0].iLast + 1 - g_aRange[0].iFirst;
     } else {
+        g_nRange = 0;
         StartResponse("200 OK");
     }
     if (nRes > 0) {
@@ -2598,13 +4273,24 @@ static void CgiHandleReply(FILE *in, int isNPH) {
     }
     if (iStatus == 304) {
         nOut += althttpd_printf(CRLF CRLF);
+    } else if (seenContentLength && g_nRange > 0) {
+        nOut += althttpd_printf("Content-length: %lld" CRLF CRLF, contentLength);
+        xferBytes(in, stdout, (ssize_t) contentLength, (ssize_t) g_aRange[0].iFirst);
     } else if (seenContentLength) {
-        nOut += althttpd_printf("Content-length: %d" CRLF CRLF, contentLength);
-        xferBytes(in, stdout, contentLength, rangeStart);
+        httpd_body_begin(seenEncoding ? 0 : zType, contentLength, zAcceptEncoding);
+        BodyCopy(in, contentLength);
+        httpd_body_end();
+    } else if (ProtocolAtLeast11()) {
+        // 长度未知：HTTP/1.1 客户端以 chunked 编码边读边发，不需要等 CGI 结束，也不需要缓存全部输出
+        httpd_body_begin(seenEncoding ? 0 : zType, -1, zAcceptEncoding);
+        BodyStream(in);
+        httpd_body_end();
     } else {
-        while ((c = getc(in)) != EOF) {
-            if (nRes >= nMalloc) {
-                nMalloc = nMalloc * 2 + 1000;
+        // HTTP/1.0 客户端不支持 chunked，读入全部输出后以 Content-length 发送
+        size_t got;
+        do {
+            if (nMalloc - nRes < 16384) {
+                nMalloc = nMalloc * 2 + 16384;
                 aRes = realloc(aRes, nMalloc + 1);
                 if (aRes == 0) {
                     Malfunction(610, /* LOG: OOM */
@@ -2612,18 +4298,16 @@ static void CgiHandleReply(FILE *in, int isNPH) {
                                 (long long unsigned int) nMalloc);
                 }
             }
-            aRes[nRes++] = (char)c;
-        }
-        if (nRes) {
-            aRes[nRes] = 0;
-            nOut += althttpd_printf("Content-length: %d" CRLF CRLF, (int) nRes);
-            nOut += althttpd_fwrite(aRes, nRes, 1, stdout);
-        } else {
-            nOut += althttpd_printf("Content-length: 0" CRLF CRLF);
-        }
+            got = CgiRead(aRes + nRes, nMalloc - nRes, in);
+            nRes += got;
+        } while (got > 0);
+        httpd_body_begin(seenEncoding ? 0 : zType, (long long) nRes, zAcceptEncoding);
+        BodyWrite(aRes, nRes);
+        httpd_body_end();
     }
     free(aRes);
     fclose(in);
+    g_iCgiIn = g_nCgiIn = 0;            // 丢弃没有用到的数据，之后的文件读取（xferBytes()）不能再取到
 }
 
 // 发送 SCGI 请求到 csFile 标识的主机，并处理主机的回复。
@@ -2670,12 +4354,10 @@ static void SendScgiRequest(const char *csFile, const char *scScript) {
         if (zCmd[0] == '#') continue;
         RemoveNewline(z);
         if (strcmp(zCmd, "relight:") == 0) {
-            free(zRelight);
             zRelight = StrDup(z);
             continue;
         }
         if (strcmp(zCmd, "fallback:") == 0) {
-            free(zFallback);
             zFallback = StrDup(z);
             continue;
         }
@@ -2710,7 +4392,6 @@ static void SendScgiRequest(const char *csFile, const char *scScript) {
                                 "Relight failed with %d: \"%s\"\n",
                                 rc, zRelight);
                 }
-                free(zRelight);
                 zRelight = 0;
                 sleep(1);
                 continue;
@@ -2728,8 +4409,7 @@ static void SendScgiRequest(const char *csFile, const char *scScript) {
                 rc = stat(zFallback, &statbuf);
                 if (rc == 0 && S_ISREG(statbuf.st_mode) && access(zFallback, R_OK) == 0) {
                     closeConnection = true;
-                    rc = SendFile(zFallback, (int) strlen(zFallback), &statbuf);
-                    free(zFallback);
+                    rc = SendFile(zFallback, (int) strlen(zFallback), &statbuf, NULL);
                     althttpd_exit(0);
                 } else {
                     Malfunction(706, /* LOG: bad SCGI fallback */
@@ -2745,6 +4425,7 @@ static void SendScgiRequest(const char *csFile, const char *scScript) {
 
     nHdrAlloc = 0;
     zHdr = 0;
+    ReadPostData();
     if (zContentLength == 0) zContentLength = "0";
     ComputeRequestUri();
     zScgi = "1";
@@ -2852,7 +4533,9 @@ static int tls_init_conn(int iSocket) {
             if( NULL==tlsState.sslCon ) {
                 Malfunction(512/* LOG: TLS context */, "Could not instantiate TLS context.");
             }
-            atexit(tls_atexit);
+            // prefork worker 会在同一进程中处理多个连接，atexit 只需注册一次
+            static bool bAtExit = false;
+            if (!bAtExit) { atexit(tls_atexit); bAtExit = true; }
         }
         return 1;
     }
@@ -2871,6 +4554,206 @@ static void tls_close_conn(void) {
 #endif
 }
 
+// 设置当前进程的 CPU 时间限制（g_maxCpu 秒）
+// + 每连接 fork 模型下，对请求处理子进程设置；prefork 模型下 worker 是长期运行的，只对 CGI 子进程设置
+static void SetCpuLimit(void) {
+#ifdef RLIMIT_CPU
+    if (g_maxCpu > 0) {
+        struct rlimit rlim;
+        rlim.rlim_cur = g_maxCpu;
+        rlim.rlim_max = g_maxCpu;
+        setrlimit(RLIMIT_CPU, &rlim);
+    }
+#endif
+}
+
+#ifdef linux
+// 事件循环中的连接
+typedef struct EvConn {
+    char*                           zBuf;                       // 已读入、尚未处理的请求数据（连接空闲时释放）
+    size_t                          nBuf;                       // zBuf 中的数据长度
+    size_t                          nAlloc;                     // zBuf 的分配大小
+    time_t                          tLast;                      // 最近一次活动的时间，用于空闲超时
+    pid_t                           pid;                        // 正在接手该连接上请求的子进程，0 表示连接由事件循环持有
+    char*                           zPend;                      // 尚未发出的回复（套接字的发送缓冲已满），可写时继续发送，发完之前不处理后续请求
+    size_t                          nPend;                      // zPend 的长度
+    size_t                          iPend;                      // zPend 中已发送的字节数
+    bool                            bClose;                     // 回复发送完后关闭连接
+    int                             nReq;                       // 该连接上已经处理的请求数
+    bool                            bUsed;                      // 该项是否对应一个打开的连接
+    char                            zRemoteAddr[48];            // 远程 IP 地址
+} EvConn;
+
+static EvConn*                      g_aEvConn = NULL;           // 事件循环的连接表，按 fd 索引
+static int                          g_nEvConn = 0;              // 连接表的大小（即允许的最大 fd + 1）
+static int                          g_evMaxFd = -1;             // 当前打开的最大连接 fd
+static int                          g_evEpoll = -1;             // 事件循环的 epoll fd
+static int                          g_evPipe[2] = {-1, -1};     // SIGCHLD 自唤醒管道
+static int                          g_evIdleFd = -1;            // 连接处理完后占位 stdin/stdout 的 fd
+static int                          g_evFd = -1;                // 当前正在处理请求的连接 fd
+#endif
+
+// 在事件循环中，把当前请求交给 fork 出的子进程继续处理（CGI、C 脚本、SCGI、SQTP、POST 及较大的静态内容）
+/* + 子进程继承了已解析的请求状态，从调用处直接继续执行，处理完后退出，并通过退出码告知事件循环连接是否可以继续复用
+ |   事件循环进程（父进程）放弃当前请求，跳转回事件循环，在子进程结束前不再监听该连接
+ |   不在事件循环中（或已经在子进程中）时什么都不做
+*/
+static void EvHandOff(void) {
+#ifdef linux
+    if (!g_evLoop) return;
+
+    // 已经写入 memfd 的输出（通常没有）由子进程先发出：memfd 由父子进程共享，需要在 fork 之前取出
+    fflush(stdout);
+    off_t nPend = lseek(g_evOutFd, 0, SEEK_CUR);
+    char *zPend = nPend > 0 ? (char*)malloc((size_t)nPend) : 0;
+    if (zPend && pread(g_evOutFd, zPend, (size_t)nPend, 0) != nPend) nPend = 0;
+    pid_t child = fork();
+    if (child < 0) {                    // fork 失败，只能在事件循环中继续处理了
+        free(zPend);
+        return;
+    }
+    if (child == 0) {
+        // 以下代码在接手请求的子进程中运行：连接恢复为阻塞模式，直接作为标准输出
+        g_evLoop = false;
+        g_evChild = true;
+        signal(SIGCHLD, SIG_DFL);
+        fcntl(g_evFd, F_SETFL, fcntl(g_evFd, F_GETFL) & ~O_NONBLOCK);
+        dup2(g_evFd, 1);
+        close(g_evOutFd);
+        g_evOutFd = -1;
+        for (off_t i = 0; zPend && i < nPend; ) {
+            ssize_t n = write(1, zPend + i, (size_t)(nPend - i));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            i += n;
+        }
+        free(zPend);
+        close(g_evEpoll);
+        close(g_evPipe[0]);
+        close(g_evPipe[1]);
+        close(g_evIdleFd);
+        close(g_listener);
+        if (g_listenTLS > 0) close(g_listenTLS);
+        // 关闭其它连接在子进程中的引用，否则事件循环关闭这些连接时，连接并不会真正断开
+        for (int fd = 0; fd <= g_evMaxFd; fd++) {
+            if (g_aEvConn[fd].bUsed && fd != g_evFd) close(fd);
+        }
+        SetCpuLimit();
+        scoreboard_claim(SB_KIND_HANDOFF);
+        return;
+    }
+    free(zPend);
+    metrics_fork(METRICS_FORK_HANDOFF);
+    g_evHandOff = child;
+    siglongjmp(g_workerJmp, 2);
+#endif
+}
+
+static void ResetRequestState(void);
+void ProcessOneRequest(int forceClose, int socketId);
+
+#define METRICS_BUF         (256*1024)  // /-/metrics 输出的缓冲大小
+
+// 保留的 URI /-/metrics：以 Prometheus 文本格式输出运行统计（所有进程共享的统计内存，读取时不加锁）
+static void ServeMetrics(void) {
+    metrics_procs procs = {0, 0};
+    char *zBuf = ReqAlloc(METRICS_BUF);
+    size_t n;
+
+    if (g_aWorkerStat) {
+        for (int i = 0; i < g_nWorkers; i++) {
+            if (g_aWorkerStat[i].pid <= 0) continue;
+            if (g_aWorkerStat[i].bBusy) procs.nBusy++;
+            else procs.nIdle++;
+        }
+    }
+    n = metrics_format(zBuf, METRICS_BUF, g_aWorkerStat ? &procs : NULL);
+
+    StartResponse("200 OK");
+    nOut += althttpd_printf(
+            "Content-type: text/plain; version=0.0.4; charset=utf-8" CRLF
+            "Cache-Control: no-cache, no-store" CRLF);
+    httpd_body_begin("text/plain", (long long)n, zAcceptEncoding);
+    if (strcmp(zMethod, "HEAD") != 0) BodyWrite(zBuf, n);
+    httpd_body_end();
+    MakeLogEntry(0, 291);  /* LOG: /-/metrics */
+}
+
+// 回复 /-/status：各个进程的状态和当前请求，查询字符串为 "json" 时输出 JSON，否则输出 HTML
+#define STATUS_BUF          (1024*1024)
+
+static void ServeStatus(void) {
+
+    // 记分板中有其它客户端的地址和 URI：回环地址之外的客户端需要通过服务器根目录中 -auth 文件的认证，没有该文件时拒绝
+    bool bLoopback = g_zRemoteAddr && (strncmp(g_zRemoteAddr, "127.", 4) == 0 || strcmp(g_zRemoteAddr, "::1") == 0);
+    if (!bLoopback) {
+        if (access("-auth", R_OK) != 0) Forbidden(293);  /* LOG: /-/status from a remote address */
+        if (!CheckBasicAuthorization("-auth")) return;
+    }
+
+    char *zBuf = ReqAlloc(STATUS_BUF);
+    bool bJson = zQueryString && strcmp(zQueryString, "json") == 0;
+    size_t n;
+
+    scoreboard_state(SB_WRITE);
+    n = scoreboard_format(zBuf, STATUS_BUF, bJson);
+    const char *zType = bJson ? "application/json" : "text/html";
+
+    StartResponse("200 OK");
+    nOut += althttpd_printf(
+            "Content-type: %s; charset=utf-8" CRLF
+            "Cache-Control: no-cache, no-store" CRLF, zType);
+    httpd_body_begin(zType, (long long)n, zAcceptEncoding);
+    if (strcmp(zMethod, "HEAD") != 0) BodyWrite(zBuf, n);
+    httpd_body_end();
+    MakeLogEntry(0, 292);  /* LOG: /-/status */
+}
+
+// 在 HTTP/2 多路复用器 fork 出的子进程中处理一个流
+/* + socketpair 代替连接作为 stdin/stdout，请求是协议版本为 "HTTP/2.0" 的 HTTP/1.x 报文，按普通的请求处理
+ |   回复之后关闭 socketpair（不使用 Keep-Alive），多路复用器据此知道回复已经结束（没有 Content-length 时）
+*/
+static void H2RunStream(int fd) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    close(fd);
+#ifdef linux
+    if (g_evChild && g_evFd > 1) close(g_evFd);     // 不再持有原连接的引用
+#endif
+    g_isWorker = false;                 // althttpd_exit() 结束进程，而不是返回 worker 的 accept 循环
+    g_h2Stream = true;
+    metrics_fork(METRICS_FORK_H2_STREAM);
+    scoreboard_claim(SB_KIND_H2_STREAM);
+    memset(&priorSelf, 0, sizeof(priorSelf));       // 新进程的资源用量从 0 开始计算
+    memset(&priorChild, 0, sizeof(priorChild));
+    ResetRequestState();
+    ProcessOneRequest(1, 0);
+    althttpd_exit(0);
+}
+
+// 把连接交给 HTTP/2 多路复用器处理，不再返回
+/* + pUp 为 NULL：客户端直接以连接前言开始（prior knowledge），前言的第一部分已经被当作请求头读入
+ |   否则是 h2c 升级：先回复 101，升级请求作为流 1 处理
+ |   事件循环中整个连接交给子进程；连接的空闲超时由多路复用器自己处理
+*/
+static void H2Serve(const h2_upgrade *pUp) {
+    EvHandOff();
+    alarm(0);
+    if (pUp) {
+        nOut += althttpd_printf(
+                "HTTP/1.1 101 Switching Protocols" CRLF
+                "Connection: Upgrade" CRLF
+                "Upgrade: h2c" CRLF
+                CRLF);
+    }
+    althttpd_fflush(stdout);
+    scoreboard_state(SB_H2);
+    h2_serve(0, 1, g_zConnIn + g_iConnIn, g_nConnIn - g_iConnIn, pUp ? 0 : H2_PREFACE_LINE, pUp, H2RunStream);
+    g_iConnIn = g_nConnIn;
+    closeConnection = true;
+    althttpd_exit(0);
+}
+
 /**
  * @brief                           处理单个 HTTP 请求。这是 althttpd 的核心请求处理函数
  * @param forceClose                强制关闭连接标志
@@ -2892,6 +4775,22 @@ static void tls_close_conn(void) {
  *                                  依赖"一个进程处理一个连接"的模型。
  */
 
+// 保存一个路径的解析结果到路径解析缓存（zHome、zRealScript 取自当前请求，路径过长时不缓存）
+static void PathCacheStore(const char *zVhost, const char *zUri, int kind, const char *zCheckDir, path_cache_val *pVal) {
+    pVal->kind = (uint8_t)kind;
+    if (kind != PATH_CACHE_FILE) {
+        pVal->bBuildin = pVal->bAuth = 0;
+        pVal->iPathInfo = 0;
+        pVal->pMime = NULL;
+        memset(&pVal->st, 0, sizeof(pVal->st));
+    }
+    if ((size_t)snprintf(pVal->zHome, sizeof(pVal->zHome), "%s", zHome) >= sizeof(pVal->zHome)
+        || (size_t)snprintf(pVal->zRealScript, sizeof(pVal->zRealScript), "%s",
+                            kind == PATH_CACHE_FILE ? zRealScript : "") >= sizeof(pVal->zRealScript)
+        || (size_t)snprintf(pVal->zDir, sizeof(pVal->zDir), "%s", zCheckDir) >= sizeof(pVal->zDir)) return;
+    path_cache_put(zVhost, zUri, pVal);
+}
+
 void ProcessOneRequest(int forceClose, int socketId) {
 
     int i, j, j0;
@@ -2905,9 +4804,17 @@ void ProcessOneRequest(int forceClose, int socketId) {
     const MimeTypeDef *pMimeType = 0; /* URI 的 MIME 类型 */
     size_t sz = 0;
     struct tm vTm;            /* zExpLogFile 的时间戳 */
+    http_request req;         /* 请求头的解析结果 */
+    char *zVhost;             /* 虚拟主机目录（路径解析缓存的键） */
+    path_cache_val pc;        /* 路径解析缓存的查找结果 */
+    bool bCached = false;     /* 路径解析结果来自缓存 */
+    bool bNoCache = false;    /* 路径解析结果不能缓存 */
 
     // ---------------------------
 
+    // 上一个请求（如果有）已经结束，重置请求级内存池
+    ReqArenaReset();
+
     // 记录请求开始的精确时间（用于性能统计）
     clock_gettime(ALTHTTPD_CLOCK_ID, &tsBeginTime);
     gettimeofday(&beginTime, 0);
@@ -2942,29 +4849,58 @@ void ProcessOneRequest(int forceClose, int socketId) {
 
     // ---------------------------
 
-    // 读取 HTTP 请求协议的第一行：METHOD /path/to/resource HTTP/1.1
+    // 读取完整的 HTTP 请求头：METHOD /path/to/resource HTTP/1.1 以及之后的头部字段，直到空行
+    // + 请求头整体读入连接输入缓冲后一次性解析，请求方法、协议和各头部字段直接引用缓冲中的内容（就地以 null 结尾）
     // + 这里会临时禁止日志输出（避免记录空请求）
     omitLog = 1;
-    if (althttpd_fgets(zLine, sizeof(zLine), stdin) == 0)
+    scoreboard_state(nRequest > 1 ? SB_KEEPALIVE : SB_READ);
+    int nHead = ReadRequestHeader(&req);
+    if (nHead == 0)
         althttpd_exit(0);               // 如果读取失败（连接已关闭或超时），直接退出
     omitLog = 0;
-
-    nIn += (i = (int)strlen(zLine));    // 跳过第一行的长度，同时统计上行数据的数据大小
+    clock_gettime(ALTHTTPD_CLOCK_ID, &tsHeadDone);
+    PhaseReset();
+    g_iHandler = METRICS_OTHER;
+    if (g_isWorker && !g_evChild) g_aWorkerStat[g_iWorker].bBusy = 1;
+
+    char *zHead = g_zConnIn + g_iConnIn;                    // 请求头在连接输入缓冲中的位置，req 中的偏移都相对于这里
+    char *zUpgradeReq = 0;                                  // h2c 升级请求的原文（请求头之后会被就地修改）
+    if (g_h2c && !g_h2Stream && g_useHttps != 2 && nHead > 0) {
+        for (j = 0; j < req.nHeader && req.aHeader[j].id != HTTP_HDR_UPGRADE; j++);
+        if (j < req.nHeader) {
+            zUpgradeReq = ReqAlloc(nHead);
+            memcpy(zUpgradeReq, zHead, nHead);
+        }
+    }
+    nIn += nHead > 0 ? nHead : (int)(g_nConnIn - g_iConnIn);// 统计上行数据的数据大小
+    i = nHead > 0 ? (int)req.nLine : 0;                     // 请求行的长度
 
     // 解析 HTTP 请求的第一行
-    zMethod = StrDup(GetFirstElement(zLine, &z));           // HTTP 方法：GET、POST、HEAD
-    zRealScript = zScript = StrDup(GetFirstElement(z, &z)); // 请求的 URI 路径
-    zProtocol = StrDup(GetFirstElement(z, &z));             // 协议版本：HTTP/1.0 或 HTTP/1.1
-    fprintf(stderr, "[httpd] HTTP Request: %s %s %s\n", zMethod, zScript, zProtocol);
+    zProtocol = NULL;
+    if (nHead > 0) {
+        zMethod = ConnSlice(zHead, req.method);             // HTTP 方法：GET、POST、HEAD
+        zRealScript = zScript = StrDup(ConnSlice(zHead, req.uri)); // 请求的 URI 路径（后续会被改写，需要复制）
+        if (req.protocol.len) zProtocol = ConnSlice(zHead, req.protocol);  // 协议版本：HTTP/1.0 或 HTTP/1.1
+        fprintf(stderr, "[httpd] HTTP Request: %s %s %s\n", zMethod, zScript, zProtocol ? zProtocol : "");
+    }
 
     // 如果请求协议无效，返回 400 Bad Request 错误
     // > 必须以 "HTTP/" 开头
     // > 总长度必须是 8 个字符（例如 "HTTP/1.1"）
     // > 请求行不能过长（防止缓冲区溢出攻击）
+    // > 整个请求头不能超过 MAX_HEADER_SIZE
     // 检查协议：支持 HTTP 和 SQTP
     if (zProtocol == NULL || i > 9990) { zProtocol = NULL;
 
-        if (i <= 9990) {
+        if (nHead == REQ_HEADER_TOO_LARGE) {
+            StartResponse("431 Request Header Fields Too Large");
+            nOut += althttpd_printf(
+                    "Content-type: text/plain; charset=utf-8" CRLF
+                    CRLF
+                    "Request header too large\n"
+            );
+            MakeLogEntry(0, 202); /* 日志：请求头过长 */
+        } else if (i <= 9990) {
             StartResponse("400 Bad Request");
             nOut += althttpd_printf(
                     "Content-type: text/plain; charset=utf-8" CRLF
@@ -2996,18 +4932,29 @@ void ProcessOneRequest(int forceClose, int socketId) {
         althttpd_exit(0);
     }
 
+    // HTTP/2 连接前言（"PRI * HTTP/2.0"）：之后的整个连接交给 HTTP/2 多路复用器
+    if (g_h2c && !g_h2Stream && g_useHttps != 2 && strcmp(zMethod, "PRI") == 0
+        && strcmp(zScript, "*") == 0 && strcmp(zProtocol, "HTTP/2.0") == 0) {
+        g_iConnIn += nHead;
+        H2Serve(NULL);
+    }
+
     if (*zScript != '/') NotFound(210);                     // 空的 URI 请求
     while (zScript[1] == '/') zScript++; zRealScript++;     // 规范化 URI：移除多余的前导斜杠（例如 "//path" -> "/path"）
+    scoreboard_request(zMethod, zScript, g_zRemoteAddr);
 
     // 确定执行完后是否关闭连接
     // > 调用者明确要求关闭连接（例如达到最大连续请求数）
     // > HTTP/1.0 或更早版本不支持 Keep-Alive，必须关闭连接
-    if (forceClose ||
-        zProtocol[5] < '1' || zProtocol[7] < '1')
+    if (forceClose || !ProtocolAtLeast11())
         closeConnection = true;
 
     // SQTP 协议拦截：如果 METHOD 以 SQTP- 开头，交给 httpd_sqtp 处理
     if (strncmp(zMethod, "SQTP-", 5) == 0) {
+        g_iConnIn += req.nSkip + req.nLine;                 // 只消费请求行，头部字段由 SQTP 自己读取
+        EvHandOff();                                        // 事件循环中 SQTP 请求交给子进程处理
+        g_iHandler = metrics_sqtp_handler(zMethod + 5);
+        httpd_phase(HTTPD_PHASE_PARSE);
         httpd_sqtp(zMethod, zScript, zProtocol, &nOut);  // 交给 SQTP 处理函数，传递必要参数
         althttpd_exit(0);
     }
@@ -3049,60 +4996,71 @@ void ProcessOneRequest(int forceClose, int socketId) {
     // ---------------------------
     // 解析 HTTP header 字段
 
-    // 初始化头部字段变量（清空上次请求的数据）
+    // 初始化头部字段变量（清空上次请求的数据，它们可能指向已被覆盖的连接输入缓冲）
     zCookie = 0;              // Cookie 信息
     zAuthType = 0;            // 认证类型（Basic/Digest）
     zRemoteUser = 0;          // 认证后的远程用户名
     zReferer = 0;             // 引用页（从哪个页面跳转来的）
     zIfNoneMatch = 0;         // ETag 缓存验证
     zIfModifiedSince = 0;     // 时间缓存验证
+    zIfRange = 0;             // Range 的前提条件
     zContentLength = 0;       // POST 数据长度
-    rangeEnd = 0;             // Range 请求的结束位置
-    
-    // 循环读取 HTTP header 每一行，直到遇到空行（即 \n\n 表示头部结束）
-    // + 这里只解析了部分常见的 HTTP 头部字段，其他字段会被忽略
-    while (althttpd_fgets(zLine, sizeof(zLine), stdin)) {
-        char *zFieldName;  // 头部字段名（冒号前的部分）
-        char *zVal;        // 头部字段值（冒号后的部分）
+    zTransferEncoding = 0;    // 请求体的传输编码（chunked）
+    zExpect = 0;              // 100-continue
+    char *zUpgrade = 0, *zHttp2Settings = 0;                // h2c 升级
+    zAgent = zAccept = zAcceptEncoding = zContentType = 0;
+    zServerName = zServerPort = 0;
+    g_zHttpHost = g_zDefaultHost;
+    g_nRange = 0;             // Range 请求的范围
 
 #ifdef LOG_HEADER
-        // 如果启用了头部日志记录，将原始头部写入日志
-        if( hdrLog ) fprintf(hdrLog, "%s", zLine);
+    // 如果启用了头部日志记录，将原始头部写入日志
+    if (hdrLog) {
+        fwrite(zHead + req.nSkip + req.nLine, 1, nHead - req.nSkip - req.nLine, hdrLog);
+        fclose(hdrLog);
+    }
 #endif
-        nIn += strlen(zLine);                                   // 统计上行数据的大小（包括头部字段）
-        
-        zFieldName = GetFirstElement(zLine, &zVal);
-        if (zFieldName == 0 || *zFieldName == 0) break;         // 空行表示头部结束
-        RemoveNewline(zVal);                                    // 移除字段值末尾的换行符
 
-        if (strcasecmp(zFieldName, "User-Agent:") == 0) zAgent = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Accept:") == 0) zAccept = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Accept-Encoding:") == 0) zAcceptEncoding = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Content-length:") == 0) zContentLength = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Content-type:") == 0) zContentType = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Referer:") == 0) {
-
-            zReferer = StrDup(zVal);
+    // 逐个处理已识别的头部字段（字段名已由解析器通过完美哈希分派）
+    // + 这里只解析了部分常见的 HTTP 头部字段，其他字段在解析时已被忽略
+    for (j = 0; j < req.nHeader; j++) {
+        char *zVal = ConnSlice(zHead, req.aHeader[j].value);  // 头部字段值
+
+        switch (req.aHeader[j].id) {
+        case HTTP_HDR_USER_AGENT:       zAgent = zVal; break;
+        case HTTP_HDR_ACCEPT:           zAccept = zVal; break;
+        case HTTP_HDR_ACCEPT_ENCODING:  zAcceptEncoding = zVal; break;
+        case HTTP_HDR_CONTENT_LENGTH:   zContentLength = zVal; break;
+        case HTTP_HDR_TRANSFER_ENCODING: zTransferEncoding = zVal; break;
+        case HTTP_HDR_EXPECT:           zExpect = zVal; break;
+        case HTTP_HDR_CONTENT_TYPE:     zContentType = zVal; break;
+        case HTTP_HDR_REFERER:
+
+            zReferer = zVal;
             if (strstr(zVal, "devids.net/") != 0) {
                 zReferer = "devids.net.smut";
                 Forbidden(230); /* LOG: Referrer is devids.net */
             }
-        }
-        else if (strcasecmp(zFieldName, "Cookie:") == 0) zCookie = StrAppend(zCookie, "; ", zVal);
-        else if (strcasecmp(zFieldName, "Connection:") == 0) {
+            break;
+        case HTTP_HDR_COOKIE:
+
+            // 多个 Cookie 字段合并为一个
+            zCookie = zCookie ? StrAppend(zCookie, "; ", zVal) : zVal;
+            break;
+        case HTTP_HDR_CONNECTION:
 
             if (strcasecmp(zVal, "close") == 0)
                 closeConnection = true;
             else if (!forceClose && strcasecmp(zVal, "keep-alive") == 0)
                 closeConnection = false;
-        }
-        else if (strcasecmp(zFieldName, "Host:") == 0) {
+            break;
+        case HTTP_HDR_HOST: {
 
             // 安全检查：Host 头不能包含危险字符
             if (sanitizeString(zVal)) Forbidden(240);  /* 日志：HOST 参数中的非法内容 */
 
-            g_zHttpHost = StrDup(zVal);                           // 保存完整的 Host 值
-            zServerPort = zServerName = StrDup(g_zHttpHost);
+            g_zHttpHost = zVal;                                 // 保存完整的 Host 值
+            zServerPort = zServerName = StrDup(zVal);
 
             // 解析 Host 头，分离主机名和端口号
             // + 格式：hostname:port 或 [IPv6]:port
@@ -3113,7 +5071,7 @@ void ProcessOneRequest(int forceClose, int socketId) {
                 if (c == ']') inSquare = 0;                     // 离开 IPv6 地址
                 zServerPort++;
             }
-            
+
             // 如果找到了端口号，分离它
             if (zServerPort && *zServerPort) {
                 *zServerPort = 0;
@@ -3121,28 +5079,31 @@ void ProcessOneRequest(int forceClose, int socketId) {
             }
 
             // 如果有实际端口（独立模式），使用实际端口覆盖
-            if (zRealPort) zServerPort = StrDup(zRealPort);
-
+            if (zRealPort) zServerPort = zRealPort;
+            break;
         }
-        else if (strcasecmp(zFieldName, "Authorization:") == 0) zAuthType = GetFirstElement(StrDup(zVal), &zAuthArg);
-        else if (strcasecmp(zFieldName, "If-None-Match:") == 0) zIfNoneMatch = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "If-Modified-Since:") == 0)  zIfModifiedSince = StrDup(zVal);
-        else if (strcasecmp(zFieldName, "Range:") == 0 && strcmp(zMethod, "GET") == 0) {
-
-            int x1 = 0, x2 = 0;
-            int n = sscanf(zVal, "bytes=%d-%d", &x1, &x2);
-            if (n == 2 && x1 >= 0 && x2 >= x1) {
-                rangeStart = x1;
-                rangeEnd = x2;
-            } else if (n == 1 && x1 > 0) {
-                rangeStart = x1;
-                rangeEnd = 0x7fffffff;
-            }
+        case HTTP_HDR_AUTHORIZATION:    zAuthType = GetFirstElement(zVal, &zAuthArg); break;
+        case HTTP_HDR_IF_NONE_MATCH:    zIfNoneMatch = zVal; break;
+        case HTTP_HDR_IF_MODIFIED_SINCE:zIfModifiedSince = zVal; break;
+        case HTTP_HDR_RANGE:            if (strcmp(zMethod, "GET") == 0) RangeParse(zVal); break;
+        case HTTP_HDR_IF_RANGE:         zIfRange = zVal; break;
+        case HTTP_HDR_UPGRADE:          zUpgrade = zVal; break;
+        case HTTP_HDR_HTTP2_SETTINGS:   zHttp2Settings = zVal; break;
+        default:
+            break;
         }
     }
-#ifdef LOG_HEADER
-    if( hdrLog ) fclose(hdrLog);
-#endif
+
+    // 请求头已全部消费，连接输入缓冲中剩下的是请求体，或者管线化的后续请求
+    g_iConnIn += nHead;
+
+    // h2c 升级（RFC 7540 3.2）：只升级没有请求体的 HTTP/1.1 请求，升级请求以协议版本 HTTP/2.0 作为流 1 重新处理
+    if (zUpgradeReq && zUpgrade && zHttp2Settings && strcmp(zProtocol, "HTTP/1.1") == 0
+        && zContentLength == 0 && zTransferEncoding == 0 && strstr(zUpgrade, "h2c") != 0) {
+        h2_upgrade up = { zUpgradeReq, (size_t)nHead, zHttp2Settings, strcmp(zMethod, "HEAD") == 0 };
+        memcpy(zUpgradeReq + req.protocol.off, "HTTP/2.0", 8);
+        H2Serve(&up);
+    }
 
     // ---------------------------
     // 1. Agent
@@ -3203,7 +5164,7 @@ void ProcessOneRequest(int forceClose, int socketId) {
 
     // 如果 Host 头部没有提供服务器名称或端口号，尝试使用系统调用获取服务器主机名
     if (zServerName == 0) {
-        zServerName = SafeMalloc(100);
+        zServerName = ReqAlloc(100);
         gethostname(zServerName, 100);
     }
     if (zServerPort == 0 || *zServerPort == 0) {
@@ -3243,11 +5204,40 @@ void ProcessOneRequest(int forceClose, int socketId) {
     // ---------------------------
     // 4. POST 数据上传
 
-    // 如果是 POST 请求且有 Content-Length 头，读取请求体数据
-    if (zMethod[0] == 'P' && zContentLength != 0) {
+    // 如果是 POST 请求且有请求体（Content-Length 或 Transfer-Encoding: chunked），检查请求体的长度和编码
+    // + 这里不读取请求体，由最终处理请求的分支读取（见 ReadPostData()、FeedPostData()）
+    if (zMethod[0] == 'P' && (zContentLength != 0 || zTransferEncoding != 0)) {
+
+        EvHandOff();                                            // 事件循环中不读取请求体，交给子进程处理
+
+        size_t len = zContentLength ? strtol(zContentLength, NULL, 10) : 0;  // 获取要读取的数据长度
+
+        // 只支持 chunked 传输编码
+        if (zTransferEncoding && strcasecmp(zTransferEncoding, "chunked") != 0) {
+            closeConnection = true;
+            StartResponse("501 Not Implemented");
+            nOut += althttpd_printf(
+                    "Content-type: text/plain; charset=utf-8" CRLF
+                    CRLF
+                    "Transfer-Encoding \"%s\" is not implemented on this server.\n",
+                    zTransferEncoding);
+            MakeLogEntry(0, 271); /* 日志：不支持的传输编码 */
+            althttpd_exit(0);
+        }
+
+        // 只支持 100-continue 一种期望
+        if (zExpect && strcasecmp(zExpect, "100-continue") != 0) {
+            closeConnection = true;
+            StartResponse("417 Expectation Failed");
+            nOut += althttpd_printf(
+                    "Content-type: text/plain; charset=utf-8" CRLF
+                    CRLF
+                    "Unsupported expectation\n"
+            );
+            MakeLogEntry(0, 272); /* 日志：不支持的 Expect */
+            althttpd_exit(0);
+        }
 
-        size_t len = strtol(zContentLength, NULL, 10);          // 获取要读取的数据长度
-        
         // 安全检查：防止过大的 POST 数据导致内存耗尽
         if (len > MAX_CONTENT_LENGTH) {
             StartResponse("500 Request too large");
@@ -3260,15 +5250,15 @@ void ProcessOneRequest(int forceClose, int socketId) {
             althttpd_exit(0);
         }
         
-        rangeEnd = 0;                                           // POST 请求不支持 Range
-        zPostData = SafeMalloc(len + 1);                        // 分配内存来存储 POST 数据
-        
-        // 设置超时：15秒基础 + 每2KB数据增加1秒（防止慢速POST攻击）
-        SetTimeout(15 + (int)len / 2000, 803/* 日志：POST 数据超时 */);
-        
-        // 从 stdin 读取 POST 数据
-        nPostData = althttpd_fread(zPostData, 1, len, stdin);
-        nIn += nPostData;                                       // 统计上行数据的大小（包括 POST 数据）
+        g_nRange = 0;                                           // POST 请求不支持 Range
+        if (zTransferEncoding) {
+            g_postChunked = true;
+            if (zContentLength) closeConnection = true;         // 两者同时出现时以 chunked 为准，且不再复用连接（防止请求走私）
+            zContentLength = 0;
+        }
+        g_nPostLen = len;
+        g_expectContinue = zExpect != 0;
+        g_postPending = g_postChunked || len > 0;
     }
 
     // ---------------------------
@@ -3287,6 +5277,17 @@ void ProcessOneRequest(int forceClose, int socketId) {
     // + 屏蔽机制通过 --ipshun 选项启用，用于防止滥用和攻击
     if (g_zIPShunDir && DisallowedRemoteAddr())
         ServiceUnavailable(901/* 日志：被禁止的远程 IP 地址 */);
+    httpd_phase(HTTPD_PHASE_PARSE);
+
+    // 保留的 URI：服务器自身的信息（"/-" 开头的路径不会对应到文件，见下面的路径安全检查）
+    if (g_metricsUri && strcmp(zScript, "/-/metrics") == 0 && zMethod[0] != 'P') {
+        ServeMetrics();
+        return;
+    }
+    if (g_statusUri && strcmp(zScript, "/-/status") == 0 && zMethod[0] != 'P') {
+        ServeStatus();
+        return;
+    }
 
     // 路径安全检查
     // + 不允许 "/." 或 "/-" 出现在路径中
@@ -3342,7 +5343,16 @@ void ProcessOneRequest(int forceClose, int socketId) {
     }
     strcpy(&zLine[i], ".website");
 
-    if (stat(zLine, &statbuf) || !S_ISDIR(statbuf.st_mode)) {
+    // 查找路径解析缓存（键为虚拟主机目录和 URI）
+    // + 命中时跳过下面的虚拟主机目录查找、逐段解析 URI 和 -auth 文件检查，找不到的路径直接返回 404
+    zVhost = StrDup(zLine);
+    bCached = path_cache_get(zVhost, zScript, &pc);
+    if (bCached) {
+        if (pc.kind == PATH_CACHE_NOT_FOUND) NotFound(380/* 日志：URI 未找到 */);
+        if (pc.kind == PATH_CACHE_NO_INDEX) NotFound(400/* 日志：URI 是目录但没有 index.html */);
+        strcpy(zLine, pc.zHome);
+    }
+    else if (stat(zLine, &statbuf) || !S_ISDIR(statbuf.st_mode)) {
         sprintf(zLine, "%s/default.website", g_zRoot);
         if (stat(zLine, &statbuf) || !S_ISDIR(statbuf.st_mode)) {
             sprintf(zLine, "%s", g_zRoot);
@@ -3363,11 +5373,21 @@ void ProcessOneRequest(int forceClose, int socketId) {
     // 处理逻辑：
     i = 0; j = j0 = (int) strlen(zLine);  // j0 记录根目录长度
 
+    // 缓存命中时直接使用缓存的解析结果
+    if (bCached) {
+        zRealScript = StrDup(pc.zRealScript);
+        strcpy(&zLine[j0], pc.zRealScript);
+        i = pc.iPathInfo;
+        statbuf = pc.st;
+    }
+
     // 解析处理 script 信息
     // 1. 以 '/' 为分隔符，逐段遍历处理 URI 路径，找到一个存在的文件
     // 2. 如果逐级遍历过程过程中，某段路径不存在，则尝试寻找 "not-found.html" 错误页，如果没有找到则返回 404 错误
     // 3. 如果整个 URI 指向一个目录，则尝试寻找目录下是否存在默认索引文件（index.html、index.cgi 等），如果没有找到则返回 404 错误
-    while (zScript[i]) {
+    while (!bCached && zScript[i]) {
+
+        int jParent = j;                // 当前这段路径的上级目录在 zLine 中的长度（可能含结尾的 '/'）
 
         // 遍历 URI 路径中（以 '/' 分隔）的一段，并复制到 zLine
         while (zScript[i] && (i == 0 || zScript[i] != '/')) { // 找到下一个 '/'
@@ -3383,6 +5403,11 @@ void ProcessOneRequest(int forceClose, int socketId) {
         if (!buildin && stat(zLine, &statbuf) != 0) {
             // 路径既不在 buildins 也不在文件系统，尝试寻找 "not-found.html" 错误页
 
+            // 记下最近的上级目录，找不到错误页时作为负缓存的校验目录
+            if (jParent > j0 && zLine[jParent - 1] == '/') jParent--;
+            char *zParent = jParent > 0 ? ReqAlloc(jParent + 1) : "/";
+            if (jParent > 0) { memcpy(zParent, zLine, jParent); zParent[jParent] = 0; }
+
             int stillSearching = 1;
             while (stillSearching && i > 0 && j > j0) {
 
@@ -3409,13 +5434,17 @@ void ProcessOneRequest(int forceClose, int socketId) {
                         return;
                     }
                     stillSearching = 0;
+                    bNoCache = true;            // 作为 CGI 运行的错误页，不缓存
                     break;
                 }
 
                 --j;  // 继续向上回溯
             }
 
-            if (stillSearching) NotFound(380/* 日志：URI 未找到 */);
+            if (stillSearching) {
+                PathCacheStore(zVhost, zScript, PATH_CACHE_NOT_FOUND, zParent, &pc);
+                NotFound(380/* 日志：URI 未找到 */);
+            }
             break;
         }
 
@@ -3461,7 +5490,12 @@ void ProcessOneRequest(int forceClose, int socketId) {
                 }
             }
             
-            if (jj >= n) NotFound(400/* 日志：URI 是目录但没有 index.html */);
+            if (jj >= n) {
+                if (k > 0) zLine[k] = 0;        // 负缓存的校验目录即该目录本身
+                else strcpy(zLine, "/");
+                PathCacheStore(zVhost, zScript, PATH_CACHE_NO_INDEX, zLine, &pc);
+                NotFound(400/* 日志：URI 是目录但没有 index.html */);
+            }
 
             // 保存（带有索引文件的）实际文件路径
             zRealScript = StrDup(&zLine[j0]);
@@ -3490,19 +5524,35 @@ void ProcessOneRequest(int forceClose, int socketId) {
     if (i == 0) strcpy(zDir, "/");      // 文件在根目录
     else zDir[i] = 0;                   // 截断，只保留目录部分
 
+    // 检查是否是 buildins 文件（只查找一次，后续复用；缓存命中且不在 buildins 中时不需要查找）
+    buildin_file_info_st *buildin_file = bCached && !pc.bBuildin ? NULL : buildins_find(zRealScript);
+
+    httpd_phase(HTTPD_PHASE_RESOLVE);
+
     // 授权检查（HTTP Basic/Digest 认证）
     sprintf(zLine, "%s/-auth", zDir);   // 在目录中查找 -auth 文件
-    if (access(zLine, R_OK) == 0 && !CheckBasicAuthorization(zLine)) {
+    int hasAuth = bCached ? pc.bAuth : access(zLine, R_OK) == 0;
+
+    // 保存解析结果（需要在授权检查之前，授权失败时不会返回）
+    if (!bCached && !bNoCache && i <= UINT16_MAX) {
+        pc.bBuildin = buildin_file != NULL;
+        pc.bAuth = (uint8_t)hasAuth;
+        pc.iPathInfo = (uint16_t)i;
+        pc.pMime = buildin_file ? NULL : GetMimeType(zFile, lenFile);
+        if (buildin_file) memset(&pc.st, 0, sizeof(pc.st));
+        else pc.st = statbuf;
+        PathCacheStore(zVhost, zScript, PATH_CACHE_FILE, zDir, &pc);
+    }
+
+    if (hasAuth && !CheckBasicAuthorization(zLine)) {
         tls_close_conn();  // 认证失败，关闭连接
         return;
     }
+    if (hasAuth) httpd_phase(HTTPD_PHASE_AUTH);
 
     // ---------------------------
     // 根据文件类型采取相应行动
     // ---------------------------
-
-    // 检查是否是 buildins 文件（只查找一次，后续复用）
-    buildin_file_info_st *buildin_file = buildins_find(zRealScript);
     bool is_buildin_c_cgi = false;  // 标记是否为 buildin C 脚本
     char *temp_cgi_path = NULL;
     
@@ -3527,7 +5577,6 @@ void ProcessOneRequest(int forceClose, int socketId) {
             chmod(temp_cgi_path, 0700);
             
             // 更新 zFile 指向临时文件
-            free(zFile);
             zFile = temp_cgi_path;
             lenFile = (int)strlen(zFile);
             
@@ -3560,6 +5609,26 @@ void ProcessOneRequest(int forceClose, int socketId) {
         // 不带目录前缀的文件名
         char *zBaseFilename = &zFile[i + 1];
 
+        // C 脚本：在本进程（事件循环模式下为 worker）中查找已编译的缓存，未命中时编译，CGI 子子进程继承后直接运行（-X）
+        if (isCScript) httpd_cgi_c_prepare(zFile, is_buildin_c_cgi ? buildin_file : NULL);
+
+        // 事件循环模式下，CGI 交给子进程处理（该子进程再 fork 出 CGI 子子进程）
+        EvHandOff();
+        g_iHandler = isCScript ? METRICS_C_CGI : METRICS_CGI;
+
+        // 常驻 C 脚本（-R）：直接在本进程中调用 handle_request()
+        if (isCScript && g_residentC && httpd_cgi_c_resident()) {
+            g_iHandler = METRICS_C_RESIDENT;
+            ResidentReply();
+            althttpd_fflush(stdout);
+            MakeLogEntry(0, 0);  /* LOG: Normal reply */
+            omitLog = 1;
+            return;
+        }
+
+        // chunked 编码的请求体长度未知，先完整读入并解码，以便通过 CONTENT_LENGTH 告诉 CGI
+        if (g_postChunked) ReadPostData();
+
         // fork 一个子进程来运行 CGI 脚本，这样即使 CGI 崩溃也不会影响对请求的响应
         
         // 创建用于与子 CGI 进程通信的管道
@@ -3570,8 +5639,17 @@ void ProcessOneRequest(int forceClose, int socketId) {
 
         // 创建运行 CGI 的子子进程
         fflush(stdout);  // fork 之前刷新缓冲区，避免子进程重复输出缓存中的数据
+        PhaseShare();
         if (fork() == 0) {
             // 以下代码在 CGI 子子进程中运行
+            httpd_phase(HTTPD_PHASE_FORK);
+            metrics_fork(METRICS_FORK_CGI);
+            scoreboard_claim(SB_KIND_CGI);
+            if (isCScript) scoreboard_state(SB_COMPILE);    // 缓存命中时由 httpd_cgi_c() 直接改为 SB_RUN
+            if (g_isWorker) {
+                g_isWorker = false;                 // CGI 子进程中的 althttpd_exit() 必须真正退出进程
+                SetCpuLimit();
+            }
 
             // 设置 CGI → 请求处理进程的管道（重定向 stdout）
             close(1);                               // 关闭标准输出
@@ -3584,6 +5662,7 @@ void ProcessOneRequest(int forceClose, int socketId) {
             if (dup(py[0]) < 0) {                   // 将 stdin 重定向到管道读端
                 CgiStartFailure(px[1], 444/* 日志：dup() 失败 */, "CGI cannot dup() file descriptor 0");
             }
+            close(py[1]);                           // 否则 CGI 自己持有写入端，读到请求体末尾时等不到 EOF
 
             // [2026-02-11] 注释掉 fd 批量关闭逻辑
             // 原设计：关闭所有 fd≥3 的文件描述符，防止泄漏到 CGI 子进程
@@ -3598,169 +5677,1091 @@ void ProcessOneRequest(int forceClose, int socketId) {
             // 设计权衡：支持 buildins 机制 > 手动管理少量 fd 副本
             // for (i = 3; close(i) == 0; i++) {}
 
-            // 移动到 CGI 程序所在的目录
-            if (chdir(zDir)) {
-                char zBuf[1000];
-                CgiStartFailure(1, 445/* 日志：chdir() 失败 */, "CGI cannot chdir to [%s] from [%s]",
-                                zDir, getcwd(zBuf, 999));
+            // 移动到 CGI 程序所在的目录
+            if (chdir(zDir)) {
+                char zBuf[1000];
+                CgiStartFailure(1, 445/* 日志：chdir() 失败 */, "CGI cannot chdir to [%s] from [%s]",
+                                zDir, getcwd(zBuf, 999));
+            }
+
+            // 设置 CGI 环境变量
+            ComputeRequestUri();                    // 计算 REQUEST_URI
+            putenv("GATEWAY_INTERFACE=CGI/1.0");    // 设置 CGI 版本
+            for (i = 0; i < (int) (sizeof(cgienv) / sizeof(cgienv[0])); i++) {
+
+                if (*cgienv[i].pzEnvValue) SetEnv(cgienv[i].zEnvName, *cgienv[i].pzEnvValue);
+            }
+
+            // 根据类型执行不同的 CGI
+            if (isCScript) {
+                // C 脚本：使用 TinyCC 运行时编译并执行
+                // + 优势：无需预编译，修改即生效，适合快速开发
+                // + 劣势：每次请求都要编译，性能略低于预编译 CGI
+                // + 注意：这里在子子进程中执行，crash 不会影响请求处理进程
+                httpd_cgi_c(zMethod, zFile, zProtocol, &nOut, is_buildin_c_cgi ? buildin_file : NULL);
+                exit(0);  // C 脚本执行完毕，退出 CGI 子子进程
+            } else {
+                // 传统 CGI：execl() 替换进程映像执行二进制文件
+                execl(zBaseFilename, zBaseFilename, (char *) 0);
+                CgiStartFailure(1, 446/* 日志：CGI exec() 失败 */,
+                                "CGI program \"%s\" could not be started.", zScript);
+            }
+
+            /* NOT REACHED */
+        }
+
+        // 以下代码在请求处理进程（父进程）中运行
+        isCGI = true;                      // 标记当前请求为 CGI
+        scoreboard_state(SB_RUN);
+
+        close(px[1]);                   // 关闭管道写端（只读取）
+        in = fdopen(px[0], "rb");       // 打开管道读端为文件流
+        if (in) setvbuf(in, 0, _IONBF, 0);  // 无缓冲：读取的数据都经过 g_zCgiIn（见 CgiGets()），splice() 前不会有遗漏
+
+        // 设置 althttpd 到 CGI 的管道用于发送 POST 数据（如果有）
+        // + 请求体在 CGI 运行的同时写入，完成后关闭管道写入端，告知 CGI 数据已发送完毕
+
+        close(py[0]);                   // 关闭管道读端（只写入）
+        FeedPostData(py[1]);
+
+        // 等待 CGI 程序响应并处理该响应
+        if (in == 0) {
+            CgiError();                                                 // 管道打开失败
+        } else {
+            CgiHandleReply(in, strncmp(zBaseFilename, "nph-", 4) == 0); // 处理 CGI 的响应输出
+        }
+        PostFeederWait();               // 请求体读完之后才能继续处理连接上的下一个请求
+    }
+
+    // 如果文件以 ".scgi" 结尾，进入 SCGI 处理流程
+    else if (lenFile > 5 && strcmp(&zFile[lenFile - 5], ".scgi") == 0) {
+
+        // 任何以 ".scgi" 结尾的文件都被假定为包含如下格式的文本：SCGI hostname port
+        // + 打开一个 TCP/IP 连接到该主机并发送 SCGI 请求
+        EvHandOff();
+        g_iHandler = METRICS_SCGI;
+        SendScgiRequest(zFile, zScript);
+    }
+
+    // 如果访问的是静态文件，但 URI 中包含了文件名之后的额外路径信息（即 PATH_INFO 部分），则返回 404 错误
+    // + 前面已经完成了 CGI 和 SCGI 的处理，所以这里被认为是静态文件请求
+    //   cgi 允许额外路径信息，但静态文件不允许
+    // ! 这里不能直接判断 zPathInfo 是否为空，因为静态页面也可以存在 PATH_INFO 信息，即页面内锚点（即 #anchor 部分）
+    //   但锚点 #anchor 肯定不会包含斜杠 '/'，所以这里通过比较斜杠数量来判断
+    else if (countSlashes(zRealScript) != countSlashes(zScript)) {
+
+        NotFound(460/* 日志：静态文件名之后的额外 URI 内容 */);
+    }
+    // 对于普通静态文件请求，默认执行文件发送处理
+    else {
+
+        g_iHandler = buildin_file ? METRICS_BUILDINS : METRICS_STATIC;
+
+        // 事件循环中只直接发送较小的静态内容，较大的交给子进程发送，避免长时间阻塞事件循环
+        if (g_evLoop && (buildin_file ? (size_t)buildin_file->orig_sz : (size_t)statbuf.st_size) > EVLOOP_INLINE_MAX)
+            EvHandOff();
+
+        // 设置超时：30秒基础 + 每 2KB 数据 1 秒
+        SetTimeout(30 + (int)(statbuf.st_size / 2000), 805/* 日志：发送静态文件超时 */);
+
+        // 检查是否是 buildins 文件（复用前面的查找结果，到这里不可能是目录）
+        if (buildin_file) {
+            // 从 buildins 发送（支持 gzip 直传）
+            // + 返回 1 表示已经记录过日志（304、HEAD 等），否则在下面记录日志
+            // ! 注意 buildins 已发送的情况下不能再尝试文件系统，否则会在同一连接上输出两份回复
+            fprintf(stderr, "[httpd] Sending file from buildins: %s\n", zRealScript);
+            if (SendBuildins(zRealScript, strlen(zRealScript), buildin_file)) {
+                // 清理临时 CGI 文件（如果存在）
+                if (temp_cgi_path) {
+                    unlink(temp_cgi_path);
+                    free(temp_cgi_path);
+                }
+                return;
+            }
+        }
+        else {
+            // 从文件系统发送
+            fprintf(stderr, "[httpd] Sending file from filesystem: %s\n", zFile);
+            if (SendFile(zFile, lenFile, &statbuf, bCached ? pc.pMime : NULL)) {
+                // 清理 buildins 临时CGI 文件
+                if (temp_cgi_path) {
+                    unlink(temp_cgi_path);
+                    free(temp_cgi_path);
+                }
+                return;
+            }
+        }
+    }
+
+    althttpd_fflush(stdout);
+    MakeLogEntry(0, 0);  /* LOG: Normal reply */
+    omitLog = 1;
+    
+    // 清理 buildins 临时 CGI 文件
+    if (temp_cgi_path) {
+        unlink(temp_cgi_path);
+        free(temp_cgi_path);
+    }
+}
+
+// 启动浏览器，打开指定 zPage, 即 URL http://localhost:iPort/zPath
+static void launch_web_browser(const char *zPath, int iPort) {
+
+    char zUrl[2000];
+    static const char *const azBrowserProg[] = {
+#if defined(__DARWIN__) || defined(__APPLE__) || defined(__HAIKU__)
+        "open"
+#else
+        "xdg-open", "gnome-open", "firefox", "google-chrome"
+#endif
+    };
+
+    if (strlen(zPath) <= sizeof(zUrl) - 1000) {
+        while (zPath[0] == '/') zPath++;
+        sprintf(zUrl, "http://localhost:%d/%s", iPort, zPath);
+        for (size_t i = 0; i < sizeof(azBrowserProg) / sizeof(azBrowserProg[0]); i++) {
+            execlp(azBrowserProg[i], azBrowserProg[i], zUrl, (char *) 0);
+        }
+    }
+    althttpd_exit(1);
+}
+
+/*
+** All possible forms of an IP address.  Needed to work around GCC strict
+** aliasing rules.
+*/
+typedef union {
+    struct sockaddr sa;              /* Abstract superclass */
+    struct sockaddr_in sa4;          /* IPv4 */
+    struct sockaddr_in6 sa6;         /* IPv6 */
+    struct sockaddr_storage sas;     /* Should be the maximum of the above 3 */
+} address;
+
+// 获取请求来源的IP地址（连接套接字已被映射到 stdin 上），结果保存在 g_zRemoteAddr 中
+static void ComputeRemoteAddr(void) {
+
+    if (g_zRemoteAddr == 0) {
+
+        address remoteAddr;
+        socklen_t size = sizeof(remoteAddr);
+        char zHost[NI_MAXHOST];
+        if (getpeername(0, &remoteAddr.sa, &size) >= 0) {
+            getnameinfo(&remoteAddr.sa, size, zHost, sizeof(zHost), 0, 0, NI_NUMERICHOST);
+            static char zRemoteAddr[NI_MAXHOST];    // 连接级别的状态，不能使用请求级内存池
+            memcpy(zRemoteAddr, zHost, sizeof(zRemoteAddr));
+            g_zRemoteAddr = zRemoteAddr;
+        }
+    }
+    if (g_zRemoteAddr != 0
+        && strncmp(g_zRemoteAddr, "::ffff:", 7) == 0
+        && strchr(g_zRemoteAddr + 7, ':') == 0
+        && strchr(g_zRemoteAddr + 7, '.') != 0 ) {
+
+        g_zRemoteAddr += 7;
+    }
+}
+
+// 重置与单个请求（连接）相关的全局状态
+// + prefork worker 和事件循环会在同一进程中处理多个连接，需要在连接（请求）之间清除上一个连接遗留的状态
+static void ResetRequestState(void) {
+    if (zPostData) free(zPostData);
+    zPostData = 0;
+    nPostData = 0;
+    g_postPending = g_postChunked = g_expectContinue = false;
+    g_nPostLen = 0;
+    g_postFeeder = 0;
+    nIn = nOut = 0;
+    statusSent = 0;
+    closeConnection = false;
+    isExiting = 0;
+    inSignalHandler = 0;
+    omitLog = 0;
+    isCGI = false;
+    isRobot = 0;
+    zAgent = zAccept = zAcceptEncoding = zContentType = 0;
+    zServerName = zServerPort = 0;
+    zScgi = 0;
+    g_nRange = 0;
+    if (g_bodyMode == BODY_GZIP) deflateEnd(&g_bodyZ);     // 上一个请求在响应体输出期间中止
+    g_bodyMode = BODY_DIRECT;
+    g_nBodyChunk = 0;
+    g_zHttpHost = g_zDefaultHost;
+    g_iConnIn = g_nConnIn = 0;          // 丢弃上一个连接残留的输入
+    g_iCgiIn = g_nCgiIn = 0;
+}
+
+static volatile sig_atomic_t        g_stopMaster = 0;           // prefork 主进程收到了终止信号
+static volatile sig_atomic_t        g_dumpStat = 0;             // prefork 主进程收到了输出统计信息的请求（SIGUSR1）
+
+static void PreforkSignal(int iSig) {
+    if (iSig == SIGUSR1) g_dumpStat = 1;
+    else if (iSig != SIGCHLD) g_stopMaster = 1;     // SIGCHLD 只用来打断主进程的 epoll_wait()
+}
+
+// 输出各 worker 槽位的统计信息，用于确认连接在各 worker（CPU 核心）之间是否均衡
+static void PreforkDumpStat(void) {
+    uint64_t nTotal = 0;
+    for (int i = 0; i < g_nWorkers; i++) nTotal += g_aWorkerStat[i].nAccept;
+    printf("Prefork worker stats: %llu connections\n", (unsigned long long)nTotal);
+    for (int i = 0; i < g_nWorkers; i++) {
+        WorkerStat *p = &g_aWorkerStat[i];
+        printf("  worker %d: pid %d, cpu %d, accepts %llu (%.1f%%), requests %llu, parked %llu\n",
+               i, (int)p->pid, p->iCpu, (unsigned long long)p->nAccept,
+               nTotal ? 100.0 * (double)p->nAccept / (double)nTotal : 0.0,
+               (unsigned long long)p->nRequest, (unsigned long long)p->nPark);
+    }
+    if (file_cache_enabled()) {
+        file_cache_stat st;
+        file_cache_stats(&st);
+        printf("File cache: hits %llu, misses %llu, inserts %llu, evictions %llu, %llu / %llu bytes\n",
+               (unsigned long long)st.nHit, (unsigned long long)st.nMiss, (unsigned long long)st.nInsert,
+               (unsigned long long)st.nEvict, (unsigned long long)st.nBytes, (unsigned long long)st.nBudget);
+    }
+    fflush(stdout);
+}
+
+// 为 worker 创建独立的 SO_REUSEPORT 监听套接字，由内核在同一端口的多个套接字之间分配新连接
+// + bListen 为 0 时只绑定不监听（主进程用来占用端口，不分到连接）
+// + 返回监听套接字，失败返回 -1
+static int OpenReusePortListener(int iPort, int bLocalhost, int bListen) {
+#ifdef SO_REUSEPORT
+    struct sockaddr_in6 inaddr;
+    int opt = 1;
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    memset(&inaddr, 0, sizeof(inaddr));
+    inaddr.sin6_family = AF_INET6;
+    inaddr.sin6_addr = bLocalhost ? in6addr_loopback : in6addr_any;
+    inaddr.sin6_port = htons(iPort);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if (bind(fd, (struct sockaddr *) &inaddr, sizeof(inaddr)) < 0 || (bListen && listen(fd, 100) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)iPort; (void)bLocalhost; (void)bListen;
+    return -1;
+#endif
+}
+
+#ifdef linux
+
+// 主进程托管的空闲连接（以连接 fd 为下标）
+typedef struct ParkConn {
+    time_t                          tPark;                      // 连接交还主进程的时间
+    int                             nReq;                       // 连接上已处理的请求数
+    bool                            bUsed;                      // 该项是否正在使用
+    bool                            bReady;                     // 连接上有新数据，等待分派给 worker
+} ParkConn;
+static ParkConn*                    g_aParked = NULL;
+static int                          g_nParkMax = 0;             // g_aParked 的大小（fd 上限）
+static int                          g_parkMaxFd = -1;           // 正在托管的最大 fd
+static int                          g_nParkReady = 0;           // 等待分派的连接数
+static int                          g_parkEpoll = -1;
+
+// 通过 unix 套接字 sock 传递连接 fd（SCM_RIGHTS），同时附带该连接已处理的请求数。成功返回 0
+static int ParkSendFd(int sock, int fd, int nReq) {
+    struct msghdr msg;
+    struct iovec iov;
+    union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &nReq;
+    iov.iov_len = sizeof(nReq);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// 从 unix 套接字 sock 接收 ParkSendFd() 传递的连接 fd，没有（或被其它进程抢先收走）时返回 -1
+static int ParkRecvFd(int sock, int *pnReq) {
+    struct msghdr msg;
+    struct iovec iov;
+    union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = pnReq;
+    iov.iov_len = sizeof(*pnReq);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*pnReq)) return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm == 0 || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) return -1;
+    memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    return fd;
+}
+
+// 主进程：初始化空闲连接托管（托管 / 分派通道、连接表和 epoll），失败时关闭该功能
+static void ParkInit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    getrlimit(RLIMIT_NOFILE, &rl);
+    g_nParkMax = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20)) ? (1 << 20) : (int)rl.rlim_cur;
+    g_aParked = (ParkConn*)calloc(g_nParkMax, sizeof(ParkConn));
+    g_parkEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (g_aParked == 0 || g_parkEpoll < 0
+        || socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, g_parkSock) < 0
+        || socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, g_dispatchSock) < 0) {
+        printf("Cannot initialize idle connection parking: %s\n", strerror(errno));
+        g_parkIdle = false;
+        return;
+    }
+    // 多个 worker 同时等待分派的连接，未抢到的 recvmsg() 应立即返回
+    fcntl(g_dispatchSock[0], F_SETFL, O_NONBLOCK);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = g_parkSock[0];
+    epoll_ctl(g_parkEpoll, EPOLL_CTL_ADD, g_parkSock[0], &ev);
+}
+
+// 新 fork 的 worker：关闭只属于主进程的 fd（包括正在托管的连接，否则连接关闭后对端收不到 FIN）
+static void ParkCloseMasterFds(void) {
+    for (int fd = 0; fd <= g_parkMaxFd; fd++) {
+        if (g_aParked[fd].bUsed) close(fd);
+    }
+    free(g_aParked);
+    g_aParked = 0;
+    close(g_parkEpoll);
+    close(g_parkSock[0]);
+    close(g_dispatchSock[1]);
+}
+
+// 主进程：关闭托管的连接
+static void ParkClose(int fd) {
+    epoll_ctl(g_parkEpoll, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+    if (g_aParked[fd].bReady) g_nParkReady--;
+    memset(&g_aParked[fd], 0, sizeof(ParkConn));
+}
+
+// 主进程：等待托管通道和托管连接上的事件（最长 1 秒）
+/* + worker 交还的空闲连接加入 epoll；连接上有新数据后，通过分派通道交给任意一个空闲的 worker，连接关闭或超时则直接关闭
+ |   分派通道已满（所有 worker 都在忙）时，连接留在主进程中，稍后再试
+*/
+static void ParkPoll(void) {
+    static time_t tSweep = 0;
+    struct epoll_event aEv[64], ev;
+
+    int n = epoll_wait(g_parkEpoll, aEv, (int)(sizeof(aEv) / sizeof(aEv[0])), g_nParkReady ? 10 : 1000);
+    time_t now = time(0);
+    memset(&ev, 0, sizeof(ev));
+    for (int i = 0; i < n; i++) {
+        int fd = aEv[i].data.fd;
+
+        // worker 交还的空闲连接
+        if (fd == g_parkSock[0]) {
+            int c, nReq;
+            while ((c = ParkRecvFd(g_parkSock[0], &nReq)) >= 0) {
+                if (c >= g_nParkMax) { close(c); continue; }
+                ParkConn *p = &g_aParked[c];
+                memset(p, 0, sizeof(ParkConn));
+                p->bUsed = true;
+                p->nReq = nReq;
+                p->tPark = now;
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.fd = c;
+                epoll_ctl(g_parkEpoll, EPOLL_CTL_ADD, c, &ev);
+                if (c > g_parkMaxFd) g_parkMaxFd = c;
+            }
+            continue;
+        }
+
+        // 托管的连接上有新数据，或者连接已关闭
+        char ch;
+        ssize_t got = recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+            ParkClose(fd);
+            continue;
+        }
+        if (got < 0) continue;
+        epoll_ctl(g_parkEpoll, EPOLL_CTL_DEL, fd, 0);
+        g_aParked[fd].bReady = true;
+        g_nParkReady++;
+    }
+
+    // 分派有新数据的连接
+    for (int fd = 0; g_nParkReady > 0 && fd <= g_parkMaxFd; fd++) {
+        ParkConn *p = &g_aParked[fd];
+        if (!p->bReady) continue;
+        if (ParkSendFd(g_dispatchSock[1], fd, p->nReq) < 0) break;
+        close(fd);
+        g_nParkReady--;
+        memset(p, 0, sizeof(ParkConn));
+    }
+
+    // 每秒关闭一次超时的托管连接
+    if (now != tSweep) {
+        tSweep = now;
+        for (int fd = 0; fd <= g_parkMaxFd; fd++) {
+            ParkConn *p = &g_aParked[fd];
+            if (p->bUsed && !p->bReady && now - p->tPark > PARK_IDLE_TIMEOUT) ParkClose(fd);
+        }
+    }
+    while (g_parkMaxFd >= 0 && !g_aParked[g_parkMaxFd].bUsed) g_parkMaxFd--;
+}
+
+// worker：Keep-Alive 连接上暂时没有新的请求时，将连接交还主进程托管，然后回到 accept 循环
+// + 连接的引用在 http_worker() 中释放；TLS 连接的状态在本进程中，无法托管
+static void WorkerParkIdle(void) {
+    if (!g_parkIdle || g_useHttps == 2 || g_iConnIn < g_nConnIn) return;
+
+    struct pollfd pfd;
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, PARK_IDLE_MS) != 0) return;               // 下一个请求已到达（或连接已关闭），照常处理
+    if (ParkSendFd(g_parkSock[1], 0, nRequest) < 0) return;     // 托管失败，照常在本进程中等待
+    g_aWorkerStat[g_iWorker].nPark++;
+    siglongjmp(g_workerJmp, 2);
+}
+#endif /* linux */
+
+// prefork 主进程：预先 fork 出 g_nWorkers 个 worker 进程，然后只负责监管
+/* + 主进程不再 accept 连接，而是由各 worker 直接在（继承来的）监听套接字上 accept
+ |   如果开启了 g_reusePort，则每个 worker 各自创建 SO_REUSEPORT 监听套接字，并绑定到一个 CPU 核心上，
+ |   此时主进程的监听套接字只用来占用端口（不调用 listen），新连接由内核直接分配给各 worker
+ |   worker 退出（被回收或崩溃）后，主进程会立即 fork 一个新的 worker 替补
+ |   主进程收到 SIGTERM/SIGINT 时，先终止所有 worker 再退出；收到 SIGUSR1 时输出各 worker 的统计信息
+ |   如果开启了 g_parkIdle，主进程还负责托管 worker 交还的空闲 Keep-Alive 连接（见 ParkPoll）
+ |   该函数只会在 worker 进程中返回
+*/
+static void PreforkSupervise(int listener, int listenTLS, int iPort, int tlsPort, int bLocalhost) {
+
+    pid_t *aWorker = (pid_t*)SafeMalloc(sizeof(pid_t) * g_nWorkers);
+    time_t *aStart = (time_t*)SafeMalloc(sizeof(time_t) * g_nWorkers);
+    memset(aWorker, 0, sizeof(pid_t) * g_nWorkers);
+
+    // worker 统计信息需要在主进程和 worker 之间共享
+    g_aWorkerStat = (WorkerStat*)mmap(0, sizeof(WorkerStat) * g_nWorkers, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANON, -1, 0);
+    if (g_aWorkerStat == MAP_FAILED) Malfunction(530/* LOG: mmap() failed */, "cannot allocate worker stats");
+    memset(g_aWorkerStat, 0, sizeof(WorkerStat) * g_nWorkers);
+
+    // 多个 worker 同时在监听套接字上等待，未抢到连接的 accept() 应立即返回，而不是阻塞
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    if (listenTLS > 0) fcntl(listenTLS, F_SETFL, fcntl(listenTLS, F_GETFL) | O_NONBLOCK);
+
+    // 不使用 SA_RESTART，以便信号可以打断下面阻塞的 waitpid()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = PreforkSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGUSR1, &sa, 0);
+
+#ifdef linux
+    if (g_parkIdle) {
+        ParkInit();
+        if (g_parkIdle) sigaction(SIGCHLD, &sa, 0);
+    }
+#endif
+
+    int nCpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpu < 1) nCpu = 1;
+
+    printf("Prefork %d worker processes%s%s\n", g_nWorkers, g_reusePort ? " (SO_REUSEPORT, CPU pinned)" : "",
+           g_parkIdle ? " (idle connections parked in master)" : "");
+    fflush(stdout);
+
+    pid_t masterPid = getpid();
+    for (;;) {
+
+        // 补足 worker 进程
+        for (int i = 0; i < g_nWorkers && !g_stopMaster; i++) {
+            if (aWorker[i] > 0) continue;
+
+            pid_t child = fork();
+            if (child == 0) {
+                // 以下代码在 worker 进程中运行
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                signal(SIGUSR1, SIG_DFL);
+                signal(SIGCHLD, SIG_DFL);
+#ifdef linux
+                if (g_parkIdle) ParkCloseMasterFds();
+#endif
+                free(aWorker);
+                free(aStart);
+                g_iWorker = i;
+                g_masterPid = masterPid;
+                g_listener = listener;
+                g_listenTLS = listenTLS;
+                g_aWorkerStat[i].pid = getpid();
+                g_aWorkerStat[i].iCpu = -1;
+
+                if (g_reusePort) {
+                    // 创建 worker 自己的监听套接字（需在降权之前完成，且与主进程同一用户身份）
+                    g_listener = OpenReusePortListener(iPort, bLocalhost, 1);
+                    if (g_listener < 0) Malfunction(531/* LOG: SO_REUSEPORT listener failed */, "cannot open SO_REUSEPORT listener on port %d", iPort);
+                    close(listener);
+                    if (listenTLS > 0) {
+                        g_listenTLS = OpenReusePortListener(tlsPort, bLocalhost, 1);
+                        if (g_listenTLS < 0) Malfunction(531, "cannot open SO_REUSEPORT listener on port %d", tlsPort);
+                        close(listenTLS);
+                    }
+
+#ifdef linux
+                    // 将 worker 绑定到一个 CPU 核心上，连接的处理始终在同一个核心上完成
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(i % nCpu, &cpus);
+                    if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0) g_aWorkerStat[i].iCpu = i % nCpu;
+#endif
+                }
+                g_isWorker = true;
+                scoreboard_claim(SB_KIND_WORKER);
+                return;
             }
+            if (child < 0) break;           // fork 失败，等到下次有 worker 退出时再重试
+            aWorker[i] = child;
+            aStart[i] = time(0);
+            metrics_fork(METRICS_FORK_WORKER);
+        }
 
-            // 设置 CGI 环境变量
-            ComputeRequestUri();                    // 计算 REQUEST_URI
-            putenv("GATEWAY_INTERFACE=CGI/1.0");    // 设置 CGI 版本
-            for (i = 0; i < (int) (sizeof(cgienv) / sizeof(cgienv[0])); i++) {
-
-                if (*cgienv[i].pzEnvValue) SetEnv(cgienv[i].zEnvName, *cgienv[i].pzEnvValue);
+        if (g_stopMaster) {
+            for (int i = 0; i < g_nWorkers; i++) {
+                if (aWorker[i] > 0) kill(aWorker[i], SIGTERM);
             }
+            if (g_logWriter > 0) kill(g_logWriter, SIGTERM);      // 日志进程写完缓冲中剩余的记录后退出
+            if (g_scriptWatcher > 0) kill(g_scriptWatcher, SIGTERM);
+            while (wait(0) > 0 || errno == EINTR) {}
+            PreforkDumpStat();
+            althttpd_exit(0);
+        }
+        if (g_dumpStat) {
+            g_dumpStat = 0;
+            PreforkDumpStat();
+        }
 
-            // 根据类型执行不同的 CGI
-            if (isCScript) {
-                // C 脚本：使用 TinyCC 运行时编译并执行
-                // + 优势：无需预编译，修改即生效，适合快速开发
-                // + 劣势：每次请求都要编译，性能略低于预编译 CGI
-                // + 注意：这里在子子进程中执行，crash 不会影响请求处理进程
-                httpd_cgi_c(zMethod, zFile, zProtocol, &nOut, is_buildin_c_cgi ? buildin_file : NULL);
-                exit(0);  // C 脚本执行完毕，退出 CGI 子子进程
-            } else {
-                // 传统 CGI：execl() 替换进程映像执行二进制文件
-                execl(zBaseFilename, zBaseFilename, (char *) 0);
-                CgiStartFailure(1, 446/* 日志：CGI exec() 失败 */,
-                                "CGI program \"%s\" could not be started.", zScript);
+        // 等待任意子进程结束（包括浏览器启动进程），如果是 worker 则在下一轮循环中补足
+        // + 托管空闲连接时，在等待连接事件的同时检查子进程（SIGCHLD 会打断 epoll_wait）
+        int status;
+        pid_t child;
+#ifdef linux
+        if (g_parkIdle) {
+            ParkPoll();
+            if ((child = waitpid(-1, &status, WNOHANG)) <= 0) continue;
+        } else
+#endif
+        {
+            child = waitpid(-1, &status, 0);
+            if (child < 0) {
+                if (errno != EINTR) sleep(1);
+                continue;
             }
+        }
+        scoreboard_reap(child);
+        for (int i = 0; i < g_nWorkers; i++) {
+            if (aWorker[i] != child) continue;
+            aWorker[i] = 0;
+            // worker 刚启动就退出（比如启动阶段出错），稍作等待，避免反复 fork
+            if (time(0) - aStart[i] < 1) sleep(1);
+            break;
+        }
+    }
+}
 
-            /* NOT REACHED */
+// prefork worker 的主循环：在监听套接字上 accept 连接，并在当前进程中处理连接上的（Keep-Alive）请求
+/* + 连接结束时，althttpd_exit() 会通过 siglongjmp 返回到这里，而不是退出进程，之后重置连接相关的全局状态
+ |   请求处理中的字符串从请求级内存池分配，每个请求开始时整体重置；作为其它资源泄漏的兜底，worker 处理的请求数或 RSS 超过限制后仍会主动退出，由主进程重建
+ |   开启 g_parkIdle 时，空闲的 Keep-Alive 连接会交还主进程（WorkerParkIdle 跳转回来），worker 同时等待主进程分派回来的连接
+ |   该函数不会返回
+*/
+static void http_worker(void) {
+
+    // 记录连接相关的全局变量的初始值，每个连接开始前据此恢复
+    int useHttps = g_useHttps;
+    char *zHttps = g_zHttps;
+    char *zHttpScheme = g_zHttpScheme;
+    char *zPort = zRealPort;
+
+    if (!g_useTimeout) signal(SIGPIPE, SIG_IGN);    // 连接断开不能导致 worker 退出
+
+    // 以下在 sigsetjmp 之后仍会读取的局部变量声明为 volatile，避免 siglongjmp 返回后取到寄存器中的旧值
+    struct pollfd aPoll[3];
+    int nPoll = 0;
+    volatile int iTLS = -1, iDispatch = -1;
+    aPoll[nPoll].fd = g_listener; aPoll[nPoll++].events = POLLIN;
+    if (g_listenTLS > 0) { iTLS = nPoll; aPoll[nPoll].fd = g_listenTLS; aPoll[nPoll++].events = POLLIN; }
+
+    // 连接交还主进程后，用一个占位的 fd 替换 stdin/stdout，释放本进程对连接的引用
+    volatile int idleFd = -1;
+#ifdef linux
+    if (g_parkIdle) {
+        iDispatch = nPoll; aPoll[nPoll].fd = g_dispatchSock[0]; aPoll[nPoll++].events = POLLIN;
+        idleFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    }
+#endif
+
+    for (;;) {
+
+        // 检查 worker 是否需要回收
+        if (g_workerMaxReqs > 0 && g_nWorkerReqs >= g_workerMaxReqs) break;
+        if (g_workerMaxRssKB > 0) {
+            struct rusage self;
+            getrusage(RUSAGE_SELF, &self);
+#ifdef __APPLE__
+            if (self.ru_maxrss / 1024 > g_workerMaxRssKB) break;   // macOS 上单位为字节
+#else
+            if (self.ru_maxrss > g_workerMaxRssKB) break;
+#endif
         }
 
-        // 以下代码在请求处理进程（父进程）中运行
-        isCGI = true;                      // 标记当前请求为 CGI
+        // 等待新的连接，每秒检查一次主进程是否还在
+        if (poll(aPoll, nPoll, 1000) <= 0) {
+            if (getppid() != g_masterPid) break;
+            continue;
+        }
+        int onTLSSocket = iTLS > 0 && (aPoll[iTLS].revents & POLLIN);
+        int connection, nParkedReq = 0;
 
-        close(px[1]);                   // 关闭管道写端（只读取）
-        in = fdopen(px[0], "rb");       // 打开管道读端为文件流
+#ifdef linux
+        if (iDispatch > 0 && (aPoll[iDispatch].revents & POLLIN)) {
+            // 主进程分派过来的（曾经空闲的）Keep-Alive 连接，已经有新的请求数据到达
+            connection = ParkRecvFd(g_dispatchSock[0], &nParkedReq);
+            if (connection < 0) continue;
+            onTLSSocket = 0;
+        } else
+#endif
+        {
+            // accept() 连接。多个 worker 会同时被唤醒，未抢到连接的直接返回继续等待
+            connection = accept(onTLSSocket ? g_listenTLS : g_listener, 0, 0);
+            if (connection < 0) continue;
+            g_aWorkerStat[g_iWorker].nAccept++;
+        }
 
-        // 设置 althttpd 到 CGI 的管道用于发送 POST 数据（如果有）
+        // 监听套接字是非阻塞的，某些系统上 accept 出来的连接会继承该属性
+        fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) & ~O_NONBLOCK);
+
+        // 将连接映射到 stdin/stdout 上（替换掉上一个连接）
+        dup2(connection, 0);
+        dup2(connection, 1);
+        close(connection);
+
+        g_useHttps = useHttps;
+        g_zHttps = zHttps;
+        g_zHttpScheme = zHttpScheme;
+        zRealPort = zPort;
+        if (onTLSSocket) {
+            zRealPort = zRealTlsPort;
+        } else if (g_listenTLS > 0) {
+            g_useHttps = 0;
+            g_zHttps = 0;
+            g_zHttpScheme = "http";
+        }
 
-        close(py[0]);                   // 关闭管道读端（只写入）
-        if (nPostData > 0) {
-
-            // 循环写入 POST 数据，直到全部发送
-            ssize_t wrote = 0, n;
-            while ((ssize_t) nPostData > wrote) {
-                n = write(py[1], zPostData + wrote, nPostData - wrote);
-                if (n <= 0) break;  // 写入错误
-                wrote += n;
+        g_zRemoteAddr = 0;
+        ComputeRemoteAddr();
+
+        // 和每连接 fork 的模型一样，每个连接最多连续处理 100 + 1 个请求
+        nRequest = nParkedReq;
+        int rc = sigsetjmp(g_workerJmp, 1);
+        if (rc == 0) {
+            while (nRequest < 100) {
+#ifdef linux
+                if (nRequest > 0) WorkerParkIdle();
+#endif
+                ProcessOneRequest(0, 1);
             }
+            ProcessOneRequest(1, 1);
+            althttpd_exit(0);
         }
 
-        // 释放 POST 数据缓冲区
-        if (zPostData) {
-            free(zPostData);
-            zPostData = 0;
-            nPostData = 0;
+        // 以下代码在连接结束后执行（althttpd_exit 跳转到这里），或者连接已交还主进程（rc == 2）
+        alarm(0);
+        g_aWorkerStat[g_iWorker].bBusy = 0;
+        scoreboard_state(SB_IDLE);
+        if (rc == 2) {
+            dup2(idleFd, 0);
+            dup2(idleFd, 1);
         }
-        close(py[1]);                   // 关闭管道写入端，告知 CGI 数据已发送完毕
+        else shutdown(0, SHUT_RDWR);    // 连接的 fd 会在下一个连接 dup2() 时被关闭，这里先结束连接
+        althttpd_fpurge(stdout);        // 丢弃当前连接残留的输出缓冲（输入缓冲在 ResetRequestState 中清除）
+        clearerr(stdout);
 
-        // 等待 CGI 程序响应并处理该响应
-        if (in == 0) {
-            CgiError();                                                 // 管道打开失败
-        } else {
-            CgiHandleReply(in, strncmp(zBaseFilename, "nph-", 4) == 0); // 处理 CGI 的响应输出
-        }
+        // 重置连接相关的全局状态
+        ResetRequestState();
+        nRequest = 0;
     }
 
-    // 如果文件以 ".scgi" 结尾，进入 SCGI 处理流程
-    else if (lenFile > 5 && strcmp(&zFile[lenFile - 5], ".scgi") == 0) {
+    // worker 退出，由主进程重新 fork 替补
+    g_isWorker = false;
+    althttpd_exit(0);
+}
 
-        // 任何以 ".scgi" 结尾的文件都被假定为包含如下格式的文本：SCGI hostname port
-        // + 打开一个 TCP/IP 连接到该主机并发送 SCGI 请求
-        SendScgiRequest(zFile, zScript);
-    }
 
-    // 如果访问的是静态文件，但 URI 中包含了文件名之后的额外路径信息（即 PATH_INFO 部分），则返回 404 错误
-    // + 前面已经完成了 CGI 和 SCGI 的处理，所以这里被认为是静态文件请求
-    //   cgi 允许额外路径信息，但静态文件不允许
-    // ! 这里不能直接判断 zPathInfo 是否为空，因为静态页面也可以存在 PATH_INFO 信息，即页面内锚点（即 #anchor 部分）
-    //   但锚点 #anchor 肯定不会包含斜杠 '/'，所以这里通过比较斜杠数量来判断
-    else if (countSlashes(zRealScript) != countSlashes(zScript)) {
+#ifdef linux
 
-        NotFound(460/* 日志：静态文件名之后的额外 URI 内容 */);
-    }
-    // 对于普通静态文件请求，默认执行文件发送处理
-    else {
+#define EVLOOP_KEEPALIVE    100         // 接手请求的子进程的退出码：请求处理完毕，连接可以继续复用
 
-        // 设置超时：30秒基础 + 每 2KB 数据 1 秒
-        SetTimeout(30 + (int)statbuf.st_size / 2000, 805/* 日志：发送静态文件超时 */);
+static void EvSigChld(int iSig) {
+    int e = errno;
+    (void)iSig;
+    if (write(g_evPipe[1], "", 1) < 0) {}
+    errno = e;
+}
 
-        // 检查是否是 buildins 文件（复用前面的查找结果，到这里不可能是目录）
-        if (buildin_file) {
-            // 从 buildins 发送（支持 gzip 直传）
-            fprintf(stderr, "[httpd] Sending file from buildins: %s\n", zRealScript);
-            if (SendBuildins(zRealScript, strlen(zRealScript), buildin_file)) {
-                // 清理临时 CGI 文件（如果存在）
-                if (temp_cgi_path) {
-                    unlink(temp_cgi_path);
-                    free(temp_cgi_path);
-                }
-                return;
-            }
-            // SendBuildins 失败，继续尝试文件系统（不太可能发生）
+// 关闭事件循环中的连接
+static void EvClose(int fd) {
+    EvConn *p = &g_aEvConn[fd];
+    epoll_ctl(g_evEpoll, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+    free(p->zBuf);
+    free(p->zPend);
+    memset(p, 0, sizeof(EvConn));
+}
+
+// 继续发送连接 fd 上尚未发出的回复，返回 -1 = 连接出错；0 = 发送缓冲已满，等待可写；1 = 已全部发出
+static int EvFlush(int fd) {
+    EvConn *p = &g_aEvConn[fd];
+    while (p->iPend < p->nPend) {
+        ssize_t n = send(fd, p->zPend + p->iPend, p->nPend - p->iPend, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
+        p->iPend += (size_t)n;
+    }
+    free(p->zPend);
+    p->zPend = 0;
+    p->nPend = p->iPend = 0;
+    return 1;
+}
 
-        // 从文件系统发送
-        fprintf(stderr, "[httpd] Sending file from filesystem: %s\n", zFile);
-        if (SendFile(zFile, lenFile, &statbuf)) {
-            // 清理 buildins 临时CGI 文件
-            if (temp_cgi_path) {
-                unlink(temp_cgi_path);
-                free(temp_cgi_path);
+// 发送请求处理期间写入 memfd 的回复，发送缓冲放不下的部分留在连接的待发送队列中，等连接可写时再发
+/* + 返回 false 表示连接出错，需要关闭
+ |   有待发送数据时连接只监听 EPOLLOUT，不再读取后续请求，从而对不读取回复的客户端形成背压
+*/
+static bool EvQueueOutput(int fd) {
+    static char *zOut = 0;
+    static size_t nOutAlloc = 0;
+    EvConn *p = &g_aEvConn[fd];
+    off_t n = lseek(g_evOutFd, 0, SEEK_CUR);
+    bool bOk = true;
+
+    if (n > 0) {
+        if ((size_t)n > nOutAlloc) {
+            free(zOut);
+            nOutAlloc = (size_t)n > 65536 ? (size_t)n : 65536;
+            zOut = (char*)SafeMalloc(nOutAlloc);
+        }
+        if (pread(g_evOutFd, zOut, (size_t)n, 0) != n) bOk = false;
+        size_t nSent = 0;
+        while (bOk && nSent < (size_t)n) {
+            ssize_t got = send(fd, zOut + nSent, (size_t)n - nSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) bOk = false;
+                break;
             }
-            return;
+            nSent += (size_t)got;
+        }
+        if (bOk && nSent < (size_t)n) {
+            p->nPend = (size_t)n - nSent;
+            p->iPend = 0;
+            p->zPend = (char*)SafeMalloc(p->nPend);
+            memcpy(p->zPend, zOut + nSent, p->nPend);
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;       // 不监听 EPOLLRDHUP：半关闭的客户端仍可能读取回复，且电平触发会反复唤醒
+            ev.data.fd = fd;
+            epoll_ctl(g_evEpoll, EPOLL_CTL_MOD, fd, &ev);
         }
     }
+    if (ftruncate(g_evOutFd, 0) < 0) {}
+    lseek(g_evOutFd, 0, SEEK_SET);
+    return bOk;
+}
 
-    althttpd_fflush(stdout);
-    MakeLogEntry(0, 0);  /* LOG: Normal reply */
-    omitLog = 1;
-    
-    // 清理 buildins 临时 CGI 文件
-    if (temp_cgi_path) {
-        unlink(temp_cgi_path);
-        free(temp_cgi_path);
-    }
+// 检查缓存的数据中是否已经包含完整的请求头（格式错误也视为完整，交给 ProcessOneRequest 返回错误）
+static bool EvHeaderComplete(const char *z, size_t n) {
+    static http_request req;
+    return http_parse_request(z, n, &req) != HTTP_PARSE_INCOMPLETE;
 }
 
-// 启动浏览器，打开指定 zPage, 即 URL http://localhost:iPort/zPath
-static void launch_web_browser(const char *zPath, int iPort) {
+// 处理连接 fd 缓存中的一个请求，返回 sigsetjmp 的结果：0 = 处理完毕，连接保持；1 = 连接已结束；2 = 请求已交给子进程
+/* + 请求在事件循环进程中用 ProcessOneRequest() 直接处理，此时请求头已经完整地读入内存（或者已超过长度上限），不会阻塞在读取上
+ |   处理期间连接的缓存交给连接输入缓冲（g_zConnIn）使用，结束后再收回
+ |   回复写入 memfd（标准输出），返回后由 EvQueueOutput() 发送；交给子进程时由子进程把连接作为标准输出
+ |   需要进程隔离的请求由 EvHandOff() 交给子进程，父进程通过 siglongjmp 回到这里
+*/
+static int EvDispatch(int fd) {
+
+    dup2(fd, 0);
+    dup2(g_evOutFd, 1);                 // 回复先写入 memfd，再由事件循环以非阻塞方式发送
+    ResetRequestState();
+    nRequest = g_aEvConn[fd].nReq;
+    g_zRemoteAddr = g_aEvConn[fd].zRemoteAddr;
+    g_evFd = fd;
+    g_zConnIn = g_aEvConn[fd].zBuf;
+    g_nConnInAlloc = g_aEvConn[fd].nAlloc;
+    g_nConnIn = g_aEvConn[fd].nBuf;
+
+    int rc = sigsetjmp(g_workerJmp, 1);
+    if (rc == 0) {
+        ProcessOneRequest(nRequest >= 100, g_evFd);
+        if (g_evChild) {
+            // 接手请求的子进程：继续处理已读入的（管线化的）后续请求，然后告知事件循环连接可以继续复用
+            while (g_iConnIn < g_nConnIn) ProcessOneRequest(nRequest >= 100, g_evFd);
+            fflush(stdout);
+            exit(EVLOOP_KEEPALIVE);
+        }
+    }
+    else if (g_evChild) {
+        exit(1);                        // 子进程中连接已结束（althttpd_exit 已经完成了输出）
+    }
 
-    char zUrl[2000];
-    static const char *const azBrowserProg[] = {
-#if defined(__DARWIN__) || defined(__APPLE__) || defined(__HAIKU__)
-        "open"
-#else
-        "xdg-open", "gnome-open", "firefox", "google-chrome"
-#endif
-    };
+    alarm(0);
+    g_aWorkerStat[g_iWorker].bBusy = 0;     // 请求可能已经交给了子进程
+    scoreboard_state(SB_IDLE);
+    fflush(stdout);
+    althttpd_fpurge(stdout);
+    clearerr(stdout);
+    dup2(g_evIdleFd, 0);                // 不再持有连接的引用，这样关闭连接时能真正断开
+    dup2(g_evIdleFd, 1);
+
+    EvConn *p = &g_aEvConn[g_evFd];
+    p->zBuf = g_zConnIn;
+    p->nAlloc = g_nConnInAlloc;
+    p->nBuf = g_nConnIn;
+    if (rc == 0) {
+        // 移除已经处理过的数据，剩下的是管线化的后续请求
+        p->nReq = nRequest;
+        p->nBuf -= g_iConnIn;
+        if (p->nBuf) memmove(p->zBuf, p->zBuf + g_iConnIn, p->nBuf);
+        else {
+            free(p->zBuf);              // 空闲连接不占用缓存
+            p->zBuf = 0;
+            p->nAlloc = 0;
+        }
+        p->tLast = time(0);
+    }
+    g_zConnIn = 0;
+    g_nConnInAlloc = g_iConnIn = g_nConnIn = 0;
+    return rc;
+}
 
-    if (strlen(zPath) <= sizeof(zUrl) - 1000) {
-        while (zPath[0] == '/') zPath++;
-        sprintf(zUrl, "http://localhost:%d/%s", iPort, zPath);
-        for (size_t i = 0; i < sizeof(azBrowserProg) / sizeof(azBrowserProg[0]); i++) {
-            execlp(azBrowserProg[i], azBrowserProg[i], zUrl, (char *) 0);
+// 处理连接 fd 缓存中所有完整的请求，交给子进程的连接记录到 aBusy 中
+/* + 回复没能一次发完时停止处理，剩下的请求等回复发完后再处理
+ |   连接结束（rc == 1）时，等尚未发出的回复发完再关闭
+*/
+static void EvProcess(int fd, int *aBusy, int *pnBusy) {
+    EvConn *p = &g_aEvConn[fd];
+    while (p->bUsed && p->pid == 0 && p->zPend == 0 && p->nBuf > 0) {
+        if (p->nBuf < MAX_HEADER_SIZE && !EvHeaderComplete(p->zBuf, p->nBuf)) break;
+        int rc = EvDispatch(fd);
+        if (rc == 2) {
+            // 请求已交给子进程，子进程结束前不再监听该连接，缓存的数据和已有的输出已由子进程继承
+            if (ftruncate(g_evOutFd, 0) < 0) {}
+            lseek(g_evOutFd, 0, SEEK_SET);
+            epoll_ctl(g_evEpoll, EPOLL_CTL_DEL, fd, 0);
+            free(p->zBuf);
+            p->zBuf = 0;
+            p->nBuf = p->nAlloc = 0;
+            p->pid = g_evHandOff;
+            aBusy[(*pnBusy)++] = fd;
         }
+        else if (!EvQueueOutput(fd) || (rc == 1 && p->zPend == 0)) EvClose(fd);
+        else if (rc == 1) p->bClose = true;
     }
-    althttpd_exit(1);
 }
 
-/*
-** All possible forms of an IP address.  Needed to work around GCC strict
-** aliasing rules.
+// epoll 事件循环：在 worker 进程中处理大量（空闲的）Keep-Alive 连接
+/* + 连接上的数据以非阻塞的方式读入到该连接的缓存中，收到完整的请求头后才开始处理请求
+ |   静态文件和 buildins 在本进程中直接发送；CGI、C 脚本、SCGI、SQTP、POST 以及较大的文件交给 fork 出的子进程处理，
+ |   子进程处理完后，连接重新回到事件循环中
+ |   空闲连接只占用一个 fd 和连接表中的一项，不再占用一个进程
+ |   该函数不会返回
 */
-typedef union {
-    struct sockaddr sa;              /* Abstract superclass */
-    struct sockaddr_in sa4;          /* IPv4 */
-    struct sockaddr_in6 sa6;         /* IPv6 */
-    struct sockaddr_storage sas;     /* Should be the maximum of the above 3 */
-} address;
+static void http_evloop(void) {
+
+    // 尽量提高 fd 上限，以容纳大量的 Keep-Alive 连接
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    getrlimit(RLIMIT_NOFILE, &rl);
+    g_nEvConn = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20)) ? (1 << 20) : (int)rl.rlim_cur;
+    g_aEvConn = (EvConn*)calloc(g_nEvConn, sizeof(EvConn));
+    int *aBusy = (int*)SafeMalloc(sizeof(int) * g_nEvConn);    // 正在由子进程处理的连接
+    int nBusy = 0;
+    if (g_aEvConn == 0) Malfunction(532/* LOG: event loop startup failed */, "cannot allocate connection table");
+
+    if (!g_useTimeout) signal(SIGPIPE, SIG_IGN);
+
+    g_evIdleFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    g_evOutFd = memfd_create("wpp-evout", MFD_CLOEXEC);
+    g_evEpoll = epoll_create1(0);
+    if (g_evIdleFd < 0 || g_evOutFd < 0 || g_evEpoll < 0 || pipe(g_evPipe) < 0)
+        Malfunction(532, "cannot initialize the event loop");
+    fcntl(g_evPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(g_evPipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(g_listener, F_SETFL, fcntl(g_listener, F_GETFL) | O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = EvSigChld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, 0);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = g_listener;
+    epoll_ctl(g_evEpoll, EPOLL_CTL_ADD, g_listener, &ev);
+    ev.data.fd = g_evPipe[0];
+    epoll_ctl(g_evEpoll, EPOLL_CTL_ADD, g_evPipe[0], &ev);
+
+    struct epoll_event aEv[256];
+    time_t tSweep = time(0);
+    for (;;) {
+
+        // 检查 worker 是否需要回收（未完成的子进程不受影响，空闲连接会被关闭）
+        if (g_workerMaxReqs > 0 && g_nWorkerReqs >= g_workerMaxReqs) break;
+        if (g_workerMaxRssKB > 0) {
+            struct rusage self;
+            getrusage(RUSAGE_SELF, &self);
+            if (self.ru_maxrss > g_workerMaxRssKB) break;
+        }
+
+        int n = epoll_wait(g_evEpoll, aEv, (int)(sizeof(aEv) / sizeof(aEv[0])), 1000);
+        time_t now = time(0);
+        for (int i = 0; i < n; i++) {
+            int fd = aEv[i].data.fd;
+
+            // 新连接
+            if (fd == g_listener) {
+                for (;;) {
+                    address addr;
+                    socklen_t lenaddr = sizeof(addr);
+                    int c = accept4(g_listener, &addr.sa, &lenaddr, SOCK_NONBLOCK);
+                    if (c < 0) break;
+                    if (c >= g_nEvConn) { close(c); continue; }
+
+                    EvConn *p = &g_aEvConn[c];
+                    memset(p, 0, sizeof(EvConn));
+                    p->bUsed = true;
+                    p->tLast = now;
+                    if (getnameinfo(&addr.sa, lenaddr, p->zRemoteAddr, sizeof(p->zRemoteAddr), 0, 0, NI_NUMERICHOST) != 0)
+                        p->zRemoteAddr[0] = 0;
+                    if (strncmp(p->zRemoteAddr, "::ffff:", 7) == 0
+                        && strchr(p->zRemoteAddr + 7, ':') == 0
+                        && strchr(p->zRemoteAddr + 7, '.') != 0) {
+                        memmove(p->zRemoteAddr, p->zRemoteAddr + 7, strlen(p->zRemoteAddr + 7) + 1);
+                    }
+
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.fd = c;
+                    epoll_ctl(g_evEpoll, EPOLL_CTL_ADD, c, &ev);
+                    if (c > g_evMaxFd) g_evMaxFd = c;
+                    g_aWorkerStat[g_iWorker].nAccept++;
+                }
+                continue;
+            }
+
+            // 子进程结束：连接重新回到事件循环，或者关闭
+            if (fd == g_evPipe[0]) {
+                char zDrain[64];
+                int status;
+                pid_t child;
+                while (read(g_evPipe[0], zDrain, sizeof(zDrain)) > 0) {}
+                while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+                    scoreboard_reap(child);
+                    for (int j = 0; j < nBusy; j++) {
+                        int c = aBusy[j];
+                        if (g_aEvConn[c].pid != child) continue;
+                        aBusy[j] = aBusy[--nBusy];
+                        if (WIFEXITED(status) && WEXITSTATUS(status) == EVLOOP_KEEPALIVE) {
+                            fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);     // 子进程中恢复成了阻塞模式
+                            g_aEvConn[c].pid = 0;
+                            g_aEvConn[c].nReq++;
+                            g_aEvConn[c].tLast = now;
+                            ev.events = EPOLLIN | EPOLLRDHUP;
+                            ev.data.fd = c;
+                            epoll_ctl(g_evEpoll, EPOLL_CTL_ADD, c, &ev);
+                        }
+                        else EvClose(c);
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            EvConn *p = &g_aEvConn[fd];
+            if (!p->bUsed || p->pid) continue;
+
+            // 连接可写：继续发送尚未发出的回复，发完后恢复读取，并处理已缓存的后续请求
+            if (p->zPend) {
+                size_t iPend = p->iPend;
+                int rc = (aEv[i].events & (EPOLLERR | EPOLLHUP)) ? -1 : EvFlush(fd);
+                if (p->iPend != iPend) p->tLast = now;
+                if (rc < 0 || (rc > 0 && p->bClose)) EvClose(fd);
+                else if (rc > 0) {
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.fd = fd;
+                    epoll_ctl(g_evEpoll, EPOLL_CTL_MOD, fd, &ev);
+                    EvProcess(fd, aBusy, &nBusy);
+                }
+                continue;
+            }
+
+            // 连接上有数据到达
+            if (p->nAlloc - p->nBuf < 1024) {
+                p->nAlloc = p->nAlloc ? p->nAlloc * 2 : 4096;
+                p->zBuf = realloc(p->zBuf, p->nAlloc);
+                if (p->zBuf == 0) { EvClose(fd); continue; }
+            }
+            ssize_t got = recv(fd, p->zBuf + p->nBuf, p->nAlloc - p->nBuf, MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                EvClose(fd);
+                continue;
+            }
+            if (got < 0) continue;
+            p->nBuf += got;
+            p->tLast = now;
+
+            // 处理缓存中所有完整的请求
+            EvProcess(fd, aBusy, &nBusy);
+        }
+
+        // 每秒清理一次超时的连接（尚未收到完整请求头的连接为 10 秒，回复发送停滞的连接为 EVLOOP_SEND_TIMEOUT 秒），并检查主进程是否还在
+        if (now != tSweep) {
+            tSweep = now;
+            for (int fd = 0; fd <= g_evMaxFd; fd++) {
+                EvConn *p = &g_aEvConn[fd];
+                if (p->bUsed && p->pid == 0
+                    && now - p->tLast > (p->zPend ? EVLOOP_SEND_TIMEOUT : p->nBuf ? 10 : EVLOOP_IDLE_TIMEOUT)) EvClose(fd);
+            }
+            while (g_evMaxFd >= 0 && !g_aEvConn[g_evMaxFd].bUsed) g_evMaxFd--;
+            if (getppid() != g_masterPid) break;
+        }
+    }
 
+    // worker 退出，由主进程重新 fork 替补
+    g_isWorker = false;
+    althttpd_exit(0);
+}
+#endif /* linux */
 
 // HTTP 监听服务守护进程，监听端口 zPort
 /* + 当监听到连接时，fork 出一个子进程来处理连接请求，父进程继续监听
@@ -3805,12 +6806,22 @@ int http_server(
         }
 
         // 如果无法正常终止，至少允许套接字被重用
+        // + 绑定时不设置 SO_REUSEPORT：端口已被其它进程占用时（包括以 SO_REUSEPORT 占用）绑定失败，继续尝试下一个端口
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         if (bind(listener, (struct sockaddr *) &inaddr, sizeof(inaddr)) < 0) {
             close(listener);
             iPort++;
             continue;
         }
+        if (g_reusePort) {
+            // 端口可用：换成设置了 SO_REUSEPORT 的套接字继续占用它，各 worker 才能在同一端口上绑定自己的监听套接字
+            close(listener);
+            listener = OpenReusePortListener(iPort, bLocalhost, 0);
+            if (listener < 0) {
+                iPort++;
+                continue;
+            }
+        }
 
         break;
     }
@@ -3822,13 +6833,14 @@ int http_server(
     }
     if (iPort > mxPort) return 1;
 
-    zRealPort = StrDup("            ");
-    snprintf(zRealPort, 10, "%d", iPort);
+    static char zPortBuf[16];
+    snprintf(zRealPort = zPortBuf, sizeof(zPortBuf), "%d", iPort);
 
     //---------------------------------------
 
     // 启动对套接字的监听，准备接收连接请求
-    listen(listener, 100);
+    // + SO_REUSEPORT 模式下由各 worker 的监听套接字接收连接，主进程的套接字只用来占用端口
+    if (!g_reusePort) listen(listener, 100);
     mxListener = listener;
 
 #ifdef ENABLE_TLS
@@ -3853,9 +6865,18 @@ int http_server(
             fprintf(stderr,"unable to open listening socket on port %d\n", tlsPort);
             althttpd_exit(1);
         }
-        zRealTlsPort = StrDup("            ");
-        snprintf(zRealTlsPort, 10, "%d", tlsPort);
-        listen(listenTLS,100);
+        if (g_reusePort) {
+            // 与 HTTP 端口相同：确认端口可用之后再换成设置了 SO_REUSEPORT 的套接字
+            close(listenTLS);
+            listenTLS = OpenReusePortListener(tlsPort, bLocalhost, 0);
+            if (listenTLS < 0) {
+                fprintf(stderr,"unable to open listening socket on port %d\n", tlsPort);
+                althttpd_exit(1);
+            }
+        }
+        static char zTlsPortBuf[16];
+        snprintf(zRealTlsPort = zTlsPortBuf, sizeof(zTlsPortBuf), "%d", tlsPort);
+        if (!g_reusePort) listen(listenTLS,100);
         printf("Listening for TLS-encrypted HTTPS requests on TCP port %d\n", tlsPort);
         if( tlsPort>mxListener ) mxListener = tlsPort;
     }
@@ -3881,6 +6902,34 @@ int http_server(
     // + 同样，下面主进程对 stdout 的输出也需要立即 flush
     fflush(stdout); 
 
+    // 异步访问日志：创建日志环形缓冲，fork 出日志进程
+    // + 日志进程从这里返回，在 httpd_main() 中和 worker 一样降权后进入 LogWriterMain()
+    // + 环形缓冲需要在 fork worker 或请求处理子进程之前创建
+    if (g_zLogFile && g_logRingKB && log_ring_init((size_t)g_logRingKB * 1024) == 0) {
+        child = fork();
+        if (child == 0) {
+            close(listener);
+            if (listenTLS > 0) close(listenTLS);
+            g_isLogger = true;
+            return 0;
+        }
+        if (child > 0) g_logWriter = child;
+        // fork 失败时没有读取者，环形缓冲写满后所有请求都退回到同步写日志
+    }
+
+    // C 脚本的后台预编译：fork 出监视进程
+    // + 和日志进程一样从这里返回，在 httpd_main() 中降权后进入 script_watch_main()
+    if (g_scriptWatch) {
+        child = fork();
+        if (child == 0) {
+            close(listener);
+            if (listenTLS > 0) close(listenTLS);
+            g_isWatcher = true;
+            return 0;
+        }
+        if (child > 0) g_scriptWatcher = child;
+    }
+
     // 如果需要启动 web 浏览器来打开指定的页面
     if (zPage) {
 
@@ -3898,6 +6947,13 @@ int http_server(
         else if (child > 0) nchildren++;     // 记录子进程数量
     }
 
+    // prefork 模式：预先 fork 出 worker 进程，由 worker 直接 accept 并处理连接
+    // + 返回的是 worker 进程（主进程在 PreforkSupervise() 中监管 worker，不会返回）
+    if (g_nWorkers > 0) {
+        PreforkSupervise(listener, listenTLS, iPort, tlsPort, bLocalhost);
+        return 0;
+    }
+
     for(;;) {
 
         int onTLSSocket;    /* True if inbound connection on --tls-port */
@@ -3922,9 +6978,12 @@ int http_server(
             if (connection >= 0) {
 
                 // 如果达到了允许的最大子进程数，则等待一个旧的子进程结束后再创建一个新的子进程来处理连接请求
+                // + 记分板中标记主进程阻塞，/-/status 可以看到是哪些请求占满了子进程
                 int status;  /* Required argument to wait() */
+                if (nchildren >= g_mxChild) scoreboard_master(nchildren, g_mxChild, true);
                 while (nchildren >= g_mxChild && (child = wait(&status)) >= 0) {
-                    nchildren--;
+                    if (child != g_logWriter && child != g_scriptWatcher) nchildren--;
+                    scoreboard_reap(child);
                     /* printf("process %d ends; %d/%d\n",child,nchildren,g_mxChild); fflush(stdout); */
                 }
 
@@ -3951,6 +7010,8 @@ int http_server(
 
                     int nErr = 0, fd;
 
+                    scoreboard_claim(SB_KIND_CONNECTION);
+
                     close(0);               // 关闭 stdin
                     fd = dup(connection);   // 将 connection 映射到 stdin 上，即以后可以通过 stdin 来读取连接套接字的数据
                     if (fd != 0) nErr++;
@@ -3980,7 +7041,10 @@ int http_server(
                 // 以下代码在主进程中运行，继续监听新连接
 
                 // child < 0 表示 fork 失败，即无法创建子进程来处理连接请求，此时父进程继续监听，但不增加子进程计数
-                if (child > 0) nchildren++;
+                if (child > 0) {
+                    nchildren++;
+                    metrics_fork(METRICS_FORK_CONNECTION);
+                }
 
                 // 关闭连接套接字 fd（在父进程中的引用）
                 close(connection);
@@ -3996,14 +7060,37 @@ int http_server(
         // > WNOHANG: Wait No Hang（等待但不挂起/非阻塞）
         // 函数返回 0 说明没有已经结束的子进程了
         while ((child = waitpid(0, NULL, WNOHANG)) > 0) {
-            nchildren--;
+            if (child != g_logWriter && child != g_scriptWatcher) nchildren--;
+            scoreboard_reap(child);
             /* printf("process %d ends; %d/%d\n",child,nchildren,g_mxChild); fflush(stdout); */
         }
+        metrics_children(nchildren);
+        scoreboard_master(nchildren, g_mxChild, false);
     }
     /* NOT REACHED */
     althttpd_exit(1);
 }
 
+void httpd_params_default(http_params_st *p) {
+    // 各项的默认值就是对应全局变量的初值（httpd_main() 之前它们不会被修改）
+    memset(p, 0, sizeof(*p));
+    p->csLogFile = g_zLogFile;
+    p->csIPShunDir = g_zIPShunDir;
+    p->csDefaultHost = g_zDefaultHost;
+    p->iMxAge = (uint32_t)g_mxAge;
+    p->iMaxCpu = (uint32_t)g_maxCpu;
+    p->iMxChild = (uint32_t)g_mxChild;
+    p->bEnableSAB = g_enableSAB;
+    p->bUseTimeout = g_useTimeout;
+    p->iWorkers = g_nWorkers;
+    p->iWorkerMaxReqs = (uint32_t)g_workerMaxReqs;
+    p->iWorkerMaxRssKB = (uint32_t)g_workerMaxRssKB;
+    p->iGzipLevel = (uint32_t)g_gzipLevel;
+    p->iGzipMinSize = (uint32_t)g_gzipMin;
+    p->bH2c = g_h2c;
+    p->iLogRingKB = g_logRingKB;
+}
+
 int httpd_main(uint16_t mnPort, uint16_t mxPort,
                bool loopback,
                bool jail,
@@ -4040,18 +7127,65 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,
         g_zRoot = root;
         g_zLogFile = pParams->csLogFile;
         g_zIPShunDir = pParams->csIPShunDir;
-        g_zHttpHost = (char*)pParams->csDefaultHost;
+        g_zHttpHost = g_zDefaultHost = (char*)pParams->csDefaultHost;
         g_mxAge = (int)pParams->iMxAge;
         g_maxCpu = (int)pParams->iMaxCpu;
         g_mxChild = (int)pParams->iMxChild;
         g_enableSAB = pParams->bEnableSAB;
         g_useTimeout = pParams->bUseTimeout;
+        g_gzipLevel = pParams->iGzipLevel > 9 ? 9 : (int)pParams->iGzipLevel;
+        g_gzipMin = pParams->iGzipMinSize;
+        if (pParams->csGzipTypes) g_zGzipTypes = pParams->csGzipTypes;
+        g_h2c = pParams->bH2c;
+        g_logRingKB = pParams->iLogRingKB;
+        g_metricsUri = pParams->bMetrics;
+        g_statusUri = pParams->bStatus;
+        g_bTiming = pParams->bTiming;
+        httpd_cgi_c_cache_init((int)pParams->iScriptCache, pParams->csScriptCacheDir);
+        g_residentC = pParams->bResident && pParams->iScriptCache > 0;
+        g_zHeaderSnapshot = pParams->csHeaderSnapshot;
+        g_scriptWatch = pParams->bScriptWatch;
+        if (g_scriptWatch && !script_watch_supported()) {
+            fprintf(stderr, "--watch is not supported on this platform\n");
+            g_scriptWatch = false;
+        }
+        g_workerMaxReqs = (int)pParams->iWorkerMaxReqs;
+        g_workerMaxRssKB = (long)pParams->iWorkerMaxRssKB;
+        g_nWorkers = pParams->iWorkers;
+#ifdef SO_REUSEPORT
+        g_reusePort = pParams->bReusePort;
+        if (g_reusePort && g_nWorkers == 0) g_nWorkers = -1;    // SO_REUSEPORT 模式基于 prefork worker
+#endif
+#ifdef linux
+        g_evLoop = pParams->bEventLoop;
+        if (g_evLoop && g_nWorkers == 0) g_nWorkers = -1;       // 事件循环运行在 prefork worker 中（每个 CPU 核心一个）
+        g_parkIdle = pParams->bParkIdle && !g_evLoop;           // 事件循环自己就能持有大量空闲连接，不需要托管
+        if (g_parkIdle && g_nWorkers == 0) g_nWorkers = -1;     // 空闲连接托管基于 prefork worker
+#endif
+        if (g_nWorkers < 0) {
+            g_nWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);  // 每个 CPU 核心一个 worker
+            if (g_nWorkers < 1) g_nWorkers = 1;
+        }
+    }
+
+    // 路径解析缓存和内容缓存位于共享内存中，需要在 fork 任何子进程之前创建
+    if (pParams && pParams->iPathCache && path_cache_init(pParams->iPathCache) != 0)
+        fprintf(stderr, "cannot allocate the path-resolution cache, continuing without it\n");
+    if (pParams && pParams->iFileCacheKB && file_cache_init((size_t)pParams->iFileCacheKB * 1024) != 0)
+        fprintf(stderr, "cannot allocate the static content cache, continuing without it\n");
+    if (g_metricsUri && metrics_init() != 0) {
+        fprintf(stderr, "cannot allocate the metrics block, /-/metrics is disabled\n");
+        g_metricsUri = false;
+    }
+    if (g_statusUri && scoreboard_init(g_mxChild * 2 + 64) != 0) {      // 每个请求处理进程最多同时有一个 CGI 子进程
+        fprintf(stderr, "cannot allocate the scoreboard, /-/status is disabled\n");
+        g_statusUri = false;
     }
 
     // 如果没有指定根目录，则使用当前目录作为根目录，并且以用户权限运行
     if (g_zRoot == NULL) g_zRoot = ".";
 
-    int tlsPort;
+    int tlsPort = 0;
     if (pTls) {
         if (pTls == (void*)-1) {
             g_useHttps = 1/* 外置TLS支持 */;
@@ -4115,6 +7249,12 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,
     else if( tlsPort ) tlsPort = 0;
 #endif
 
+    // 事件循环直接在连接 fd 上读取数据，暂不支持内置 TLS，此时退回到普通的 prefork worker
+    if (g_evLoop && g_useHttps == 2) {
+        printf("Event loop mode does not support built-in TLS, using prefork workers\n");
+        g_evLoop = false;
+    }
+
     // 初始化该服务器软件标识名字符串，用于 CGI 的 SERVER_SOFTWARE 信息
     g_zServerSoftware = g_useHttps == 2 ? SERVER_SOFTWARE_TLS : SERVER_SOFTWARE;
 
@@ -4157,6 +7297,11 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,
         else g_zRoot = "";
     }
 
+    // 系统头文件快照：prefork 时只登记头文件组，worker 第一次编译可以使用它的脚本时才在 jail 中建立（见 tcc_snapshot_init()）
+    // + 每连接 fork 的模型中请求处理进程只处理一个连接，按需建立的快照不能留给之后的连接，由主进程现在建立（失败时不输出）
+    // + 只处理一个连接时不使用
+    if (mnPort > 0 && mnPort <= mxPort) httpd_cgi_c_snapshot_init(g_zHeaderSnapshot, g_nWorkers == 0);
+
     // 根据请求，启动 HTTP 服务
     // + 这里主进程进入 http_server() 后，会变为一个监听 HTTP 连接的守护进程，接收 HTTP 请求后会 fork 出子进程来处理请求
     //   也就是说，从 http_server() 返回的，就是 fork 出来的一个用于处理 HTTP 请求的子进程
@@ -4170,15 +7315,10 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,
 
     // 设置 CPU 限制
     // + 该操作需要针对 fork 出的子进程进行设置
+    // + prefork worker 会长期运行，CPU 时间会跨请求累计，所以改为在其 fork 的 CGI 子进程中设置
+    // + 日志进程、C 脚本的监视进程同样长期运行，不受 CPU 时间限制
     // ! 注意，该操作需要 root 权限，所以需要在下面降权之前执行
-#ifdef RLIMIT_CPU
-    if (g_maxCpu > 0) {
-        struct rlimit rlim;
-        rlim.rlim_cur = g_maxCpu;
-        rlim.rlim_max = g_maxCpu;
-        setrlimit(RLIMIT_CPU, &rlim);
-    }
-#endif
+    if (!g_isWorker && !g_isLogger && !g_isWatcher) SetCpuLimit();
 
     // 如果指定了用来运行 http 处理的用户身份
     // + 此时相当于放弃了当前的 root 权限。目的是增加沙箱模式的安全性，避免利用 root 权限来越狱
@@ -4197,25 +7337,23 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,
 
     //---------------------------------
 
-    // 获取请求来源的IP地址
-    if (g_zRemoteAddr == 0) {
+    // 日志进程进入自己的循环（不会返回）
+    if (g_isLogger) LogWriterMain();
 
-        address remoteAddr;
-        socklen_t size = sizeof(remoteAddr);
-        char zHost[NI_MAXHOST];
-        if (getpeername(0, &remoteAddr.sa, &size) >= 0) {
-            getnameinfo(&remoteAddr.sa, size, zHost, sizeof(zHost), 0, 0, NI_NUMERICHOST);
-            g_zRemoteAddr = StrDup(zHost);
-        }
-    }
-    if (g_zRemoteAddr != 0
-        && strncmp(g_zRemoteAddr, "::ffff:", 7) == 0
-        && strchr(g_zRemoteAddr + 7, ':') == 0
-        && strchr(g_zRemoteAddr + 7, '.') != 0 ) {
+    // C 脚本的监视进程进入自己的循环（不会返回）
+    if (g_isWatcher) script_watch_main();
 
-        g_zRemoteAddr += 7;
+    // prefork worker 进入自己的 accept 循环或事件循环（不会返回）
+    if (g_isWorker) {
+#ifdef linux
+        if (g_evLoop) http_evloop();
+#endif
+        http_worker();
     }
 
+    // 获取请求来源的IP地址
+    ComputeRemoteAddr();
+
     // 连续执行 100 + 1 个 HTTP 请求
     // + 也就是在 Keep-Alive 模式下，可以连续持续处理（最多 100 + 1 次）
     //   如果不是 Keep-Alive，或者 connection 被远程 closed，会直接 exit 进程，即不会返回到这里来
@@ -4253,6 +7391,7 @@ INSERT INTO xref VALUES(180,' malformed entry in -auth file');
 INSERT INTO xref VALUES(190,'chdir() failed');
 INSERT INTO xref VALUES(200,'bad protocol in HTTP header');
 INSERT INTO xref VALUES(201,'URI too long');
+INSERT INTO xref VALUES(202,'request header too large');
 INSERT INTO xref VALUES(210,'Empty request URI');
 INSERT INTO xref VALUES(220,'Unknown request method');
 INSERT INTO xref VALUES(230,'Referrer is devids.net');
@@ -4261,6 +7400,11 @@ INSERT INTO xref VALUES(250,'Disallowed user agent');
 INSERT INTO xref VALUES(251,'Disallowed user agent (20190424)');
 INSERT INTO xref VALUES(260,'Disallowed referrer');
 INSERT INTO xref VALUES(270,'Request too large');
+INSERT INTO xref VALUES(271,'Unsupported Transfer-Encoding');
+INSERT INTO xref VALUES(272,'Unsupported Expect');
+INSERT INTO xref VALUES(291,'/-/metrics');
+INSERT INTO xref VALUES(292,'/-/status');
+INSERT INTO xref VALUES(293,'/-/status from a remote address');
 INSERT INTO xref VALUES(300,'Path element begins with "." or "-"');
 INSERT INTO xref VALUES(310,'URI does not start with "/"');
 INSERT INTO xref VALUES(320,'URI too long');
@@ -4281,6 +7425,7 @@ INSERT INTO xref VALUES(445,'chdir() failed');
 INSERT INTO xref VALUES(460,'Excess URI content past static file name');
 INSERT INTO xref VALUES(470,'ETag Cache Hit');
 INSERT INTO xref VALUES(480,'fopen() failed for static content');
+INSERT INTO xref VALUES(490,'Range not satisfiable');
 INSERT INTO xref VALUES(501,'Error initializing the SSL Server');
 INSERT INTO xref VALUES(502,'Error loading CERT file');
 INSERT INTO xref VALUES(503,'Error loading private key file');
@@ -4307,8 +7452,16 @@ INSERT INTO xref VALUES(526,'SSL read too big');
 INSERT INTO xref VALUES(527,'SSL read error');
 INSERT INTO xref VALUES(528,'SSL write too big');
 INSERT INTO xref VALUES(529,'Output buffer too small');
+INSERT INTO xref VALUES(530,'mmap() failed');
+INSERT INTO xref VALUES(531,'SO_REUSEPORT listener failed');
+INSERT INTO xref VALUES(532,'event loop startup failed');
+INSERT INTO xref VALUES(533,'Out of memory');
+INSERT INTO xref VALUES(534,'Too many response header blocks');
+INSERT INTO xref VALUES(535,'Response header too large');
 INSERT INTO xref VALUES(600,'OOM');
 INSERT INTO xref VALUES(610,'OOM');
+INSERT INTO xref VALUES(611,'OOM');
+INSERT INTO xref VALUES(612,'OOM');
 INSERT INTO xref VALUES(700,'cannot open file');
 INSERT INTO xref VALUES(701,'cannot read file');
 INSERT INTO xref VALUES(702,'bad SCGI spec');
@@ -25,6 +25,27 @@ typedef struct http_params {
     uint32_t                    iMxChild;                   // 最大子进程数，默认 1000
     bool                        bEnableSAB;                 // 允许添加回复头以启用 SharedArrayBuffer，默认 false
     bool                        bUseTimeout;                // 是否开启超时限制机制，默认 true
+    int32_t                     iWorkers;                   // prefork worker 进程数，0 表示每个连接 fork 一个子进程，<0 表示每个 CPU 核心一个 worker，默认 0
+    uint32_t                    iWorkerMaxReqs;             // 每个 worker 最多处理的请求数，之后回收重建，0 表示不限，默认 10000
+    uint32_t                    iWorkerMaxRssKB;            // 每个 worker 允许的最大常驻内存（KB），超过后回收重建，0 表示不限，默认 0
+    bool                        bReusePort;                 // 每个 worker 使用独立的 SO_REUSEPORT 监听套接字并绑定到一个 CPU 核心（隐含 prefork），默认 false
+    bool                        bEventLoop;                 // worker 以 epoll 事件循环模式运行，静态内容在事件循环中直接处理（隐含 prefork，仅 Linux），默认 false
+    bool                        bParkIdle;                  // worker 将空闲的 Keep-Alive 连接交还主进程托管，有新请求时再分派给空闲的 worker（隐含 prefork，仅 Linux），默认 false
+    uint32_t                    iPathCache;                 // 路径解析缓存（所有子进程共享）的项数，0 表示不使用，默认 0
+    uint32_t                    iFileCacheKB;               // 小静态文件内容缓存（所有子进程共享）的字节预算（KB），0 表示不使用，默认 0
+    uint32_t                    iGzipLevel;                 // 动态响应（CGI、C 脚本、SQTP）的 gzip 压缩级别（1-9），0 表示不压缩，默认 0
+    uint32_t                    iGzipMinSize;               // 动态响应体小于该字节数时不压缩
+    const char*                 csGzipTypes;                // 允许压缩的 MIME 类型列表（逗号分隔，以 / 结尾的项匹配整个大类），NULL 使用默认列表
+    bool                        bH2c;                       // 接受明文 HTTP/2（h2c：直接以连接前言开始，或者 Upgrade: h2c 升级），默认 false
+    bool                        bMetrics;                   // 提供 /-/metrics（Prometheus 文本格式的运行统计），默认 false
+    bool                        bStatus;                    // 提供 /-/status（各进程的状态和当前请求，HTML 或 JSON），默认 false
+    uint32_t                    iLogRingKB;                 // 异步访问日志的共享环形缓冲大小（KB），由单独的日志进程成批写入日志文件，0 表示每个请求直接写日志文件，默认 0
+    bool                        bTiming;                    // 记录请求各阶段的时间，以 Server-Timing 头部回复，并追加到访问日志中（性能分析时使用），默认 false
+    uint32_t                    iScriptCache;               // 每个请求处理进程缓存的已编译 C 脚本数，0 表示每个请求都在 CGI 子进程中重新编译，默认 0
+    const char*                 csScriptCacheDir;           // 已编译的 C 脚本同时以目标文件保存在该目录（jail 中的路径），重新启动后加载而不是重新编译，NULL 表示不保存
+    bool                        bResident;                  // 定义了 handle_request() 的 C 脚本由请求处理进程直接调用，不 fork CGI 子进程（只用于可信的脚本，需要 -X），默认 false
+    const char*                 csHeaderSnapshot;           // 系统头文件快照的头文件组（见 tcc_snapshot_init()），第一次编译使用它的脚本时建立，NULL 表示默认的组，"none" 表示不使用
+    bool                        bScriptWatch;               // 由单独的监视进程以 inotify 监视根目录，C 脚本被部署或修改时在后台编译到目标文件缓存（需要 -X 和 -O，仅 Linux），默认 false
 
 } http_params_st;
 
@@ -37,25 +58,67 @@ typedef struct http_tls {
 // SQTP 需要的工具函数
 char* GetFirstElement(char *zInput, char **zLeftOver);
 char* StrDup(const char *zSrc);
+void* ReqAlloc(size_t size);        // 请求级内存池，请求结束后整体释放
 void RemoveNewline(char *z);
 char* althttpd_fgets(char *zBuf, int nBuf, FILE *in);
-#ifdef ENABLE_TLS
+size_t althttpd_fread(void *tgt, size_t sz, size_t nmemb, FILE *in);
 int althttpd_printf(const char *zFormat, ...);
-#else
-#define althttpd_printf printf
-#endif
+void httpd_body_begin(const char *zContentType, long long nLength, const char *zAccept);   // 开始动态响应体（可能压缩），之后的 althttpd_printf() 输出作为响应体
+void httpd_body_end(void);
 void MakeLogEntry(int completed, int lineno);
+void httpd_reply_status(const char *zStatus);   // 记录回复的状态码（"200 OK" 等），用于日志和运行统计
+void httpd_reply_begin(void);                   // 开始回复：输出 Server-Timing 头部（-t），记分板进入发送状态。自己输出状态行的处理方式（SQTP）需要调用
+
+// 请求处理的各个阶段（-t/--timing），依次为：
+enum {
+    HTTPD_PHASE_PARSE = 0,      // 解释完请求行和头部字段
+    HTTPD_PHASE_RESOLVE,        // 路径解析完成（虚拟主机、文件、PATH_INFO）
+    HTTPD_PHASE_AUTH,           // -auth 授权检查完成（只在目录中有 -auth 文件时）
+    HTTPD_PHASE_FORK,           // CGI 子进程开始运行
+    HTTPD_PHASE_COMPILE,        // C 脚本编译完成
+    HTTPD_PHASE_RELOCATE,       // C 脚本重定位完成（进入 main() 之前）
+    HTTPD_PHASE_EXECUTE,        // C 脚本执行结束
+    HTTPD_PHASE_FIRST_BYTE,     // 开始发送回复（状态行）
+    HTTPD_PHASE_LAST_BYTE,      // 请求结束
+    HTTPD_PHASE_N
+};
+void httpd_phase(int iPhase);   // 记录当前请求的一个阶段结束（可以在 CGI 子进程中调用）
+bool httpd_timing_enabled(void);
 
 // SQTP 处理函数（参数传递）
 void httpd_sqtp(char* method, char* script, char* protocol, size_t* out);
 
 // TinyCC CGI 处理函数
 void httpd_cgi_c(char* method, char* script, char* protocol, size_t* out, buildin_file_info_st* buildin_info);
+void httpd_cgi_c_cache_init(int nMax, const char *zObjDir);    // 设置已编译脚本的缓存项数（-X，0 表示不缓存）和目标文件缓存目录（-O），chroot 之前调用
+void httpd_cgi_c_snapshot_init(const char *zSets, bool bNow);    // 登记系统头文件快照的头文件组（-I），进入 jail 之后调用：快照在第一次编译使用它的脚本时建立，bNow 时现在建立
+void httpd_cgi_c_prepare(char* script, buildin_file_info_st* buildin_info);    // 在 fork CGI 子进程之前查找或编译脚本（请求处理进程中调用）
+int httpd_cgi_c_precompile(const char *zPath);    // 后台预编译（-W 的监视进程中调用）：编译错误输出到 stderr，返回 1: 已编译；0: 内容未改变或目标文件已存在；-1: 失败
+void httpd_cgi_c_forget(const char *zPath);       // 脚本（或者目录中的所有脚本）已被删除或移走：删除不再需要的目标文件
+
+// 常驻 C 脚本（-R/--resident）：脚本定义 int handle_request(wpp_req *req, wpp_res *res)，由请求处理进程直接调用
+// + wpp_param() 以 CGI 环境变量的名字读取请求的内容，wpp_body() 读取请求体
+// + wpp_status()、wpp_header() 设置回复的状态（默认 "200 OK"）和头部字段，第一次 wpp_write()/wpp_printf() 时一起发送
+typedef struct wpp_req wpp_req;
+typedef struct wpp_res wpp_res;
+const char* wpp_param(wpp_req *req, const char *zName);
+const char* wpp_body(wpp_req *req, size_t *pnBody);
+void wpp_status(wpp_res *res, const char *zStatus);
+void wpp_header(wpp_res *res, const char *zName, const char *zValue);
+size_t wpp_write(wpp_res *res, const void *pData, size_t nData);
+int wpp_printf(wpp_res *res, const char *zFormat, ...);
+bool httpd_cgi_c_resident(void);                        // httpd_cgi_c_prepare() 准备好的脚本定义了 handle_request()
+int httpd_cgi_c_handle(wpp_req *req, wpp_res *res);    // 调用该脚本的 handle_request()，返回它的返回值（脚本调用 exit() 时为退出码）
 
 // 预配置的 TCCState（在 main 中初始化，fork 后子进程继承）
 typedef struct TCCState TCCState;
 extern TCCState *cgi_tcc_state;
 
+/**
+ * 以 httpd 的默认值填充参数（调用者再修改需要的项），在 httpd_main() 之前调用
+ */
+void httpd_params_default(http_params_st *p);
+
 /**
  * @brief HTTP 服务器主函数
  * 
@@ -67,7 +130,7 @@ int httpd_main(uint16_t mnPort, uint16_t mxPort,            // 监听的 TCP 端
                bool jail,                                   // 是否使用 change-root jail（沙盒）机制，默认 true
                const char *csStartPage/* nullable */,
                const char* user/* nullable */,              // 指定的用来运行 http 处理的用户身份
-               const char* root/* nullable */,              // Web 根目录
+               const char* root/* nullable */,              // Web 根目录，只在 pParams 非 NULL 时使用，NULL 表示当前目录
                http_params_st* pParams/* nullable */,
                http_tls_st* pTls/* nullable */,
                const char* pid_file/* nullable */);
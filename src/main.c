@@ -12,6 +12,7 @@
 #include "httpd.h"
 #include "buildins.h"
 #include "tcc_evn.h"
+#include "http_bench.h"
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
@@ -23,6 +24,34 @@ TCCState *cgi_tcc_state = NULL;
 #define URL_PATH "/hello.html"
 
 ARGS_B(false, stop, 's', "stop", "Stop current running wpp");
+ARGS_B(false, prefork, 'p', "prefork", "Serve requests with a pre-forked worker pool (one worker per CPU core)");
+ARGS_I(false, workers, 'w', "workers", "Number of prefork workers (implies --prefork)");
+ARGS_I(false, max_requests, 'r', "max-requests", "Recycle a prefork worker after N requests (default 10000, 0 = unlimited)");
+ARGS_I(false, max_rss, 'm', "max-rss", "Recycle a prefork worker once its RSS exceeds N MB (0 = unlimited)");
+ARGS_B(false, reuseport, 'P', "reuseport", "Give each prefork worker its own SO_REUSEPORT listener pinned to a CPU (implies --prefork)");
+ARGS_B(false, evloop, 'e', "evloop", "Serve static and buildins content from an epoll event loop per worker (implies --prefork, Linux)");
+ARGS_B(false, park, 'k', "park", "Hand idle keep-alive connections back to the master so workers can take new ones (implies --prefork, Linux)");
+ARGS_I(false, path_cache, 'C', "path-cache", "Entries in the shared path-resolution cache (default 1024, 0 = disabled)");
+ARGS_I(false, file_cache, 'F', "file-cache", "Byte budget in MB of the shared cache for small static files (0 = disabled)");
+ARGS_I(false, gzip_level, 'z', "gzip-level", "gzip level (1-9) for dynamic CGI / C-script / SQTP responses (default 6, 0 = disabled)");
+ARGS_I(false, gzip_min, 'Z', "gzip-min", "Do not compress dynamic responses smaller than N bytes (default 1024)");
+ARGS_S(false, gzip_types, 'T', "gzip-types", "Comma-separated MIME types to compress, a trailing / matches a whole class");
+ARGS_B(false, h2c, 'H', "h2c", "Accept cleartext HTTP/2 (prior-knowledge connections or Upgrade: h2c); each stream is handled by its own forked process");
+ARGS_B(false, metrics, 'M', "metrics", "Serve Prometheus-style metrics (per-handler counts, bytes, latency histograms, workers, forks) at /-/metrics");
+ARGS_B(false, status, 'S', "status", "Serve a scoreboard of live request / CGI processes (state, URI, elapsed time, bytes sent) at /-/status, ?json for JSON (loopback clients only, unless the root has a -auth file)");
+ARGS_S(false, log_file, 'l', "log", "CSV access log file, strftime() %-patterns rotate it (the path is inside the web root jail)");
+ARGS_I(false, log_ring, 'L', "log-ring", "Size in KB of a shared ring that a separate logger process drains into the access log, e.g. 1024 (default 0 = each request writes the log file itself)");
+ARGS_B(false, timing, 't', "timing", "Time each request phase (parse, resolve, auth, fork, compile, relocate, execute, first/last byte) into a Server-Timing header and extra log fields");
+ARGS_I(false, script_cache, 'X', "script-cache", "Compiled C scripts kept relocated in each request-handling process, keyed on path, mtime and content hash, so CGI children run them without recompiling (default 64, 0 = compile on every request)");
+ARGS_S(false, script_cache_dir, 'O', "script-cache-dir", "Also save compiled C scripts as object files in this directory (inside the web root jail, writable by the server user) and load them after a restart instead of recompiling");
+ARGS_B(false, resident, 'R', "resident", "Call handle_request(wpp_req*, wpp_res*) of C scripts that define it directly in the request-handling process, without forking a CGI child (trusted scripts only, needs --script-cache)");
+ARGS_S(false, header_snapshot, 'I', "header-snapshot", "Header sets preprocessed once (macros kept; at startup, or on the first compile that can use them in prefork workers) into a shared snapshot that replaces the matching leading #include <...> lines of C scripts, ';' between sets, ',' between headers (default \"stdio.h,stdlib.h,string.h;stdio.h,stdlib.h,string.h,sqlite3.h\", \"none\" to disable)");
+ARGS_B(false, script_watch, 'W', "watch", "Fork a process that watches the web root with inotify and compiles C scripts in the background whenever one is deployed or changed, logging compile errors; with --script-cache-dir the first request loads the object instead of compiling (Linux only)");
+ARGS_B(false, bench, 'b', "bench", "Start the server on a loopback port with a temporary web root, load it with the built-in HTTP/1.1 client (buildins gzip / identity, static file, C script, SQTP-SELECT) and exit");
+ARGS_I(false, bench_time, 'd', "bench-time", "Seconds measured per benchmark scenario, after a warm-up of 1/5 of that (default 5)");
+ARGS_I(false, bench_conns, 'c', "bench-conns", "Concurrent keep-alive connections of the benchmark client (default 32)");
+ARGS_I(false, bench_threads, 'j', "bench-threads", "Benchmark client threads (default half the CPU cores)");
+ARGS_S(false, bench_json, 'J', "bench-json", "Also write the benchmark results as JSON to this file ('-' = stdout)");
 
 // PID 文件路径（动态计算，位于 Web 根目录下）
 // Web 根目录规则：
@@ -124,16 +153,56 @@ int main(int argc, char *argv[]) {
         "  $0              Start server using executable directory as web root\n"
         "  $0 .            Start server using current directory as web root\n"
         "  $0 /path/to/www Start server using specified directory as web root\n"
-        "  $0 --stop       Stop running server\n\n"
+        "  $0 --stop       Stop running server\n"
+        "  $0 -p .         Serve with one pre-forked worker per CPU core\n"
+        "  $0 -b -w 4 -J result.json\n"
+        "                  Benchmark 4 prefork workers, save the results as JSON\n\n"
         "Features:\n"
         "  - C CGI support via TinyCC\n"
         "  - SQTP (SQL Transfer Protocol) for database queries\n"
         "  - Automatic browser launch on startup\n"
         "  - Single-instance mode with PID file management");
 
+    // HTTP 服务参数：先取 httpd 的默认值，命令行选项的默认值也由此而来
+    http_params_st params;
+    httpd_params_default(&params);
+
     // 解析命令行参数
+    ARGS_max_requests.i64 = params.iWorkerMaxReqs;
+    ARGS_path_cache.i64 = 1024;
+    ARGS_gzip_level.i64 = 6;
+    ARGS_gzip_min.i64 = params.iGzipMinSize;
+    ARGS_script_cache.i64 = 64;
     int pos_count = ARGS_parse(argc, argv,
         &ARGS_DEF_stop,
+        &ARGS_DEF_prefork,
+        &ARGS_DEF_workers,
+        &ARGS_DEF_max_requests,
+        &ARGS_DEF_max_rss,
+        &ARGS_DEF_reuseport,
+        &ARGS_DEF_evloop,
+        &ARGS_DEF_park,
+        &ARGS_DEF_path_cache,
+        &ARGS_DEF_file_cache,
+        &ARGS_DEF_gzip_level,
+        &ARGS_DEF_gzip_min,
+        &ARGS_DEF_gzip_types,
+        &ARGS_DEF_h2c,
+        &ARGS_DEF_metrics,
+        &ARGS_DEF_status,
+        &ARGS_DEF_log_file,
+        &ARGS_DEF_log_ring,
+        &ARGS_DEF_timing,
+        &ARGS_DEF_script_cache,
+        &ARGS_DEF_script_cache_dir,
+        &ARGS_DEF_resident,
+        &ARGS_DEF_header_snapshot,
+        &ARGS_DEF_script_watch,
+        &ARGS_DEF_bench,
+        &ARGS_DEF_bench_time,
+        &ARGS_DEF_bench_conns,
+        &ARGS_DEF_bench_threads,
+        &ARGS_DEF_bench_json,
         NULL);
     
     // 确定 Web 根目录
@@ -188,9 +257,10 @@ int main(int argc, char *argv[]) {
     printf("WPP Server with SQTP Support\n");
     printf("=====================================\n");
     
-    // 检查是否已有实例在运行
+    // 检查是否已有实例在运行（压力测试使用自己的临时根目录和端口，不受影响）
+    bool bench = ARGS_bench.i64 != 0;
     int running_port = 0;
-    pid_t running_pid = check_running(&running_port);
+    pid_t running_pid = bench ? 0 : check_running(&running_port);
     if (running_pid < 0) return 1;  // 出错退出
     if (running_pid) {
 
@@ -219,8 +289,10 @@ int main(int argc, char *argv[]) {
     }
     
     // 保存主进程 PID 并注册退出清理函数
-    g_main_pid = getpid();
-    atexit(clean_pid);
+    if (!bench) {
+        g_main_pid = getpid();
+        atexit(clean_pid);
+    }
     
     // 初始化 buildins（由 main 触发）
     if (buildins_init() < 0) {
@@ -251,12 +323,50 @@ int main(int argc, char *argv[]) {
     // 初始化共享内存数据库（用于 SQTP 测试）
     init_shared_memory_db();
     
-    printf("启动 HTTP/SQTP 服务器...\n");
-    printf("Web 根目录: %s\n", web_root);
-    printf("PID 文件: %s\n", g_pid_file);
+    if (!bench) {
+        printf("启动 HTTP/SQTP 服务器...\n");
+        printf("Web 根目录: %s\n", web_root);
+        printf("PID 文件: %s\n", g_pid_file);
+    }
+
+    // 命令行选项（其余各项保持 httpd 的默认值）
+    params.iWorkers = ARGS_workers.i64 > 0 ? (int32_t)ARGS_workers.i64 : (ARGS_prefork.i64 ? -1 : 0);
+    params.iWorkerMaxReqs = ARGS_max_requests.i64 > 0 ? (uint32_t)ARGS_max_requests.i64 : 0;
+    params.iWorkerMaxRssKB = ARGS_max_rss.i64 > 0 ? (uint32_t)(ARGS_max_rss.i64 * 1024) : 0;
+    params.bReusePort = ARGS_reuseport.i64 != 0;
+    params.bEventLoop = ARGS_evloop.i64 != 0;
+    params.bParkIdle = ARGS_park.i64 != 0;
+    params.iPathCache = ARGS_path_cache.i64 > 0 ? (uint32_t)ARGS_path_cache.i64 : 0;
+    params.iFileCacheKB = ARGS_file_cache.i64 > 0 ? (uint32_t)(ARGS_file_cache.i64 * 1024) : 0;
+    params.iGzipLevel = ARGS_gzip_level.i64 > 0 ? (uint32_t)ARGS_gzip_level.i64 : 0;
+    params.iGzipMinSize = ARGS_gzip_min.i64 > 0 ? (uint32_t)ARGS_gzip_min.i64 : 0;
+    params.csGzipTypes = ARGS_gzip_types.str && *ARGS_gzip_types.str ? ARGS_gzip_types.str : NULL;
+    params.bH2c = ARGS_h2c.i64 != 0;
+    params.bMetrics = ARGS_metrics.i64 != 0;
+    params.bStatus = ARGS_status.i64 != 0;
+    params.csLogFile = ARGS_log_file.str && *ARGS_log_file.str ? ARGS_log_file.str : NULL;
+    params.iLogRingKB = ARGS_log_ring.i64 > 0 ? (uint32_t)ARGS_log_ring.i64 : 0;
+    params.bTiming = ARGS_timing.i64 != 0;
+    params.iScriptCache = ARGS_script_cache.i64 > 0 ? (uint32_t)ARGS_script_cache.i64 : 0;
+    params.csScriptCacheDir = ARGS_script_cache_dir.str && *ARGS_script_cache_dir.str ? ARGS_script_cache_dir.str : NULL;
+    params.bResident = ARGS_resident.i64 != 0;
+    params.csHeaderSnapshot = ARGS_header_snapshot.str && *ARGS_header_snapshot.str ? ARGS_header_snapshot.str : NULL;
+    params.bScriptWatch = ARGS_script_watch.i64 != 0;
+
+    // 压力测试：在临时的根目录上以相同的参数启动服务器，运行各个场景后退出
+    if (bench) {
+        http_bench_st bench_params = {
+            .nSeconds = ARGS_bench_time.i64 > 0 ? (int)ARGS_bench_time.i64 : 5,
+            .nConns = ARGS_bench_conns.i64 > 0 ? (int)ARGS_bench_conns.i64 : 32,
+            .nThreads = ARGS_bench_threads.i64 > 0 ? (int)ARGS_bench_threads.i64 : 0,
+            .csJson = ARGS_bench_json.str && *ARGS_bench_json.str ? ARGS_bench_json.str : NULL,
+        };
+        return http_bench_main(&params, &bench_params);
+    }
 
     // 使用动态端口分配（传入 0, 0），httpd 会在获得端口后写入 PID 文件
-    httpd_main(0, 0, true, true, URL_PATH, NULL, web_root, NULL, NULL, g_pid_file);
+    // + 不传入根目录：和没有参数时一样，以当前目录作为网站的根目录（和 chroot 的目录）
+    httpd_main(0, 0, true, true, URL_PATH, NULL, NULL, &params, NULL, g_pid_file);
 
     // httpd_main 主进程进入监听循环不会返回，只有子进程会到达这里
     return 0;
@@ -6,14 +6,62 @@
 #include "buildins.h"
 #include "vfile.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sqlite3.h>
 #include <zlib.h>
 
 static int g_tcc_evn_initialized = 0;
 
+/**
+ * TCC 基础头文件（buildins/include 下由 TCC 提供的编译器内置头文件）
+ * 注意：由于使用了 CONFIG_TCC_PREDEFS=1 构建选项
+ * 即 tccdefs.h 已编译到 libtcc.a，并会被 tcc_predefs() 自动加载，因此不在这里
+ */
+static const char *s_builtin_headers[] = {
+    "/include/stddef.h",
+    "/include/stdarg.h",
+    "/include/stdbool.h",
+    "/include/stdalign.h",
+    "/include/stdnoreturn.h",
+    "/include/stdatomic.h",
+    "/include/float.h",
+    "/include/tgmath.h",
+    NULL
+};
+
+// 系统头文件快照
+#define TCC_SNAPSHOT_MAX        16      // 每个进程最多的快照数（包括建立失败的）
+#define TCC_SNAPSHOT_HEADERS    32      // 一个快照最多的头文件数
+#define TCC_SNAPSHOT_LINE       "#line 1 \"<string>\"\n"     // 快照之后恢复脚本的行号和文件名（tcc_compile_string() 的文件名）
+#define TCC_SNAPSHOT_DEFAULT    "stdio.h,stdlib.h,string.h;stdio.h,stdlib.h,string.h,sqlite3.h"
+
+typedef struct tcc_snapshot {
+    int                 nHeader;
+    char*               azHeader[TCC_SNAPSHOT_HEADERS];
+    bool                bFailed;        // 预处理或者验证失败（记录下来，不再重试）
+    bool                bPending;       // -I 指定的组，还没有建立：第一次编译可以使用它的脚本时才建立
+    vfile_st            vf;             // 预处理的结果，vf.mem 是它的只读共享映射
+} tcc_snapshot_st;
+
+static tcc_snapshot_st  s_aSnapshot[TCC_SNAPSHOT_MAX];
+static int              s_nSnapshot = 0;
+
+// 脚本开头的一条 #include <...>
+typedef struct tcc_include {
+    const char*         zName;          // 头文件名（不以 0 结尾）
+    int                 nName;
+    const char*         zLine;          // 该行在源代码中的位置（从 # 到行尾，不含换行）
+    const char*         zEnd;
+} tcc_include_st;
+
+// tcc_configure_env() 的选项
+#define TCC_EVN_HEADERS     0x01    // 预编译 API 声明（编译源代码时需要）
+#define TCC_EVN_SYMBOLS     0x02    // 注册内置 API 符号的地址（链接、运行时需要）
+
 /**
  * API 声明字符串（预编译给用户代码使用）
  * 用户 C 脚本无需 #include 即可直接调用这些 API
@@ -162,10 +210,12 @@ static const char *BUILDINS_API_DECLS =
 /**
  * 注册内置 API 符号到 TCC
  * 步骤：
- * 1. tcc_add_symbol() - 注册函数地址（运行时链接）
- * 2. tcc_compile_string() - 预编译函数声明（编译时类型检查）
+ * 1. tcc_add_symbol() - 注册函数地址（运行时链接），TCC_EVN_SYMBOLS
+ * 2. tcc_compile_string() - 预编译函数声明（编译时类型检查），TCC_EVN_HEADERS
  */
-static int tcc_register_builtin_symbols(TCCState *s) {
+static int tcc_register_builtin_symbols(TCCState *s, int flags) {
+    if (!(flags & TCC_EVN_SYMBOLS)) goto decls;
+
     // ========== 注册 SQLite3 符号 ==========
     tcc_add_symbol(s, "sqlite3_open", sqlite3_open);
     tcc_add_symbol(s, "sqlite3_open_v2", sqlite3_open_v2);
@@ -226,6 +276,9 @@ static int tcc_register_builtin_symbols(TCCState *s) {
     tcc_add_symbol(s, "adler32", adler32);
     tcc_add_symbol(s, "crc32", crc32);
 
+decls:
+    if (!(flags & TCC_EVN_HEADERS)) return 0;
+
     // ========== 预编译 API 声明 ==========
     // 用户 C 脚本无需 #include 即可直接调用
     if (tcc_compile_string(s, BUILDINS_API_DECLS) < 0) {
@@ -282,6 +335,14 @@ int tcc_evn_init(void) {
     if (g_tcc_evn_initialized) {
         return 0;
     }
+    // 预先解压 TCC 基础头文件（buildins 的虚拟文件在进程中缓存，fork 后子进程直接复用）
+    for (int i = 0; s_builtin_headers[i] != NULL; i++) {
+        buildin_file_info_st *node = buildins_find(s_builtin_headers[i]);
+        if (!node || !buildins_acquire_vfile(node)) {
+            fprintf(stderr, "TCC EVN: Failed to preload %s\n", s_builtin_headers[i]);
+            return -1;
+        }
+    }
     g_tcc_evn_initialized = 1;
     return 0;
 }
@@ -290,7 +351,7 @@ void tcc_evn_cleanup(void) {
     g_tcc_evn_initialized = 0;
 }
 
-int tcc_configure(TCCState *s) {
+static int tcc_configure_env(TCCState *s, int flags) {
     if (!s) {
         fprintf(stderr, "TCC EVN: NULL TCCState pointer\n");
         return -1;
@@ -358,34 +419,11 @@ int tcc_configure(TCCState *s) {
      * 手动 tcc_add_file() 会导致符号重复定义错误，应避免。
      */
 
-    /* ========== 预编译基础标准头文件 ========== 
-     * 用途：预先编译 TCC 基础头文件，加速后续用户代码编译
-     * 文件：buildins/include 下的全部头文件（由 TCC 提供的编译器内置头文件）
-     *   - stddef.h, stdarg.h, stdbool.h, stdalign.h, stdnoreturn.h, stdatomic.h
-     *   - float.h, tgmath.h, tccdefs.h
-     * 注意：通过回调从 buildins 虚拟文件系统读取
+    /* ========== TCC 基础头文件 ==========
+     * 由脚本的 #include 通过回调从 buildins 虚拟文件系统读取（tcc_evn_init() 已预先解压）
+     * 注意：不在这里以 tcc_add_file() 预先编译：每个文件是单独的编译单元，宏和声明在编译结束后就被丢弃，
+     *       对之后编译的脚本没有作用，却是每次配置的主要开销。常用的系统头文件见 tcc_snapshot_init()
      */
-    const char *builtin_headers[] = {
-        "/include/stddef.h",
-        "/include/stdarg.h",
-        "/include/stdbool.h",
-        "/include/stdalign.h",
-        "/include/stdnoreturn.h",
-        "/include/stdatomic.h",
-        "/include/float.h",
-        "/include/tgmath.h",
-        // 注意：由于使用了 CONFIG_TCC_PREDEFS=1 构建选项
-        // 即 tccdefs.h 已编译到 libtcc.a，并会被 tcc_predefs() 自动加载，
-        // 因此，这里显式加载会导致宏重定义错误
-        /* "/include/tccdefs.h", */ 
-        NULL
-    };
-    for (int i = 0; builtin_headers[i] != NULL; i++) {
-        if (tcc_add_file(s, builtin_headers[i]) < 0) {
-            fprintf(stderr, "TCC EVN: Failed to preload %s\n", builtin_headers[i]);
-            return -1;
-        }
-    }
 
     /* ========== tcc_add_library() ========== 
      * 用途：链接标准 C 库
@@ -403,10 +441,272 @@ int tcc_configure(TCCState *s) {
      *   1. tcc_add_symbol() - 注册函数地址（运行时链接）
      *   2. tcc_compile_string() - 预编译函数声明（编译时类型检查）
      * 效果：用户 C 脚本无需 #include 即可直接调用这些 API
+     * 注意：输出目标文件时不注册地址，否则以绝对符号写入目标文件，与加载时注册的符号重复（且地址只在本次运行有效）
      */
-    if (tcc_register_builtin_symbols(s) < 0) {
+    if (tcc_register_builtin_symbols(s, flags) < 0) {
         return -1;
     }
 
     return 0;
 }
+
+int tcc_configure(TCCState *s) {
+    return tcc_configure_env(s, TCC_EVN_HEADERS | TCC_EVN_SYMBOLS);
+}
+
+int tcc_configure_object(TCCState *s) {
+    return tcc_configure_env(s, TCC_EVN_HEADERS);
+}
+
+int tcc_configure_link(TCCState *s) {
+    return tcc_configure_env(s, TCC_EVN_SYMBOLS);
+}
+
+/* ========== 系统头文件快照 ========== */
+
+// 扫描脚本开头连续的 #include <...>（之间只允许空白和注释），遇到其它内容（代码、#define、#include "..." 等）时停止
+// + 停止之后的 #include 可能依赖之前定义的宏，不能提前到快照中
+static int tcc_scan_includes(const char *z, tcc_include_st *a, int nMax) {
+    int n = 0;
+    while (n < nMax) {
+        while (*z == ' ' || *z == '\t' || *z == '\r' || *z == '\n' || *z == '\f' || *z == '\v') z++;
+        if (z[0] == '/' && z[1] == '/') {
+            while (*z && *z != '\n') z++;
+            continue;
+        }
+        if (z[0] == '/' && z[1] == '*') {
+            const char *zClose = strstr(z + 2, "*/");
+            if (!zClose) break;
+            z = zClose + 2;
+            continue;
+        }
+        if (*z != '#') break;
+
+        const char *zLine = z++;
+        while (*z == ' ' || *z == '\t') z++;
+        if (strncmp(z, "include", 7) != 0) break;
+        z += 7;
+        while (*z == ' ' || *z == '\t') z++;
+        if (*z != '<') break;
+        const char *zName = ++z;
+        while (*z && *z != '>' && *z != '\n') z++;
+        if (*z != '>' || z == zName) break;
+        int nName = (int)(z++ - zName);
+        // 行尾只允许空白和 // 注释
+        while (*z == ' ' || *z == '\t' || *z == '\r') z++;
+        if (z[0] == '/' && z[1] == '/') while (*z && *z != '\n') z++;
+        if (*z && *z != '\n') break;
+
+        a[n].zName = zName;
+        a[n].nName = nName;
+        a[n].zLine = zLine;
+        a[n].zEnd = z;
+        n++;
+    }
+    return n;
+}
+
+static bool tcc_snapshot_has(const tcc_snapshot_st *p, const char *zName, int nName) {
+    for (int i = 0; i < p->nHeader; i++) {
+        if ((int)strlen(p->azHeader[i]) == nName && memcmp(p->azHeader[i], zName, nName) == 0) return true;
+    }
+    return false;
+}
+
+// 快照的所有头文件都在 a[] 中
+static bool tcc_snapshot_within(const tcc_snapshot_st *p, const tcc_include_st *a, int n) {
+    for (int i = 0; i < p->nHeader; i++) {
+        int j;
+        for (j = 0; j < n && !((int)strlen(p->azHeader[i]) == a[j].nName
+                               && memcmp(p->azHeader[i], a[j].zName, a[j].nName) == 0); j++) {}
+        if (j == n) return false;
+    }
+    return true;
+}
+
+// 建立快照时的错误不输出：找不到头文件（如 jail 中没有 /usr/include）时，使用这些头文件的脚本编译时自己会报告
+static void tcc_snapshot_error(void *opaque, const char *msg) {
+    (void)opaque;
+    (void)msg;
+}
+
+// 以 -E -dD 预处理这组头文件，得到展开了所有 #include 和条件编译、保留了宏定义的单个文件
+// + 预处理的结果以 "<command line>" 中的预定义宏开始，回到 "<string>" 之后才是头文件的内容：编译时这些宏已经定义
+static char *tcc_snapshot_preprocess(const char *zSource, size_t *pnImage) {
+    char *zOut = NULL, *zImage = NULL;
+    size_t nOut = 0;
+    FILE *pOut = open_memstream(&zOut, &nOut);
+    if (!pOut) return NULL;
+
+    TCCState *s = tcc_new();
+    int rc = -1;
+    if (s) {
+        tcc_set_error_func(s, NULL, tcc_snapshot_error);
+        tcc_set_output_type(s, TCC_OUTPUT_PREPROCESS);
+        tcc_set_pp_output(s, pOut);
+        if (tcc_configure_env(s, 0) == 0 && tcc_set_options(s, "-dD") == 0) rc = tcc_compile_string(s, zSource);
+        tcc_delete(s);
+    }
+    fclose(pOut);
+
+    const char *zBody = rc == 0 && zOut ? strstr(zOut, "\n# 1 \"<string>\" 2\n") : NULL;
+    if (zBody) {
+        zBody++;
+        *pnImage = nOut - (size_t)(zBody - zOut);
+        zImage = malloc(*pnImage + 1);
+        if (zImage) memcpy(zImage, zBody, *pnImage + 1);
+    }
+    free(zOut);
+    return zImage;
+}
+
+// 登记一组头文件（还没有建立快照），失败时返回 NULL
+static tcc_snapshot_st *tcc_snapshot_define(const tcc_include_st *a, int n) {
+    if (s_nSnapshot >= TCC_SNAPSHOT_MAX) return NULL;
+    tcc_snapshot_st *p = &s_aSnapshot[s_nSnapshot++];
+
+    memset(p, 0, sizeof(*p));
+    p->vf.fd = -1;
+    p->bPending = true;
+    for (int i = 0; i < n; i++) {
+        if (tcc_snapshot_has(p, a[i].zName, a[i].nName)) continue;
+        if (!(p->azHeader[p->nHeader] = strndup(a[i].zName, a[i].nName))) {
+            p->bPending = false;
+            p->bFailed = true;
+            return NULL;
+        }
+        p->nHeader++;
+    }
+    return p;
+}
+
+// 建立登记过的快照：预处理，验证快照可以编译，写入 memfd 并以只读共享映射
+// + 失败时同样记录下来（bFailed），避免每次编译都重试
+static bool tcc_snapshot_make(tcc_snapshot_st *p) {
+    size_t nSource = 0, nImage = 0;
+    char *zImage = NULL;
+
+    p->bPending = false;
+    p->bFailed = true;
+    for (int i = 0; i < p->nHeader; i++) nSource += strlen(p->azHeader[i]) + 12;
+
+    char *zSource = malloc(nSource + 1);
+    if (!zSource) return false;
+    zSource[0] = 0;
+    for (int i = 0; i < p->nHeader; i++) {
+        strcat(zSource, "#include <");
+        strcat(zSource, p->azHeader[i]);
+        strcat(zSource, ">\n");
+    }
+    zImage = tcc_snapshot_preprocess(zSource, &nImage);
+    free(zSource);
+    if (!zImage) return false;
+
+    // 验证：快照与直接 #include 应当等价，任何错误都说明预处理的结果不能原样使用
+    char *zCheck = malloc(nImage + sizeof(TCC_SNAPSHOT_LINE));
+    TCCState *s = tcc_new();
+    int rc = -1;
+    if (zCheck && s) {
+        memcpy(zCheck, zImage, nImage);
+        memcpy(zCheck + nImage, TCC_SNAPSHOT_LINE, sizeof(TCC_SNAPSHOT_LINE));
+        tcc_set_error_func(s, NULL, tcc_snapshot_error);
+        tcc_set_output_type(s, TCC_OUTPUT_OBJ);
+        if (tcc_configure_env(s, 0) == 0) rc = tcc_compile_string(s, zCheck);
+    }
+    if (s) tcc_delete(s);
+    free(zCheck);
+
+    // 写入 memfd：fork 之后所有子进程共享同一份映射
+    if (rc == 0 && vfile_open(&p->vf, "snapshot", false) == 0 && vfile_write(&p->vf, zImage, nImage) == 0) {
+        void *pMem = mmap(NULL, nImage, PROT_READ, MAP_SHARED, p->vf.fd, 0);
+        if (pMem != MAP_FAILED) {
+            p->vf.mem = pMem;
+            p->bFailed = false;
+        }
+    }
+    free(zImage);
+    return !p->bFailed;
+}
+
+int tcc_snapshot_init(const char *zSets) {
+    tcc_include_st a[TCC_SNAPSHOT_HEADERS];
+    int nSet = 0;
+    if (!zSets) zSets = TCC_SNAPSHOT_DEFAULT;
+    if (strcmp(zSets, "none") == 0) return 0;
+
+    while (*zSets) {
+        // 一组：逗号分隔的头文件名，组之间以分号分隔
+        int n = 0;
+        const char *zEnd = zSets + strcspn(zSets, ";");
+        while (zSets < zEnd && n < TCC_SNAPSHOT_HEADERS) {
+            while (zSets < zEnd && (*zSets == ',' || *zSets == ' ')) zSets++;
+            const char *zName = zSets;
+            while (zSets < zEnd && *zSets != ',' && *zSets != ' ') zSets++;
+            if (zSets == zName) continue;
+            a[n].zName = zName;
+            a[n].nName = (int)(zSets - zName);
+            a[n].zLine = a[n].zEnd = NULL;
+            n++;
+        }
+        zSets = *zEnd ? zEnd + 1 : zEnd;
+        if (!n) continue;
+
+        if (tcc_snapshot_define(a, n)) nSet++;
+    }
+    return nSet;
+}
+
+void tcc_snapshot_ready(void) {
+    for (int k = 0; k < s_nSnapshot; k++) {
+        if (s_aSnapshot[k].bPending) tcc_snapshot_make(&s_aSnapshot[k]);
+    }
+}
+
+char *tcc_snapshot_apply(const char *zSource, bool bBuild) {
+    tcc_include_st a[TCC_SNAPSHOT_HEADERS];
+    tcc_snapshot_st *pBest = NULL;
+    int n = tcc_scan_includes(zSource, a, TCC_SNAPSHOT_HEADERS);
+    if (!n) return NULL;
+
+    // 选择头文件最多的、所有头文件都在脚本开头被包含的快照（不能引入脚本没有包含的头文件中的名字）
+    // + 选中的还没有建立（-I 登记的组）时现在建立，失败时重新选择
+    for (;;) {
+        pBest = NULL;
+        for (int k = 0; k < s_nSnapshot; k++) {
+            tcc_snapshot_st *p = &s_aSnapshot[k];
+            if (p->bFailed || (p->bPending && !bBuild) || (pBest && p->nHeader <= pBest->nHeader)) continue;
+            if (tcc_snapshot_within(p, a, n)) pBest = p;
+        }
+        if (!pBest || !pBest->bPending || tcc_snapshot_make(pBest)) break;
+    }
+
+    // 没有覆盖全部头文件的快照时，为这一组头文件建立一个（同一组、或者更少的头文件建立失败过的不再重试）
+    if (bBuild) {
+        bool bCovered = pBest != NULL;
+        for (int j = 0; j < n && bCovered; j++) bCovered = tcc_snapshot_has(pBest, a[j].zName, a[j].nName);
+        for (int k = 0; k < s_nSnapshot && !bCovered; k++) {
+            if (s_aSnapshot[k].bFailed && tcc_snapshot_within(&s_aSnapshot[k], a, n)) bCovered = true;
+        }
+        if (!bCovered) {
+            tcc_snapshot_st *p = tcc_snapshot_define(a, n);
+            if (p && tcc_snapshot_make(p)) pBest = p;
+        }
+    }
+    if (!pBest) return NULL;
+
+    // 快照 + 恢复行号 + 脚本（快照中包含的 #include 行替换为空格，保持行号不变）
+    size_t nImage = pBest->vf.size;
+    size_t nSource = strlen(zSource);
+    char *zOut = malloc(nImage + sizeof(TCC_SNAPSHOT_LINE) - 1 + nSource + 1);
+    if (!zOut) return NULL;
+    memcpy(zOut, pBest->vf.mem, nImage);
+    memcpy(zOut + nImage, TCC_SNAPSHOT_LINE, sizeof(TCC_SNAPSHOT_LINE) - 1);
+    char *zScript = zOut + nImage + sizeof(TCC_SNAPSHOT_LINE) - 1;
+    memcpy(zScript, zSource, nSource + 1);
+    for (int j = 0; j < n; j++) {
+        if (tcc_snapshot_has(pBest, a[j].zName, a[j].nName)) {
+            memset(zScript + (a[j].zLine - zSource), ' ', a[j].zEnd - a[j].zLine);
+        }
+    }
+    return zOut;
+}
@@ -5,6 +5,7 @@
 #ifndef TCC_EVN_H
 #define TCC_EVN_H
 
+#include <stdbool.h>
 #include <libtcc.h>
 
 #ifdef __cplusplus
@@ -14,7 +15,7 @@ extern "C" {
 /**
  * 初始化 TCC 环境（由 main 触发）
  * 
- * 预先加载部分 buildins 资源，便于 fork 子进程直接复用。
+ * 预先加载部分 buildins 资源（TCC 基础头文件），便于 fork 子进程直接复用。
  *
  * @return 0 成功，-1 失败
  */
@@ -36,6 +37,65 @@ int tcc_evn_init(void);
  */
 int tcc_configure(TCCState *s);
 
+/**
+ * 配置输出目标文件（TCC_OUTPUT_OBJ）的 TCC 编译环境
+ *
+ * 与 tcc_configure() 相同，但不注册内置 API 符号的地址：
+ * 目标文件中对这些 API 的引用在加载到 tcc_configure() 配置的内存 State 时解析
+ *
+ * @param s TinyCC 编译状态（已设置 TCC_OUTPUT_OBJ）
+ * @return 0 成功，-1 失败
+ */
+int tcc_configure_object(TCCState *s);
+
+/**
+ * 配置只加载目标文件、链接运行的 TCC 环境
+ *
+ * 与 tcc_configure() 相同，但不预编译 API 声明：
+ * 加载 tcc_configure_object() 输出的目标文件时不需要
+ *
+ * @param s TinyCC 编译状态
+ * @return 0 成功，-1 失败
+ */
+int tcc_configure_link(TCCState *s);
+
+/**
+ * 登记系统头文件快照的头文件组（由 httpd_main() 触发，进入 jail 之后调用）
+ *
+ * 脚本每次编译都要重新读取、切分 <stdio.h>、<sqlite3.h> 等大的系统头文件（以及它们包含的几十个文件），
+ * 这是编译的主要开销。快照是一组头文件以 -E -dD 预处理一次的结果：所有 #include 和条件编译已经展开，
+ * 注释已经去掉，宏定义保留，只有原来大小的几分之一。快照写入 memfd，之后 fork 的子进程共享同一份映射
+ *
+ * 这里只登记，不预处理：没有 C 脚本、或者 jail 中没有这些头文件时不产生任何开销和输出。
+ * 快照在第一次编译可以使用它的脚本时建立（见 tcc_snapshot_apply()、tcc_snapshot_ready()），
+ * 建立失败时不输出错误（使用这些头文件的脚本编译时自己会报告），也不再重试
+ *
+ * @param zSets 分号分隔的多组头文件，每组以逗号分隔，如 "stdio.h,stdlib.h,string.h;stdio.h,sqlite3.h"；
+ *              NULL 使用默认的组，"none" 不使用
+ * @return 登记的组数
+ */
+int tcc_snapshot_init(const char *zSets);
+
+/**
+ * 建立所有登记过、还没有建立的快照（在 fork 出自己编译脚本的子进程之前调用，子进程不建立快照）
+ */
+void tcc_snapshot_ready(void);
+
+/**
+ * 以快照改写脚本的源代码
+ *
+ * 脚本开头连续的 #include <...>（之间只有空白和注释）包含了某个快照的全部头文件时，源代码改写为：
+ * 快照 + #line 1 "<string>" + 原来的脚本（快照中的 #include 行替换为空格，行号不变）。
+ * 只使用头文件全部被脚本包含的快照：不会引入脚本没有包含的名字；有多个时选择头文件最多的
+ *
+ * @param zSource 脚本的源代码（以 tcc_compile_string() 编译）
+ * @param bBuild  建立选中的、还没有建立的快照；没有覆盖脚本全部头文件的快照时，为这一组头文件建立一个
+ *                （只在长期运行的进程中使用：建立的开销与一次普通的编译相当，之后同一组头文件的脚本都能使用）；
+ *                false 时只使用已经建立的快照
+ * @return 改写后的源代码（调用者 free），没有可用的快照时返回 NULL
+ */
+char *tcc_snapshot_apply(const char *zSource, bool bBuild);
+
 /**
  * 清理 TCC 环境
  */
@@ -1093,6 +1093,38 @@ LIBTCCAPI void tcc_set_file_open_callback(TCCState *s, void *opaque,
     s->file_open_callback = callback;
 }
 
+/* [WPP PATCH]:
+ * 设置预处理结果的输出流（tcc_compile_string() 等在 TCC_OUTPUT_PREPROCESS 时写入）
+ */
+LIBTCCAPI void tcc_set_pp_output(TCCState *s, void *fp)
+{
+    s->ppfp = fp ? (FILE *)fp : stdout;
+}
+
+/* [WPP PATCH]:
+ * 取得编译时打开的文件（-MMD 时记录的依赖），返回个数
+ */
+LIBTCCAPI int tcc_get_dependencies(TCCState *s, const char ***pazDeps)
+{
+    *pazDeps = (const char **)s->target_deps;
+    return s->nb_target_deps;
+}
+
+/* [WPP PATCH]:
+ * 取得重定位后可写段（.data/.bss 等）的地址和长度
+ * 非本机目标（没有 TCC_IS_NATIVE，不能在内存中运行）时返回 NULL
+ */
+LIBTCCAPI void *tcc_get_data_range(TCCState *s, unsigned *psize)
+{
+#ifdef TCC_IS_NATIVE
+    *psize = s->run_data_size;
+    return s->run_data;
+#else
+    *psize = 0;
+    return NULL;
+#endif
+}
+
 LIBTCCAPI void tcc_set_lib_path(TCCState *s, const char *path)
 {
     tcc_set_str(&s->tcc_lib_path, path);
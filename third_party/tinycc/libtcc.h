@@ -72,6 +72,24 @@ typedef int (*TCCFileOpenCallback)(void *opaque, const char *filename);
  */
 LIBTCCAPI void tcc_set_file_open_callback(TCCState *s, void *opaque, TCCFileOpenCallback callback);
 
+/* [WPP PATCH]:
+ * 设置预处理（TCC_OUTPUT_PREPROCESS）结果的输出流（FILE*），默认为 stdout
+ * 配合 tcc_set_options(s, "-dD") 可以得到保留宏定义的预处理结果
+ */
+LIBTCCAPI void tcc_set_pp_output(TCCState *s, void *fp);
+
+/* [WPP PATCH]:
+ * 取得编译过程中打开的源文件和头文件，返回个数（需要先以 tcc_set_options(s, "-MMD") 开启记录）
+ * 不包括在系统 include 路径（sysinclude）中找到的头文件；列表属于 TCCState，tcc_delete() 时释放
+ */
+LIBTCCAPI int tcc_get_dependencies(TCCState *s, const char ***pazDeps);
+
+/* [WPP PATCH]:
+ * 取得重定位后可写段（.data/.bss 等，在 runtime_memory 的末尾连续存放）的地址，*psize 返回长度
+ * tcc_relocate()（或 tcc_run()）之前、没有可写段时返回 NULL
+ */
+LIBTCCAPI void *tcc_get_data_range(TCCState *s, unsigned *psize);
+
 /* compile a string containing a C source. Return -1 if error. */
 LIBTCCAPI int tcc_compile_string(TCCState *s, const char *buf);
 
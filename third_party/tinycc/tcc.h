@@ -995,6 +995,11 @@ struct TCCState {
     const char *run_main; /* entry for tcc_run() */
     void *run_ptr; /* runtime_memory */
     unsigned run_size; /* size of runtime_memory  */
+    /* [WPP PATCH]:
+     * 可写段（.data/.bss 等）在 runtime_memory 中的范围，tcc_relocate() 时记录
+     */
+    void *run_data;
+    unsigned run_data_size;
     const char *run_stdin; /* custom stdin file for run_main */
 #ifdef _WIN64
     void *run_function_table; /* unwind data */
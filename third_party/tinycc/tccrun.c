@@ -397,6 +397,11 @@ redo:
         if (copy == 2) { /* set permissions */
             if (n == 0) /* no data  */
                 continue;
+            /* [WPP PATCH]:
+             * 记录可写段的范围（tcc_get_data_range()）
+             */
+            if (k == 3)
+                s1->run_data = (void*)addr, s1->run_data_size = n;
 #ifdef CONFIG_SELINUX
             if (k == 0) /* SHF_EXECINSTR has its own mapping */
                 continue;